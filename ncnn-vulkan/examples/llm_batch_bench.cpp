@@ -0,0 +1,70 @@
+#include "llm_engine.h"
+#include "llm_scheduler.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Aggregate decode throughput of the continuous-batching scheduler
+// every client asks for the same number of tokens with a slightly different
+// prompt, greedy decoding, the tokens actually produced are counted
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [gguf file] [max concurrency] [tokens per request] [threads]\n", argv[0]);
+        return -1;
+    }
+
+    int max_clients = argc >= 3 ? atoi(argv[2]) : 8;
+    int max_tokens = argc >= 4 ? atoi(argv[3]) : 64;
+
+    ncnn::EngineConfig engine_config;
+    engine_config.num_threads = argc >= 5 ? atoi(argv[4]) : 0;
+
+    ncnn::LLMEngine engine;
+    if (!engine.load_model(argv[1], engine_config)) {
+        fprintf(stderr, "Failed to load model\n");
+        return -1;
+    }
+
+    ncnn::GenerationConfig config;
+    config.do_sample = false;
+    config.max_tokens = max_tokens;
+
+    ncnn::Scheduler scheduler(engine, max_clients);
+
+    // fault the weights in before timing
+    scheduler.generate("warm up", config);
+
+    double base = 0;
+    for (int clients = 1; clients <= max_clients; clients *= 2) {
+        std::vector<size_t> counts(clients, 0);
+        std::vector<std::thread> threads;
+        const size_t allocations = engine.allocation_count();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int c = 0; c < clients; c++) {
+            threads.push_back(std::thread([&, c]() {
+                std::string prompt = "Request " + std::to_string(c) + " asks the model something";
+                counts[c] = scheduler.generate(prompt, config).size();
+            }));
+        }
+        for (size_t c = 0; c < threads.size(); c++) {
+            threads[c].join();
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        size_t total = 0;
+        for (int c = 0; c < clients; c++) total += counts[c];
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double rate = total / seconds;
+        if (clients == 1) base = rate;
+        // activation buffers only grow when a step is larger than any before
+        fprintf(stderr, "clients %2d  tokens %6zu  %.3f s  %8.1f tokens/s  x%.2f  allocations %zu\n", clients, total, seconds, rate, rate / base,
+                engine.allocation_count() - allocations);
+    }
+
+    return 0;
+}
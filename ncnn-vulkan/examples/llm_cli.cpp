@@ -11,6 +11,9 @@ int main(int argc, char** argv)
     float temperature = 1.0f;
     float top_p = 1.0f;
     int top_k = 0;
+    bool use_mmap = true;
+    bool index_cache = false;
+    int num_threads = 0;
 
     static struct option long_options[] = {
         {"model", required_argument, 0, 'm'},
@@ -19,11 +22,14 @@ int main(int argc, char** argv)
         {"temperature", required_argument, 0, 'T'},
         {"top-p", required_argument, 0, 'P'},
         {"top-k", required_argument, 0, 'k'},
+        {"no-mmap", no_argument, 0, 'M'},
+        {"threads", required_argument, 0, 'j'},
+        {"index-cache", no_argument, 0, 'I'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "m:p:t:T:P:k:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "m:p:t:T:P:k:Mj:I", long_options, NULL)) != -1) {
         switch (opt) {
             case 'm':
                 model_path = optarg;
@@ -43,6 +49,15 @@ int main(int argc, char** argv)
             case 'k':
                 top_k = atoi(optarg);
                 break;
+            case 'M':
+                use_mmap = false;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                break;
+            case 'I':
+                index_cache = true;
+                break;
             default:
                 fprintf(stderr, "Usage: %s --model <model.gguf> --prompt <text> [options]\n", argv[0]);
                 return -1;
@@ -56,11 +71,19 @@ int main(int argc, char** argv)
         fprintf(stderr, "  --temperature <f>   Sampling temperature (default: 1.0)\n");
         fprintf(stderr, "  --top-p <f>         Top-p sampling (default: 1.0)\n");
         fprintf(stderr, "  --top-k <n>         Top-k sampling (default: 0)\n");
+        fprintf(stderr, "  --no-mmap           Read the model into memory instead of mapping it\n");
+        fprintf(stderr, "  --threads <n>       Worker threads (default: physical big cores)\n");
+        fprintf(stderr, "  --index-cache       Keep the parsed metadata in <model>.idx for faster reloads\n");
         return -1;
     }
 
+    ncnn::EngineConfig engine_config;
+    engine_config.use_mmap = use_mmap;
+    engine_config.index_cache = index_cache;
+    engine_config.num_threads = num_threads;
+
     ncnn::LLMEngine engine;
-    if (!engine.load_model(model_path)) {
+    if (!engine.load_model(model_path, engine_config)) {
         fprintf(stderr, "Failed to load model: %s\n", model_path.c_str());
         return -1;
     }
@@ -71,9 +94,12 @@ int main(int argc, char** argv)
     config.top_p = top_p;
     config.top_k = top_k;
 
-    std::cout << "Generating response..." << std::endl;
-    std::string response = engine.generate_text(prompt, config);
-    std::cout << "Response: " << response << std::endl;
+    std::cout << "Response: " << std::flush;
+    engine.generate(prompt, config, [](int /*token*/, const std::string& text) {
+        std::cout << text << std::flush;
+        return true;
+    });
+    std::cout << std::endl;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "gguf.h"
+#include "llm_engine.h"
+#include "llm_grammar.h"
+#include "tokenizer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static std::string read_text(const char* path)
+{
+    std::string text;
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return text;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        text.append(buf, n);
+    }
+    fclose(fp);
+    return text;
+}
+
+// a tool call as an agent would request it
+static const char* default_schema =
+    "{\"type\": \"object\", \"properties\": {"
+    "\"tool\": {\"enum\": [\"read\", \"write\", \"bash\", \"grep\"]},"
+    "\"arguments\": {\"type\": \"object\", \"properties\": {"
+    "\"path\": {\"type\": \"string\"}, \"content\": {\"type\": \"string\"}, \"timeout\": {\"type\": \"integer\"}},"
+    "\"required\": [\"path\"]}},"
+    "\"required\": [\"tool\", \"arguments\"]}";
+
+static const char* default_document =
+    "{\"tool\": \"write\", \"arguments\": {\"path\": \"src/main.cpp\", \"content\": "
+    "\"#include <cstdio>\\n\\nint main()\\n{\\n    printf(\\\"hello, world\\\\n\\\");\\n    return 0;\\n}\\n\", "
+    "\"timeout\": 120}}";
+
+// Cost of the allowed-token mask while a schema-conforming document is fed
+// token by token, and of sampling with and without it
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [gguf file] [schema file] [document file]\n", argv[0]);
+        return -1;
+    }
+
+    ncnn::GGUFLoader loader;
+    if (!loader.load(argv[1])) {
+        fprintf(stderr, "Failed to load GGUF file\n");
+        return -1;
+    }
+    ncnn::Tokenizer tokenizer;
+    if (!tokenizer.load_from_gguf(loader)) {
+        fprintf(stderr, "Failed to load tokenizer\n");
+        return -1;
+    }
+    const ncnn::gguf_kv* vocab = loader.find_kv("tokenizer.ggml.tokens");
+    const int n_vocab = vocab ? (int)vocab->array_size : 0;
+
+    std::string schema = argc >= 3 ? read_text(argv[2]) : default_schema;
+    std::string document = argc >= 4 ? read_text(argv[3]) : default_document;
+
+    std::string error;
+    ncnn::Grammar grammar;
+    if (!grammar.parse_json_schema(schema, &error)) {
+        fprintf(stderr, "schema: %s\n", error.c_str());
+        return -1;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    ncnn::TokenTrie trie;
+    trie.build(tokenizer, n_vocab);
+    double trie_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    std::vector<int> tokens = tokenizer.encode(document);
+
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.f, 2.f);
+    std::vector<float> logits(n_vocab);
+    for (int i = 0; i < n_vocab; i++) logits[i] = normal(gen);
+
+    ncnn::GenerationConfig config;
+    config.top_p = 0.9f;
+    ncnn::Sampler sampler;
+    sampler.init(n_vocab, 1234);
+    std::vector<int> history;
+
+    ncnn::GrammarState state;
+    state.init(&grammar, tokenizer.add_space_prefix_token());
+    double mask_us = 0, masked_us = 0, plain_us = 0;
+    size_t n_allowed = 0;
+    int checksum = 0;
+    size_t n = 0;
+    for (; n < tokens.size(); n++) {
+        start = std::chrono::high_resolution_clock::now();
+        const std::vector<int>& allowed = state.allowed_tokens(trie, tokenizer.eos_token());
+        auto mid = std::chrono::high_resolution_clock::now();
+        checksum += sampler.sample(logits.data(), config, history, &allowed);
+        auto end = std::chrono::high_resolution_clock::now();
+        checksum += sampler.sample(logits.data(), config, history);
+        auto end2 = std::chrono::high_resolution_clock::now();
+
+        mask_us += std::chrono::duration<double, std::micro>(mid - start).count();
+        masked_us += std::chrono::duration<double, std::micro>(end - mid).count();
+        plain_us += std::chrono::duration<double, std::micro>(end2 - end).count();
+        n_allowed += allowed.size();
+
+        if (!state.accept(trie.piece(tokens[n]))) {
+            fprintf(stderr, "document leaves the grammar at token %d '%s'\n", (int)n, trie.piece(tokens[n]).c_str());
+            break;
+        }
+    }
+    if (n == 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "vocab %d  trie built in %.1f ms\n", n_vocab, trie_ms);
+    fprintf(stderr, "document  %zu tokens, %s\n", tokens.size(), state.can_end() ? "complete" : "incomplete");
+    fprintf(stderr, "mask            %8.1f us/token  %.0f tokens allowed on average\n", mask_us / n, (double)n_allowed / n);
+    fprintf(stderr, "sample masked   %8.1f us/token\n", masked_us / n);
+    fprintf(stderr, "sample unmasked %8.1f us/token  (%d)\n", plain_us / n, checksum);
+
+    return state.can_end() ? 0 : 1;
+}
@@ -0,0 +1,465 @@
+#include "gguf.h"
+#include "mat.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks every isa variant of the row kernels this cpu can run against the
+// generic code, the dequantized rows of every variant against a plain scalar
+// decoder written here from the ggml block layouts, and the generic dot
+// product against a plain one over that decoded row, exits 1 on any mismatch
+// the integer kernels of every variant are checked against that plain dot
+// product too, within the error quantizing the activations to int8 allows
+// the kv cache types are quantized from random values with quantize_row, the
+// other types have no quantizer here and get random blocks whose fp16 scales
+// are overwritten with small finite values
+struct TypeCase {
+    ncnn::ggml_type type;
+    const char* name;
+    int block;     // values per block
+    int scales[2]; // byte offsets of the fp16 scales in a block, -1 for none
+};
+
+static const TypeCase type_cases[] = {
+    {ncnn::GGML_TYPE_F32, "f32", 1, {-1, -1}},
+    {ncnn::GGML_TYPE_F16, "f16", 1, {-1, -1}},
+    {ncnn::GGML_TYPE_BF16, "bf16", 1, {-1, -1}},
+    {ncnn::GGML_TYPE_Q4_0, "q4_0", 32, {-1, -1}},
+    {ncnn::GGML_TYPE_Q4_1, "q4_1", 32, {0, 2}},
+    {ncnn::GGML_TYPE_Q5_0, "q5_0", 32, {0, -1}},
+    {ncnn::GGML_TYPE_Q5_1, "q5_1", 32, {0, 2}},
+    {ncnn::GGML_TYPE_Q8_0, "q8_0", 32, {-1, -1}},
+    {ncnn::GGML_TYPE_Q2_K, "q2_K", 256, {80, 82}},
+    {ncnn::GGML_TYPE_Q3_K, "q3_K", 256, {108, -1}},
+    {ncnn::GGML_TYPE_Q4_K, "q4_K", 256, {0, 2}},
+    {ncnn::GGML_TYPE_Q5_K, "q5_K", 256, {0, 2}},
+    {ncnn::GGML_TYPE_Q6_K, "q6_K", 256, {208, -1}},
+    {ncnn::GGML_TYPE_Q8_K, "q8_K", 256, {-1, -1}},
+};
+
+static bool kv_type(ncnn::ggml_type type)
+{
+    return type == ncnn::GGML_TYPE_F32 || type == ncnn::GGML_TYPE_F16 || type == ncnn::GGML_TYPE_BF16
+           || type == ncnn::GGML_TYPE_Q8_0 || type == ncnn::GGML_TYPE_Q4_0;
+}
+
+static void random_row(const TypeCase& c, int n, std::mt19937& gen, std::vector<char>& row)
+{
+    std::normal_distribution<float> normal(0.f, 1.f);
+    row.resize(ncnn::ggml_row_size(c.type, n));
+    if (kv_type(c.type)) {
+        std::vector<float> values(n);
+        for (int i = 0; i < n; i++) values[i] = normal(gen);
+        ncnn::quantize_row(c.type, values.data(), row.data(), n);
+        return;
+    }
+
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_real_distribution<float> scale(0.001f, 0.05f);
+    for (size_t i = 0; i < row.size(); i++) row[i] = (char)byte(gen);
+
+    const size_t block_size = ncnn::ggml_row_size(c.type, c.block);
+    for (size_t b = 0; b < row.size(); b += block_size) {
+        if (c.type == ncnn::GGML_TYPE_Q8_K) {
+            const float d = scale(gen);
+            memcpy(&row[b], &d, sizeof(d));
+            continue;
+        }
+        for (int j = 0; j < 2; j++) {
+            if (c.scales[j] < 0) continue;
+            // a min is subtracted, give it either sign
+            const float d = j == 0 ? scale(gen) : scale(gen) * (byte(gen) & 1 ? 1.f : -1.f);
+            const unsigned short h = ncnn::float32_to_float16(d);
+            memcpy(&row[b + c.scales[j]], &h, sizeof(h));
+        }
+    }
+}
+
+static float fp16(const unsigned char* p)
+{
+    unsigned short h;
+    memcpy(&h, p, sizeof(h));
+    return ncnn::float16_to_float32(h);
+}
+
+// scale and min j of the 12 packed 6-bit pairs of q4_K and q5_K
+static void scale_min_k4(int j, const unsigned char* q, int& d, int& m)
+{
+    if (j < 4) {
+        d = q[j] & 63;
+        m = q[j + 4] & 63;
+    } else {
+        d = (q[j + 4] & 0xF) | ((q[j - 4] >> 6) << 4);
+        m = (q[j + 4] >> 4) | ((q[j] >> 6) << 4);
+    }
+}
+
+// The reference every variant is held to, one block at a time, shares no
+// code with gguf_quant.h so a wrong formula there cannot hide in both
+static void reference_dequantize(const TypeCase& c, const char* row, float* y, int n)
+{
+    const ncnn::ggml_type type = c.type;
+    const unsigned char* b = (const unsigned char*)row;
+    switch (type) {
+    case ncnn::GGML_TYPE_F32:
+        memcpy(y, b, n * sizeof(float));
+        return;
+    case ncnn::GGML_TYPE_F16:
+        for (int i = 0; i < n; i++) y[i] = fp16(b + 2 * i);
+        return;
+    case ncnn::GGML_TYPE_BF16:
+        for (int i = 0; i < n; i++) {
+            unsigned short h;
+            memcpy(&h, b + 2 * i, sizeof(h));
+            unsigned int u = (unsigned int)h << 16;
+            memcpy(&y[i], &u, sizeof(u));
+        }
+        return;
+    default:
+        break;
+    }
+
+    const size_t block_size = ncnn::ggml_row_size(type, c.block);
+    for (int i = 0; i < n; b += block_size) {
+        switch (type) {
+        case ncnn::GGML_TYPE_Q4_0: {
+            // d, 16 bytes of nibbles: low ones are values 0-15, high ones 16-31
+            const float d = fp16(b);
+            for (int j = 0; j < 16; j++) {
+                y[i + j] = ((b[2 + j] & 0xF) - 8) * d;
+                y[i + j + 16] = ((b[2 + j] >> 4) - 8) * d;
+            }
+            i += 32;
+            break;
+        }
+        case ncnn::GGML_TYPE_Q4_1: {
+            const float d = fp16(b);
+            const float m = fp16(b + 2);
+            for (int j = 0; j < 16; j++) {
+                y[i + j] = (b[4 + j] & 0xF) * d + m;
+                y[i + j + 16] = (b[4 + j] >> 4) * d + m;
+            }
+            i += 32;
+            break;
+        }
+        case ncnn::GGML_TYPE_Q5_0:
+        case ncnn::GGML_TYPE_Q5_1: {
+            // d, [m,] 32 fifth bits, 16 bytes of nibbles
+            const bool has_min = type == ncnn::GGML_TYPE_Q5_1;
+            const float d = fp16(b);
+            const float m = has_min ? fp16(b + 2) : 0.f;
+            const unsigned char* p = b + (has_min ? 4 : 2);
+            unsigned int qh;
+            memcpy(&qh, p, sizeof(qh));
+            const unsigned char* qs = p + 4;
+            for (int j = 0; j < 16; j++) {
+                const int x0 = (qs[j] & 0xF) | (((qh >> j) & 1) << 4);
+                const int x1 = (qs[j] >> 4) | (((qh >> (j + 16)) & 1) << 4);
+                y[i + j] = has_min ? x0 * d + m : (x0 - 16) * d;
+                y[i + j + 16] = has_min ? x1 * d + m : (x1 - 16) * d;
+            }
+            i += 32;
+            break;
+        }
+        case ncnn::GGML_TYPE_Q8_0: {
+            const float d = fp16(b);
+            for (int j = 0; j < 32; j++) y[i + j] = (signed char)b[2 + j] * d;
+            i += 32;
+            break;
+        }
+        case ncnn::GGML_TYPE_Q2_K: {
+            // 16 scale/min nibble pairs, 64 bytes of 2-bit values, d, dmin
+            const unsigned char* scales = b;
+            const unsigned char* q = b + 16;
+            const float d = fp16(b + 80);
+            const float dmin = fp16(b + 82);
+            int is = 0;
+            for (int half = 0; half < 2; half++, q += 32) {
+                for (int shift = 0; shift < 8; shift += 2) {
+                    for (int k = 0; k < 2; k++) {
+                        const int sc = scales[is++];
+                        for (int l = 0; l < 16; l++) {
+                            y[i++] = d * (sc & 0xF) * ((q[k * 16 + l] >> shift) & 3) - dmin * (sc >> 4);
+                        }
+                    }
+                }
+            }
+            break;
+        }
+        case ncnn::GGML_TYPE_Q3_K: {
+            // 32 bytes of high bits, 64 bytes of 2-bit values, 16 6-bit scales
+            // in 12 bytes, d
+            const unsigned char* hmask = b;
+            const unsigned char* q = b + 32;
+            const unsigned char* packed = b + 96;
+            const float d = fp16(b + 108);
+            int scales[16];
+            for (int j = 0; j < 16; j++) {
+                const int low = j < 8 ? packed[j] & 0xF : packed[j - 8] >> 4;
+                const int high = (packed[8 + j % 4] >> (2 * (j / 4))) & 3;
+                scales[j] = (low | (high << 4)) - 32;
+            }
+            int is = 0;
+            int m = 1;
+            for (int half = 0; half < 2; half++, q += 32) {
+                for (int shift = 0; shift < 8; shift += 2, m <<= 1) {
+                    for (int k = 0; k < 2; k++) {
+                        const int sc = scales[is++];
+                        for (int l = 0; l < 16; l++) {
+                            const int v = ((q[k * 16 + l] >> shift) & 3) - (hmask[k * 16 + l] & m ? 0 : 4);
+                            y[i++] = d * sc * v;
+                        }
+                    }
+                }
+            }
+            break;
+        }
+        case ncnn::GGML_TYPE_Q4_K:
+        case ncnn::GGML_TYPE_Q5_K: {
+            // d, dmin, 8 6-bit scale/min pairs in 12 bytes, [32 bytes of fifth
+            // bits,] 128 bytes of nibbles, 64 values per 32 bytes
+            const bool five = type == ncnn::GGML_TYPE_Q5_K;
+            const float d = fp16(b);
+            const float dmin = fp16(b + 2);
+            const unsigned char* packed = b + 4;
+            const unsigned char* qh = b + 16;
+            const unsigned char* q = b + (five ? 48 : 16);
+            for (int j = 0; j < 4; j++, q += 32) {
+                int sc1, m1, sc2, m2;
+                scale_min_k4(2 * j, packed, sc1, m1);
+                scale_min_k4(2 * j + 1, packed, sc2, m2);
+                for (int l = 0; l < 32; l++) {
+                    const int h = five ? ((qh[l] >> (2 * j)) & 1) << 4 : 0;
+                    y[i + l] = d * sc1 * ((q[l] & 0xF) + h) - dmin * m1;
+                }
+                for (int l = 0; l < 32; l++) {
+                    const int h = five ? ((qh[l] >> (2 * j + 1)) & 1) << 4 : 0;
+                    y[i + 32 + l] = d * sc2 * ((q[l] >> 4) + h) - dmin * m2;
+                }
+                i += 64;
+            }
+            break;
+        }
+        case ncnn::GGML_TYPE_Q6_K: {
+            // 128 bytes of low nibbles, 64 bytes of high bit pairs, 16 int8
+            // scales, d
+            const unsigned char* ql = b;
+            const unsigned char* qh = b + 128;
+            const signed char* scales = (const signed char*)(b + 192);
+            const float d = fp16(b + 208);
+            for (int half = 0; half < 2; half++, ql += 64, qh += 32, scales += 8) {
+                for (int l = 0; l < 32; l++) {
+                    const int is = l / 16;
+                    const int q1 = ((ql[l] & 0xF) | (((qh[l] >> 0) & 3) << 4)) - 32;
+                    const int q2 = ((ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4)) - 32;
+                    const int q3 = ((ql[l] >> 4) | (((qh[l] >> 4) & 3) << 4)) - 32;
+                    const int q4 = ((ql[l + 32] >> 4) | (((qh[l] >> 6) & 3) << 4)) - 32;
+                    y[i + l] = d * scales[is] * q1;
+                    y[i + l + 32] = d * scales[is + 2] * q2;
+                    y[i + l + 64] = d * scales[is + 4] * q3;
+                    y[i + l + 96] = d * scales[is + 6] * q4;
+                }
+                i += 128;
+            }
+            break;
+        }
+        case ncnn::GGML_TYPE_Q8_K: {
+            // float d, 256 int8 values, 16 block sums
+            float d;
+            memcpy(&d, b, sizeof(d));
+            for (int j = 0; j < 256; j++) y[i + j] = (signed char)b[4 + j] * d;
+            i += 256;
+            break;
+        }
+        default:
+            return;
+        }
+    }
+}
+
+// results of the row kernels for one row
+struct RowResult {
+    std::vector<float> dequantized;
+    float dot;
+    std::vector<float> mad;
+};
+
+static void run_kernels(const TypeCase& c, const std::vector<char>& row, const std::vector<float>& x, const std::vector<float>& y, RowResult& r)
+{
+    const int n = (int)x.size();
+    r.dequantized.resize(n);
+    ncnn::dequantize_row(c.type, row.data(), r.dequantized.data(), n);
+    r.dot = ncnn::vec_dot_row(c.type, row.data(), x.data(), n);
+    r.mad = y;
+    if (kv_type(c.type)) {
+        ncnn::vec_mad_row(c.type, row.data(), 0.5f, r.mad.data(), n);
+    }
+}
+
+// dot products of q8 activation rows with rows of q4_0, q4_K and q8_0,
+// within |w| * d / 2 of the fp32 dot product for an activation scale d,
+// repacked tiles within a thousandth of that of the row kernel
+static int check_q8(const TypeCase& c, const std::vector<std::vector<char> >& rows, const std::vector<std::vector<float> >& decoded, const std::vector<std::vector<float> >& xs, const std::vector<std::string>& variants)
+{
+    const int n = (int)xs[0].size();
+    const int n_x = (int)xs.size();
+    const int n_rows = (int)rows.size();
+    const size_t xq_size = ncnn::q8_row_size(n);
+    std::vector<char> xq(n_x * xq_size);
+    for (int r = 0; r < n_x; r++) ncnn::quantize_row_q8(xs[r].data(), &xq[r * xq_size], n);
+
+    // the plain dot product and how far activation rounding can move it,
+    // activations are quantized in blocks of 256
+    std::vector<double> exact(n_rows * n_x);
+    std::vector<double> bound(n_rows * n_x);
+    for (int i = 0; i < n_rows; i++) {
+        for (int r = 0; r < n_x; r++) {
+            double dot = 0.0;
+            double err = 1e-5;
+            for (int b = 0; b < n; b += 256) {
+                float amax = 0.f;
+                for (int j = b; j < b + 256; j++) amax = std::max(amax, fabsf(xs[r][j]));
+                for (int j = b; j < b + 256; j++) {
+                    dot += (double)decoded[i][j] * xs[r][j];
+                    err += fabs((double)decoded[i][j]) * (amax / 254.0 + 1e-6 * fabsf(xs[r][j]));
+                }
+            }
+            exact[i * n_x + r] = dot;
+            bound[i * n_x + r] = err;
+        }
+    }
+
+    const bool tiled = ncnn::q8_tile_supported(c.type);
+    const int tile_rows = ncnn::q8_tile_rows;
+    std::vector<char> tile;
+    if (tiled && n_rows >= tile_rows) {
+        const size_t row_size = rows[0].size();
+        std::vector<char> packed(tile_rows * row_size);
+        for (int i = 0; i < tile_rows; i++) memcpy(&packed[i * row_size], rows[i].data(), row_size);
+        tile.resize(ncnn::q8_tile_size(c.type, n));
+        ncnn::repack_q8_tile(c.type, packed.data(), row_size, tile.data(), n);
+    }
+
+    int failures = 0;
+    for (size_t v = 0; v < variants.size(); v++) {
+        ncnn::set_gguf_kernel_variant(variants[v]);
+        float err = 0.f;
+        std::vector<float> s(n_rows * n_x);
+        for (int i = 0; i < n_rows; i++) {
+            ncnn::vec_dot_row_q8(c.type, rows[i].data(), xq.data(), n, n_x, &s[i * n_x]);
+            for (int r = 0; r < n_x; r++) {
+                err = std::max(err, (float)(fabs(s[i * n_x + r] - exact[i * n_x + r]) / bound[i * n_x + r]));
+            }
+        }
+        bool ok = err <= 1.f;
+
+        float tile_err = 0.f;
+        if (!tile.empty()) {
+            float sums[4 * ncnn::q8_tile_rows];
+            ncnn::vec_dot_tile_q8(c.type, tile.data(), xq.data(), n, n_x, sums);
+            for (int r = 0; r < n_x; r++) {
+                for (int i = 0; i < tile_rows; i++) {
+                    const float a = s[i * n_x + r];
+                    tile_err = std::max(tile_err, (float)(fabs(sums[r * tile_rows + i] - a) / bound[i * n_x + r]));
+                }
+            }
+            ok = ok && tile_err <= 1e-3f;
+        }
+
+        fprintf(stderr, "%-5s %-10s q8 %.2e of bound tile %.2e %s\n", c.name, variants[v].c_str(), err, tile_err, ok ? "ok" : "MISMATCH");
+        failures += !ok;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc >= 2 ? atoi(argv[1]) : 512;
+    int n_rows = argc >= 3 ? atoi(argv[2]) : 16;
+    if (n <= 0 || n % 256 != 0) {
+        fprintf(stderr, "row length must be a multiple of 256\n");
+        return 1;
+    }
+
+    const std::vector<std::string> variants = ncnn::gguf_kernel_variants();
+    fprintf(stderr, "variants:");
+    for (size_t v = 0; v < variants.size(); v++) fprintf(stderr, " %s", variants[v].c_str());
+    fprintf(stderr, "\n");
+
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.f, 1.f);
+    // up to four activation rows go through the integer kernels at once
+    std::vector<std::vector<float> > xs(4, std::vector<float>(n));
+    for (size_t r = 0; r < xs.size(); r++) {
+        for (int i = 0; i < n; i++) xs[r][i] = normal(gen);
+    }
+    const std::vector<float>& x = xs[0];
+    std::vector<float> y(n);
+    for (int i = 0; i < n; i++) y[i] = normal(gen);
+
+    int failures = 0;
+    for (size_t t = 0; t < sizeof(type_cases) / sizeof(type_cases[0]); t++) {
+        const TypeCase& c = type_cases[t];
+        std::vector<std::vector<char> > rows(n_rows);
+        for (int i = 0; i < n_rows; i++) random_row(c, n, gen, rows[i]);
+
+        std::vector<std::vector<float> > decoded(n_rows, std::vector<float>(n));
+        for (int i = 0; i < n_rows; i++) reference_dequantize(c, rows[i].data(), decoded[i].data(), n);
+
+        ncnn::set_gguf_kernel_variant("generic");
+        std::vector<RowResult> ref(n_rows);
+        std::vector<double> magnitude(n_rows);
+        float dot_err = 0.f;
+        for (int i = 0; i < n_rows; i++) {
+            run_kernels(c, rows[i], x, y, ref[i]);
+            // reassociated sums may differ in proportion to the terms
+            double plain = 0.0;
+            magnitude[i] = 1e-6;
+            for (int j = 0; j < n; j++) {
+                plain += (double)decoded[i][j] * x[j];
+                magnitude[i] += fabs((double)decoded[i][j] * x[j]);
+            }
+            dot_err = std::max(dot_err, (float)(fabs(ref[i].dot - plain) / magnitude[i]));
+        }
+
+        for (size_t v = 0; v < variants.size(); v++) {
+            ncnn::set_gguf_kernel_variant(variants[v]);
+            float dequant_err = 0.f;
+            float var_dot_err = 0.f;
+            float mad_err = 0.f;
+            for (int i = 0; i < n_rows; i++) {
+                RowResult r;
+                run_kernels(c, rows[i], x, y, r);
+                for (int j = 0; j < n; j++) {
+                    const float a = decoded[i][j];
+                    dequant_err = std::max(dequant_err, fabsf(r.dequantized[j] - a) / (1.f + fabsf(a)));
+                    if (kv_type(c.type)) {
+                        const float m = y[j] + 0.5f * a;
+                        mad_err = std::max(mad_err, fabsf(r.mad[j] - m) / (1.f + fabsf(y[j]) + fabsf(0.5f * a)));
+                    }
+                }
+                var_dot_err = std::max(var_dot_err, (float)(fabs(r.dot - ref[i].dot) / magnitude[i]));
+            }
+            if (v == 0) {
+                // the generic dot is held to the plain one over the decoded row
+                var_dot_err = dot_err;
+            }
+            const bool ok = dequant_err <= 1e-6f && var_dot_err <= 1e-5f && mad_err <= 1e-6f;
+            fprintf(stderr, "%-5s %-10s dequantize %.2e dot %.2e mad %.2e %s\n", c.name, variants[v].c_str(), dequant_err, var_dot_err, mad_err, ok ? "ok" : "MISMATCH");
+            failures += !ok;
+        }
+
+        if (ncnn::vec_dot_q8_supported(c.type)) {
+            failures += check_q8(c, rows, decoded, xs, variants);
+        }
+    }
+    ncnn::set_gguf_kernel_variant("");
+
+    fprintf(stderr, "%d mismatches\n", failures);
+    return failures ? 1 : 0;
+}
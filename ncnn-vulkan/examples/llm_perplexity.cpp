@@ -0,0 +1,53 @@
+#include "llm_engine.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Perplexity of a text file with the KV cache stored in each supported type
+// the model is reloaded per type, the change against f32 shows what the
+// smaller cache costs in accuracy
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s [gguf file] [text file] [context] [threads]\n", argv[0]);
+        return -1;
+    }
+
+    std::ifstream file(argv[2], std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", argv[2]);
+        return -1;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+
+    int n_ctx = argc >= 4 ? atoi(argv[3]) : 512;
+
+    const ncnn::ggml_type types[] = {ncnn::GGML_TYPE_F32, ncnn::GGML_TYPE_F16, ncnn::GGML_TYPE_BF16, ncnn::GGML_TYPE_Q8_0, ncnn::GGML_TYPE_Q4_0};
+    const char* names[] = {"f32", "f16", "bf16", "q8_0", "q4_0"};
+
+    float base = 0;
+    for (int i = 0; i < 5; i++) {
+        ncnn::EngineConfig engine_config;
+        engine_config.num_threads = argc >= 5 ? atoi(argv[4]) : 0;
+        engine_config.kv_cache_type = types[i];
+
+        ncnn::LLMEngine engine;
+        if (!engine.load_model(argv[1], engine_config)) {
+            fprintf(stderr, "Failed to load model\n");
+            return -1;
+        }
+
+        float ppl = engine.perplexity(text.str(), n_ctx);
+        if (ppl < 0) {
+            fprintf(stderr, "Failed to score %s\n", argv[2]);
+            return -1;
+        }
+        if (i == 0) base = ppl;
+        fprintf(stderr, "kv %-5s  %6zu bytes/token  ppl %10.4f  %+.3f%%\n", names[i], engine.kv_bytes_per_token(), ppl, (ppl / base - 1.f) * 100.f);
+    }
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "llm_engine.h"
+#include "llm_sampler.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// Cost of picking one token from the logits, without any forward pass
+// logits are random with a few standing out the way real ones do, the
+// history is as long as a typical conversation so the penalties see work
+int main(int argc, char** argv)
+{
+    int n_vocab = argc >= 2 ? atoi(argv[1]) : 151936;
+    int n_history = argc >= 3 ? atoi(argv[2]) : 4096;
+    int iterations = argc >= 4 ? atoi(argv[3]) : 200;
+
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.f, 2.f);
+    std::uniform_int_distribution<int> token(0, n_vocab - 1);
+
+    std::vector<std::vector<float> > logits(16, std::vector<float>(n_vocab));
+    for (size_t i = 0; i < logits.size(); i++) {
+        for (int j = 0; j < n_vocab; j++) logits[i][j] = normal(gen);
+        for (int j = 0; j < 8; j++) logits[i][token(gen)] += 12.f;
+    }
+    std::vector<int> history(n_history);
+    for (int i = 0; i < n_history; i++) history[i] = token(gen);
+
+    struct Case {
+        const char* name;
+        ncnn::GenerationConfig config;
+    };
+    std::vector<Case> cases;
+    Case c;
+    c.name = "greedy";
+    c.config.do_sample = false;
+    cases.push_back(c);
+    c = Case();
+    c.name = "temperature";
+    cases.push_back(c);
+    c.name = "top-k 40";
+    c.config.top_k = 40;
+    cases.push_back(c);
+    c = Case();
+    c.name = "top-p 0.9";
+    c.config.top_p = 0.9f;
+    cases.push_back(c);
+    c.name = "top-k 40 top-p 0.9";
+    c.config.top_k = 40;
+    cases.push_back(c);
+    c = Case();
+    c.name = "min-p 0.05";
+    c.config.min_p = 0.05f;
+    cases.push_back(c);
+    c = Case();
+    c.name = "typical 0.95";
+    c.config.typical_p = 0.95f;
+    cases.push_back(c);
+    c = Case();
+    c.name = "penalties top-p 0.9";
+    c.config.top_p = 0.9f;
+    c.config.repetition_penalty = 1.1f;
+    c.config.presence_penalty = 0.5f;
+    c.config.frequency_penalty = 0.2f;
+    cases.push_back(c);
+
+    ncnn::Sampler sampler;
+    sampler.init(n_vocab, 1234);
+
+    fprintf(stderr, "vocab %d  history %d\n", n_vocab, n_history);
+    for (size_t i = 0; i < cases.size(); i++) {
+        int checksum = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iterations; it++) {
+            checksum += sampler.sample(logits[it % logits.size()].data(), cases[i].config, history);
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+        fprintf(stderr, "%-22s %8.1f us/token  (%d)\n", cases[i].name, us, checksum);
+    }
+
+    return 0;
+}
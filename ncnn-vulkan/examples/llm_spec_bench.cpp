@@ -0,0 +1,83 @@
+#include "llm_engine.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Decode speed of speculative decoding against plain decoding for one model
+// pair, or for prompt lookup when the draft is -, for every number of drafted
+// tokens up to the given maximum
+// acceptance rate and tokens per model pass show where a larger k stops paying
+// prompt lookup pays off on prompts the answer copies from, such as a file to edit
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s [gguf file] [draft gguf file or -] [max draft tokens] [tokens] [threads] [prompt file]\n", argv[0]);
+        return -1;
+    }
+
+    int max_k = argc >= 4 ? atoi(argv[3]) : 8;
+    int max_tokens = argc >= 5 ? atoi(argv[4]) : 128;
+
+    ncnn::EngineConfig engine_config;
+    engine_config.num_threads = argc >= 6 ? atoi(argv[5]) : 0;
+
+    ncnn::LLMEngine plain;
+    if (!plain.load_model(argv[1], engine_config)) {
+        fprintf(stderr, "Failed to load model\n");
+        return -1;
+    }
+
+    if (std::string(argv[2]) == "-") {
+        engine_config.lookup_ngram = 3;
+    } else {
+        engine_config.draft_model = argv[2];
+    }
+    ncnn::LLMEngine engine;
+    if (!engine.load_model(argv[1], engine_config)) {
+        fprintf(stderr, "Failed to load model\n");
+        return -1;
+    }
+
+    ncnn::GenerationConfig config;
+    config.do_sample = false;
+    config.max_tokens = max_tokens;
+    std::string prompt = "The history of the city begins with";
+    if (argc >= 7) {
+        std::ifstream file(argv[6], std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "Failed to open %s\n", argv[6]);
+            return -1;
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+        prompt = text.str();
+    }
+
+    // fault the weights in before timing
+    plain.generate("warm up", config);
+    engine.generate("warm up", config);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    size_t n = plain.generate(prompt, config).size();
+    double base = n / std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    fprintf(stderr, "plain     tokens %4zu  %8.1f tokens/s\n", n, base);
+
+    for (int k = 1; k <= max_k; k++) {
+        engine.set_draft_tokens(k);
+        engine.reset_speculative_stats();
+
+        start = std::chrono::high_resolution_clock::now();
+        n = engine.generate(prompt, config).size();
+        double rate = n / std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        ncnn::SpeculativeStats stats = engine.speculative_stats();
+        fprintf(stderr, "k %2d      tokens %4zu  %8.1f tokens/s  x%.2f  accepted %5.1f%%  %.2f tokens/pass  looked up %5.1f%%  draft %.3f s  verify %.3f s\n",
+                k, n, rate, rate / base, stats.acceptance_rate() * 100.f, stats.tokens_per_step(),
+                stats.drafted ? stats.looked_up * 100.f / stats.drafted : 0.f, stats.draft_seconds, stats.verify_seconds);
+    }
+
+    return 0;
+}
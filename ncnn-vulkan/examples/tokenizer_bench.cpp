@@ -0,0 +1,100 @@
+#include "gguf.h"
+#include "tokenizer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static std::string read_text(const char* path)
+{
+    std::string text;
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return text;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        text.append(buf, n);
+    }
+    fclose(fp);
+    return text;
+}
+
+// mixed prose, code, numbers and non-ascii so every pre-tokenizer branch runs
+static std::string synth_text(size_t bytes)
+{
+    static const char* lines[] = {
+        "The quick brown fox jumps over the lazy dog, doesn't it? ",
+        "In 1969 they landed 2 men on the moon after 8 years of work.\n",
+        "for (int i = 0; i < n; ++i) { sum += x[i] * w[i]; }\n",
+        "    We'll see what they're doing with 3.14159 and 2,718 items...\n\n",
+        "Ça coûte 12 €, naïve café — résumé déjà vu. ",
+        "日本語のテキストも少し混ぜておく。 ",
+        "Привет, мир! Как дела? ",
+    };
+    const int nlines = sizeof(lines) / sizeof(lines[0]);
+    std::string text;
+    text.reserve(bytes + 128);
+    for (int i = 0; text.size() < bytes; i++) {
+        text += lines[(i * 7 + i / nlines) % nlines];
+    }
+    return text;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [gguf file] [text file or size in MB] [loops]\n", argv[0]);
+        return -1;
+    }
+
+    ncnn::GGUFLoader loader;
+    if (!loader.load(argv[1])) {
+        fprintf(stderr, "Failed to load GGUF file\n");
+        return -1;
+    }
+
+    ncnn::Tokenizer tokenizer;
+    if (!tokenizer.load_from_gguf(loader)) {
+        fprintf(stderr, "Failed to load tokenizer\n");
+        return -1;
+    }
+
+    std::string text;
+    if (argc >= 3 && atof(argv[2]) == 0) {
+        text = read_text(argv[2]);
+    } else {
+        double mb = argc >= 3 ? atof(argv[2]) : 4.0;
+        text = synth_text((size_t)(mb * 1024 * 1024));
+    }
+    int loops = argc >= 4 ? atoi(argv[3]) : 3;
+
+    if (text.empty()) {
+        fprintf(stderr, "No input text\n");
+        return -1;
+    }
+
+    std::vector<int> tokens;
+    double best = 1e30;
+    for (int i = 0; i < loops; i++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        tokens = tokenizer.encode(text);
+        auto end = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (seconds < best) best = seconds;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::string decoded = tokenizer.decode(tokens);
+    auto end = std::chrono::high_resolution_clock::now();
+    double decode_seconds = std::chrono::duration<double>(end - start).count();
+
+    double mb = text.size() / (1024.0 * 1024.0);
+    fprintf(stderr, "input     %.2f MB\n", mb);
+    fprintf(stderr, "tokens    %zu (%.2f bytes/token)\n", tokens.size(), text.size() / (double)tokens.size());
+    fprintf(stderr, "encode    %.3f s  %.2f MB/s  %.0f tokens/s\n", best, mb / best, tokens.size() / best);
+    fprintf(stderr, "decode    %.3f s  %.2f MB/s\n", decode_seconds, mb / decode_seconds);
+    fprintf(stderr, "roundtrip %s\n", decoded == text ? "ok" : "MISMATCH");
+
+    return decoded == text ? 0 : 1;
+}
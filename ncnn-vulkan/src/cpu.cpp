@@ -3025,6 +3025,38 @@ const CpuSet& get_cpu_thread_affinity_mask(int powersave)
     return g_cpu_affinity_mask_all;
 }
 
+CpuSet get_cpu_physical_affinity_mask(const CpuSet& thread_affinity_mask)
+{
+    try_initialize_global_cpu_info();
+#if defined __ANDROID__ || defined __linux__
+    CpuSet mask;
+    mask.disable_all();
+    for (int i = 0; i < g_cpucount; i++)
+    {
+        if (!thread_affinity_mask.is_enabled(i))
+            continue;
+
+        // drop i when a lower sibling of the same core is already taken
+        int thread_siblings = i < 31 ? get_thread_siblings(i) : -1;
+        bool sibling_taken = false;
+        for (int j = 0; thread_siblings != -1 && j < i; j++)
+        {
+            if ((thread_siblings & (1 << j)) && thread_affinity_mask.is_enabled(j))
+            {
+                sibling_taken = true;
+                break;
+            }
+        }
+
+        if (!sibling_taken)
+            mask.enable(i);
+    }
+    return mask;
+#else
+    return thread_affinity_mask;
+#endif
+}
+
 int set_cpu_thread_affinity(const CpuSet& thread_affinity_mask)
 {
     try_initialize_global_cpu_info();
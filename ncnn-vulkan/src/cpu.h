@@ -148,6 +148,10 @@ NCNN_EXPORT const CpuSet& get_cpu_thread_affinity_mask(int powersave);
 // set explicit thread affinity
 NCNN_EXPORT int set_cpu_thread_affinity(const CpuSet& thread_affinity_mask);
 
+// one hardware thread of every physical core in thread_affinity_mask
+// only implemented on linux and android, elsewhere the mask is returned as is
+NCNN_EXPORT CpuSet get_cpu_physical_affinity_mask(const CpuSet& thread_affinity_mask);
+
 // runtime thread affinity info
 NCNN_EXPORT int is_current_thread_running_on_a53_a55();
 
@@ -1,5 +1,8 @@
 #include "gguf.h"
+#include "cpu.h"
 #include "mat.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -7,7 +10,20 @@
 #include <cstddef>
 #include <unordered_map>
 #include <vector>
-#include <cstring> // for memcpy
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "gguf_quant.h"
 
 namespace ncnn {
 
@@ -47,15 +63,18 @@ static size_t ggml_blck_size(ggml_type type) {
     switch (type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
-        case GGML_TYPE_Q4_K:
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
-        case GGML_TYPE_Q5_K:
-        case GGML_TYPE_Q6_K:
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
-        case GGML_TYPE_Q8_K:
             return 32;
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q6_K:
+        case GGML_TYPE_Q8_K:
+            return QK_K;
         default:
             return 1;
     }
@@ -65,15 +84,19 @@ static size_t ggml_type_size(ggml_type type) {
     switch (type) {
         case GGML_TYPE_F32:  return 4;
         case GGML_TYPE_F16:  return 2;
-        case GGML_TYPE_Q4_0: return sizeof(uint32_t) + 16;
-        case GGML_TYPE_Q4_1: return 2*sizeof(uint32_t) + 16;
-        case GGML_TYPE_Q5_0: return 2*sizeof(uint32_t) + 20;
-        case GGML_TYPE_Q5_1: return 3*sizeof(uint32_t) + 20;
-        case GGML_TYPE_Q8_0: return sizeof(uint32_t) + 32;
-        case GGML_TYPE_Q4_K: return 84;
-        case GGML_TYPE_Q5_K: return 92;
-        case GGML_TYPE_Q6_K: return 48 + 24;
-        case GGML_TYPE_Q8_K: return 2*sizeof(uint32_t) + 32;
+        case GGML_TYPE_BF16: return 2;
+        case GGML_TYPE_Q4_0: return sizeof(block_q4_0);
+        case GGML_TYPE_Q4_1: return sizeof(block_q4_1);
+        case GGML_TYPE_Q5_0: return sizeof(block_q5_0);
+        case GGML_TYPE_Q5_1: return sizeof(block_q5_1);
+        case GGML_TYPE_Q8_0: return sizeof(block_q8_0);
+        case GGML_TYPE_Q8_1: return 2 * sizeof(uint16_t) + 32;
+        case GGML_TYPE_Q2_K: return sizeof(block_q2_K);
+        case GGML_TYPE_Q3_K: return sizeof(block_q3_K);
+        case GGML_TYPE_Q4_K: return sizeof(block_q4_K);
+        case GGML_TYPE_Q5_K: return sizeof(block_q5_K);
+        case GGML_TYPE_Q6_K: return sizeof(block_q6_K);
+        case GGML_TYPE_Q8_K: return sizeof(block_q8_K);
         default: return 0;
     }
 }
@@ -86,186 +109,730 @@ size_t gguf_tensor_size(const std::vector<uint64_t>& ne, ggml_type type) {
     return blocks * ggml_type_size(type);
 }
 
-bool GGUFLoader::load(const char* file_path) {
-    fprintf(stderr, "Loading GGUF: %s\n", file_path);
+static bool map_file(const char* file_path, const GGUFLoadOption& opt, char*& data, size_t& size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(file, &li) || li.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) return false;
+
+    void* addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!addr) return false;
+
+    (void)opt;
+    data = (char*)addr;
+    size = (size_t)li.QuadPart;
+    return true;
+#else
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (opt.populate) flags |= MAP_POPULATE;
+#endif
+    void* addr = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
 
+    if (opt.random_access) {
+        madvise(addr, (size_t)st.st_size, MADV_RANDOM);
+    }
+#ifndef MAP_POPULATE
+    if (opt.populate) {
+        madvise(addr, (size_t)st.st_size, MADV_WILLNEED);
+    }
+#endif
+
+    data = (char*)addr;
+    size = (size_t)st.st_size;
+    return true;
+#endif
+}
+
+static void unmap_file(char* data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+static bool read_file(const char* file_path, char*& data, size_t& size) {
     FILE* fp = fopen(file_path, "rb");
     if (!fp) return false;
 
     fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
+    size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    file_data = (char*)malloc(file_size);
-    if (!file_data || fread(file_data, 1, file_size, fp) != file_size) {
+    data = (char*)malloc(size);
+    if (!data || fread(data, 1, size, fp) != size) {
         fclose(fp);
         return false;
     }
     fclose(fp);
+    return true;
+}
 
+// bytes per element of the fixed size metadata types, 0 for strings and arrays
+static size_t gguf_value_size(uint32_t type) {
+    switch (type) {
+        case GGUF_TYPE_UINT8:
+        case GGUF_TYPE_INT8:
+        case GGUF_TYPE_BOOL:    return 1;
+        case GGUF_TYPE_UINT16:
+        case GGUF_TYPE_INT16:   return 2;
+        case GGUF_TYPE_UINT32:
+        case GGUF_TYPE_INT32:
+        case GGUF_TYPE_FLOAT32: return 4;
+        case GGUF_TYPE_UINT64:
+        case GGUF_TYPE_INT64:
+        case GGUF_TYPE_FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+static bool gguf_is_int(uint32_t type) {
+    return gguf_value_size(type) != 0 && type != GGUF_TYPE_FLOAT32 && type != GGUF_TYPE_FLOAT64;
+}
+
+static int64_t read_int(uint32_t type, const char* ptr) {
+    switch (type) {
+        case GGUF_TYPE_UINT8:
+        case GGUF_TYPE_BOOL:   return (int64_t)(uint8_t)ptr[0];
+        case GGUF_TYPE_INT8:   return (int64_t)(int8_t)ptr[0];
+        case GGUF_TYPE_UINT16: return (int64_t)read_u16(ptr);
+        case GGUF_TYPE_INT16:  return (int64_t)(int16_t)read_u16(ptr);
+        case GGUF_TYPE_UINT32: return (int64_t)read_u32(ptr);
+        case GGUF_TYPE_INT32:  return (int64_t)(int32_t)read_u32(ptr);
+        case GGUF_TYPE_UINT64:
+        case GGUF_TYPE_INT64:  return (int64_t)read_u64(ptr);
+        default: return 0;
+    }
+}
+
+static float read_float(uint32_t type, const char* ptr) {
+    if (type == GGUF_TYPE_FLOAT32) {
+        float v;
+        memcpy(&v, ptr, 4);
+        return v;
+    }
+    if (type == GGUF_TYPE_FLOAT64) {
+        double v;
+        memcpy(&v, ptr, 8);
+        return (float)v;
+    }
+    return 0.f;
+}
+
+// fnv-1a
+static uint64_t hash_bytes(const char* data, size_t size, uint64_t h = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Walks the header once and records where every value lives
+// nothing is copied, string arrays become a table of offsets
+bool GGUFLoader::parse_index(uint64_t& data_offset) {
     const char* ptr = file_data;
     const char* end = file_data + file_size;
 
+#define GGUF_NEED(n) if ((uint64_t)(end - ptr) < (uint64_t)(n)) return false
+
+    GGUF_NEED(24);
     uint32_t magic = read_u32(ptr);
     uint32_t version = read_u32(ptr);
     if (magic != 0x46554747 || (version != 2 && version != 3)) return false;
 
     uint64_t tensor_count = read_u64(ptr);
     uint64_t kv_count     = read_u64(ptr);
+    if (tensor_count > file_size || kv_count > file_size) return false;
 
-    // Parse KV pairs
+    kvs.reserve((size_t)kv_count);
     for (uint64_t i = 0; i < kv_count; ++i) {
+        GGUF_NEED(8);
         uint64_t key_len = read_u64(ptr);
-        std::string key_str(ptr, key_len);
+        GGUF_NEED(key_len + 4);
+
+        gguf_kv kv;
+        kv.key = ptr - file_data;
+        kv.key_size = key_len;
         ptr += key_len;
+        kv.type = read_u32(ptr);
+        kv.array_type = 0;
+        kv.array_size = 0;
+        kv.strings = 0;
+        kv.value = ptr - file_data;
 
-        uint32_t type = read_u32(ptr);
-
-        switch (type) {
-            case GGUF_TYPE_UINT8:   this->kv_ints[key_str] = (int64_t)*(uint8_t*)ptr; ptr += 1; break;
-            case GGUF_TYPE_INT8:    this->kv_ints[key_str] = (int64_t)*(int8_t*)ptr; ptr += 1; break;
-            case GGUF_TYPE_UINT16:  this->kv_ints[key_str] = (int64_t)read_u16(ptr); break;
-            case GGUF_TYPE_INT16:   this->kv_ints[key_str] = (int64_t)*(int16_t*)ptr; ptr += 2; break;
-            case GGUF_TYPE_UINT32:  this->kv_ints[key_str] = (int64_t)read_u32(ptr); break;
-            case GGUF_TYPE_INT32:   this->kv_ints[key_str] = (int64_t)*(int32_t*)ptr; ptr += 4; break;
-            case GGUF_TYPE_FLOAT32: this->kv_floats[key_str] = *(float*)ptr; ptr += 4; break;
-            case GGUF_TYPE_BOOL:    this->kv_ints[key_str] = (int64_t)*(bool*)ptr; ptr += 1; break;
-            case GGUF_TYPE_STRING: {
-                uint64_t slen = read_u64(ptr);
-                this->kv_strings[key_str] = std::string(ptr, slen);
-                ptr += slen;
-                break;
-            }
-            case GGUF_TYPE_ARRAY: {
-                uint32_t arr_type = read_u32(ptr);
-                uint64_t arr_len  = read_u64(ptr);
-
-                switch (arr_type) {
-                    case GGUF_TYPE_UINT8:
-                    case GGUF_TYPE_INT8:
-                    case GGUF_TYPE_UINT16:
-                    case GGUF_TYPE_INT16:
-                    case GGUF_TYPE_UINT32:
-                    case GGUF_TYPE_INT32:
-                    case GGUF_TYPE_UINT64:
-                    case GGUF_TYPE_INT64: {
-                        std::vector<int32_t> vec;
-                        size_t element_size;
-                        if (arr_type == GGUF_TYPE_UINT64 || arr_type == GGUF_TYPE_INT64) element_size = 8;
-                        else if (arr_type == GGUF_TYPE_UINT32 || arr_type == GGUF_TYPE_INT32) element_size = 4;
-                        else if (arr_type == GGUF_TYPE_UINT16 || arr_type == GGUF_TYPE_INT16) element_size = 2;
-                        else element_size = 1;
-                        for (uint64_t j = 0; j < arr_len; j++) {
-                            int64_t val = 0;
-                            if (element_size == 8) val = (int64_t)read_u64(ptr);
-                            else if (element_size == 4) val = (int32_t)read_u32(ptr);
-                            else if (element_size == 2) val = (int16_t)read_u16(ptr);
-                            else { val = (int8_t)ptr[0]; ptr += 1; }
-                            vec.push_back((int32_t)val);
-                        }
-                        this->kv_int32_arrays[key_str] = vec;
-                        break;
-                    }
-                    case GGUF_TYPE_FLOAT32: {
-                        std::vector<float> vec;
-                        for (uint64_t j = 0; j < arr_len; j++) {
-                            vec.push_back(*(float*)ptr);
-                            ptr += 4;
-                        }
-                        this->kv_float_arrays[key_str] = vec;
-                        break;
-                    }
-                    case GGUF_TYPE_STRING: {
-                        std::vector<std::string> vec;
-                        for (uint64_t j = 0; j < arr_len; j++) {
-                            uint64_t slen = read_u64(ptr);
-                            vec.push_back(std::string(ptr, slen));
-                            ptr += slen;
-                        }
-                        this->kv_string_arrays[key_str] = vec;
-                        break;
-                    }
-                    default: {
-                        // skip unsupported array types
-                        size_t element_size = 0;
-                        switch (arr_type) {
-                            case GGUF_TYPE_UINT8:   element_size = 1; break;
-                            case GGUF_TYPE_INT8:    element_size = 1; break;
-                            case GGUF_TYPE_UINT16:  element_size = 2; break;
-                            case GGUF_TYPE_INT16:   element_size = 2; break;
-                            case GGUF_TYPE_UINT32:  element_size = 4; break;
-                            case GGUF_TYPE_INT32:   element_size = 4; break;
-                            case GGUF_TYPE_FLOAT32: element_size = 4; break;
-                            case GGUF_TYPE_BOOL:    element_size = 1; break;
-                            case GGUF_TYPE_UINT64:  element_size = 8; break;
-                            case GGUF_TYPE_INT64:   element_size = 8; break;
-                            case GGUF_TYPE_FLOAT64: element_size = 8; break;
-                            case GGUF_TYPE_STRING: {
-                                for (uint64_t j = 0; j < arr_len; j++) {
-                                    uint64_t slen = read_u64(ptr);
-                                    ptr += slen;
-                                }
-                                element_size = 0; // already advanced
-                                break;
-                            }
-                            default:
-                                return false;
-                        }
-
-                        if (element_size > 0) {
-                            size_t bytes = arr_len * element_size;
-                            if (ptr + bytes > end) return false;
-                            ptr += bytes;
-                        }
-                        break;
-                    }
+        if (kv.type == GGUF_TYPE_STRING) {
+            GGUF_NEED(8);
+            uint64_t slen = read_u64(ptr);
+            GGUF_NEED(slen);
+            ptr += slen;
+        } else if (kv.type == GGUF_TYPE_ARRAY) {
+            GGUF_NEED(12);
+            kv.array_type = read_u32(ptr);
+            kv.array_size = read_u64(ptr);
+            kv.value = ptr - file_data;
+
+            if (kv.array_type == GGUF_TYPE_STRING) {
+                if (kv.array_size > (uint64_t)(end - ptr) / 8) return false;
+                kv.strings = string_offsets.size();
+                string_offsets.reserve(string_offsets.size() + (size_t)kv.array_size);
+                for (uint64_t j = 0; j < kv.array_size; j++) {
+                    GGUF_NEED(8);
+                    string_offsets.push_back(ptr - file_data);
+                    uint64_t slen = read_u64(ptr);
+                    GGUF_NEED(slen);
+                    ptr += slen;
                 }
-                break;
+            } else {
+                size_t element_size = gguf_value_size(kv.array_type);
+                if (element_size == 0) return false;
+                if (kv.array_size > (uint64_t)(end - ptr) / element_size) return false;
+                ptr += kv.array_size * element_size;
             }
-            case GGUF_TYPE_UINT64:  this->kv_ints[key_str] = (int64_t)read_u64(ptr); break;
-            case GGUF_TYPE_INT64:   this->kv_ints[key_str] = (int64_t)read_u64(ptr); break;
-            case GGUF_TYPE_FLOAT64: this->kv_floats[key_str] = (float)*(double*)(ptr); ptr += 8; break;
-            default:
-                return false;
+        } else {
+            size_t size = gguf_value_size(kv.type);
+            if (size == 0) return false;
+            GGUF_NEED(size);
+            ptr += size;
         }
-    }
 
-    // uint32_t alignment = 32; // unused for now
+        kvs.push_back(kv);
+    }
 
+    tensor_infos.reserve((size_t)tensor_count);
     for (uint64_t i = 0; i < tensor_count; ++i) {
-        std::string name_str;
         // GGUF spec: name is gguf_string_t: uint64 len + bytes
+        GGUF_NEED(8);
         uint64_t name_len = read_u64(ptr);
-        name_str = std::string(ptr, name_len);
+        GGUF_NEED(name_len + 4);
+
+        gguf_tensor_info info;
+        info.name = ptr - file_data;
+        info.name_size = name_len;
         ptr += name_len;
 
-        uint32_t n_dims = read_u32(ptr);
-        std::vector<uint64_t> ne(n_dims);
-        for (uint32_t j = 0; j < n_dims; ++j) ne[j] = read_u64(ptr);
+        info.n_dims = read_u32(ptr);
+        if (info.n_dims > 4) return false;
+        GGUF_NEED(info.n_dims * 8 + 12);
+        for (uint32_t j = 0; j < 4; ++j) info.ne[j] = j < info.n_dims ? read_u64(ptr) : 1;
+
+        info.type = read_u32(ptr);
+        info.offset = read_u64(ptr);
+        tensor_infos.push_back(info);
+    }
+
+#undef GGUF_NEED
+
+    build_kv_buckets();
+
+    // tensor offsets are relative to the aligned start of the data section
+    int64_t alignment = 32;
+    if (!get_kv_int("general.alignment", alignment) || alignment <= 0) alignment = 32;
+
+    data_offset = ((uint64_t)(ptr - file_data) + alignment - 1) / alignment * alignment;
+    return true;
+}
 
-        ggml_type type = (ggml_type)read_u32(ptr);
-        uint64_t tensor_offset = read_u64(ptr);
+void GGUFLoader::build_kv_buckets() {
+    size_t n = 16;
+    while (n < kvs.size() * 2) n *= 2;
+    kv_buckets.assign(n, -1);
+
+    for (size_t i = 0; i < kvs.size(); ++i) {
+        const char* key = file_data + kvs[i].key;
+        size_t b = hash_bytes(key, (size_t)kvs[i].key_size) & (n - 1);
+        while (kv_buckets[b] >= 0) {
+            // a repeated key replaces the earlier entry
+            const gguf_kv& other = kvs[kv_buckets[b]];
+            if (other.key_size == kvs[i].key_size && memcmp(file_data + other.key, key, (size_t)other.key_size) == 0) break;
+            b = (b + 1) & (n - 1);
+        }
+        kv_buckets[b] = (int)i;
+    }
+}
+
+static uint64_t file_mtime(const char* file_path) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(file_path, &st) != 0) return 0;
+#else
+    struct stat st;
+    if (stat(file_path, &st) != 0) return 0;
+#endif
+    return (uint64_t)st.st_mtime;
+}
+
+// the header and the tail of the file, cheap enough to run on every load
+static uint64_t file_hash(const char* data, size_t size) {
+    const size_t window = 64 * 1024;
+    uint64_t h = hash_bytes(data, std::min(size, window));
+    if (size > window) {
+        h = hash_bytes(data + size - std::min(size - window, window), std::min(size - window, window), h);
+    }
+    return h;
+}
+
+struct gguf_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    uint64_t mtime;
+    uint64_t hash;
+    uint64_t data_offset;
+    uint64_t n_kv;
+    uint64_t n_strings;
+    uint64_t n_tensors;
+};
+
+static const uint32_t GGUF_INDEX_MAGIC = 0x58444947; // "GIDX"
+static const uint32_t GGUF_INDEX_VERSION = 1;
+
+// whether [offset, offset + size) lies in a file of file_size bytes, the
+// sum is never formed so huge values cannot wrap around
+static bool in_file(uint64_t offset, uint64_t size, uint64_t file_size) {
+    return offset <= file_size && size <= file_size - offset;
+}
+
+// whether a gguf string, a u64 length and its bytes, at offset lies in the file
+static bool string_in_file(const char* file_data, uint64_t offset, uint64_t file_size) {
+    if (!in_file(offset, 8, file_size)) return false;
+    const char* ptr = file_data + offset;
+    return in_file(offset + 8, read_u64(ptr), file_size);
+}
+
+bool GGUFLoader::load_index_cache(const char* cache_path, uint64_t mtime, uint64_t hash, uint64_t& data_offset) {
+    FILE* fp = fopen(cache_path, "rb");
+    if (!fp) return false;
+
+    gguf_index_header header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1
+              && header.magic == GGUF_INDEX_MAGIC && header.version == GGUF_INDEX_VERSION
+              && header.file_size == file_size && header.mtime == mtime && header.hash == hash
+              && header.n_kv <= file_size && header.n_strings <= file_size && header.n_tensors <= file_size
+              && header.data_offset <= file_size;
+    if (ok) {
+        kvs.resize((size_t)header.n_kv);
+        string_offsets.resize((size_t)header.n_strings);
+        tensor_infos.resize((size_t)header.n_tensors);
+        ok = fread(kvs.data(), sizeof(gguf_kv), kvs.size(), fp) == kvs.size()
+             && fread(string_offsets.data(), sizeof(uint64_t), string_offsets.size(), fp) == string_offsets.size()
+             && fread(tensor_infos.data(), sizeof(gguf_tensor_info), tensor_infos.size(), fp) == tensor_infos.size();
+    }
+    fclose(fp);
+
+    // never trust an offset or a size that would read past the mapping, the
+    // strings are checked once through the offset table
+    for (size_t i = 0; ok && i < string_offsets.size(); ++i) {
+        ok = string_in_file(file_data, string_offsets[i], file_size);
+    }
+    for (size_t i = 0; ok && i < kvs.size(); ++i) {
+        const gguf_kv& kv = kvs[i];
+        ok = in_file(kv.key, kv.key_size, file_size);
+        if (!ok) break;
+        if (kv.type == GGUF_TYPE_STRING) {
+            ok = string_in_file(file_data, kv.value, file_size);
+        } else if (kv.type == GGUF_TYPE_ARRAY && kv.array_type == GGUF_TYPE_STRING) {
+            ok = kv.strings <= string_offsets.size() && kv.array_size <= string_offsets.size() - kv.strings;
+        } else if (kv.type == GGUF_TYPE_ARRAY) {
+            const size_t element_size = gguf_value_size(kv.array_type);
+            ok = element_size != 0 && kv.value <= file_size && kv.array_size <= (file_size - kv.value) / element_size;
+        } else {
+            const size_t size = gguf_value_size(kv.type);
+            ok = size != 0 && in_file(kv.value, size, file_size);
+        }
+    }
+    for (size_t i = 0; ok && i < tensor_infos.size(); ++i) {
+        ok = in_file(tensor_infos[i].name, tensor_infos[i].name_size, file_size) && tensor_infos[i].n_dims <= 4
+             && tensor_infos[i].offset <= file_size;
+    }
+
+    if (!ok) {
+        kvs.clear();
+        string_offsets.clear();
+        tensor_infos.clear();
+        return false;
+    }
+
+    build_kv_buckets();
+    data_offset = header.data_offset;
+    return true;
+}
+
+void GGUFLoader::save_index_cache(const char* cache_path, uint64_t mtime, uint64_t hash, uint64_t data_offset) const {
+    gguf_index_header header;
+    header.magic = GGUF_INDEX_MAGIC;
+    header.version = GGUF_INDEX_VERSION;
+    header.file_size = file_size;
+    header.mtime = mtime;
+    header.hash = hash;
+    header.data_offset = data_offset;
+    header.n_kv = kvs.size();
+    header.n_strings = string_offsets.size();
+    header.n_tensors = tensor_infos.size();
+
+    // write aside and rename so a concurrent load never sees a partial file
+    std::string tmp_path = std::string(cache_path) + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) return;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+              && fwrite(kvs.data(), sizeof(gguf_kv), kvs.size(), fp) == kvs.size()
+              && fwrite(string_offsets.data(), sizeof(uint64_t), string_offsets.size(), fp) == string_offsets.size()
+              && fwrite(tensor_infos.data(), sizeof(gguf_tensor_info), tensor_infos.size(), fp) == tensor_infos.size();
+    ok = fclose(fp) == 0 && ok;
+
+#ifdef _WIN32
+    if (ok) remove(cache_path);
+#endif
+    if (!ok || rename(tmp_path.c_str(), cache_path) != 0) {
+        remove(tmp_path.c_str());
+    }
+}
+
+bool GGUFLoader::load(const char* file_path, const GGUFLoadOption& opt) {
+    fprintf(stderr, "Loading GGUF: %s\n", file_path);
+
+    unload();
+
+    if (opt.use_mmap) {
+        mapped = map_file(file_path, opt, file_data, file_size);
+        if (!mapped) {
+            fprintf(stderr, "mmap %s failed, falling back to read\n", file_path);
+        }
+    }
+    if (!mapped && !read_file(file_path, file_data, file_size)) {
+        return false;
+    }
+
+    uint64_t data_offset = 0;
+    bool cached = false;
+    std::string cache_path;
+    uint64_t mtime = 0;
+    uint64_t hash = 0;
+    if (opt.index_cache) {
+        cache_path = std::string(file_path) + ".idx";
+        mtime = file_mtime(file_path);
+        hash = file_hash(file_data, file_size);
+        cached = load_index_cache(cache_path.c_str(), mtime, hash, data_offset);
+    }
+    if (!cached) {
+        if (!parse_index(data_offset)) {
+            fprintf(stderr, "invalid GGUF header in %s\n", file_path);
+            return false;
+        }
+        if (opt.index_cache) {
+            save_index_cache(cache_path.c_str(), mtime, hash, data_offset);
+        }
+    }
+
+    tensor_map.reserve(tensor_infos.size());
+    for (size_t i = 0; i < tensor_infos.size(); ++i) {
+        const gguf_tensor_info& info = tensor_infos[i];
 
         gguf_tensor t;
-        t.name = name_str;
-        t.type = type;
-        t.ne = ne;
-        t.offset = tensor_offset;
-        t.size = gguf_tensor_size(ne, type);
+        t.name = std::string(file_data + info.name, (size_t)info.name_size);
+        t.type = (ggml_type)info.type;
+        t.ne.assign(info.ne, info.ne + info.n_dims);
+        t.offset = info.offset + data_offset;
+        t.size = gguf_tensor_size(t.ne, t.type);
+        if (!in_file(t.offset, t.size, file_size)) {
+            fprintf(stderr, "tensor %s out of file bounds\n", t.name.c_str());
+            return false;
+        }
+        t.data = file_data + t.offset;
+
+        tensor_map[t.name] = t;
+    }
+
+    return true;
+}
+
+struct gguf_repack_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    uint64_t mtime;
+    uint64_t hash;
+    char isa[16];
+    uint64_t n_tensors;
+    uint64_t data_offset;
+};
+
+static const uint32_t GGUF_REPACK_MAGIC = 0x4b505247; // "GRPK"
+static const uint32_t GGUF_REPACK_VERSION = 1;
+
+static void fill_repack_header(gguf_repack_header& header, const char* model_path, const GGUFLoader& model, const std::string& isa) {
+    memset(&header, 0, sizeof(header));
+    header.magic = GGUF_REPACK_MAGIC;
+    header.version = GGUF_REPACK_VERSION;
+    header.file_size = model.get_file_size();
+    header.mtime = file_mtime(model_path);
+    header.hash = file_hash(model.get_file_data(), model.get_file_size());
+    strncpy(header.isa, isa.c_str(), sizeof(header.isa) - 1);
+}
+
+GGUFRepackCache::~GGUFRepackCache() {
+    clear();
+}
+
+bool GGUFRepackCache::open(const char* cache_path, const char* model_path, const GGUFLoader& model, const std::string& isa) {
+    clear();
+
+    GGUFLoadOption opt;
+    mapped = map_file(cache_path, opt, file_data, file_size);
+    if (!mapped && !read_file(cache_path, file_data, file_size)) {
+        return false;
+    }
+
+    gguf_repack_header expected;
+    fill_repack_header(expected, model_path, model, isa);
+    gguf_repack_header header;
+    bool ok = file_size >= sizeof(header);
+    if (ok) {
+        memcpy(&header, file_data, sizeof(header));
+        ok = memcmp(&header, &expected, offsetof(gguf_repack_header, n_tensors)) == 0
+             && header.n_tensors <= file_size && header.data_offset <= file_size;
+    }
+
+    // table of name size, name, offset and size per tensor, every range checked against the file
+    const char* ptr = file_data + sizeof(header);
+    const char* end = file_data + (ok ? header.data_offset : 0);
+    for (uint64_t i = 0; ok && i < header.n_tensors; ++i) {
+        ok = ptr + 8 <= end;
+        if (!ok) break;
+        uint64_t name_size = read_u64(ptr);
+        ok = name_size <= (uint64_t)(end - ptr) && (uint64_t)(end - ptr) - name_size >= 16;
+        if (!ok) break;
+        std::string name(ptr, (size_t)name_size);
+        ptr += name_size;
+        uint64_t offset = read_u64(ptr);
+        uint64_t size = read_u64(ptr);
+        ok = offset >= header.data_offset && offset <= file_size && size <= file_size - offset;
+        if (ok) entries[name] = std::make_pair(file_data + offset, (size_t)size);
+    }
+
+    if (!ok) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+const char* GGUFRepackCache::find(const std::string& name, size_t size) const {
+    auto it = entries.find(name);
+    return it != entries.end() && it->second.second == size ? it->second.first : nullptr;
+}
+
+char* GGUFRepackCache::add(const std::string& name, size_t size) {
+    added.push_back(std::make_pair(name, std::vector<char>(size)));
+    return added.back().second.data();
+}
+
+bool GGUFRepackCache::save(const char* cache_path, const char* model_path, const GGUFLoader& model, const std::string& isa) const {
+    const size_t align = 64;
+
+    gguf_repack_header header;
+    fill_repack_header(header, model_path, model, isa);
+    header.n_tensors = added.size();
+    uint64_t table_size = 0;
+    for (size_t i = 0; i < added.size(); ++i) {
+        table_size += 8 + added[i].first.size() + 16;
+    }
+    header.data_offset = (sizeof(header) + table_size + align - 1) / align * align;
 
+    // write aside and rename like the index cache
+    std::string tmp_path = std::string(cache_path) + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) return false;
 
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t offset = header.data_offset;
+    for (size_t i = 0; ok && i < added.size(); ++i) {
+        uint64_t name_size = added[i].first.size();
+        uint64_t size = added[i].second.size();
+        ok = fwrite(&name_size, 8, 1, fp) == 1
+             && fwrite(added[i].first.data(), 1, (size_t)name_size, fp) == name_size
+             && fwrite(&offset, 8, 1, fp) == 1
+             && fwrite(&size, 8, 1, fp) == 1;
+        offset = (offset + size + align - 1) / align * align;
+    }
+    static const char zeros[64] = {0};
+    uint64_t pos = sizeof(header) + table_size;
+    offset = header.data_offset;
+    for (size_t i = 0; ok && i < added.size(); ++i) {
+        ok = fwrite(zeros, 1, (size_t)(offset - pos), fp) == offset - pos
+             && fwrite(added[i].second.data(), 1, added[i].second.size(), fp) == added[i].second.size();
+        pos = offset + added[i].second.size();
+        offset = (pos + align - 1) / align * align;
+    }
+    ok = fclose(fp) == 0 && ok;
 
-        tensor_map[name_str] = t;
+#ifdef _WIN32
+    if (ok) remove(cache_path);
+#endif
+    if (!ok || rename(tmp_path.c_str(), cache_path) != 0) {
+        remove(tmp_path.c_str());
+        return false;
     }
+    return true;
+}
+
+void GGUFRepackCache::clear() {
+    if (file_data) {
+        if (mapped) unmap_file(file_data, file_size);
+        else free(file_data);
+    }
+    file_data = nullptr;
+    file_size = 0;
+    mapped = false;
+    entries.clear();
+    added.clear();
+}
+
+const gguf_kv* GGUFLoader::find_kv(const std::string& key) const {
+    if (kv_buckets.empty()) return nullptr;
+
+    const size_t mask = kv_buckets.size() - 1;
+    for (size_t b = hash_bytes(key.data(), key.size()) & mask;; b = (b + 1) & mask) {
+        int i = kv_buckets[b];
+        if (i < 0) return nullptr;
+        const gguf_kv& kv = kvs[i];
+        if (kv.key_size == key.size() && memcmp(file_data + kv.key, key.data(), key.size()) == 0) return &kv;
+    }
+}
+
+gguf_str GGUFLoader::get_kv_key(const gguf_kv& kv) const {
+    gguf_str s;
+    s.data = file_data + kv.key;
+    s.size = kv.key_size;
+    return s;
+}
 
+bool GGUFLoader::get_kv_int(const std::string& key, int64_t& value) const {
+    const gguf_kv* kv = find_kv(key);
+    if (!kv || !gguf_is_int(kv->type)) return false;
+    value = read_int(kv->type, file_data + kv->value);
     return true;
 }
 
+bool GGUFLoader::get_kv_float(const std::string& key, float& value) const {
+    const gguf_kv* kv = find_kv(key);
+    if (!kv || (kv->type != GGUF_TYPE_FLOAT32 && kv->type != GGUF_TYPE_FLOAT64)) return false;
+    value = read_float(kv->type, file_data + kv->value);
+    return true;
+}
+
+bool GGUFLoader::get_kv_string(const std::string& key, std::string& value) const {
+    const gguf_kv* kv = find_kv(key);
+    if (!kv || kv->type != GGUF_TYPE_STRING) return false;
+    const char* ptr = file_data + kv->value;
+    uint64_t slen = read_u64(ptr);
+    value.assign(ptr, (size_t)slen);
+    return true;
+}
+
+gguf_str GGUFLoader::get_arr_str(const gguf_kv& kv, uint64_t i) const {
+    const char* ptr = file_data + string_offsets[(size_t)(kv.strings + i)];
+    gguf_str s;
+    s.size = read_u64(ptr);
+    s.data = ptr;
+    return s;
+}
+
+int64_t GGUFLoader::get_arr_int(const gguf_kv& kv, uint64_t i) const {
+    return read_int(kv.array_type, file_data + kv.value + i * gguf_value_size(kv.array_type));
+}
+
+float GGUFLoader::get_arr_float(const gguf_kv& kv, uint64_t i) const {
+    return read_float(kv.array_type, file_data + kv.value + i * gguf_value_size(kv.array_type));
+}
+
+void GGUFLoader::build_kv_maps() const {
+    if (kv_maps_built) return;
+    kv_maps_built = true;
+
+    for (size_t i = 0; i < kvs.size(); ++i) {
+        const gguf_kv& kv = kvs[i];
+        std::string key = get_kv_key(kv).str();
+        const char* ptr = file_data + kv.value;
+
+        if (kv.type == GGUF_TYPE_STRING) {
+            uint64_t slen = read_u64(ptr);
+            kv_strings[key] = std::string(ptr, (size_t)slen);
+        } else if (kv.type == GGUF_TYPE_FLOAT32 || kv.type == GGUF_TYPE_FLOAT64) {
+            kv_floats[key] = read_float(kv.type, ptr);
+        } else if (gguf_is_int(kv.type)) {
+            kv_ints[key] = read_int(kv.type, ptr);
+        } else if (kv.array_type == GGUF_TYPE_STRING) {
+            std::vector<std::string>& vec = kv_string_arrays[key];
+            vec.reserve((size_t)kv.array_size);
+            for (uint64_t j = 0; j < kv.array_size; j++) vec.push_back(get_arr_str(kv, j).str());
+        } else if (kv.array_type == GGUF_TYPE_FLOAT32) {
+            std::vector<float>& vec = kv_float_arrays[key];
+            vec.resize((size_t)kv.array_size);
+            for (uint64_t j = 0; j < kv.array_size; j++) vec[j] = get_arr_float(kv, j);
+        } else if (gguf_is_int(kv.array_type) && kv.array_type != GGUF_TYPE_BOOL) {
+            std::vector<int32_t>& vec = kv_int32_arrays[key];
+            vec.resize((size_t)kv.array_size);
+            for (uint64_t j = 0; j < kv.array_size; j++) vec[j] = (int32_t)get_arr_int(kv, j);
+        }
+    }
+}
+
+void GGUFLoader::prefetch(const gguf_tensor& t) const {
+#ifndef _WIN32
+    if (!mapped || !t.data) return;
+
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)(t.data - file_data) / page_size * page_size;
+    size_t end = (size_t)(t.data - file_data) + t.size;
+    madvise(file_data + begin, end - begin, MADV_WILLNEED);
+#else
+    (void)t;
+#endif
+}
+
 GGUFLoader::~GGUFLoader() {
-    if (file_data) free(file_data);
+    unload();
+}
+
+void GGUFLoader::unload() {
+    if (file_data) {
+        if (mapped) unmap_file(file_data, file_size);
+        else free(file_data);
+    }
     file_data = nullptr;
     file_size = 0;
+    mapped = false;
     tensor_map.clear();
+    kvs.clear();
+    kv_buckets.clear();
+    string_offsets.clear();
+    tensor_infos.clear();
+    kv_maps_built = false;
     kv_strings.clear();
     kv_string_arrays.clear();
     kv_ints.clear();
@@ -274,46 +841,346 @@ GGUFLoader::~GGUFLoader() {
     kv_int32_arrays.clear();
 }
 
+size_t ggml_row_size(ggml_type type, int64_t n) {
+    return n / ggml_blck_size(type) * ggml_type_size(type);
+}
+
+// row kernel variants, set_gguf_kernel_variant() pins the dispatch to one
+enum {
+    KERNEL_GENERIC = 0,
+    KERNEL_AVX2,
+    KERNEL_AVXVNNI,
+    KERNEL_AVX512,
+    KERNEL_AVX512VNNI,
+    KERNEL_ASIMDDP,
+    KERNEL_COUNT
+};
+
+static const char* const kernel_names[KERNEL_COUNT] = {"generic", "avx2", "avxvnni", "avx512", "avx512vnni", "asimddp"};
+
+// -1 leaves the choice to the cpu
+static int kernel_variant = -1;
+
+static bool kernel_enabled(int variant) {
+    return kernel_variant < 0 || kernel_variant == variant;
+}
+
+std::vector<std::string> gguf_kernel_variants() {
+    std::vector<std::string> names(1, kernel_names[KERNEL_GENERIC]);
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (ncnn::cpu_support_x86_avx2()) names.push_back(kernel_names[KERNEL_AVX2]);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVXVNNI && __SSE2__ && !__AVXVNNI__
+    if (ncnn::cpu_support_x86_avx_vnni()) names.push_back(kernel_names[KERNEL_AVXVNNI]);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (ncnn::cpu_support_x86_avx512()) names.push_back(kernel_names[KERNEL_AVX512]);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX512VNNI && __SSE2__ && !__AVX512VNNI__
+    if (ncnn::cpu_support_x86_avx512_vnni()) names.push_back(kernel_names[KERNEL_AVX512VNNI]);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_ARM82DOT && __aarch64__ && !__ARM_FEATURE_DOTPROD
+    if (ncnn::cpu_support_arm_asimddp()) names.push_back(kernel_names[KERNEL_ASIMDDP]);
+#endif
+    return names;
+}
+
+bool set_gguf_kernel_variant(const std::string& name) {
+    if (name.empty()) {
+        kernel_variant = -1;
+        return true;
+    }
+    const std::vector<std::string> names = gguf_kernel_variants();
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+        return false;
+    }
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        if (name == kernel_names[i]) kernel_variant = i;
+    }
+    return true;
+}
+
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+int dequantize_row_avx512(ggml_type type, const void* src, float* dst, int64_t n);
+int vec_dot_row_avx512(ggml_type type, const void* src, const float* x, int64_t n, float* s);
+int vec_mad_row_avx512(ggml_type type, const void* src, float a, float* y, int64_t n);
+int vec_dot_row_q8_avx512(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s);
+int vec_dot_tile_q8_avx512(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+int dequantize_row_avx2(ggml_type type, const void* src, float* dst, int64_t n);
+int vec_dot_row_avx2(ggml_type type, const void* src, const float* x, int64_t n, float* s);
+int vec_mad_row_avx2(ggml_type type, const void* src, float a, float* y, int64_t n);
+int vec_dot_row_q8_avx2(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s);
+int vec_dot_tile_q8_avx2(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX512VNNI && __SSE2__ && !__AVX512VNNI__
+int vec_dot_row_q8_avx512vnni(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s);
+int vec_dot_tile_q8_avx512vnni(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVXVNNI && __SSE2__ && !__AVXVNNI__
+int vec_dot_row_q8_avxvnni(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s);
+int vec_dot_tile_q8_avxvnni(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s);
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_ARM82DOT && __aarch64__ && !__ARM_FEATURE_DOTPROD
+int vec_dot_row_q8_asimddp(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s);
+int vec_dot_tile_q8_asimddp(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s);
+#endif
+
+void dequantize_row(ggml_type type, const void* src, float* dst, int64_t n) {
+    int ret;
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (kernel_enabled(KERNEL_AVX512) && ncnn::cpu_support_x86_avx512()) {
+        ret = dequantize_row_avx512(type, src, dst, n);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (kernel_enabled(KERNEL_AVX2) && ncnn::cpu_support_x86_avx2()) {
+        ret = dequantize_row_avx2(type, src, dst, n);
+    } else
+#endif
+    {
+        ret = dequantize_row_kernel(type, src, dst, n);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Unsupported type %d\n", type);
+    }
+}
+
+float vec_dot_row(ggml_type type, const void* src, const float* x, int64_t n) {
+    float sum = 0.f;
+    int ret;
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (kernel_enabled(KERNEL_AVX512) && ncnn::cpu_support_x86_avx512()) {
+        ret = vec_dot_row_avx512(type, src, x, n, &sum);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (kernel_enabled(KERNEL_AVX2) && ncnn::cpu_support_x86_avx2()) {
+        ret = vec_dot_row_avx2(type, src, x, n, &sum);
+    } else
+#endif
+    {
+        ret = vec_dot_row_kernel(type, src, x, n, &sum);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Unsupported type %d\n", type);
+    }
+    return sum;
+}
+
+void vec_mad_row(ggml_type type, const void* src, float a, float* y, int64_t n) {
+    int ret;
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (kernel_enabled(KERNEL_AVX512) && ncnn::cpu_support_x86_avx512()) {
+        ret = vec_mad_row_avx512(type, src, a, y, n);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (kernel_enabled(KERNEL_AVX2) && ncnn::cpu_support_x86_avx2()) {
+        ret = vec_mad_row_avx2(type, src, a, y, n);
+    } else
+#endif
+    {
+        ret = vec_mad_row_kernel(type, src, a, y, n);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Unsupported type %d\n", type);
+    }
+}
+
+size_t q8_row_size(int64_t n) {
+    return (n + QK8_A - 1) / QK8_A * sizeof(block_q8_a);
+}
+
+void quantize_row_q8(const float* src, void* dst, int64_t n) {
+    for (int64_t i = 0; i * QK8_A < n; i++) {
+        quantize_block_q8_a(src + i * QK8_A, (block_q8_a*)dst + i, (int)std::min((int64_t)QK8_A, n - i * QK8_A));
+    }
+}
+
+bool vec_dot_q8_supported(ggml_type type) {
+    return type == GGML_TYPE_Q4_0 || type == GGML_TYPE_Q4_K || type == GGML_TYPE_Q8_0;
+}
+
+void vec_dot_row_q8(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s) {
+    int ret;
+#if NCNN_RUNTIME_CPU && NCNN_AVX512VNNI && __SSE2__ && !__AVX512VNNI__
+    if (kernel_enabled(KERNEL_AVX512VNNI) && ncnn::cpu_support_x86_avx512_vnni()) {
+        ret = vec_dot_row_q8_avx512vnni(type, src, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (kernel_enabled(KERNEL_AVX512) && ncnn::cpu_support_x86_avx512()) {
+        ret = vec_dot_row_q8_avx512(type, src, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVXVNNI && __SSE2__ && !__AVXVNNI__
+    if (kernel_enabled(KERNEL_AVXVNNI) && ncnn::cpu_support_x86_avx_vnni()) {
+        ret = vec_dot_row_q8_avxvnni(type, src, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (kernel_enabled(KERNEL_AVX2) && ncnn::cpu_support_x86_avx2()) {
+        ret = vec_dot_row_q8_avx2(type, src, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_ARM82DOT && __aarch64__ && !__ARM_FEATURE_DOTPROD
+    if (kernel_enabled(KERNEL_ASIMDDP) && ncnn::cpu_support_arm_asimddp()) {
+        ret = vec_dot_row_q8_asimddp(type, src, xq, n, n_rows, s);
+    } else
+#endif
+    {
+        ret = vec_dot_row_q8_kernel(type, src, xq, n, n_rows, s);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Unsupported type %d\n", type);
+    }
+}
+
+const char* vec_dot_q8_isa() {
+#if NCNN_RUNTIME_CPU && NCNN_AVX512VNNI && __SSE2__ && !__AVX512VNNI__
+    if (kernel_enabled(KERNEL_AVX512VNNI) && ncnn::cpu_support_x86_avx512_vnni()) return "avx512vnni";
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (kernel_enabled(KERNEL_AVX512) && ncnn::cpu_support_x86_avx512()) return "avx512";
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVXVNNI && __SSE2__ && !__AVXVNNI__
+    if (kernel_enabled(KERNEL_AVXVNNI) && ncnn::cpu_support_x86_avx_vnni()) return "avxvnni";
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (kernel_enabled(KERNEL_AVX2) && ncnn::cpu_support_x86_avx2()) return "avx2";
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_ARM82DOT && __aarch64__ && !__ARM_FEATURE_DOTPROD
+    if (kernel_enabled(KERNEL_ASIMDDP) && ncnn::cpu_support_arm_asimddp()) return "asimddp";
+#endif
+#if __AVX512VNNI__
+    return "avx512vnni";
+#elif __AVX512F__
+    return "avx512";
+#elif __AVXVNNI__
+    return "avxvnni";
+#elif __AVX2__
+    return "avx2";
+#elif __ARM_FEATURE_DOTPROD
+    return "asimddp";
+#elif __ARM_NEON
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
+bool q8_tile_supported(ggml_type type) {
+    return type == GGML_TYPE_Q4_K;
+}
+
+size_t q8_tile_size(ggml_type type, int64_t n) {
+    return type == GGML_TYPE_Q4_K ? n / QK_K * sizeof(block_q4_Kx8) : 0;
+}
+
+void repack_q8_tile(ggml_type type, const void* src, size_t row_stride, void* dst, int64_t n) {
+    if (type == GGML_TYPE_Q4_K) {
+        repack_q4_Kx8((const char*)src, row_stride, (block_q4_Kx8*)dst, n);
+    } else {
+        fprintf(stderr, "Unsupported type %d\n", type);
+    }
+}
+
+void vec_dot_tile_q8(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s) {
+    int ret;
+#if NCNN_RUNTIME_CPU && NCNN_AVX512VNNI && __SSE2__ && !__AVX512VNNI__
+    if (kernel_enabled(KERNEL_AVX512VNNI) && ncnn::cpu_support_x86_avx512_vnni()) {
+        ret = vec_dot_tile_q8_avx512vnni(type, tile, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX512 && __SSE2__ && !__AVX512F__
+    if (kernel_enabled(KERNEL_AVX512) && ncnn::cpu_support_x86_avx512()) {
+        ret = vec_dot_tile_q8_avx512(type, tile, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVXVNNI && __SSE2__ && !__AVXVNNI__
+    if (kernel_enabled(KERNEL_AVXVNNI) && ncnn::cpu_support_x86_avx_vnni()) {
+        ret = vec_dot_tile_q8_avxvnni(type, tile, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_AVX2 && __SSE2__ && !__AVX2__
+    if (kernel_enabled(KERNEL_AVX2) && ncnn::cpu_support_x86_avx2()) {
+        ret = vec_dot_tile_q8_avx2(type, tile, xq, n, n_rows, s);
+    } else
+#endif
+#if NCNN_RUNTIME_CPU && NCNN_ARM82DOT && __aarch64__ && !__ARM_FEATURE_DOTPROD
+    if (kernel_enabled(KERNEL_ASIMDDP) && ncnn::cpu_support_arm_asimddp()) {
+        ret = vec_dot_tile_q8_asimddp(type, tile, xq, n, n_rows, s);
+    } else
+#endif
+    {
+        ret = vec_dot_tile_q8_kernel(type, tile, xq, n, n_rows, s);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Unsupported type %d\n", type);
+    }
+}
+
+// rounding follows the ggml reference quantizers so stored blocks match theirs
+static void quantize_block_q8_0(const float* x, block_q8_0* b) {
+    float amax = 0.f;
+    for (int j = 0; j < QK8_0; j++) amax = std::max(amax, fabsf(x[j]));
+    const float d = amax / 127.f;
+    const float id = d ? 1.f / d : 0.f;
+    b->d = float32_to_float16(d);
+    for (int j = 0; j < QK8_0; j++) b->qs[j] = (int8_t)roundf(x[j] * id);
+}
+
+static void quantize_block_q4_0(const float* x, block_q4_0* b) {
+    float amax = 0.f;
+    float max = 0.f;
+    for (int j = 0; j < QK4_0; j++) {
+        if (fabsf(x[j]) > amax) {
+            amax = fabsf(x[j]);
+            max = x[j];
+        }
+    }
+    const float d = max / -8.f;
+    const float id = d ? 1.f / d : 0.f;
+    b->d = float32_to_float16(d);
+    for (int j = 0; j < QK4_0 / 2; j++) {
+        uint8_t x0 = (uint8_t)std::min(15, (int)(x[j] * id + 8.5f));
+        uint8_t x1 = (uint8_t)std::min(15, (int)(x[j + QK4_0 / 2] * id + 8.5f));
+        b->qs[j] = x0 | (x1 << 4);
+    }
+}
+
+void quantize_row(ggml_type type, const float* src, void* dst, int64_t n) {
+    switch (type) {
+        case GGML_TYPE_F32:
+            memcpy(dst, src, n * sizeof(float));
+            break;
+        case GGML_TYPE_F16:
+            for (int64_t i = 0; i < n; i++) ((uint16_t*)dst)[i] = float32_to_float16(src[i]);
+            break;
+        case GGML_TYPE_BF16:
+            for (int64_t i = 0; i < n; i++) ((uint16_t*)dst)[i] = float32_to_bfloat16(src[i]);
+            break;
+        case GGML_TYPE_Q8_0:
+            for (int64_t i = 0; i < n / QK8_0; i++) quantize_block_q8_0(src + i * QK8_0, (block_q8_0*)dst + i);
+            break;
+        case GGML_TYPE_Q4_0:
+            for (int64_t i = 0; i < n / QK4_0; i++) quantize_block_q4_0(src + i * QK4_0, (block_q4_0*)dst + i);
+            break;
+        default:
+            fprintf(stderr, "Unsupported type %d\n", type);
+            break;
+    }
+}
+
 ncnn::Mat dequant_gguf_tensor(const gguf_tensor& t, const char* file_data) {
     const char* data = file_data + t.offset;
     ncnn::Mat mat;
     uint64_t elements = 1;
     for (auto d : t.ne) elements *= d;
     mat.create(elements);
-    float* dst = mat;
-    if (t.type == GGML_TYPE_F32) {
-        memcpy(dst, data, elements * 4);
-    } else if (t.type == GGML_TYPE_F16) {
-        const uint16_t* src = (const uint16_t*)data;
-        for (uint64_t i = 0; i < elements; i++) {
-            uint32_t h = src[i];
-            uint32_t sign = (h >> 15) & 1;
-            uint32_t exp = (h >> 10) & 31;
-            uint32_t mant = h & 1023;
-            uint32_t f;
-            if (exp == 0) {
-                f = (mant << 13) | (sign << 31);
-            } else if (exp == 31) {
-                f = (255 << 23) | (mant << 13) | (sign << 31);
-            } else {
-                f = ((exp + 112) << 23) | (mant << 13) | (sign << 31);
-            }
-             memcpy(&dst[i], &f, sizeof(float));
-        }
-    } else if (t.type == GGML_TYPE_Q4_0) {
-        const char* ptr = data;
-        uint64_t blocks = (elements + 31) / 32;
-        for (uint64_t b = 0; b < blocks; b++) {
-            float d = *(const float*)ptr; ptr += 4;
-            const uint8_t* q = (const uint8_t*)ptr; ptr += 16;
-            for (int i = 0; i < 32 && b*32 + i < elements; i++) {
-                int val = (q[i/2] >> (4*(i%2))) & 0xf;
-                dst[b*32 + i] = d * (val - 8.0f);
-            }
-        }
-    } else {
-        fprintf(stderr, "Unsupported type %d\n", t.type);
-    }
+    dequantize_row(t.type, data, mat, elements);
     if (t.ne.size() == 2) {
         mat = mat.reshape(t.ne[0], t.ne[1]);
     } else if (t.ne.size() == 1) {
@@ -2,9 +2,11 @@
 #define GGUF_H
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <utility>
 
 namespace ncnn {
 class Mat;
@@ -27,6 +29,7 @@ enum ggml_type {
     GGML_TYPE_Q5_K = 13,
     GGML_TYPE_Q6_K = 14,
     GGML_TYPE_Q8_K = 15,
+    GGML_TYPE_BF16 = 30,
 };
 
 enum gguf_type {
@@ -51,14 +54,70 @@ struct gguf_tensor {
     std::vector<uint64_t> ne;  // tensor dimensions
     uint64_t offset;           // offset in file (relative to file start)
     size_t size;               // size in bytes
+    const char* data;          // points into the file mapping or read buffer
+};
+
+// A string stored in the model file, not null terminated
+struct gguf_str {
+    const char* data;
+    uint64_t size;
+
+    std::string str() const { return std::string(data, (size_t)size); }
+    bool operator==(const char* s) const { return strlen(s) == size && memcmp(data, s, (size_t)size) == 0; }
+    bool operator!=(const char* s) const { return !(*this == s); }
+};
+
+// One metadata entry, values stay in the file and are decoded on access
+// all positions are offsets from the start of the file so the index can be cached
+struct gguf_kv {
+    uint64_t key;        // offset of the key bytes
+    uint64_t key_size;
+    uint32_t type;       // gguf_type
+    uint32_t array_type; // element type when type is GGUF_TYPE_ARRAY
+    uint64_t array_size;
+    uint64_t value;      // offset of the scalar or of the first array element
+    uint64_t strings;    // first slot of a string array in the string offset table
+};
+
+// Tensor info as stored in the index cache
+struct gguf_tensor_info {
+    uint64_t name;
+    uint64_t name_size;
+    uint32_t type;
+    uint32_t n_dims;
+    uint64_t ne[4];
+    uint64_t offset;     // relative to the data section
+};
+
+struct GGUFLoadOption {
+    // map the file read-only with MAP_SHARED instead of reading it into a heap buffer
+    // pages are faulted in only when a tensor is first accessed
+    // and the page cache is shared by every process mapping the same model
+    bool use_mmap = true;
+
+    // prefault the whole mapping during load (MAP_POPULATE / MADV_WILLNEED)
+    // slower load, but no page faults in the first forward pass
+    bool populate = false;
+
+    // disable kernel readahead on the mapping (MADV_RANDOM)
+    // useful when only a subset of the tensors is ever touched
+    bool random_access = false;
+
+    // keep the parsed metadata index in <model>.idx next to the model
+    // later loads of the same file (size, mtime and header hash) skip parsing
+    bool index_cache = false;
 };
 
 class GGUFLoader {
 public:
-    GGUFLoader() : file_data(nullptr), file_size(0) {}
+    GGUFLoader() : file_data(nullptr), file_size(0), mapped(false), kv_maps_built(false) {}
     ~GGUFLoader();
 
-    bool load(const char* file_path);
+    bool load(const char* file_path, const GGUFLoadOption& opt = GGUFLoadOption());
+
+    // ask the kernel to start paging in a tensor before it is needed
+    // no-op when the file is not memory-mapped
+    void prefetch(const gguf_tensor& t) const;
 
     const gguf_tensor* get_tensor(const std::string& name) const {
         auto it = tensor_map.find(name);
@@ -71,28 +130,147 @@ public:
 
     size_t get_file_size() const { return file_size; }
     const char* get_file_data() const { return file_data; }
+    bool is_mapped() const { return mapped; }
+
+    // metadata index, nullptr when the key is missing
+    const gguf_kv* find_kv(const std::string& key) const;
+    const std::vector<gguf_kv>& get_kvs() const { return kvs; }
+    gguf_str get_kv_key(const gguf_kv& kv) const;
+
+    // typed lookups, false when the key is missing or has another type
+    // integer and bool types all read as int, float32 and float64 as float
+    bool get_kv_int(const std::string& key, int64_t& value) const;
+    bool get_kv_float(const std::string& key, float& value) const;
+    bool get_kv_string(const std::string& key, std::string& value) const;
 
-    const std::unordered_map<std::string, std::string>& get_kv_strings() const { return kv_strings; }
-    const std::unordered_map<std::string, std::vector<std::string>>& get_kv_string_arrays() const { return kv_string_arrays; }
-    const std::unordered_map<std::string, int64_t>& get_kv_ints() const { return kv_ints; }
-    const std::unordered_map<std::string, float>& get_kv_floats() const { return kv_floats; }
-    const std::unordered_map<std::string, std::vector<float>>& get_kv_float_arrays() const { return kv_float_arrays; }
-    const std::unordered_map<std::string, std::vector<int32_t>>& get_kv_int32_arrays() const { return kv_int32_arrays; }
+    // array elements, i < kv.array_size
+    gguf_str get_arr_str(const gguf_kv& kv, uint64_t i) const;
+    int64_t get_arr_int(const gguf_kv& kv, uint64_t i) const;
+    float get_arr_float(const gguf_kv& kv, uint64_t i) const;
+
+    // copies of the metadata grouped by type, built on first use
+    const std::unordered_map<std::string, std::string>& get_kv_strings() const { build_kv_maps(); return kv_strings; }
+    const std::unordered_map<std::string, std::vector<std::string>>& get_kv_string_arrays() const { build_kv_maps(); return kv_string_arrays; }
+    const std::unordered_map<std::string, int64_t>& get_kv_ints() const { build_kv_maps(); return kv_ints; }
+    const std::unordered_map<std::string, float>& get_kv_floats() const { build_kv_maps(); return kv_floats; }
+    const std::unordered_map<std::string, std::vector<float>>& get_kv_float_arrays() const { build_kv_maps(); return kv_float_arrays; }
+    const std::unordered_map<std::string, std::vector<int32_t>>& get_kv_int32_arrays() const { build_kv_maps(); return kv_int32_arrays; }
 
 private:
+    void unload();
+    bool parse_index(uint64_t& data_offset);
+    void build_kv_buckets();
+    bool load_index_cache(const char* cache_path, uint64_t mtime, uint64_t hash, uint64_t& data_offset);
+    void save_index_cache(const char* cache_path, uint64_t mtime, uint64_t hash, uint64_t data_offset) const;
+    void build_kv_maps() const;
+
     char* file_data;
     size_t file_size;
+    bool mapped;
     std::unordered_map<std::string, gguf_tensor> tensor_map;
-    std::unordered_map<std::string, std::string> kv_strings;
-    std::unordered_map<std::string, std::vector<std::string>> kv_string_arrays;
-    std::unordered_map<std::string, int64_t> kv_ints;
-    std::unordered_map<std::string, float> kv_floats;
-    std::unordered_map<std::string, std::vector<float>> kv_float_arrays;
-    std::unordered_map<std::string, std::vector<int32_t>> kv_int32_arrays;
+
+    // metadata index, everything points into file_data
+    std::vector<gguf_kv> kvs;
+    std::vector<int> kv_buckets;         // open addressing on the key hash, -1 is empty
+    std::vector<uint64_t> string_offsets; // offset of every string array element
+    std::vector<gguf_tensor_info> tensor_infos;
+
+    mutable bool kv_maps_built;
+    mutable std::unordered_map<std::string, std::string> kv_strings;
+    mutable std::unordered_map<std::string, std::vector<std::string>> kv_string_arrays;
+    mutable std::unordered_map<std::string, int64_t> kv_ints;
+    mutable std::unordered_map<std::string, float> kv_floats;
+    mutable std::unordered_map<std::string, std::vector<float>> kv_float_arrays;
+    mutable std::unordered_map<std::string, std::vector<int32_t>> kv_int32_arrays;
+};
+
+// Weight tensors rearranged at load time, kept in a sidecar file next to the
+// model so later loads map them instead of building them again
+// the file is tied to the model's size, mtime and header hash and to the isa
+// the tiles were built for, anything else is rebuilt
+class GGUFRepackCache {
+public:
+    GGUFRepackCache() : file_data(nullptr), file_size(0), mapped(false) {}
+    ~GGUFRepackCache();
+
+    // map cache_path, false when it is missing or was written for another model or isa
+    bool open(const char* cache_path, const char* model_path, const GGUFLoader& model, const std::string& isa);
+
+    // the bytes of a tensor, nullptr when the cache does not hold it with that size
+    const char* find(const std::string& name, size_t size) const;
+
+    // room for a tensor built in memory, written out by save()
+    char* add(const std::string& name, size_t size);
+
+    // write the tensors added since open(), false on any io error
+    bool save(const char* cache_path, const char* model_path, const GGUFLoader& model, const std::string& isa) const;
+
+    void clear();
+
+private:
+    char* file_data;
+    size_t file_size;
+    bool mapped;
+    std::unordered_map<std::string, std::pair<const char*, size_t>> entries;
+    std::vector<std::pair<std::string, std::vector<char>>> added;
 };
 
 ncnn::Mat dequant_gguf_tensor(const gguf_tensor& t, const char* file_data);
 
+// bytes used by a row of n elements stored as type
+size_t ggml_row_size(ggml_type type, int64_t n);
+
+// dequantize a row of n elements, n must be a multiple of the type block size
+void dequantize_row(ggml_type type, const void* src, float* dst, int64_t n);
+
+// dot product of a row stored as type with an fp32 vector
+// blocks are dequantized on the fly and never written back to memory
+float vec_dot_row(ggml_type type, const void* src, const float* x, int64_t n);
+
+// y += a * row for a row stored as type, dequantized block by block like vec_dot_row
+void vec_mad_row(ggml_type type, const void* src, float a, float* y, int64_t n);
+
+// store n fp32 values as type, supports f32, f16, bf16, q8_0 and q4_0
+void quantize_row(ggml_type type, const float* src, void* dst, int64_t n);
+
+// activation rows for the integer kernels: n fp32 values, a multiple of 32,
+// quantized to int8 in blocks of 256 with an fp32 scale each
+size_t q8_row_size(int64_t n);
+void quantize_row_q8(const float* src, void* dst, int64_t n);
+
+// whether rows stored as type have an integer kernel, q4_0, q4_K and q8_0 do
+bool vec_dot_q8_supported(ggml_type type);
+
+// dot products of a row stored as type with n_rows (at most 4) q8 activation
+// rows stored back to back, the weight row is unpacked once for all of them
+void vec_dot_row_q8(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s);
+
+// name of the isa the integer kernels dispatch to on this cpu
+const char* vec_dot_q8_isa();
+
+// q8 tiles: weight rows repacked eight at a time so one vector load covers the
+// same positions of every row, q4_K only, n a multiple of 256
+static const int q8_tile_rows = 8;
+bool q8_tile_supported(ggml_type type);
+size_t q8_tile_size(ggml_type type, int64_t n);
+
+// rows src, src + row_stride, ... of n values to one tile
+void repack_q8_tile(ggml_type type, const void* src, size_t row_stride, void* dst, int64_t n);
+
+// s[r * q8_tile_rows + c] is the dot product of row c of the tile with q8
+// activation row r of n_rows (at most 4)
+void vec_dot_tile_q8(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s);
+
+// row kernel variants this cpu can run, "generic" first, then the isa specific
+// ones built in, for checking them against each other
+std::vector<std::string> gguf_kernel_variants();
+
+// makes the row kernels above use one of those variants, a function the
+// variant has no code for runs the generic one, an empty name restores the
+// runtime choice, false for a variant this cpu cannot run
+// not thread safe, meant for tests and benchmarks
+bool set_gguf_kernel_variant(const std::string& name);
+
 } // namespace ncnn
 
 #endif // GGUF_H
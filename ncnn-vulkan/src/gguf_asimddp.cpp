@@ -0,0 +1,15 @@
+#include "gguf_quant.h"
+
+namespace ncnn {
+
+int vec_dot_row_q8_asimddp(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s)
+{
+    return vec_dot_row_q8_kernel(type, src, xq, n, n_rows, s);
+}
+
+int vec_dot_tile_q8_asimddp(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s)
+{
+    return vec_dot_tile_q8_kernel(type, tile, xq, n, n_rows, s);
+}
+
+} // namespace ncnn
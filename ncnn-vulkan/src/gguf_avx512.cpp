@@ -0,0 +1,30 @@
+#include "gguf_quant.h"
+
+namespace ncnn {
+
+int dequantize_row_avx512(ggml_type type, const void* src, float* dst, int64_t n)
+{
+    return dequantize_row_kernel(type, src, dst, n);
+}
+
+int vec_dot_row_avx512(ggml_type type, const void* src, const float* x, int64_t n, float* s)
+{
+    return vec_dot_row_kernel(type, src, x, n, s);
+}
+
+int vec_mad_row_avx512(ggml_type type, const void* src, float a, float* y, int64_t n)
+{
+    return vec_mad_row_kernel(type, src, a, y, n);
+}
+
+int vec_dot_row_q8_avx512(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s)
+{
+    return vec_dot_row_q8_kernel(type, src, xq, n, n_rows, s);
+}
+
+int vec_dot_tile_q8_avx512(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s)
+{
+    return vec_dot_tile_q8_kernel(type, tile, xq, n, n_rows, s);
+}
+
+} // namespace ncnn
@@ -0,0 +1,1562 @@
+// GGUF block formats and the per-row dequantize / dot kernels
+// this file is included by gguf.cpp and by the gguf_<isa>.cpp variants,
+// which are compiled with the matching -m flags and selected at runtime
+// through cpu_support_x86_*()
+
+#ifndef GGUF_QUANT_H
+#define GGUF_QUANT_H
+
+#include "gguf.h"
+#include "mat.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#if __SSE2__
+#include "layer/x86/x86_usability.h"
+#endif
+#if __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+namespace ncnn {
+
+#define QK4_0 32
+#define QK4_1 32
+#define QK5_0 32
+#define QK5_1 32
+#define QK8_0 32
+#define QK_K  256
+#define K_SCALE_SIZE 12
+
+struct block_q4_0 {
+    uint16_t d;
+    uint8_t qs[QK4_0 / 2];
+};
+
+struct block_q4_1 {
+    uint16_t d;
+    uint16_t m;
+    uint8_t qs[QK4_1 / 2];
+};
+
+struct block_q5_0 {
+    uint16_t d;
+    uint8_t qh[4];
+    uint8_t qs[QK5_0 / 2];
+};
+
+struct block_q5_1 {
+    uint16_t d;
+    uint16_t m;
+    uint8_t qh[4];
+    uint8_t qs[QK5_1 / 2];
+};
+
+struct block_q8_0 {
+    uint16_t d;
+    int8_t qs[QK8_0];
+};
+
+struct block_q2_K {
+    uint8_t scales[QK_K / 16]; // 4-bit scale and 4-bit min per 16 elements
+    uint8_t qs[QK_K / 4];
+    uint16_t d;
+    uint16_t dmin;
+};
+
+struct block_q3_K {
+    uint8_t hmask[QK_K / 8];
+    uint8_t qs[QK_K / 4];
+    uint8_t scales[K_SCALE_SIZE]; // 6-bit scales
+    uint16_t d;
+};
+
+struct block_q4_K {
+    uint16_t d;
+    uint16_t dmin;
+    uint8_t scales[K_SCALE_SIZE]; // 6-bit scale and min per 32 elements
+    uint8_t qs[QK_K / 2];
+};
+
+struct block_q5_K {
+    uint16_t d;
+    uint16_t dmin;
+    uint8_t scales[K_SCALE_SIZE];
+    uint8_t qh[QK_K / 8];
+    uint8_t qs[QK_K / 2];
+};
+
+struct block_q6_K {
+    uint8_t ql[QK_K / 2];
+    uint8_t qh[QK_K / 4];
+    int8_t scales[QK_K / 16];
+    uint16_t d;
+};
+
+struct block_q8_K {
+    float d;
+    int8_t qs[QK_K];
+    int16_t bsums[QK_K / 16];
+};
+
+static_assert(sizeof(block_q4_0) == 18, "wrong q4_0 block size");
+static_assert(sizeof(block_q4_1) == 20, "wrong q4_1 block size");
+static_assert(sizeof(block_q5_0) == 22, "wrong q5_0 block size");
+static_assert(sizeof(block_q5_1) == 24, "wrong q5_1 block size");
+static_assert(sizeof(block_q8_0) == 34, "wrong q8_0 block size");
+static_assert(sizeof(block_q2_K) == 84, "wrong q2_K block size");
+static_assert(sizeof(block_q3_K) == 110, "wrong q3_K block size");
+static_assert(sizeof(block_q4_K) == 144, "wrong q4_K block size");
+static_assert(sizeof(block_q5_K) == 176, "wrong q5_K block size");
+static_assert(sizeof(block_q6_K) == 210, "wrong q6_K block size");
+static_assert(sizeof(block_q8_K) == 292, "wrong q8_K block size");
+
+static inline float gguf_fp16_to_fp32(uint16_t h)
+{
+#if __F16C__
+    return _cvtsh_ss(h);
+#else
+    return float16_to_float32(h);
+#endif
+}
+
+// y = d * q - m
+static void dequant_i8(const int8_t* q, float d, float m, float* y, int n)
+{
+    int i = 0;
+#if __AVX512F__
+    {
+        __m512 _d = _mm512_set1_ps(d);
+        __m512 _m = _mm512_set1_ps(m);
+        for (; i + 15 < n; i += 16)
+        {
+            __m512 _q = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(q + i))));
+            _mm512_storeu_ps(y + i, _mm512_fmsub_ps(_q, _d, _m));
+        }
+    }
+#endif // __AVX512F__
+#if __AVX2__
+    {
+        __m256 _d = _mm256_set1_ps(d);
+        __m256 _m = _mm256_set1_ps(m);
+        for (; i + 7 < n; i += 8)
+        {
+            __m256 _q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(q + i))));
+            _mm256_storeu_ps(y + i, _mm256_fmsub_ps(_q, _d, _m));
+        }
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    {
+        float32x4_t _d = vdupq_n_f32(d);
+        float32x4_t _m = vdupq_n_f32(m);
+        for (; i + 7 < n; i += 8)
+        {
+            int16x8_t _q16 = vmovl_s8(vld1_s8(q + i));
+            float32x4_t _q0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(_q16)));
+            float32x4_t _q1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(_q16)));
+            vst1q_f32(y + i, vsubq_f32(vmulq_f32(_q0, _d), _m));
+            vst1q_f32(y + i + 4, vsubq_f32(vmulq_f32(_q1, _d), _m));
+        }
+    }
+#endif // __ARM_NEON
+    for (; i < n; i++)
+    {
+        y[i] = d * q[i] - m;
+    }
+}
+
+// split n packed bytes into low and high nibbles, minus offset
+static void unpack_nibbles(const uint8_t* qs, int8_t* lo, int8_t* hi, int n, int offset)
+{
+    int i = 0;
+#if __AVX2__
+    {
+        __m256i _mask = _mm256_set1_epi8(0x0f);
+        __m256i _off = _mm256_set1_epi8((char)offset);
+        for (; i + 31 < n; i += 32)
+        {
+            __m256i _q = _mm256_loadu_si256((const __m256i*)(qs + i));
+            __m256i _lo = _mm256_and_si256(_q, _mask);
+            __m256i _hi = _mm256_and_si256(_mm256_srli_epi16(_q, 4), _mask);
+            _mm256_storeu_si256((__m256i*)(lo + i), _mm256_sub_epi8(_lo, _off));
+            _mm256_storeu_si256((__m256i*)(hi + i), _mm256_sub_epi8(_hi, _off));
+        }
+    }
+#endif // __AVX2__
+#if __SSE2__
+    {
+        __m128i _mask = _mm_set1_epi8(0x0f);
+        __m128i _off = _mm_set1_epi8((char)offset);
+        for (; i + 15 < n; i += 16)
+        {
+            __m128i _q = _mm_loadu_si128((const __m128i*)(qs + i));
+            __m128i _lo = _mm_and_si128(_q, _mask);
+            __m128i _hi = _mm_and_si128(_mm_srli_epi16(_q, 4), _mask);
+            _mm_storeu_si128((__m128i*)(lo + i), _mm_sub_epi8(_lo, _off));
+            _mm_storeu_si128((__m128i*)(hi + i), _mm_sub_epi8(_hi, _off));
+        }
+    }
+#endif // __SSE2__
+#if __ARM_NEON
+    {
+        uint8x16_t _mask = vdupq_n_u8(0x0f);
+        int8x16_t _off = vdupq_n_s8((int8_t)offset);
+        for (; i + 15 < n; i += 16)
+        {
+            uint8x16_t _q = vld1q_u8(qs + i);
+            int8x16_t _lo = vreinterpretq_s8_u8(vandq_u8(_q, _mask));
+            int8x16_t _hi = vreinterpretq_s8_u8(vshrq_n_u8(_q, 4));
+            vst1q_s8(lo + i, vsubq_s8(_lo, _off));
+            vst1q_s8(hi + i, vsubq_s8(_hi, _off));
+        }
+    }
+#endif // __ARM_NEON
+    for (; i < n; i++)
+    {
+        lo[i] = (int8_t)((qs[i] & 0x0f) - offset);
+        hi[i] = (int8_t)((qs[i] >> 4) - offset);
+    }
+}
+
+// q[i] += (bits >> i & 1) ? v : 0, for the 32 bits of a q5 block
+static void add_high_bits_32(const uint8_t* qh, int8_t* q, int8_t v)
+{
+    uint32_t bits;
+    memcpy(&bits, qh, 4);
+#if __AVX2__
+    const __m256i _shuf = _mm256_set_epi64x(0x0303030303030303, 0x0202020202020202, 0x0101010101010101, 0x0000000000000000);
+    __m256i _bytes = _mm256_shuffle_epi8(_mm256_set1_epi32((int)bits), _shuf);
+    _bytes = _mm256_or_si256(_bytes, _mm256_set1_epi64x(0x7fbfdfeff7fbfdfe));
+    __m256i _set = _mm256_cmpeq_epi8(_bytes, _mm256_set1_epi64x(-1));
+    __m256i _q = _mm256_loadu_si256((const __m256i*)q);
+    _q = _mm256_add_epi8(_q, _mm256_and_si256(_set, _mm256_set1_epi8(v)));
+    _mm256_storeu_si256((__m256i*)q, _q);
+#else
+    for (int i = 0; i < 32; i++)
+    {
+        if ((bits >> i) & 1) q[i] += v;
+    }
+#endif
+}
+
+// q[i] += (mask[i] & bit) ? v : 0
+static void add_masked_bits(const uint8_t* mask, uint8_t bit, int8_t* q, int8_t v, int n)
+{
+    int i = 0;
+#if __AVX2__
+    {
+        __m256i _bit = _mm256_set1_epi8((char)bit);
+        __m256i _v = _mm256_set1_epi8(v);
+        for (; i + 31 < n; i += 32)
+        {
+            __m256i _m = _mm256_loadu_si256((const __m256i*)(mask + i));
+            __m256i _set = _mm256_cmpeq_epi8(_mm256_and_si256(_m, _bit), _bit);
+            __m256i _q = _mm256_loadu_si256((const __m256i*)(q + i));
+            _mm256_storeu_si256((__m256i*)(q + i), _mm256_add_epi8(_q, _mm256_and_si256(_set, _v)));
+        }
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    {
+        uint8x16_t _bit = vdupq_n_u8(bit);
+        int8x16_t _v = vdupq_n_s8(v);
+        for (; i + 15 < n; i += 16)
+        {
+            uint8x16_t _set = vtstq_u8(vld1q_u8(mask + i), _bit);
+            int8x16_t _q = vld1q_s8(q + i);
+            vst1q_s8(q + i, vaddq_s8(_q, vandq_s8(vreinterpretq_s8_u8(_set), _v)));
+        }
+    }
+#endif // __ARM_NEON
+    for (; i < n; i++)
+    {
+        if (mask[i] & bit) q[i] += v;
+    }
+}
+
+// q[i] = (src[i] >> shift) & 3
+static void unpack_2bit(const uint8_t* src, int shift, int8_t* q, int n)
+{
+    int i = 0;
+#if __AVX2__
+    {
+        __m256i _mask = _mm256_set1_epi8(3);
+        __m128i _shift = _mm_cvtsi32_si128(shift);
+        for (; i + 31 < n; i += 32)
+        {
+            __m256i _q = _mm256_loadu_si256((const __m256i*)(src + i));
+            _q = _mm256_and_si256(_mm256_srl_epi16(_q, _shift), _mask);
+            _mm256_storeu_si256((__m256i*)(q + i), _q);
+        }
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    {
+        uint8x16_t _mask = vdupq_n_u8(3);
+        int8x16_t _shift = vdupq_n_s8((int8_t)-shift);
+        for (; i + 15 < n; i += 16)
+        {
+            uint8x16_t _q = vshlq_u8(vld1q_u8(src + i), _shift);
+            vst1q_s8(q + i, vreinterpretq_s8_u8(vandq_u8(_q, _mask)));
+        }
+    }
+#endif // __ARM_NEON
+    for (; i < n; i++)
+    {
+        q[i] = (int8_t)((src[i] >> shift) & 3);
+    }
+}
+
+static inline void get_scale_min_k4(int j, const uint8_t* q, uint8_t* d, uint8_t* m)
+{
+    if (j < 4)
+    {
+        *d = q[j] & 63;
+        *m = q[j + 4] & 63;
+    }
+    else
+    {
+        *d = (q[j + 4] & 0xf) | ((q[j - 4] >> 6) << 4);
+        *m = (q[j + 4] >> 4) | ((q[j - 0] >> 6) << 4);
+    }
+}
+
+static void dequantize_block_q4_0(const block_q4_0* b, float* y)
+{
+    int8_t q[QK4_0];
+    unpack_nibbles(b->qs, q, q + QK4_0 / 2, QK4_0 / 2, 8);
+    dequant_i8(q, gguf_fp16_to_fp32(b->d), 0.f, y, QK4_0);
+}
+
+static void dequantize_block_q4_1(const block_q4_1* b, float* y)
+{
+    int8_t q[QK4_1];
+    unpack_nibbles(b->qs, q, q + QK4_1 / 2, QK4_1 / 2, 0);
+    dequant_i8(q, gguf_fp16_to_fp32(b->d), -gguf_fp16_to_fp32(b->m), y, QK4_1);
+}
+
+static void dequantize_block_q5_0(const block_q5_0* b, float* y)
+{
+    int8_t q[QK5_0];
+    unpack_nibbles(b->qs, q, q + QK5_0 / 2, QK5_0 / 2, 16);
+    add_high_bits_32(b->qh, q, 16);
+    dequant_i8(q, gguf_fp16_to_fp32(b->d), 0.f, y, QK5_0);
+}
+
+static void dequantize_block_q5_1(const block_q5_1* b, float* y)
+{
+    int8_t q[QK5_1];
+    unpack_nibbles(b->qs, q, q + QK5_1 / 2, QK5_1 / 2, 0);
+    add_high_bits_32(b->qh, q, 16);
+    dequant_i8(q, gguf_fp16_to_fp32(b->d), -gguf_fp16_to_fp32(b->m), y, QK5_1);
+}
+
+static void dequantize_block_q8_0(const block_q8_0* b, float* y)
+{
+    dequant_i8(b->qs, gguf_fp16_to_fp32(b->d), 0.f, y, QK8_0);
+}
+
+static void dequantize_block_q2_K(const block_q2_K* b, float* y)
+{
+    const float d = gguf_fp16_to_fp32(b->d);
+    const float dmin = gguf_fp16_to_fp32(b->dmin);
+
+    int8_t q[32];
+    const uint8_t* qs = b->qs;
+    int is = 0;
+    for (int n = 0; n < QK_K; n += 128)
+    {
+        for (int shift = 0; shift < 8; shift += 2)
+        {
+            unpack_2bit(qs, shift, q, 32);
+
+            uint8_t sc = b->scales[is++];
+            dequant_i8(q, d * (sc & 0xf), dmin * (sc >> 4), y, 16);
+            sc = b->scales[is++];
+            dequant_i8(q + 16, d * (sc & 0xf), dmin * (sc >> 4), y + 16, 16);
+            y += 32;
+        }
+        qs += 32;
+    }
+}
+
+static void dequantize_block_q3_K(const block_q3_K* b, float* y)
+{
+    const uint32_t kmask1 = 0x03030303;
+    const uint32_t kmask2 = 0x0f0f0f0f;
+
+    uint32_t aux[4];
+    memcpy(aux, b->scales, K_SCALE_SIZE);
+    uint32_t tmp = aux[2];
+    aux[2] = ((aux[0] >> 4) & kmask2) | (((tmp >> 4) & kmask1) << 4);
+    aux[3] = ((aux[1] >> 4) & kmask2) | (((tmp >> 6) & kmask1) << 4);
+    aux[0] = (aux[0] & kmask2) | (((tmp >> 0) & kmask1) << 4);
+    aux[1] = (aux[1] & kmask2) | (((tmp >> 2) & kmask1) << 4);
+    const int8_t* scales = (const int8_t*)aux;
+
+    const float d_all = gguf_fp16_to_fp32(b->d);
+
+    int8_t q[32];
+    const uint8_t* qs = b->qs;
+    uint8_t m = 1;
+    int is = 0;
+    for (int n = 0; n < QK_K; n += 128)
+    {
+        for (int shift = 0; shift < 8; shift += 2)
+        {
+            // the high bit is stored inverted: clear means subtract 4
+            unpack_2bit(qs, shift, q, 32);
+            add_masked_bits(b->hmask, m, q, 4, 32);
+
+            dequant_i8(q, d_all * (scales[is] - 32), d_all * (scales[is] - 32) * 4, y, 16);
+            is++;
+            dequant_i8(q + 16, d_all * (scales[is] - 32), d_all * (scales[is] - 32) * 4, y + 16, 16);
+            is++;
+            y += 32;
+            m <<= 1;
+        }
+        qs += 32;
+    }
+}
+
+static void dequantize_block_q4_K(const block_q4_K* b, float* y)
+{
+    const float d = gguf_fp16_to_fp32(b->d);
+    const float dmin = gguf_fp16_to_fp32(b->dmin);
+
+    int8_t q[64];
+    const uint8_t* qs = b->qs;
+    for (int j = 0; j < QK_K / 64; j++)
+    {
+        unpack_nibbles(qs, q, q + 32, 32, 0);
+
+        uint8_t sc, m;
+        get_scale_min_k4(2 * j + 0, b->scales, &sc, &m);
+        dequant_i8(q, d * sc, dmin * m, y, 32);
+        get_scale_min_k4(2 * j + 1, b->scales, &sc, &m);
+        dequant_i8(q + 32, d * sc, dmin * m, y + 32, 32);
+
+        qs += 32;
+        y += 64;
+    }
+}
+
+static void dequantize_block_q5_K(const block_q5_K* b, float* y)
+{
+    const float d = gguf_fp16_to_fp32(b->d);
+    const float dmin = gguf_fp16_to_fp32(b->dmin);
+
+    int8_t q[64];
+    const uint8_t* qs = b->qs;
+    uint8_t u1 = 1;
+    uint8_t u2 = 2;
+    for (int j = 0; j < QK_K / 64; j++)
+    {
+        unpack_nibbles(qs, q, q + 32, 32, 0);
+        add_masked_bits(b->qh, u1, q, 16, 32);
+        add_masked_bits(b->qh, u2, q + 32, 16, 32);
+
+        uint8_t sc, m;
+        get_scale_min_k4(2 * j + 0, b->scales, &sc, &m);
+        dequant_i8(q, d * sc, dmin * m, y, 32);
+        get_scale_min_k4(2 * j + 1, b->scales, &sc, &m);
+        dequant_i8(q + 32, d * sc, dmin * m, y + 32, 32);
+
+        qs += 32;
+        y += 64;
+        u1 <<= 2;
+        u2 <<= 2;
+    }
+}
+
+static void dequantize_block_q6_K(const block_q6_K* b, float* y)
+{
+    const float d = gguf_fp16_to_fp32(b->d);
+
+    int8_t q[128];
+    const uint8_t* ql = b->ql;
+    const uint8_t* qh = b->qh;
+    const int8_t* sc = b->scales;
+    for (int n = 0; n < QK_K; n += 128)
+    {
+        // low nibbles of ql[0..63] and ql[32..63] then their high nibbles,
+        // each merged with a 2-bit field of qh
+        unpack_nibbles(ql, q, q + 64, 32, 0);
+        unpack_nibbles(ql + 32, q + 32, q + 96, 32, 0);
+
+        int8_t h[32];
+        for (int k = 0; k < 4; k++)
+        {
+            unpack_2bit(qh, 2 * k, h, 32);
+            int8_t* qk = q + 32 * k;
+            for (int l = 0; l < 32; l++)
+            {
+                qk[l] = (int8_t)((qk[l] | (h[l] << 4)) - 32);
+            }
+        }
+
+        for (int k = 0; k < 8; k++)
+        {
+            dequant_i8(q + 16 * k, d * sc[k], 0.f, y + 16 * k, 16);
+        }
+
+        y += 128;
+        ql += 64;
+        qh += 32;
+        sc += 8;
+    }
+}
+
+static void dequantize_block_q8_K(const block_q8_K* b, float* y)
+{
+    dequant_i8(b->qs, b->d, 0.f, y, QK_K);
+}
+
+static void dequantize_row_f16(const uint16_t* x, float* y, int64_t n)
+{
+    int64_t i = 0;
+#if __AVX512F__
+    for (; i + 15 < n; i += 16)
+    {
+        _mm512_storeu_ps(y + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(x + i))));
+    }
+#endif // __AVX512F__
+#if __F16C__
+    for (; i + 7 < n; i += 8)
+    {
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x + i))));
+    }
+#endif // __F16C__
+#if __ARM_NEON && __aarch64__
+    for (; i + 3 < n; i += 4)
+    {
+        vst1q_f32(y + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x + i))));
+    }
+#endif // __ARM_NEON && __aarch64__
+    for (; i < n; i++)
+    {
+        y[i] = gguf_fp16_to_fp32(x[i]);
+    }
+}
+
+static void dequantize_row_bf16(const uint16_t* x, float* y, int64_t n)
+{
+    for (int64_t i = 0; i < n; i++)
+    {
+        y[i] = bfloat16_to_float32(x[i]);
+    }
+}
+
+static float dot_f32(const float* a, const float* b, int n)
+{
+    int i = 0;
+    float sum = 0.f;
+#if __AVX512F__
+    {
+        __m512 _sum = _mm512_setzero_ps();
+        for (; i + 15 < n; i += 16)
+        {
+            _sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), _sum);
+        }
+        sum += _mm512_comp_reduce_add_ps(_sum);
+    }
+#endif // __AVX512F__
+#if __AVX2__
+    {
+        __m256 _sum = _mm256_setzero_ps();
+        for (; i + 7 < n; i += 8)
+        {
+            _sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), _sum);
+        }
+        sum += _mm256_reduce_add_ps(_sum);
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    {
+        float32x4_t _sum = vdupq_n_f32(0.f);
+        for (; i + 3 < n; i += 4)
+        {
+            _sum = vmlaq_f32(_sum, vld1q_f32(a + i), vld1q_f32(b + i));
+        }
+        float32x2_t _s = vadd_f32(vget_low_f32(_sum), vget_high_f32(_sum));
+        sum += vget_lane_f32(vpadd_f32(_s, _s), 0);
+    }
+#endif // __ARM_NEON
+    for (; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// y += a * x
+static void axpy_f32(const float* x, float a, float* y, int n)
+{
+    int i = 0;
+#if __AVX512F__
+    {
+        __m512 _a = _mm512_set1_ps(a);
+        for (; i + 15 < n; i += 16)
+        {
+            _mm512_storeu_ps(y + i, _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _a, _mm512_loadu_ps(y + i)));
+        }
+    }
+#endif // __AVX512F__
+#if __AVX2__
+    {
+        __m256 _a = _mm256_set1_ps(a);
+        for (; i + 7 < n; i += 8)
+        {
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _a, _mm256_loadu_ps(y + i)));
+        }
+    }
+#endif // __AVX2__
+#if __ARM_NEON
+    {
+        float32x4_t _a = vdupq_n_f32(a);
+        for (; i + 3 < n; i += 4)
+        {
+            vst1q_f32(y + i, vmlaq_f32(vld1q_f32(y + i), vld1q_f32(x + i), _a));
+        }
+    }
+#endif // __ARM_NEON
+    for (; i < n; i++)
+    {
+        y[i] += a * x[i];
+    }
+}
+
+template<typename block_t, int QK>
+static void dequantize_row_blocks(void (*dequantize_block)(const block_t*, float*), const void* src, float* y, int64_t n)
+{
+    const block_t* b = (const block_t*)src;
+    for (int64_t i = 0; i < n / QK; i++)
+    {
+        dequantize_block(b + i, y + i * QK);
+    }
+}
+
+template<typename block_t, int QK>
+static float vec_dot_row_blocks(void (*dequantize_block)(const block_t*, float*), const void* src, const float* x, int64_t n)
+{
+    // each block is expanded into an L1-resident scratch and consumed immediately
+    float tmp[QK];
+    float sum = 0.f;
+    const block_t* b = (const block_t*)src;
+    for (int64_t i = 0; i < n / QK; i++)
+    {
+        dequantize_block(b + i, tmp);
+        sum += dot_f32(tmp, x + i * QK, QK);
+    }
+    return sum;
+}
+
+template<typename block_t, int QK>
+static void vec_mad_row_blocks(void (*dequantize_block)(const block_t*, float*), const void* src, float a, float* y, int64_t n)
+{
+    float tmp[QK];
+    const block_t* b = (const block_t*)src;
+    for (int64_t i = 0; i < n / QK; i++)
+    {
+        dequantize_block(b + i, tmp);
+        axpy_f32(tmp, a, y + i * QK, QK);
+    }
+}
+
+static int dequantize_row_kernel(ggml_type type, const void* src, float* y, int64_t n)
+{
+    switch (type)
+    {
+    case GGML_TYPE_F32:
+        memcpy(y, src, n * sizeof(float));
+        break;
+    case GGML_TYPE_F16:
+        dequantize_row_f16((const uint16_t*)src, y, n);
+        break;
+    case GGML_TYPE_BF16:
+        dequantize_row_bf16((const uint16_t*)src, y, n);
+        break;
+    case GGML_TYPE_Q4_0:
+        dequantize_row_blocks<block_q4_0, QK4_0>(dequantize_block_q4_0, src, y, n);
+        break;
+    case GGML_TYPE_Q4_1:
+        dequantize_row_blocks<block_q4_1, QK4_1>(dequantize_block_q4_1, src, y, n);
+        break;
+    case GGML_TYPE_Q5_0:
+        dequantize_row_blocks<block_q5_0, QK5_0>(dequantize_block_q5_0, src, y, n);
+        break;
+    case GGML_TYPE_Q5_1:
+        dequantize_row_blocks<block_q5_1, QK5_1>(dequantize_block_q5_1, src, y, n);
+        break;
+    case GGML_TYPE_Q8_0:
+        dequantize_row_blocks<block_q8_0, QK8_0>(dequantize_block_q8_0, src, y, n);
+        break;
+    case GGML_TYPE_Q2_K:
+        dequantize_row_blocks<block_q2_K, QK_K>(dequantize_block_q2_K, src, y, n);
+        break;
+    case GGML_TYPE_Q3_K:
+        dequantize_row_blocks<block_q3_K, QK_K>(dequantize_block_q3_K, src, y, n);
+        break;
+    case GGML_TYPE_Q4_K:
+        dequantize_row_blocks<block_q4_K, QK_K>(dequantize_block_q4_K, src, y, n);
+        break;
+    case GGML_TYPE_Q5_K:
+        dequantize_row_blocks<block_q5_K, QK_K>(dequantize_block_q5_K, src, y, n);
+        break;
+    case GGML_TYPE_Q6_K:
+        dequantize_row_blocks<block_q6_K, QK_K>(dequantize_block_q6_K, src, y, n);
+        break;
+    case GGML_TYPE_Q8_K:
+        dequantize_row_blocks<block_q8_K, QK_K>(dequantize_block_q8_K, src, y, n);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int vec_dot_row_kernel(ggml_type type, const void* src, const float* x, int64_t n, float* s)
+{
+    switch (type)
+    {
+    case GGML_TYPE_F32:
+        *s = dot_f32((const float*)src, x, (int)n);
+        break;
+    case GGML_TYPE_F16:
+    {
+        float tmp[256];
+        float sum = 0.f;
+        const uint16_t* p = (const uint16_t*)src;
+        for (int64_t i = 0; i < n; i += 256)
+        {
+            int nn = (int)std::min(n - i, (int64_t)256);
+            dequantize_row_f16(p + i, tmp, nn);
+            sum += dot_f32(tmp, x + i, nn);
+        }
+        *s = sum;
+        break;
+    }
+    case GGML_TYPE_BF16:
+    {
+        float tmp[256];
+        float sum = 0.f;
+        const uint16_t* p = (const uint16_t*)src;
+        for (int64_t i = 0; i < n; i += 256)
+        {
+            int nn = (int)std::min(n - i, (int64_t)256);
+            dequantize_row_bf16(p + i, tmp, nn);
+            sum += dot_f32(tmp, x + i, nn);
+        }
+        *s = sum;
+        break;
+    }
+    case GGML_TYPE_Q4_0:
+        *s = vec_dot_row_blocks<block_q4_0, QK4_0>(dequantize_block_q4_0, src, x, n);
+        break;
+    case GGML_TYPE_Q4_1:
+        *s = vec_dot_row_blocks<block_q4_1, QK4_1>(dequantize_block_q4_1, src, x, n);
+        break;
+    case GGML_TYPE_Q5_0:
+        *s = vec_dot_row_blocks<block_q5_0, QK5_0>(dequantize_block_q5_0, src, x, n);
+        break;
+    case GGML_TYPE_Q5_1:
+        *s = vec_dot_row_blocks<block_q5_1, QK5_1>(dequantize_block_q5_1, src, x, n);
+        break;
+    case GGML_TYPE_Q8_0:
+        *s = vec_dot_row_blocks<block_q8_0, QK8_0>(dequantize_block_q8_0, src, x, n);
+        break;
+    case GGML_TYPE_Q2_K:
+        *s = vec_dot_row_blocks<block_q2_K, QK_K>(dequantize_block_q2_K, src, x, n);
+        break;
+    case GGML_TYPE_Q3_K:
+        *s = vec_dot_row_blocks<block_q3_K, QK_K>(dequantize_block_q3_K, src, x, n);
+        break;
+    case GGML_TYPE_Q4_K:
+        *s = vec_dot_row_blocks<block_q4_K, QK_K>(dequantize_block_q4_K, src, x, n);
+        break;
+    case GGML_TYPE_Q5_K:
+        *s = vec_dot_row_blocks<block_q5_K, QK_K>(dequantize_block_q5_K, src, x, n);
+        break;
+    case GGML_TYPE_Q6_K:
+        *s = vec_dot_row_blocks<block_q6_K, QK_K>(dequantize_block_q6_K, src, x, n);
+        break;
+    case GGML_TYPE_Q8_K:
+        *s = vec_dot_row_blocks<block_q8_K, QK_K>(dequantize_block_q8_K, src, x, n);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+// only the types a KV cache is stored in
+static int vec_mad_row_kernel(ggml_type type, const void* src, float a, float* y, int64_t n)
+{
+    switch (type)
+    {
+    case GGML_TYPE_F32:
+        axpy_f32((const float*)src, a, y, (int)n);
+        break;
+    case GGML_TYPE_F16:
+    case GGML_TYPE_BF16:
+    {
+        float tmp[256];
+        const uint16_t* p = (const uint16_t*)src;
+        for (int64_t i = 0; i < n; i += 256)
+        {
+            int nn = (int)std::min(n - i, (int64_t)256);
+            if (type == GGML_TYPE_F16)
+                dequantize_row_f16(p + i, tmp, nn);
+            else
+                dequantize_row_bf16(p + i, tmp, nn);
+            axpy_f32(tmp, a, y + i, nn);
+        }
+        break;
+    }
+    case GGML_TYPE_Q4_0:
+        vec_mad_row_blocks<block_q4_0, QK4_0>(dequantize_block_q4_0, src, a, y, n);
+        break;
+    case GGML_TYPE_Q8_0:
+        vec_mad_row_blocks<block_q8_0, QK8_0>(dequantize_block_q8_0, src, a, y, n);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+// Integer kernels against activation rows quantized to block_q8_a
+// weight sub blocks of 32 are brought to bytes and multiplied with the
+// activation bytes in int32, q4_K folds its 6-bit sub block scales in with
+// pmaddwd and needs one fp32 multiply-add per 256 values, q4_0 and q8_0 reduce
+// the dot products of eight sub blocks into one vector before their fp16
+// scales are applied, the zero points and mins come back through the sums of
+// the activation sub blocks
+// pmaddubsw on avx2 and avx512, vpdpbusd with avx vnni or avx512 vnni, sdot on
+// arm with dotprod and widening multiplies without it
+#define QK8_A 256
+
+// 256 activations with one scale and the sums of its eight sub blocks of 32
+struct block_q8_a {
+    float d;
+    int16_t bsums[8];
+    int8_t qs[QK8_A];
+};
+
+static_assert(sizeof(block_q8_a) == 276, "wrong q8_a block size");
+
+// n is a multiple of 32, values past n are zero
+static void quantize_block_q8_a(const float* x, block_q8_a* b, int n)
+{
+    float amax = 0.f;
+    for (int j = 0; j < n; j++) amax = std::max(amax, fabsf(x[j]));
+    const float d = amax / 127.f;
+    const float id = d ? 1.f / d : 0.f;
+    b->d = d;
+    for (int k = 0; k < 8; k++)
+    {
+        int8_t* q = b->qs + k * 32;
+        int sum = 0;
+        for (int j = 0; j < 32; j++)
+        {
+            q[j] = k * 32 < n ? (int8_t)roundf(x[k * 32 + j] * id) : 0;
+            sum += q[j];
+        }
+        b->bsums[k] = (int16_t)sum;
+    }
+}
+
+#if __AVX2__
+// acc plus the 8 int32 partial sums of u[i] * s[i] with u unsigned and s signed
+// pmaddubsw saturates a pair of products to int16, fine for u up to 128
+static inline __m256i mm256_dpbusd(__m256i acc, __m256i u, __m256i s)
+{
+#if __AVX512VNNI__
+    return _mm256_dpbusd_epi32(acc, u, s);
+#elif __AVXVNNI__
+    return _mm256_dpbusd_avx_epi32(acc, u, s);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(u, s), _mm256_set1_epi16(1)));
+#endif
+}
+
+static inline __m256i mm256_dot_u8s8(__m256i u, __m256i s)
+{
+#if __AVX512VNNI__ || __AVXVNNI__
+    return mm256_dpbusd(_mm256_setzero_si256(), u, s);
+#else
+    return _mm256_madd_epi16(_mm256_maddubs_epi16(u, s), _mm256_set1_epi16(1));
+#endif
+}
+
+// lane k of the result is the sum of the lanes of p[k]
+static inline __m256i mm256_hsum8_epi32(const __m256i* p)
+{
+    __m256i _p01 = _mm256_hadd_epi32(p[0], p[1]);
+    __m256i _p23 = _mm256_hadd_epi32(p[2], p[3]);
+    __m256i _p45 = _mm256_hadd_epi32(p[4], p[5]);
+    __m256i _p67 = _mm256_hadd_epi32(p[6], p[7]);
+    // the low 128 bits hold sums over the low halves, the high 128 bits over the high ones
+    __m256i _p0123 = _mm256_hadd_epi32(_p01, _p23);
+    __m256i _p4567 = _mm256_hadd_epi32(_p45, _p67);
+    __m256i _lo = _mm256_permute2x128_si256(_p0123, _p4567, 0x20);
+    __m256i _hi = _mm256_permute2x128_si256(_p0123, _p4567, 0x31);
+    return _mm256_add_epi32(_lo, _hi);
+}
+
+// lane k is the dot product of sub block k of u and x, signed u has its sign
+// moved onto x so it can go through the unsigned multiply
+template<bool is_signed>
+static inline __m256i mm256_dot8(const int8_t* u, const int8_t* x)
+{
+    __m256i _p[8];
+    for (int k = 0; k < 8; k++)
+    {
+        __m256i _u = _mm256_loadu_si256((const __m256i*)(u + 32 * k));
+        __m256i _x = _mm256_loadu_si256((const __m256i*)(x + 32 * k));
+        if (is_signed)
+        {
+            _x = _mm256_sign_epi8(_x, _u);
+            _u = _mm256_sign_epi8(_u, _u);
+        }
+        _p[k] = mm256_dot_u8s8(_u, _x);
+    }
+    return mm256_hsum8_epi32(_p);
+}
+#endif // __AVX2__
+
+#if __ARM_NEON && __aarch64__
+static inline int32x4_t neon_dot_s8(int32x4_t acc, int8x16_t a, int8x16_t b)
+{
+#if __ARM_FEATURE_DOTPROD
+    return vdotq_s32(acc, a, b);
+#else
+    int16x8_t _p0 = vmull_s8(vget_low_s8(a), vget_low_s8(b));
+    int16x8_t _p1 = vmull_s8(vget_high_s8(a), vget_high_s8(b));
+    return vpadalq_s16(vpadalq_s16(acc, _p0), _p1);
+#endif
+}
+
+static inline int32x4_t neon_dot32(const int8_t* u, const int8_t* x)
+{
+    int32x4_t _p = neon_dot_s8(vdupq_n_s32(0), vld1q_s8(u), vld1q_s8(x));
+    return neon_dot_s8(_p, vld1q_s8(u + 16), vld1q_s8(x + 16));
+}
+
+// lane k of lo and hi is the dot product of sub block k and 4 + k of u and x
+static inline void neon_dot8(const int8_t* u, const int8_t* x, int32x4_t& lo, int32x4_t& hi)
+{
+    int32x4_t _p[8];
+    for (int k = 0; k < 8; k++) _p[k] = neon_dot32(u + 32 * k, x + 32 * k);
+    lo = vpaddq_s32(vpaddq_s32(_p[0], _p[1]), vpaddq_s32(_p[2], _p[3]));
+    hi = vpaddq_s32(vpaddq_s32(_p[4], _p[5]), vpaddq_s32(_p[6], _p[7]));
+}
+#endif // __ARM_NEON && __aarch64__
+
+// Group g of a q4_0 or q8_0 weight row, count sub blocks of it, as bytes u
+// and their scales wd, zero past count
+struct unpack_q4_0 {
+    const block_q4_0* w;
+    void operator()(int g, int count, int8_t* u, float* wd) const
+    {
+        for (int k = 0; k < 8; k++)
+        {
+            if (k >= count)
+            {
+                memset(u + 32 * k, 0, 32);
+                wd[k] = 0.f;
+                continue;
+            }
+            const block_q4_0& b = w[g * 8 + k];
+            unpack_nibbles(b.qs, u + 32 * k, u + 32 * k + 16, QK4_0 / 2, 0);
+            wd[k] = gguf_fp16_to_fp32(b.d);
+        }
+    }
+};
+
+struct unpack_q8_0 {
+    const block_q8_0* w;
+    void operator()(int g, int count, int8_t* u, float* wd) const
+    {
+        for (int k = 0; k < 8; k++)
+        {
+            if (k >= count)
+            {
+                memset(u + 32 * k, 0, 32);
+                wd[k] = 0.f;
+                continue;
+            }
+            memcpy(u + 32 * k, w[g * 8 + k].qs, QK8_0);
+            wd[k] = gguf_fp16_to_fp32(w[g * 8 + k].d);
+        }
+    }
+};
+
+// s[r] is the dot product of a weight row with activation row r of R stored
+// back to back, every group of the weight row is unpacked once for all rows
+// signed weights are q8_0, unsigned ones are q4_0 nibbles with zero point 8
+template<int R, bool is_signed, typename unpack_t>
+static void vec_dot_groups_q8(const unpack_t& unpack, const block_q8_a* x, int64_t n, float* s)
+{
+    const int n_sub = (int)(n / 32);
+    const int nb = (n_sub + 7) / 8;
+    int8_t u[QK8_A];
+    float wd[8];
+#if __AVX2__
+    __m256 _acc[R];
+    for (int r = 0; r < R; r++) _acc[r] = _mm256_setzero_ps();
+    for (int g = 0; g < nb; g++)
+    {
+        unpack(g, std::min(8, n_sub - g * 8), u, wd);
+        __m256 _wd = _mm256_loadu_ps(wd);
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            __m256i _p = mm256_dot8<is_signed>(u, a.qs);
+            if (!is_signed)
+            {
+                __m256i _bs = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)a.bsums));
+                _p = _mm256_sub_epi32(_p, _mm256_slli_epi32(_bs, 3));
+            }
+            _acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_p), _mm256_mul_ps(_wd, _mm256_set1_ps(a.d)), _acc[r]);
+        }
+    }
+    for (int r = 0; r < R; r++) s[r] = _mm256_reduce_add_ps(_acc[r]);
+#elif __ARM_NEON && __aarch64__
+    float32x4_t _acc[R];
+    for (int r = 0; r < R; r++) _acc[r] = vdupq_n_f32(0.f);
+    for (int g = 0; g < nb; g++)
+    {
+        unpack(g, std::min(8, n_sub - g * 8), u, wd);
+        float32x4_t _wd0 = vld1q_f32(wd);
+        float32x4_t _wd1 = vld1q_f32(wd + 4);
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            int32x4_t _lo, _hi;
+            neon_dot8(u, a.qs, _lo, _hi);
+            if (!is_signed)
+            {
+                _lo = vmlsq_n_s32(_lo, vmovl_s16(vld1_s16(a.bsums)), 8);
+                _hi = vmlsq_n_s32(_hi, vmovl_s16(vld1_s16(a.bsums + 4)), 8);
+            }
+            _acc[r] = vfmaq_f32(_acc[r], vcvtq_f32_s32(_lo), vmulq_n_f32(_wd0, a.d));
+            _acc[r] = vfmaq_f32(_acc[r], vcvtq_f32_s32(_hi), vmulq_n_f32(_wd1, a.d));
+        }
+    }
+    for (int r = 0; r < R; r++) s[r] = vaddvq_f32(_acc[r]);
+#else
+    float acc[R];
+    for (int r = 0; r < R; r++) acc[r] = 0.f;
+    for (int g = 0; g < nb; g++)
+    {
+        unpack(g, std::min(8, n_sub - g * 8), u, wd);
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            for (int k = 0; k < 8; k++)
+            {
+                int sum = 0;
+                for (int j = 0; j < 32; j++) sum += u[32 * k + j] * a.qs[32 * k + j];
+                if (!is_signed) sum -= 8 * a.bsums[k];
+                acc[r] += sum * wd[k] * a.d;
+            }
+        }
+    }
+    for (int r = 0; r < R; r++) s[r] = acc[r];
+#endif
+}
+
+// the 6-bit scales of a q4_K super block to sc[0..7] and its mins to sc[8..15]
+static inline void unpack_scales_q4_K(const uint8_t* q, uint8_t* sc)
+{
+    uint32_t u[4];
+    memcpy(u, q, 12);
+    u[3] = ((u[2] >> 4) & 0x0f0f0f0f) | (((u[1] >> 6) & 0x03030303) << 4);
+    const uint32_t m = u[1] & 0x3f3f3f3f;
+    u[1] = (u[2] & 0x0f0f0f0f) | (((u[0] >> 6) & 0x03030303) << 4);
+    u[2] = m;
+    u[0] &= 0x3f3f3f3f;
+    memcpy(sc, u, 16);
+}
+
+// 32 bytes of a q4_K super block hold sub block 2j in the low nibbles and
+// 2j + 1 in the high ones, the sub block scales multiply the int32 sums
+// directly and the mins the activation sub block sums
+template<int R>
+static void vec_dot_q4_K_q8(const block_q4_K* w, const block_q8_a* x, int64_t n, float* s)
+{
+    const int nb = (int)(n / QK_K);
+#if __AVX2__
+    __m128 _mins[R];
+    for (int r = 0; r < R; r++) _mins[r] = _mm_setzero_ps();
+#else
+    float mins[R];
+    for (int r = 0; r < R; r++) mins[r] = 0.f;
+#endif
+#if __AVX512F__ && __AVX512BW__
+    __m512 _acc[R];
+    for (int r = 0; r < R; r++) _acc[r] = _mm512_setzero_ps();
+#elif __AVX2__
+    __m256 _acc[R];
+    for (int r = 0; r < R; r++) _acc[r] = _mm256_setzero_ps();
+#elif __ARM_NEON && __aarch64__
+    float32x4_t _acc[R];
+    for (int r = 0; r < R; r++) _acc[r] = vdupq_n_f32(0.f);
+#else
+    float acc[R];
+    for (int r = 0; r < R; r++) acc[r] = 0.f;
+#endif
+    for (int g = 0; g < nb; g++)
+    {
+        const block_q4_K& b = w[g];
+        const float d = gguf_fp16_to_fp32(b.d);
+        const float dmin = gguf_fp16_to_fp32(b.dmin);
+        uint8_t sc[16];
+        unpack_scales_q4_K(b.scales, sc);
+        const uint8_t* m = sc + 8;
+
+#if __AVX512F__ && __AVX512BW__
+        const __m512i _mask = _mm512_set1_epi8(0x0f);
+        __m512i _sum[R];
+        for (int r = 0; r < R; r++) _sum[r] = _mm512_setzero_si512();
+        for (int j = 0; j < QK_K / 128; j++)
+        {
+            __m512i _q = _mm512_loadu_si512((const __m512i*)(b.qs + 64 * j));
+            __m512i _lo = _mm512_and_si512(_q, _mask);
+            __m512i _hi = _mm512_and_si512(_mm512_srli_epi16(_q, 4), _mask);
+            // lo holds sub blocks 4j and 4j + 2, hi 4j + 1 and 4j + 3, put them in activation order
+            __m512i _u0 = _mm512_shuffle_i64x2(_lo, _hi, _MM_SHUFFLE(1, 0, 1, 0));
+            __m512i _u1 = _mm512_shuffle_i64x2(_lo, _hi, _MM_SHUFFLE(3, 2, 3, 2));
+            __m512i _sc0 = _mm512_inserti64x4(_mm512_set1_epi16(sc[4 * j]), _mm256_set1_epi16(sc[4 * j + 1]), 1);
+            __m512i _sc1 = _mm512_inserti64x4(_mm512_set1_epi16(sc[4 * j + 2]), _mm256_set1_epi16(sc[4 * j + 3]), 1);
+            for (int r = 0; r < R; r++)
+            {
+                const int8_t* xq = x[r * nb + g].qs + 128 * j;
+                __m512i _p0 = _mm512_maddubs_epi16(_u0, _mm512_loadu_si512((const __m512i*)xq));
+                __m512i _p1 = _mm512_maddubs_epi16(_u1, _mm512_loadu_si512((const __m512i*)(xq + 64)));
+                _sum[r] = _mm512_add_epi32(_sum[r], _mm512_madd_epi16(_p0, _sc0));
+                _sum[r] = _mm512_add_epi32(_sum[r], _mm512_madd_epi16(_p1, _sc1));
+            }
+        }
+        for (int r = 0; r < R; r++)
+        {
+            _acc[r] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_sum[r]), _mm512_set1_ps(d * x[r * nb + g].d), _acc[r]);
+        }
+#elif __AVX2__
+        const __m256i _mask = _mm256_set1_epi8(0x0f);
+        __m256i _sum[R];
+        for (int r = 0; r < R; r++) _sum[r] = _mm256_setzero_si256();
+        for (int j = 0; j < QK_K / 64; j++)
+        {
+            __m256i _q = _mm256_loadu_si256((const __m256i*)(b.qs + 32 * j));
+            __m256i _lo = _mm256_and_si256(_q, _mask);
+            __m256i _hi = _mm256_and_si256(_mm256_srli_epi16(_q, 4), _mask);
+            __m256i _sc0 = _mm256_set1_epi16(sc[2 * j]);
+            __m256i _sc1 = _mm256_set1_epi16(sc[2 * j + 1]);
+            for (int r = 0; r < R; r++)
+            {
+                const int8_t* xq = x[r * nb + g].qs + 64 * j;
+                __m256i _p0 = _mm256_maddubs_epi16(_lo, _mm256_loadu_si256((const __m256i*)xq));
+                __m256i _p1 = _mm256_maddubs_epi16(_hi, _mm256_loadu_si256((const __m256i*)(xq + 32)));
+                _sum[r] = _mm256_add_epi32(_sum[r], _mm256_madd_epi16(_p0, _sc0));
+                _sum[r] = _mm256_add_epi32(_sum[r], _mm256_madd_epi16(_p1, _sc1));
+            }
+        }
+        for (int r = 0; r < R; r++)
+        {
+            _acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_sum[r]), _mm256_set1_ps(d * x[r * nb + g].d), _acc[r]);
+        }
+#elif __ARM_NEON && __aarch64__
+        const uint8x16_t _mask = vdupq_n_u8(0x0f);
+        int32x4_t _sum[R];
+        for (int r = 0; r < R; r++) _sum[r] = vdupq_n_s32(0);
+        for (int j = 0; j < QK_K / 64; j++)
+        {
+            int8_t u[64];
+            uint8x16_t _q0 = vld1q_u8(b.qs + 32 * j);
+            uint8x16_t _q1 = vld1q_u8(b.qs + 32 * j + 16);
+            vst1q_s8(u, vreinterpretq_s8_u8(vandq_u8(_q0, _mask)));
+            vst1q_s8(u + 16, vreinterpretq_s8_u8(vandq_u8(_q1, _mask)));
+            vst1q_s8(u + 32, vreinterpretq_s8_u8(vshrq_n_u8(_q0, 4)));
+            vst1q_s8(u + 48, vreinterpretq_s8_u8(vshrq_n_u8(_q1, 4)));
+            for (int r = 0; r < R; r++)
+            {
+                const int8_t* xq = x[r * nb + g].qs + 64 * j;
+                _sum[r] = vmlaq_n_s32(_sum[r], neon_dot32(u, xq), sc[2 * j]);
+                _sum[r] = vmlaq_n_s32(_sum[r], neon_dot32(u + 32, xq + 32), sc[2 * j + 1]);
+            }
+        }
+        for (int r = 0; r < R; r++)
+        {
+            _acc[r] = vfmaq_n_f32(_acc[r], vcvtq_f32_s32(_sum[r]), d * x[r * nb + g].d);
+        }
+#else
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            int sum = 0;
+            for (int j = 0; j < QK_K / 64; j++)
+            {
+                int sum0 = 0;
+                int sum1 = 0;
+                for (int l = 0; l < 32; l++)
+                {
+                    sum0 += (b.qs[32 * j + l] & 0x0f) * a.qs[64 * j + l];
+                    sum1 += (b.qs[32 * j + l] >> 4) * a.qs[64 * j + 32 + l];
+                }
+                sum += sum0 * sc[2 * j] + sum1 * sc[2 * j + 1];
+            }
+            acc[r] += d * a.d * sum;
+        }
+#endif
+
+#if __AVX2__
+        __m128i _m = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)m));
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            __m128i _msum = _mm_madd_epi16(_m, _mm_loadu_si128((const __m128i*)a.bsums));
+            _mins[r] = _mm_fmadd_ps(_mm_cvtepi32_ps(_msum), _mm_set1_ps(dmin * a.d), _mins[r]);
+        }
+#else
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            int msum = 0;
+            for (int k = 0; k < 8; k++) msum += m[k] * a.bsums[k];
+            mins[r] += dmin * a.d * msum;
+        }
+#endif
+    }
+
+    for (int r = 0; r < R; r++)
+    {
+#if __AVX512F__ && __AVX512BW__
+        s[r] = _mm512_reduce_add_ps(_acc[r]) - _mm_reduce_add_ps(_mins[r]);
+#elif __AVX2__
+        s[r] = _mm256_reduce_add_ps(_acc[r]) - _mm_reduce_add_ps(_mins[r]);
+#elif __ARM_NEON && __aarch64__
+        s[r] = vaddvq_f32(_acc[r]) - mins[r];
+#else
+        s[r] = acc[r] - mins[r];
+#endif
+    }
+}
+
+template<int R>
+static int vec_dot_rows_q8(ggml_type type, const void* src, const block_q8_a* x, int64_t n, float* s)
+{
+    switch (type)
+    {
+    case GGML_TYPE_Q4_0:
+    {
+        unpack_q4_0 unpack = {(const block_q4_0*)src};
+        vec_dot_groups_q8<R, false>(unpack, x, n, s);
+        break;
+    }
+    case GGML_TYPE_Q4_K:
+        vec_dot_q4_K_q8<R>((const block_q4_K*)src, x, n, s);
+        break;
+    case GGML_TYPE_Q8_0:
+    {
+        unpack_q8_0 unpack = {(const block_q8_0*)src};
+        vec_dot_groups_q8<R, true>(unpack, x, n, s);
+        break;
+    }
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int vec_dot_row_q8_kernel(ggml_type type, const void* src, const void* xq, int64_t n, int n_rows, float* s)
+{
+    const block_q8_a* x = (const block_q8_a*)xq;
+    switch (n_rows)
+    {
+    case 1:
+        return vec_dot_rows_q8<1>(type, src, x, n, s);
+    case 2:
+        return vec_dot_rows_q8<2>(type, src, x, n, s);
+    case 3:
+        return vec_dot_rows_q8<3>(type, src, x, n, s);
+    case 4:
+        return vec_dot_rows_q8<4>(type, src, x, n, s);
+    default:
+        return -1;
+    }
+}
+
+// Tiles of eight q4_K rows for the integer kernels
+// a super block of the eight rows is stored together with its nibbles in
+// chunks of four bytes per row, one 256-bit load holds the same four
+// positions of every row and a broadcast activation word multiplies all of
+// them, so the dot products land in one lane per row and need no horizontal
+// reduction, the 6-bit scales and mins are unpacked when the tile is built
+struct block_q4_Kx8 {
+    float d[8];
+    float dmin[8];
+    uint8_t sc[8][8];       // [sub block][row]
+    int16_t m[4][8][2];     // [sub block pair][row][sub block], pmaddwd against pairs of activation sums
+    uint8_t qs[4][8][8][4]; // [sub block pair][chunk][row][byte], low nibbles the first sub block of the pair
+};
+
+static_assert(sizeof(block_q4_Kx8) == 1280, "wrong q4_Kx8 block size");
+
+// eight rows src, src + stride, ... of n values to one tile
+static void repack_q4_Kx8(const char* src, size_t stride, block_q4_Kx8* dst, int64_t n)
+{
+    const int nb = (int)(n / QK_K);
+    for (int g = 0; g < nb; g++)
+    {
+        block_q4_Kx8& t = dst[g];
+        for (int c = 0; c < 8; c++)
+        {
+            const block_q4_K& b = ((const block_q4_K*)(src + c * stride))[g];
+            uint8_t sc[16];
+            unpack_scales_q4_K(b.scales, sc);
+            t.d[c] = gguf_fp16_to_fp32(b.d);
+            t.dmin[c] = gguf_fp16_to_fp32(b.dmin);
+            for (int k = 0; k < 8; k++)
+            {
+                t.sc[k][c] = sc[k];
+                t.m[k / 2][c][k % 2] = sc[8 + k];
+            }
+            for (int j = 0; j < 4; j++)
+            {
+                for (int q = 0; q < 8; q++)
+                    memcpy(t.qs[j][q][c], b.qs + 32 * j + 4 * q, 4);
+            }
+        }
+    }
+}
+
+// s[r * 8 + c] is the dot product of row c of the tile with activation row r
+template<int R>
+static void vec_dot_q4_Kx8_q8(const block_q4_Kx8* w, const block_q8_a* x, int64_t n, float* s)
+{
+    const int nb = (int)(n / QK_K);
+#if __AVX2__
+    const __m256i _mask = _mm256_set1_epi8(0x0f);
+    __m256 _acc[R];
+    for (int r = 0; r < R; r++) _acc[r] = _mm256_setzero_ps();
+    for (int g = 0; g < nb; g++)
+    {
+        const block_q4_Kx8& t = w[g];
+        __m256i _sum[R];
+        for (int r = 0; r < R; r++) _sum[r] = _mm256_setzero_si256();
+        for (int j = 0; j < 4; j++)
+        {
+            __m256i _p0[R];
+            __m256i _p1[R];
+            for (int r = 0; r < R; r++)
+            {
+                _p0[r] = _mm256_setzero_si256();
+                _p1[r] = _mm256_setzero_si256();
+            }
+            for (int q = 0; q < 8; q++)
+            {
+                __m256i _q = _mm256_loadu_si256((const __m256i*)t.qs[j][q]);
+                __m256i _lo = _mm256_and_si256(_q, _mask);
+                __m256i _hi = _mm256_and_si256(_mm256_srli_epi16(_q, 4), _mask);
+                for (int r = 0; r < R; r++)
+                {
+                    const int8_t* xq = x[r * nb + g].qs + 64 * j + 4 * q;
+                    int32_t x0;
+                    int32_t x1;
+                    memcpy(&x0, xq, 4);
+                    memcpy(&x1, xq + 32, 4);
+                    _p0[r] = mm256_dpbusd(_p0[r], _lo, _mm256_set1_epi32(x0));
+                    _p1[r] = mm256_dpbusd(_p1[r], _hi, _mm256_set1_epi32(x1));
+                }
+            }
+            __m256i _sc0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)t.sc[2 * j]));
+            __m256i _sc1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)t.sc[2 * j + 1]));
+            for (int r = 0; r < R; r++)
+            {
+                _sum[r] = _mm256_add_epi32(_sum[r], _mm256_mullo_epi32(_p0[r], _sc0));
+                _sum[r] = _mm256_add_epi32(_sum[r], _mm256_mullo_epi32(_p1[r], _sc1));
+            }
+        }
+        __m256 _d = _mm256_loadu_ps(t.d);
+        __m256 _dmin = _mm256_loadu_ps(t.dmin);
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            __m256i _msum = _mm256_setzero_si256();
+            for (int i = 0; i < 4; i++)
+            {
+                int32_t bs;
+                memcpy(&bs, a.bsums + 2 * i, 4);
+                _msum = _mm256_add_epi32(_msum, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)t.m[i]), _mm256_set1_epi32(bs)));
+            }
+            __m256 _ad = _mm256_set1_ps(a.d);
+            _acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_sum[r]), _mm256_mul_ps(_d, _ad), _acc[r]);
+            _acc[r] = _mm256_fnmadd_ps(_mm256_cvtepi32_ps(_msum), _mm256_mul_ps(_dmin, _ad), _acc[r]);
+        }
+    }
+    for (int r = 0; r < R; r++) _mm256_storeu_ps(s + r * 8, _acc[r]);
+#elif __ARM_NEON && __aarch64__ && __ARM_FEATURE_DOTPROD
+    // rows 0..3 in the first quad of a chunk, 4..7 in the second
+    const uint8x16_t _mask = vdupq_n_u8(0x0f);
+    float32x4_t _acc[R][2];
+    for (int r = 0; r < R; r++)
+    {
+        _acc[r][0] = vdupq_n_f32(0.f);
+        _acc[r][1] = vdupq_n_f32(0.f);
+    }
+    for (int g = 0; g < nb; g++)
+    {
+        const block_q4_Kx8& t = w[g];
+        int32x4_t _sum[R][2];
+        for (int r = 0; r < R; r++)
+        {
+            _sum[r][0] = vdupq_n_s32(0);
+            _sum[r][1] = vdupq_n_s32(0);
+        }
+        for (int j = 0; j < 4; j++)
+        {
+            int32x4_t _p[R][4];
+            for (int r = 0; r < R; r++)
+            {
+                for (int k = 0; k < 4; k++) _p[r][k] = vdupq_n_s32(0);
+            }
+            for (int q = 0; q < 8; q++)
+            {
+                uint8x16_t _q0 = vld1q_u8(t.qs[j][q][0]);
+                uint8x16_t _q1 = vld1q_u8(t.qs[j][q][4]);
+                int8x16_t _lo0 = vreinterpretq_s8_u8(vandq_u8(_q0, _mask));
+                int8x16_t _lo1 = vreinterpretq_s8_u8(vandq_u8(_q1, _mask));
+                int8x16_t _hi0 = vreinterpretq_s8_u8(vshrq_n_u8(_q0, 4));
+                int8x16_t _hi1 = vreinterpretq_s8_u8(vshrq_n_u8(_q1, 4));
+                for (int r = 0; r < R; r++)
+                {
+                    const int8_t* xq = x[r * nb + g].qs + 64 * j + 4 * q;
+                    int32_t x0;
+                    int32_t x1;
+                    memcpy(&x0, xq, 4);
+                    memcpy(&x1, xq + 32, 4);
+                    int8x16_t _x0 = vreinterpretq_s8_s32(vdupq_n_s32(x0));
+                    int8x16_t _x1 = vreinterpretq_s8_s32(vdupq_n_s32(x1));
+                    _p[r][0] = vdotq_s32(_p[r][0], _lo0, _x0);
+                    _p[r][1] = vdotq_s32(_p[r][1], _lo1, _x0);
+                    _p[r][2] = vdotq_s32(_p[r][2], _hi0, _x1);
+                    _p[r][3] = vdotq_s32(_p[r][3], _hi1, _x1);
+                }
+            }
+            uint16x8_t _sc0 = vmovl_u8(vld1_u8(t.sc[2 * j]));
+            uint16x8_t _sc1 = vmovl_u8(vld1_u8(t.sc[2 * j + 1]));
+            int32x4_t _sc00 = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(_sc0)));
+            int32x4_t _sc01 = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(_sc0)));
+            int32x4_t _sc10 = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(_sc1)));
+            int32x4_t _sc11 = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(_sc1)));
+            for (int r = 0; r < R; r++)
+            {
+                _sum[r][0] = vmlaq_s32(_sum[r][0], _p[r][0], _sc00);
+                _sum[r][1] = vmlaq_s32(_sum[r][1], _p[r][1], _sc01);
+                _sum[r][0] = vmlaq_s32(_sum[r][0], _p[r][2], _sc10);
+                _sum[r][1] = vmlaq_s32(_sum[r][1], _p[r][3], _sc11);
+            }
+        }
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            int32x4_t _msum0 = vdupq_n_s32(0);
+            int32x4_t _msum1 = vdupq_n_s32(0);
+            for (int i = 0; i < 4; i++)
+            {
+                int16x4x2_t _m0 = vld2_s16(t.m[i][0]);
+                int16x4x2_t _m1 = vld2_s16(t.m[i][4]);
+                _msum0 = vmlal_n_s16(_msum0, _m0.val[0], a.bsums[2 * i]);
+                _msum0 = vmlal_n_s16(_msum0, _m0.val[1], a.bsums[2 * i + 1]);
+                _msum1 = vmlal_n_s16(_msum1, _m1.val[0], a.bsums[2 * i]);
+                _msum1 = vmlal_n_s16(_msum1, _m1.val[1], a.bsums[2 * i + 1]);
+            }
+            for (int h = 0; h < 2; h++)
+            {
+                float32x4_t _d = vmulq_n_f32(vld1q_f32(t.d + 4 * h), a.d);
+                float32x4_t _dmin = vmulq_n_f32(vld1q_f32(t.dmin + 4 * h), a.d);
+                _acc[r][h] = vfmaq_f32(_acc[r][h], vcvtq_f32_s32(_sum[r][h]), _d);
+                _acc[r][h] = vfmsq_f32(_acc[r][h], vcvtq_f32_s32(h ? _msum1 : _msum0), _dmin);
+            }
+        }
+    }
+    for (int r = 0; r < R; r++)
+    {
+        vst1q_f32(s + r * 8, _acc[r][0]);
+        vst1q_f32(s + r * 8 + 4, _acc[r][1]);
+    }
+#else
+    for (int r = 0; r < R; r++)
+    {
+        for (int c = 0; c < 8; c++) s[r * 8 + c] = 0.f;
+    }
+    for (int g = 0; g < nb; g++)
+    {
+        const block_q4_Kx8& t = w[g];
+        for (int r = 0; r < R; r++)
+        {
+            const block_q8_a& a = x[r * nb + g];
+            for (int c = 0; c < 8; c++)
+            {
+                int sum = 0;
+                int msum = 0;
+                for (int j = 0; j < 4; j++)
+                {
+                    int sum0 = 0;
+                    int sum1 = 0;
+                    for (int l = 0; l < 32; l++)
+                    {
+                        const uint8_t b = t.qs[j][l / 4][c][l % 4];
+                        sum0 += (b & 0x0f) * a.qs[64 * j + l];
+                        sum1 += (b >> 4) * a.qs[64 * j + 32 + l];
+                    }
+                    sum += sum0 * t.sc[2 * j][c] + sum1 * t.sc[2 * j + 1][c];
+                    msum += t.m[j][c][0] * a.bsums[2 * j] + t.m[j][c][1] * a.bsums[2 * j + 1];
+                }
+                s[r * 8 + c] += a.d * (t.d[c] * sum - t.dmin[c] * msum);
+            }
+        }
+    }
+#endif
+}
+
+template<int R>
+static int vec_dot_tiles_q8(ggml_type type, const void* tile, const block_q8_a* x, int64_t n, float* s)
+{
+    switch (type)
+    {
+    case GGML_TYPE_Q4_K:
+        vec_dot_q4_Kx8_q8<R>((const block_q4_Kx8*)tile, x, n, s);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int vec_dot_tile_q8_kernel(ggml_type type, const void* tile, const void* xq, int64_t n, int n_rows, float* s)
+{
+    const block_q8_a* x = (const block_q8_a*)xq;
+    switch (n_rows)
+    {
+    case 1:
+        return vec_dot_tiles_q8<1>(type, tile, x, n, s);
+    case 2:
+        return vec_dot_tiles_q8<2>(type, tile, x, n, s);
+    case 3:
+        return vec_dot_tiles_q8<3>(type, tile, x, n, s);
+    case 4:
+        return vec_dot_tiles_q8<4>(type, tile, x, n, s);
+    default:
+        return -1;
+    }
+}
+
+} // namespace ncnn
+
+#endif // GGUF_QUANT_H
@@ -1,30 +1,216 @@
 #include "llm_engine.h"
+#include "cpu.h"
 #include "layer.h"
+#include "layer_type.h"
 #include "mat.h"
 #include "option.h"
+#include "paramdict.h"
 #include <algorithm>
-#include <random>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 namespace ncnn {
 
-class InnerProduct {
+// Linear projection whose weight stays in its GGUF block format
+// a few rows (decode) go through a GEMV that dequantizes each weight block
+// inside the dot product, longer inputs (prefill) dequantize a panel of
+// weight rows once and hand it to the Gemm layer
+// with q8 set inputs short of q8_max_rows() are quantized to int8 instead and
+// every weight block is multiplied with them in integer arithmetic, from the
+// repacked tiles of q8_tile_rows weight rows when the plan built them
+class QuantLinear {
 public:
-    Mat weight_data;
+    const gguf_tensor* weight;
     Mat bias_data;
-    int forward(const Mat& bottom_blob, Mat& top_blob, const Option& /* opt */) const {
+    const Layer* gemm;
+    bool q8;
+    const char* tiles; // the first channels / q8_tile_rows tiles, or null
+    QuantLinear() : weight(0), gemm(0), q8(false), tiles(0) {}
+
+    // rows at which one weight dequantization beats re-expanding it per row
+    static const int gemm_min_rows = 16;
+    // rows from which the fp32 Gemm layer beats the integer kernels, on one
+    // core q4_0 fell behind at 16 rows, q4_K and q8_0 at 32 to 64, and the
+    // repacked q4_K tiles were still ahead at 120
+    static int q8_max_rows(ggml_type type, bool tiled) {
+        if (tiled) return 128;
+        return type == GGML_TYPE_Q4_0 ? 16 : 32;
+    }
+    // upper bound of the fp32 weight panel handed to the Gemm layer
+    static const size_t gemm_panel_bytes = 16 * 1024 * 1024;
+
+    // rows of the weight panel handed to the Gemm layer at once
+    static int gemm_panel(const gguf_tensor* weight) {
+        const size_t w = (size_t)weight->ne[0];
+        const size_t channels = (size_t)weight->ne[1];
+        // fp32 weights are fed straight from the mapping
+        if (weight->type == GGML_TYPE_F32) return (int)channels;
+        return (int)std::min(channels, std::max((size_t)16, gemm_panel_bytes / (w * sizeof(float))));
+    }
+
+    // whether an input of rows rows goes through the integer kernels
+    bool use_q8(int rows) const {
+        return q8 && (!gemm || rows < q8_max_rows(weight->type, tiles != 0));
+    }
+
+    // floats of workspace forward() needs for an input of rows rows
+    size_t workspace_size(int rows, int num_threads) const {
+        const size_t w = (size_t)weight->ne[0];
+        const int channels = (int)weight->ne[1];
+        if (use_q8(rows)) {
+            return (rows * q8_row_size(w) + sizeof(float) - 1) / sizeof(float);
+        }
+        if (gemm && rows >= gemm_min_rows) {
+            if (weight->type == GGML_TYPE_F32) return 0;
+            // the dequantized panel, and its output when the panel is not the whole matrix
+            const int panel = gemm_panel(weight);
+            return w * panel + (panel < channels ? (size_t)rows * panel : 0);
+        }
+        return rows > 1 && weight->type != GGML_TYPE_F32 ? w * num_threads : 0;
+    }
+
+    // workspace holds at least workspace_size() floats
+    int forward(const Mat& bottom_blob, Mat& top_blob, Mat& workspace, const Option& opt) const {
+        if (use_q8(bottom_blob.h)) {
+            return forward_q8(bottom_blob, top_blob, workspace, opt);
+        }
+        if (gemm && bottom_blob.h >= gemm_min_rows) {
+            return forward_gemm(bottom_blob, top_blob, workspace, opt);
+        }
+        return forward_gemv(bottom_blob, top_blob, workspace, opt);
+    }
+
+    int forward_gemv(const Mat& bottom_blob, Mat& top_blob, Mat& workspace, const Option& opt) const {
+        int w = bottom_blob.w;
+        int h = bottom_blob.h;
+        int channels = (int)weight->ne[1];
+        size_t row_size = ggml_row_size(weight->type, w);
+        top_blob.create(channels, h);
+        if (top_blob.empty()) return -100;
+
+        // several rows (a batched decode step) share one dequantization of
+        // each weight row instead of expanding the block once per row
+        Mat scratch;
+        if (h > 1 && weight->type != GGML_TYPE_F32) {
+            scratch = Mat(w, opt.num_threads, workspace.data);
+        }
+
+        #pragma omp parallel for num_threads(opt.num_threads)
+        for (int j = 0; j < channels; j++) {
+            const char* wrow = weight->data + j * row_size;
+            ggml_type wtype = weight->type;
+            if (!scratch.empty()) {
+                float* wf = scratch.row(get_omp_thread_num());
+                dequantize_row(wtype, wrow, wf, w);
+                wrow = (const char*)wf;
+                wtype = GGML_TYPE_F32;
+            }
+            float bias = bias_data.empty() ? 0.f : bias_data[j];
+            for (int i = 0; i < h; i++) {
+                top_blob.row(i)[j] = vec_dot_row(wtype, wrow, bottom_blob.row(i), w) + bias;
+            }
+        }
+        return 0;
+    }
+
+    int forward_q8(const Mat& bottom_blob, Mat& top_blob, Mat& workspace, const Option& opt) const {
         int w = bottom_blob.w;
         int h = bottom_blob.h;
-        int channels = weight_data.h;
+        int channels = (int)weight->ne[1];
+        size_t row_size = ggml_row_size(weight->type, w);
         top_blob.create(channels, h);
+        if (top_blob.empty()) return -100;
+
+        const size_t xq_size = q8_row_size(w);
+        char* xq = (char*)workspace.data;
+        #pragma omp parallel for num_threads(opt.num_threads)
         for (int i = 0; i < h; i++) {
-            for (int j = 0; j < channels; j++) {
-                float sum = 0;
-                for (int k = 0; k < w; k++) {
-                    sum += bottom_blob.row(i)[k] * weight_data.row(j)[k];
+            quantize_row_q8(bottom_blob.row(i), xq + i * xq_size, w);
+        }
+
+        // four input rows per pass over a tile of weight rows
+        const int n_tiles = tiles ? channels / q8_tile_rows : 0;
+        const size_t tile_size = tiles ? q8_tile_size(weight->type, w) : 0;
+        #pragma omp parallel for num_threads(opt.num_threads)
+        for (int t = 0; t < n_tiles; t++) {
+            const char* tile = tiles + t * tile_size;
+            for (int i = 0; i < h; i += 4) {
+                const int n_rows = std::min(4, h - i);
+                float sums[4 * q8_tile_rows];
+                vec_dot_tile_q8(weight->type, tile, xq + i * xq_size, w, n_rows, sums);
+                for (int r = 0; r < n_rows; r++) {
+                    float* out = top_blob.row(i + r) + t * q8_tile_rows;
+                    for (int c = 0; c < q8_tile_rows; c++) {
+                        out[c] = sums[r * q8_tile_rows + c] + (bias_data.empty() ? 0.f : bias_data[t * q8_tile_rows + c]);
+                    }
+                }
+            }
+        }
+
+        // and over a weight row for the channels not in a tile
+        #pragma omp parallel for num_threads(opt.num_threads)
+        for (int j = n_tiles * q8_tile_rows; j < channels; j++) {
+            const char* wrow = weight->data + j * row_size;
+            float bias = bias_data.empty() ? 0.f : bias_data[j];
+            for (int i = 0; i < h; i += 4) {
+                const int n_rows = std::min(4, h - i);
+                float sums[4];
+                vec_dot_row_q8(weight->type, wrow, xq + i * xq_size, w, n_rows, sums);
+                for (int r = 0; r < n_rows; r++) {
+                    top_blob.row(i + r)[j] = sums[r] + bias;
+                }
+            }
+        }
+        return 0;
+    }
+
+    int forward_gemm(const Mat& bottom_blob, Mat& top_blob, Mat& workspace, const Option& opt) const {
+        int w = bottom_blob.w;
+        int h = bottom_blob.h;
+        int channels = (int)weight->ne[1];
+        size_t row_size = ggml_row_size(weight->type, w);
+        top_blob.create(channels, h);
+        if (top_blob.empty()) return -100;
+
+        const int panel = gemm_panel(weight);
+        Mat weight_panel(w, panel, workspace.data);
+        Mat panel_out(panel, h, (float*)workspace.data + (size_t)w * panel);
+        for (int j0 = 0; j0 < channels; j0 += panel) {
+            int n = std::min(panel, channels - j0);
+
+            Mat B;
+            if (weight->type == GGML_TYPE_F32) {
+                B = Mat(w, n, (void*)(weight->data + j0 * row_size));
+            } else {
+                #pragma omp parallel for num_threads(opt.num_threads)
+                for (int j = 0; j < n; j++) {
+                    dequantize_row(weight->type, weight->data + (j0 + j) * row_size, weight_panel.row(j), w);
+                }
+                B = weight_panel.row_range(0, n);
+            }
+
+            std::vector<Mat> bottoms(2);
+            bottoms[0] = bottom_blob;
+            bottoms[1] = B;
+            if (!bias_data.empty()) {
+                bottoms.push_back(bias_data.range(j0, n));
+            }
+            std::vector<Mat> tops(1);
+            tops[0] = n == channels ? top_blob : Mat(n, h, panel_out.data);
+            int ret = gemm->forward(bottoms, tops, opt);
+            if (ret != 0) return ret;
+
+            if (n != channels) {
+                for (int i = 0; i < h; i++) {
+                    memcpy(top_blob.row(i) + j0, tops[0].row(i), n * sizeof(float));
                 }
-                if (!bias_data.empty()) sum += bias_data[j];
-                top_blob.row(i)[j] = sum;
             }
         }
         return 0;
@@ -32,25 +218,161 @@ public:
 };
 
 // Rotary Position Embedding (RoPE) module
+// looks the angles up in the engine tables instead of evaluating powf/cosf/sinf
 class RoPEModule {
 public:
-    int forward(const Mat& bottom_blob, Mat& top_blob, int pos_base, const Option& /* opt */) const {
-        int seq_len = bottom_blob.h;
-        int dim = bottom_blob.w;
-        int half = dim / 2;
-        top_blob.create(dim, seq_len);
-        
-        for (int i = 0; i < seq_len; i++) {
-            const float* src = bottom_blob.row(i);
-            float* dst = top_blob.row(i);
-            int pos = pos_base + i;
-            
+    int rope_dim;
+    bool neox;
+    const Mat* cos_table;
+    const Mat* sin_table;
+
+    // rotates n_heads heads of one row at pos, src and dst may alias
+    void apply(const float* src, float* dst, int n_heads, int head_dim, int pos) const {
+        const int half = rope_dim / 2;
+        const float* cos_t = cos_table->row(pos);
+        const float* sin_t = sin_table->row(pos);
+        // pair j is (j, j + half) for neox and (2j, 2j + 1) otherwise
+        const int stride = neox ? 1 : 2;
+        const int gap = neox ? half : 1;
+
+        for (int h = 0; h < n_heads; h++) {
+            const float* x = src + h * head_dim;
+            float* y = dst + h * head_dim;
             for (int j = 0; j < half; j++) {
-                float theta = powf(10000.0f, -2.0f * j / (float)dim);
-                float cos_t = cosf(pos * theta);
-                float sin_t = sinf(pos * theta);
-                dst[2*j] = src[2*j] * cos_t - src[2*j+1] * sin_t;
-                dst[2*j+1] = src[2*j] * sin_t + src[2*j+1] * cos_t;
+                float x0 = x[j * stride];
+                float x1 = x[j * stride + gap];
+                y[j * stride] = x0 * cos_t[j] - x1 * sin_t[j];
+                y[j * stride + gap] = x0 * sin_t[j] + x1 * cos_t[j];
+            }
+            if (x != y) {
+                memcpy(y + rope_dim, x + rope_dim, (head_dim - rope_dim) * sizeof(float));
+            }
+        }
+    }
+
+    // turns n_heads rotated heads of one row back by delta positions in place,
+    // so a key rotated for pos reads as one rotated for pos - delta, the
+    // table rows are normalized as they may carry an attention scale
+    void rotate_back(float* x, int n_heads, int head_dim, int delta) const {
+        const int half = rope_dim / 2;
+        const float* cos_t = cos_table->row(delta);
+        const float* sin_t = sin_table->row(delta);
+        const int stride = neox ? 1 : 2;
+        const int gap = neox ? half : 1;
+
+        for (int j = 0; j < half; j++) {
+            const float r = 1.f / sqrtf(cos_t[j] * cos_t[j] + sin_t[j] * sin_t[j]);
+            const float c = cos_t[j] * r;
+            const float s = sin_t[j] * r;
+            for (int h = 0; h < n_heads; h++) {
+                float* y = x + h * head_dim;
+                float x0 = y[j * stride];
+                float x1 = y[j * stride + gap];
+                y[j * stride] = x0 * c + x1 * s;
+                y[j * stride + gap] = x1 * c - x0 * s;
+            }
+        }
+    }
+
+    // rotates every head of each row in place, row i at pos_base + i
+    int forward_inplace(Mat& bottom_top_blob, int head_dim, int pos_base, const Option& opt) const {
+        const int seq_len = bottom_top_blob.h;
+        const int n_heads = bottom_top_blob.w / head_dim;
+
+        #pragma omp parallel for num_threads(opt.num_threads)
+        for (int i = 0; i < seq_len; i++) {
+            float* ptr = bottom_top_blob.row(i);
+            apply(ptr, ptr, n_heads, head_dim, pos_base + i);
+        }
+        return 0;
+    }
+};
+
+// Causal attention of new queries over the cached keys/values
+// the rows of q are split into segments, one per sequence of a batched step,
+// query i of a segment sits at position start_pos + i and attends to
+// [0, start_pos + i] of that segment's cache, read through its block table,
+// or only to the last window positions of it for a sliding window model
+// keys are streamed in tiles with an online softmax so no score matrix is
+// formed, and query heads index their shared kv head directly for GQA
+// quantized K/V rows are expanded one block at a time inside the dot and
+// accumulate kernels, never as a whole row
+class FlashAttention {
+public:
+    int n_head;
+    int n_kv_head;
+    int head_dim;
+    int window; // keys a query attends to, itself included, 0 for all
+
+    static const int kv_tile = 64;
+
+    struct Segment {
+        const KVCache* cache;
+        int layer;
+        int row;       // first row of q
+        int n_rows;
+        int start_pos; // position of the first row
+    };
+
+    // row_segment[r] is the segment of row r, scratch has a row of
+    // head_dim + kv_tile floats per thread for the accumulator and score tile
+    int forward(const Mat& q, const std::vector<Segment>& segments, const int* row_segment, Mat& scratch, Mat& top_blob, const Option& opt) const {
+        const int seq_len = q.h;
+        const int heads_per_kv = n_head / n_kv_head;
+        const float scale = 1.f / sqrtf((float)head_dim);
+
+        top_blob.create(n_head * head_dim, seq_len);
+        if (top_blob.empty()) return -100;
+
+        #pragma omp parallel for num_threads(opt.num_threads)
+        for (int t = 0; t < n_head * seq_len; t++) {
+            const int h = t / seq_len;
+            const int r = t % seq_len;
+            const Segment& seg = segments[row_segment[r]];
+            const KVCache& cache = *seg.cache;
+            const ggml_type kv_type = cache.pool->row_type();
+            const int i = r - seg.row;
+            const size_t kv_offset = h / heads_per_kv * ggml_row_size(kv_type, head_dim);
+            const int n_keys = seg.start_pos + i + 1;
+            const int first = window > 0 ? std::max(0, n_keys - window) : 0;
+
+            const float* qi = (const float*)q.row(r) + h * head_dim;
+            float* acc = scratch.row(get_omp_thread_num());
+            float* scores = acc + head_dim;
+
+            float m = -INFINITY;
+            float l = 0.f;
+            for (int d = 0; d < head_dim; d++) acc[d] = 0.f;
+
+            for (int j0 = first; j0 < n_keys; j0 += kv_tile) {
+                const int nj = std::min(kv_tile, n_keys - j0);
+
+                float tile_max = -INFINITY;
+                for (int j = 0; j < nj; j++) {
+                    const char* kj = cache.key(seg.layer, j0 + j) + kv_offset;
+                    scores[j] = vec_dot_row(kv_type, kj, qi, head_dim) * scale;
+                    tile_max = std::max(tile_max, scores[j]);
+                }
+
+                // rescale what was accumulated under the previous maximum
+                const float m_new = std::max(m, tile_max);
+                const float correction = expf(m - m_new);
+                l *= correction;
+                for (int d = 0; d < head_dim; d++) acc[d] *= correction;
+
+                for (int j = 0; j < nj; j++) {
+                    const float p = expf(scores[j] - m_new);
+                    const char* vj = cache.value(seg.layer, j0 + j) + kv_offset;
+                    l += p;
+                    vec_mad_row(kv_type, vj, p, acc, head_dim);
+                }
+                m = m_new;
+            }
+
+            float* out = top_blob.row(r) + h * head_dim;
+            const float inv_l = 1.f / l;
+            for (int d = 0; d < head_dim; d++) {
+                out[d] = acc[d] * inv_l;
             }
         }
         return 0;
@@ -80,7 +402,8 @@ public:
             for (int j = 0; j < w; j++) {
                 dst[j] = (src[j] - mean) * scale;
                 if (affine) {
-                    dst[j] = dst[j] * weight_data[j] + bias_data[j];
+                    dst[j] = dst[j] * weight_data[j];
+                    if (!bias_data.empty()) dst[j] += bias_data[j];
                 }
             }
         }
@@ -88,22 +411,202 @@ public:
     }
 };
 
+// Heap behind the activation buffers of a plan and the Gemm layer's
+// temporaries, freed blocks are kept and handed out again for requests of up
+// to their size, so a step repeating an earlier shape takes nothing from the
+// heap, and the blocks that did come from it are counted
+class CountingAllocator : public Allocator {
+public:
+    CountingAllocator() : count(0) {}
+    virtual ~CountingAllocator() {
+        for (size_t i = 0; i < free_blocks.size(); i++) {
+            ncnn::fastFree(free_blocks[i].second);
+        }
+        for (size_t i = 0; i < used_blocks.size(); i++) {
+            ncnn::fastFree(used_blocks[i].second);
+        }
+    }
+
+    virtual void* fastMalloc(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // smallest free block that fits without wasting more than half of it
+        size_t best = free_blocks.size();
+        for (size_t i = 0; i < free_blocks.size(); i++) {
+            const size_t block = free_blocks[i].first;
+            if (block >= size && block / 2 <= size && (best == free_blocks.size() || block < free_blocks[best].first)) {
+                best = i;
+            }
+        }
+        std::pair<size_t, void*> b;
+        if (best < free_blocks.size()) {
+            b = free_blocks[best];
+            free_blocks[best] = free_blocks.back();
+            free_blocks.pop_back();
+        } else {
+            b = std::make_pair(size, ncnn::fastMalloc(size));
+            if (!b.second) return 0;
+            count++;
+        }
+        used_blocks.push_back(b);
+        return b.second;
+    }
+
+    virtual void fastFree(void* ptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < used_blocks.size(); i++) {
+            if (used_blocks[i].second == ptr) {
+                free_blocks.push_back(used_blocks[i]);
+                used_blocks[i] = used_blocks.back();
+                used_blocks.pop_back();
+                return;
+            }
+        }
+    }
+
+    std::atomic<size_t> count;
+
+private:
+    std::mutex mutex;
+    std::vector<std::pair<size_t, void*> > free_blocks;
+    std::vector<std::pair<size_t, void*> > used_blocks;
+};
+
+// The model compiled once at load, every weight a layer reads resolved to its
+// tensor or fp32 vector, and the activations of a step in buffers kept from
+// step to step, grown only when a step has more rows than any before it
+// a step that fits looks up no names and allocates nothing
+struct LLMEngine::ExecutionPlan {
+    struct Layer {
+        LayerNorm attn_norm;
+        QuantLinear q, k, v, o;
+        LayerNorm ffn_norm;
+        QuantLinear gate, up, down;
+    };
+
+    const gguf_tensor* embed;
+    std::vector<Layer> layers;
+    LayerNorm final_norm;
+    QuantLinear lm_head;
+    RoPEModule rope;
+    FlashAttention attention;
+
+    // declared before the buffers so it outlives them
+    CountingAllocator allocator;
+
+    int rows;       // rows every activation buffer holds
+    int logit_rows;
+    Mat x;          // residual stream
+    Mat norm;       // normalized x, input of the projections
+    Mat q, k, v;
+    Mat attn;       // attention output
+    Mat proj;       // o_proj and down_proj output, gathered last rows
+    Mat gate, up;
+    Mat logits;
+    Mat workspace;  // dequantized weight rows or panel of the projection running
+    Mat attn_scratch;
+    std::vector<int> row_segment;
+    std::vector<FlashAttention::Segment> segments;
+    std::vector<BatchSpan> single_span; // the one span of forward()
+    int prefetched; // layers, then lm_head, whose weights were advised
+
+    ExecutionPlan() : embed(0), rows(0), logit_rows(0), prefetched(0) {}
+
+    // first n_rows rows of an activation buffer, a view create() leaves alone
+    static Mat head(const Mat& buffer, int n_rows) { return Mat(buffer.w, n_rows, buffer.data); }
+
+    bool reserve(int n_rows, int n_logit_rows, int num_threads);
+    void prefetch(const GGUFLoader& loader, int l);
+};
+
+// Asks the kernel to read the mapped weights of layer l, or of lm_head past
+// the last layer, ahead of their first use
+void LLMEngine::ExecutionPlan::prefetch(const GGUFLoader& loader, int l)
+{
+    if (l < (int)layers.size()) {
+        const Layer& layer = layers[l];
+        const QuantLinear* linears[] = {&layer.q, &layer.k, &layer.v, &layer.o, &layer.gate, &layer.up, &layer.down};
+        for (size_t i = 0; i < sizeof(linears) / sizeof(linears[0]); i++) {
+            // repacked tiles are read in place of the weight
+            if (!linears[i]->tiles) loader.prefetch(*linears[i]->weight);
+        }
+    } else {
+        loader.prefetch(*lm_head.weight);
+    }
+    prefetched = l + 1;
+}
+
+bool LLMEngine::ExecutionPlan::reserve(int n_rows, int n_logit_rows, int num_threads)
+{
+    const Layer& l0 = layers[0];
+    if (n_rows > rows) {
+        x.create((int)l0.q.weight->ne[0], n_rows, 4u, &allocator);
+        norm.create(x.w, n_rows, 4u, &allocator);
+        q.create((int)l0.q.weight->ne[1], n_rows, 4u, &allocator);
+        k.create((int)l0.k.weight->ne[1], n_rows, 4u, &allocator);
+        v.create((int)l0.v.weight->ne[1], n_rows, 4u, &allocator);
+        attn.create(q.w, n_rows, 4u, &allocator);
+        proj.create(x.w, n_rows, 4u, &allocator);
+        gate.create((int)l0.gate.weight->ne[1], n_rows, 4u, &allocator);
+        up.create(gate.w, n_rows, 4u, &allocator);
+        if (x.empty() || norm.empty() || q.empty() || k.empty() || v.empty() || attn.empty()
+                || proj.empty() || gate.empty() || up.empty()) {
+            rows = 0;
+            return false;
+        }
+        row_segment.reserve(n_rows);
+        segments.reserve(n_rows);
+        rows = n_rows;
+    }
+    if (n_logit_rows > logit_rows) {
+        logits.create((int)lm_head.weight->ne[1], n_logit_rows, 4u, &allocator);
+        if (logits.empty()) {
+            logit_rows = 0;
+            return false;
+        }
+        logit_rows = n_logit_rows;
+    }
+
+    // build_plan made every layer the shape of the first, but mixed
+    // quantizations give layers different weight types and so workspaces
+    size_t need = lm_head.workspace_size(n_logit_rows, num_threads);
+    for (size_t l = 0; l < layers.size(); l++) {
+        const Layer& layer = layers[l];
+        const QuantLinear* linears[] = {&layer.q, &layer.k, &layer.v, &layer.o, &layer.gate, &layer.up, &layer.down};
+        for (size_t i = 0; i < sizeof(linears) / sizeof(linears[0]); i++) {
+            need = std::max(need, linears[i]->workspace_size(n_rows, num_threads));
+        }
+    }
+    if (need > (size_t)workspace.w) {
+        workspace.create((int)need, 4u, &allocator);
+        if (workspace.empty()) return false;
+    }
+    return true;
+}
+
 LLMEngine::LLMEngine()
-    : n_layers(0), n_head(0), n_kv_head(0), hidden_size(0), vocab_size(0), max_seq_len(0)
+    : n_layers(0), n_head(0), n_kv_head(0), hidden_size(0), vocab_size(0), max_seq_len(0), sliding_window(0), lookup_ngram(0), draft_tokens(4), prefill_chunk(0), context_shift(false), sink_tokens(0), prefill_threads(1), decode_threads(1), pin_threads(false), phase(-1), gemm(0), q8_activations(true), repack_weights(false)
 {
 }
 
 LLMEngine::~LLMEngine()
 {
+    if (gemm) {
+        gemm->destroy_pipeline(opt);
+        delete gemm;
+    }
 }
 
-bool LLMEngine::load_model(const std::string& model_path)
+bool LLMEngine::load_model(const std::string& model_path, const EngineConfig& config)
 {
-    if (!loader.load(model_path.c_str())) {
+    GGUFLoadOption load_opt;
+    load_opt.use_mmap = config.use_mmap;
+    load_opt.populate = config.mmap_populate;
+    load_opt.index_cache = config.index_cache;
+    if (!loader.load(model_path.c_str(), load_opt)) {
         return false;
     }
 
-    if (!tokenizer.load_from_gguf(loader.get_kv_strings(), loader.get_kv_string_arrays())) {
+    if (!tokenizer.load_from_gguf(loader)) {
         return false;
     }
 
@@ -115,109 +618,908 @@ bool LLMEngine::load_model(const std::string& model_path)
         return false;
     }
 
-    // Initialize KV cache
-    key_cache.resize(n_layers);
-    value_cache.resize(n_layers);
+    // release every page before the pool is laid out for this model
+    kv_cache.clear();
+    prefix_cache.clear();
+    ggml_type kv_type = config.kv_cache_type;
+    if (kv_type != GGML_TYPE_F32 && kv_type != GGML_TYPE_F16 && kv_type != GGML_TYPE_BF16
+            && kv_type != GGML_TYPE_Q8_0 && kv_type != GGML_TYPE_Q4_0) {
+        fprintf(stderr, "unsupported kv cache type %d, using f32\n", kv_type);
+        kv_type = GGML_TYPE_F32;
+    }
+    if ((kv_type == GGML_TYPE_Q8_0 || kv_type == GGML_TYPE_Q4_0) && (hidden_size / n_head) % 32 != 0) {
+        // quantized blocks must not straddle two heads
+        fprintf(stderr, "head size %d is not a multiple of 32, kv cache uses f16\n", hidden_size / n_head);
+        kv_type = GGML_TYPE_F16;
+    }
+    kv_pool.init(n_layers, hidden_size / n_head * n_kv_head, kv_type);
+    prefix_cache.set_pool(&kv_pool);
+    prefix_cache.set_budget(config.prefix_cache_size);
+
+    opt = Option();
+    if (config.num_threads > 0) {
+        opt.num_threads = config.num_threads;
+    }
+    // buffers indexed by thread are sized for the larger of the two counts
+    pin_threads = config.pin_threads;
+    set_threads(config.prefill_threads > 0 ? config.prefill_threads : opt.num_threads,
+                config.decode_threads > 0 ? config.decode_threads : opt.num_threads);
+    // keep activations in fp32, the engine feeds plain row-major mats
+    opt.use_vulkan_compute = false;
+    opt.use_fp16_storage = false;
+    opt.use_fp16_arithmetic = false;
+    opt.use_bf16_storage = false;
+
+    if (!gemm) {
+        // C = A * B^T + bias with A the activations and B a weight panel
+        gemm = create_layer_cpu(LayerType::Gemm);
+        ParamDict pd;
+        pd.set(0, 1.f);  // alpha
+        pd.set(1, 1.f);  // beta
+        pd.set(2, 0);    // transA
+        pd.set(3, 1);    // transB
+        pd.set(12, 1);   // output_elempack
+        gemm->load_param(pd);
+        gemm->create_pipeline(opt);
+    }
+
+    q8_activations = config.q8_activations;
+    repack_weights = config.repack_weights;
+    plan.reset();
+    repack_cache.clear();
+    if (!build_plan(model_path)) {
+        return false;
+    }
+    if (config.decode_threads < 0) {
+        set_threads(prefill_threads, probe_decode_threads(model_path));
+    }
+
+    draft.reset();
+    lookup_ngram = std::max(0, config.lookup_ngram);
+    draft_tokens = std::max(1, config.draft_tokens);
+    prefill_chunk = std::max(0, config.prefill_chunk);
+    context_shift = config.context_shift;
+    sink_tokens = std::max(0, config.sink_tokens);
+    reset_speculative_stats();
+    if (!config.draft_model.empty()) {
+        EngineConfig draft_config = config;
+        draft_config.draft_model.clear();
+        draft_config.prefix_cache_size = 0;
+        // the draft runs on the threads this engine pinned for the step
+        draft_config.prefill_threads = prefill_threads;
+        draft_config.decode_threads = decode_threads;
+        draft_config.pin_threads = false;
+        std::unique_ptr<LLMEngine> d(new LLMEngine);
+        if (!d->load_model(config.draft_model, draft_config)) {
+            fprintf(stderr, "Failed to load draft model %s\n", config.draft_model.c_str());
+            return false;
+        }
+        // drafted token ids are handed to this model as they are
+        if (d->vocab_size != vocab_size || d->tokenizer.bos_token() != tokenizer.bos_token()
+                || d->tokenizer.eos_token() != tokenizer.eos_token()) {
+            fprintf(stderr, "draft model %s does not share the tokenizer\n", config.draft_model.c_str());
+            return false;
+        }
+        draft = std::move(d);
+    }
 
     return true;
 }
 
 bool LLMEngine::load_weights()
 {
-    for (auto& p : loader.get_tensor_map()) {
-        weights[p.first] = dequant_gguf_tensor(p.second, loader.get_file_data());
+    // matrices stay in their GGUF block format inside the mapping and are
+    // read through quant_weight(), only small tensors such as norms and biases
+    // are dequantized to fp32 by weight() while the plan is built, so the
+    // matrix pages of a layer are not touched until that layer first runs
+    weights.clear();
+    return !loader.get_tensor_map().empty();
+}
+
+const gguf_tensor* LLMEngine::quant_weight(const std::string& name) const
+{
+    return loader.get_tensor(name);
+}
+
+Mat LLMEngine::weight(const std::string& name)
+{
+    auto it = weights.find(name);
+    if (it != weights.end()) {
+        return it->second;
+    }
+
+    const gguf_tensor* t = loader.get_tensor(name);
+    if (!t) {
+        return Mat();
+    }
+
+    Mat m = dequant_gguf_tensor(*t, loader.get_file_data());
+    weights[name] = m;
+    return m;
+}
+
+// Resolves the weights of every layer and sizes the attention scratch, the
+// activation buffers follow the first step
+bool LLMEngine::build_plan(const std::string& model_path)
+{
+    std::string prefix;
+    std::string attn_prefix;
+    std::string embed_name;
+    std::string final_norm_name;
+    if (architecture == "gpt2") {
+        prefix = "transformer.h.";
+        attn_prefix = ".attn";
+        embed_name = "transformer.wte";
+        final_norm_name = "transformer.ln_f";
+    } else if (architecture == "llama" || architecture == "mistral" || architecture == "qwen2") {
+        prefix = "model.layers.";
+        attn_prefix = ".self_attn";
+        embed_name = "model.embed_tokens";
+        final_norm_name = "model.norm";
+    } else {
+        prefix = "phi3.layers.";
+        attn_prefix = ".self_attn";
+        embed_name = "phi3.embed_tokens";
+        final_norm_name = "phi3.norm";
+    }
+
+    bool missing = false;
+    std::vector<QuantLinear*> tiled;
+    auto matrix = [&](const std::string& name) {
+        const gguf_tensor* t = quant_weight(name);
+        if (!t) {
+            fprintf(stderr, "missing tensor %s\n", name.c_str());
+            missing = true;
+        }
+        return t;
+    };
+    auto linear = [&](QuantLinear& ip, const std::string& name) {
+        ip.gemm = gemm;
+        ip.weight = matrix(name + ".weight");
+        ip.bias_data = weight(name + ".bias");
+        ip.q8 = q8_activations && ip.weight && vec_dot_q8_supported(ip.weight->type);
+        if (ip.q8 && repack_weights && q8_tile_supported(ip.weight->type) && ip.weight->ne[1] >= q8_tile_rows) {
+            tiled.push_back(&ip);
+        }
+    };
+    auto layer_norm = [&](LayerNorm& norm, const std::string& name) {
+        norm.affine = true;
+        norm.eps = 1e-5f;
+        norm.weight_data = weight(name + ".weight");
+        norm.bias_data = weight(name + ".bias");
+    };
+
+    std::unique_ptr<ExecutionPlan> p(new ExecutionPlan);
+    p->embed = matrix(embed_name);
+    p->layers.resize(n_layers);
+    for (int l = 0; l < n_layers; l++) {
+        ExecutionPlan::Layer& layer = p->layers[l];
+        const std::string layer_prefix = prefix + std::to_string(l);
+        const std::string attn = layer_prefix + attn_prefix;
+        layer_norm(layer.attn_norm, layer_prefix + ".input_layernorm");
+        linear(layer.q, attn + ".q_proj");
+        linear(layer.k, attn + ".k_proj");
+        linear(layer.v, attn + ".v_proj");
+        linear(layer.o, attn + ".o_proj");
+        layer_norm(layer.ffn_norm, layer_prefix + ".post_attention_layernorm");
+        linear(layer.gate, layer_prefix + ".mlp.gate_proj");
+        linear(layer.up, layer_prefix + ".mlp.up_proj");
+        linear(layer.down, layer_prefix + ".mlp.down_proj");
+    }
+    layer_norm(p->final_norm, final_norm_name);
+    linear(p->lm_head, "lm_head");
+    if (missing) {
+        return false;
+    }
+
+    // the activation buffers are sized once from the first layer and shared
+    // by all of them
+    const char* linear_names[] = {"q_proj", "k_proj", "v_proj", "o_proj", "gate_proj", "up_proj", "down_proj"};
+    const ExecutionPlan::Layer& l0 = p->layers[0];
+    const QuantLinear* first[] = {&l0.q, &l0.k, &l0.v, &l0.o, &l0.gate, &l0.up, &l0.down};
+    for (int l = 1; l < n_layers; l++) {
+        const ExecutionPlan::Layer& layer = p->layers[l];
+        const QuantLinear* linears[] = {&layer.q, &layer.k, &layer.v, &layer.o, &layer.gate, &layer.up, &layer.down};
+        for (int i = 0; i < 7; i++) {
+            const gguf_tensor* a = first[i]->weight;
+            const gguf_tensor* b = linears[i]->weight;
+            if (a->ne[0] != b->ne[0] || a->ne[1] != b->ne[1]) {
+                fprintf(stderr, "layer %d %s is %lldx%lld but layer 0 has %lldx%lld, layers of different shapes are not supported\n",
+                        l, linear_names[i], (long long)b->ne[0], (long long)b->ne[1], (long long)a->ne[0], (long long)a->ne[1]);
+                return false;
+            }
+        }
+    }
+
+    // tiles are mapped from <model>.repack when an earlier load wrote them for
+    // this model and isa, otherwise built here and saved for the next load
+    if (!tiled.empty()) {
+        const std::string cache_path = model_path + ".repack";
+        const std::string isa = vec_dot_q8_isa();
+        auto tiles_size = [](const gguf_tensor* t) {
+            return (size_t)(t->ne[1] / q8_tile_rows) * q8_tile_size(t->type, t->ne[0]);
+        };
+        bool cached = repack_cache.open(cache_path.c_str(), model_path.c_str(), loader, isa);
+        for (size_t i = 0; cached && i < tiled.size(); i++) {
+            tiled[i]->tiles = repack_cache.find(tiled[i]->weight->name, tiles_size(tiled[i]->weight));
+            cached = tiled[i]->tiles != 0;
+        }
+        if (!cached) {
+            repack_cache.clear();
+            for (size_t i = 0; i < tiled.size(); i++) {
+                const gguf_tensor* t = tiled[i]->weight;
+                const size_t row_size = ggml_row_size(t->type, t->ne[0]);
+                const size_t tile_size = q8_tile_size(t->type, t->ne[0]);
+                const int n_tiles = (int)(t->ne[1] / q8_tile_rows);
+                char* tiles = repack_cache.add(t->name, tiles_size(t));
+                #pragma omp parallel for num_threads(opt.num_threads)
+                for (int j = 0; j < n_tiles; j++) {
+                    repack_q8_tile(t->type, t->data + (size_t)j * q8_tile_rows * row_size, row_size, tiles + j * tile_size, t->ne[0]);
+                }
+                tiled[i]->tiles = tiles;
+            }
+            if (!repack_cache.save(cache_path.c_str(), model_path.c_str(), loader, isa)) {
+                fprintf(stderr, "could not write %s, tiles are rebuilt on the next load\n", cache_path.c_str());
+            }
+        }
+    }
+
+    const int head_dim = hidden_size / n_head;
+    p->rope.rope_dim = rope.dim;
+    p->rope.neox = rope.neox;
+    p->rope.cos_table = &rope_cos;
+    p->rope.sin_table = &rope_sin;
+    p->attention.n_head = n_head;
+    p->attention.n_kv_head = n_kv_head;
+    p->attention.head_dim = head_dim;
+    p->attention.window = sliding_window;
+    p->attn_scratch.create(head_dim + FlashAttention::kv_tile, opt.num_threads, 4u, &p->allocator);
+    if (p->attn_scratch.empty()) {
+        return false;
     }
+    p->single_span.resize(1);
+
+    plan = std::move(p);
+    // the Gemm layer's temporaries of a prefill come from the counted heap too
+    opt.workspace_allocator = &plan->allocator;
     return true;
 }
 
-bool LLMEngine::detect_architecture()
+size_t LLMEngine::allocation_count() const
 {
-    auto& kv_strings = loader.get_kv_strings();
-    auto& kv_ints = loader.get_kv_ints();
+    return plan ? plan->allocator.count.load() : 0;
+}
 
+bool LLMEngine::detect_architecture()
+{
     // Try to detect architecture from metadata
-    auto arch_it = kv_strings.find("general.architecture");
-    if (arch_it != kv_strings.end()) {
-        architecture = arch_it->second;
-    } else {
+    if (!loader.get_kv_string("general.architecture", architecture)) {
         // Fallback: try common prefixes
-        if (weights.count("phi3.embed_tokens")) {
+        if (loader.get_tensor("phi3.embed_tokens")) {
             architecture = "phi3";
-        } else if (weights.count("model.embed_tokens")) {
+        } else if (loader.get_tensor("model.embed_tokens")) {
             architecture = "llama";
-        } else if (weights.count("transformer.wte")) {
+        } else if (loader.get_tensor("transformer.wte")) {
             architecture = "gpt2";
         } else {
             return false;
         }
     }
 
+    auto kv_int = [this](const std::string& key) {
+        int64_t value = 0;
+        loader.get_kv_int(key, value);
+        return (int)value;
+    };
+
     // Load common parameters
-    if (architecture == "phi3") {
-        n_layers = kv_ints.at("phi3.block_count");
-        n_head = kv_ints.at("phi3.attention.head_count");
-        n_kv_head = kv_ints.at("phi3.attention.head_count_kv");
-        hidden_size = kv_ints.at("phi3.embedding_length");
-        vocab_size = kv_ints.at("phi3.vocab_size");
-    } else if (architecture == "llama") {
-        n_layers = kv_ints.at("llama.block_count");
-        n_head = kv_ints.at("llama.attention.head_count");
-        n_kv_head = kv_ints.at("llama.attention.head_count_kv");
-        hidden_size = kv_ints.at("llama.embedding_length");
-        vocab_size = kv_ints.at("llama.vocab_size");
-    } else if (architecture == "gpt2") {
-        n_layers = kv_ints.at("gpt2.n_layer");
-        n_head = kv_ints.at("gpt2.n_head");
+    if (architecture == "gpt2") {
+        n_layers = kv_int("gpt2.n_layer");
+        n_head = kv_int("gpt2.n_head");
         n_kv_head = n_head; // GPT-2 uses same for KV
-        hidden_size = kv_ints.at("gpt2.n_embd");
-        vocab_size = kv_ints.at("gpt2.vocab_size");
-    } else if (architecture == "mistral") {
-        n_layers = kv_ints.at("mistral.block_count");
-        n_head = kv_ints.at("mistral.attention.head_count");
-        n_kv_head = kv_ints.at("mistral.attention.head_count_kv");
-        hidden_size = kv_ints.at("mistral.embedding_length");
-        vocab_size = kv_ints.at("mistral.vocab_size");
-    } else if (architecture == "qwen2") {
-        n_layers = kv_ints.at("qwen2.block_count");
-        n_head = kv_ints.at("qwen2.attention.head_count");
-        n_kv_head = kv_ints.at("qwen2.attention.head_count_kv");
-        hidden_size = kv_ints.at("qwen2.embedding_length");
-        vocab_size = kv_ints.at("qwen2.vocab_size");
+        hidden_size = kv_int("gpt2.n_embd");
+        vocab_size = kv_int("gpt2.vocab_size");
+    } else if (architecture == "phi3" || architecture == "llama" || architecture == "mistral" || architecture == "qwen2") {
+        n_layers = kv_int(architecture + ".block_count");
+        n_head = kv_int(architecture + ".attention.head_count");
+        n_kv_head = kv_int(architecture + ".attention.head_count_kv");
+        hidden_size = kv_int(architecture + ".embedding_length");
+        vocab_size = kv_int(architecture + ".vocab_size");
     }
 
-    max_seq_len = 2048; // Default, could be loaded from metadata
+    if (n_layers <= 0 || n_head <= 0 || n_kv_head <= 0 || hidden_size <= 0) {
+        fprintf(stderr, "missing %s hyperparameters\n", architecture.c_str());
+        return false;
+    }
+
+    // Mistral style models attend to a window of the last positions only,
+    // their cache holds that window however long the context grows
+    sliding_window = std::max(0, kv_int(architecture + ".attention.sliding_window"));
+    max_seq_len = kv_int(architecture + ".context_length");
+    if (max_seq_len <= 0) {
+        max_seq_len = std::max(2048, sliding_window);
+    }
+    if (sliding_window >= max_seq_len) {
+        // the window covers the whole context
+        sliding_window = 0;
+    }
+
+    load_rope_config();
 
     return true;
 }
 
-std::vector<int> LLMEngine::generate(const std::string& prompt, const GenerationConfig& config)
+void LLMEngine::load_rope_config()
+{
+    const std::string prefix = architecture + ".rope.";
+
+    rope = RoPEConfig();
+    rope_cos.release();
+    rope_sin.release();
+
+    const int head_dim = hidden_size / n_head;
+    rope.dim = head_dim;
+    int64_t dim = 0;
+    if (loader.get_kv_int(prefix + "dimension_count", dim) && dim > 0 && dim <= head_dim) {
+        rope.dim = (int)dim & ~1;
+    }
+
+    float freq_base = 0.f;
+    if (loader.get_kv_float(prefix + "freq_base", freq_base) && freq_base > 0.f) {
+        rope.freq_base = freq_base;
+    }
+
+    // llama.cpp converts llama/mistral q/k weights to interleaved pairs,
+    // the other families keep the split-half layout
+    rope.neox = architecture == "phi3" || architecture == "qwen2" || architecture == "gptneox";
+
+    std::string scaling_type;
+    float factor = 0.f;
+    float linear = 0.f;
+    if (loader.get_kv_string(prefix + "scaling.type", scaling_type)) {
+        if (scaling_type == "linear") rope.scaling_type = RoPEConfig::SCALING_LINEAR;
+        else if (scaling_type == "ntk") rope.scaling_type = RoPEConfig::SCALING_NTK;
+        else if (scaling_type == "yarn") rope.scaling_type = RoPEConfig::SCALING_YARN;
+    } else if (loader.get_kv_float(prefix + "scale_linear", linear)) {
+        // older files only carry the linear factor
+        rope.scaling_type = RoPEConfig::SCALING_LINEAR;
+        rope.scaling_factor = linear;
+    }
+    if (loader.get_kv_float(prefix + "scaling.factor", factor) && factor > 0.f) {
+        rope.scaling_factor = factor;
+    }
+    if (rope.scaling_factor <= 1.f) {
+        rope.scaling_type = RoPEConfig::SCALING_NONE;
+        rope.scaling_factor = 1.f;
+    }
+
+    int64_t original_context = max_seq_len;
+    loader.get_kv_int(prefix + "scaling.original_context_length", original_context);
+    rope.original_context = (int)original_context;
+    float attn_factor = 0.f;
+    if (loader.get_kv_float(prefix + "scaling.attn_factor", attn_factor) && attn_factor > 0.f) {
+        rope.attn_factor = attn_factor;
+    }
+    loader.get_kv_float(prefix + "scaling.yarn_beta_fast", rope.beta_fast);
+    loader.get_kv_float(prefix + "scaling.yarn_beta_slow", rope.beta_slow);
+}
+
+// dims below the first returned index rotate faster than beta_fast turns
+// over the training context and are extrapolated, dims above the second
+// rotate slower than beta_slow and are interpolated (YaRN)
+static void rope_yarn_corr_dims(int n_dims, int n_ctx_orig, float freq_base, float beta_fast, float beta_slow, float dims[2])
+{
+    const float two_pi = 6.28318530718f;
+    float start = floorf(n_dims * logf(n_ctx_orig / (beta_fast * two_pi)) / (2 * logf(freq_base)));
+    float end = ceilf(n_dims * logf(n_ctx_orig / (beta_slow * two_pi)) / (2 * logf(freq_base)));
+    dims[0] = std::max(0.f, start);
+    dims[1] = std::min((float)(n_dims - 1), end);
+}
+
+// n cpus of mask, one per physical core while the mask has enough cores
+static CpuSet pick_cpus(const CpuSet& mask, int n)
+{
+    const CpuSet physical = get_cpu_physical_affinity_mask(mask);
+    const CpuSet& from = physical.num_enabled() >= n ? physical : mask;
+    CpuSet cpus;
+    cpus.disable_all();
+    for (int i = 0; i < get_cpu_count() && cpus.num_enabled() < n; i++) {
+        if (from.is_enabled(i)) {
+            cpus.enable(i);
+        }
+    }
+    return cpus.num_enabled() > 0 ? cpus : mask;
+}
+
+void LLMEngine::set_threads(int prefill, int decode)
+{
+    prefill_threads = std::max(1, prefill);
+    decode_threads = std::max(1, decode);
+    opt.num_threads = std::max(prefill_threads, decode_threads);
+    phase = -1;
+    if (pin_threads) {
+        prefill_cpus = pick_cpus(get_cpu_thread_affinity_mask(0), prefill_threads);
+        decode_cpus = pick_cpus(get_cpu_thread_affinity_mask(2), decode_threads);
+    }
+}
+
+// Threads of the next step: a prompt is compute bound and takes every core it
+// is given, a step of one token per sequence streams the weights once and is
+// often faster on fewer, big cores without their hyperthread siblings
+// affinity is only touched when the kind of step changes
+void LLMEngine::set_phase(int decode)
+{
+    if (decode == phase) {
+        return;
+    }
+    phase = decode;
+    opt.num_threads = decode ? decode_threads : prefill_threads;
+    if (pin_threads && set_cpu_thread_affinity(decode ? decode_cpus : prefill_cpus) != 0) {
+        fprintf(stderr, "could not pin the %s threads\n", decode ? "decode" : "prefill");
+    }
+}
+
+static std::string host_name()
+{
+#ifdef _WIN32
+    const char* name = getenv("COMPUTERNAME");
+    return name ? name : "localhost";
+#else
+    char name[256] = {0};
+    if (gethostname(name, sizeof(name) - 1) != 0) {
+        return "localhost";
+    }
+    return name;
+#endif
+}
+
+// Times single-token steps at 1, 2, 4, ... threads up to the current count
+// and returns the fastest, kept in <model>.threads as "<host> <cpus> <threads>"
+// lines so only the first load on a machine pays for the timing
+int LLMEngine::probe_decode_threads(const std::string& model_path)
+{
+    const std::string path = model_path + ".threads";
+    const std::string key = host_name() + " " + std::to_string(get_cpu_count());
+    const int max_threads = opt.num_threads;
+    if (max_threads <= 1) {
+        return max_threads;
+    }
+
+    std::vector<std::string> lines;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp) {
+        char buf[512];
+        while (fgets(buf, sizeof(buf), fp)) {
+            std::string line(buf);
+            line.erase(line.find_last_not_of("\r\n") + 1);
+            const size_t sep = line.rfind(' ');
+            if (sep == key.size() && line.compare(0, sep, key) == 0) {
+                const int n = atoi(line.c_str() + sep + 1);
+                if (n > 0 && n <= max_threads) {
+                    fclose(fp);
+                    return n;
+                }
+                continue;
+            }
+            if (!line.empty()) {
+                lines.push_back(line);
+            }
+        }
+        fclose(fp);
+    }
+
+    std::vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(max_threads);
+
+    const int n_steps = 8;
+    const std::vector<int> token(1, std::max(0, tokenizer.bos_token()));
+    KVCache cache;
+    int best = decode_threads;
+    double best_seconds = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        set_threads(prefill_threads, counts[i]);
+        cache.clear();
+        // the first step faults in the weights and pins the threads
+        if (forward(token, cache).empty()) {
+            break;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        for (int s = 0; s < n_steps; s++) {
+            forward(token, cache);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (best_seconds == 0 || seconds < best_seconds) {
+            best = counts[i];
+            best_seconds = seconds;
+        }
+    }
+    cache.clear();
+    fprintf(stderr, "decode threads %d\n", best);
+
+    // write aside and rename like the index cache
+    lines.push_back(key + " " + std::to_string(best));
+    const std::string tmp_path = path + ".tmp";
+    fp = fopen(tmp_path.c_str(), "wb");
+    if (fp) {
+        bool ok = true;
+        for (size_t i = 0; i < lines.size(); i++) {
+            ok = fprintf(fp, "%s\n", lines[i].c_str()) > 0 && ok;
+        }
+        ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+        if (ok) remove(path.c_str());
+#endif
+        if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            remove(tmp_path.c_str());
+        }
+    }
+    return best;
+}
+
+bool LLMEngine::update_rope_cache(int n_ctx)
+{
+    if (n_ctx <= rope_cos.h) {
+        return true;
+    }
+
+    int rows = std::max(rope_cos.h, 64);
+    while (rows < n_ctx) rows *= 2;
+    rows = std::min(rows, max_seq_len);
+
+    const int half = rope.dim / 2;
+    const float freq_scale = 1.f / rope.scaling_factor;
+
+    float freq_base = rope.freq_base;
+    if (rope.scaling_type == RoPEConfig::SCALING_NTK) {
+        // NTK-aware: stretch the base so the lowest frequency covers the longer context
+        freq_base *= powf(rope.scaling_factor, rope.dim / (float)(rope.dim - 2));
+    }
+
+    float corr_dims[2] = {0.f, 0.f};
+    float mscale = rope.attn_factor;
+    if (rope.scaling_type == RoPEConfig::SCALING_YARN) {
+        rope_yarn_corr_dims(rope.dim, rope.original_context, freq_base, rope.beta_fast, rope.beta_slow, corr_dims);
+        mscale *= 1.f + 0.1f * logf(1.f / freq_scale);
+    }
+
+    std::vector<float> inv_freq(half);
+    std::vector<float> ramp(half, 0.f);
+    for (int j = 0; j < half; j++) {
+        inv_freq[j] = powf(freq_base, -2.f * j / rope.dim);
+        if (rope.scaling_type == RoPEConfig::SCALING_YARN) {
+            float y = (j - corr_dims[0]) / std::max(0.001f, corr_dims[1] - corr_dims[0]);
+            ramp[j] = 1.f - std::min(1.f, std::max(0.f, y));
+        }
+    }
+
+    Mat cos_table(half, rows);
+    Mat sin_table(half, rows);
+    if (cos_table.empty() || sin_table.empty()) {
+        return false;
+    }
+
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int pos = 0; pos < rows; pos++) {
+        float* c = cos_table.row(pos);
+        float* s = sin_table.row(pos);
+        for (int j = 0; j < half; j++) {
+            float theta_extrap = pos * inv_freq[j];
+            float theta = theta_extrap;
+            if (rope.scaling_type == RoPEConfig::SCALING_LINEAR) {
+                theta = theta_extrap * freq_scale;
+            } else if (rope.scaling_type == RoPEConfig::SCALING_YARN) {
+                float theta_interp = theta_extrap * freq_scale;
+                theta = theta_interp * (1.f - ramp[j]) + theta_extrap * ramp[j];
+            }
+            c[j] = cosf(theta) * mscale;
+            s[j] = sinf(theta) * mscale;
+        }
+    }
+
+    rope_cos = cos_table;
+    rope_sin = sin_table;
+    return true;
+}
+
+// Makes cache able to take positions [n_past, n_ctx), appending pages from
+// the pool and copying any page of that range still shared with another
+// sequence or the prefix cache, rows already written never move
+// a sliding window model first releases the pages no query from n_past on
+// can reach, the pool hands them out again for the positions ahead, so a
+// sequence cycles through about window / block_size + 1 pages
+bool LLMEngine::reserve_kv_cache(KVCache& cache, int n_ctx)
+{
+    if (n_ctx > max_seq_len) {
+        return false;
+    }
+    if (!cache.pool) {
+        cache.pool = &kv_pool;
+    }
+
+    if (sliding_window > 0) {
+        const int n_behind = (cache.n_past - sliding_window + 1) / KVPool::block_size;
+        for (int b = 0; b < n_behind && b < (int)cache.blocks.size(); b++) {
+            if (cache.blocks[b] >= 0) {
+                kv_pool.release(cache.blocks[b]);
+                cache.blocks[b] = -1;
+            }
+        }
+    }
+
+    if (!unshare_pages(cache, cache.n_past / KVPool::block_size, (int)cache.blocks.size())) {
+        return false;
+    }
+
+    const int n_blocks = (n_ctx + KVPool::block_size - 1) / KVPool::block_size;
+    while ((int)cache.blocks.size() < n_blocks) {
+        const int page = kv_pool.alloc();
+        if (page < 0) {
+            return false;
+        }
+        cache.blocks.push_back(page);
+    }
+    return true;
+}
+
+// Gives cache a page of its own for each of blocks [first, last), a shared
+// page is copied and a released one replaced by a blank page
+bool LLMEngine::unshare_pages(KVCache& cache, int first, int last)
+{
+    for (int b = first; b < last; b++) {
+        const int page = cache.blocks[b];
+        if (page >= 0 && kv_pool.refcount(page) == 1) {
+            continue;
+        }
+        const int copy = kv_pool.alloc();
+        if (copy < 0) {
+            return false;
+        }
+        if (page >= 0) {
+            memcpy(kv_pool.key(copy, 0, 0), kv_pool.key(page, 0, 0), kv_pool.page_bytes());
+            kv_pool.release(page);
+        }
+        cache.blocks[b] = copy;
+    }
+    return true;
+}
+
+// StreamingLLM context shift, makes room in a full cache for n_new positions
+// by keeping its first sink_tokens positions, which draw the attention a head
+// gives to nothing in particular, and its most recent ones, at least half of
+// those in between are dropped so shifts stay rare
+// the kept keys are rotated back by the number of positions they move down
+// instead of being recomputed, and history loses the same tokens so
+// history[cache.n_past] stays the next one to run
+// a sliding window model keeps no sink and nothing behind its window
+bool LLMEngine::shift_context(KVCache& cache, std::vector<int>& history, int n_new)
+{
+    const int n_past = cache.n_past;
+    if (!context_shift || !plan || !cache.pool || (int)history.size() < n_past) {
+        return false;
+    }
+
+    const int n_keep = std::min(sliding_window > 0 ? 0 : sink_tokens, n_past);
+    int n_discard = std::max((n_past - n_keep) / 2, n_past + n_new - max_seq_len);
+    if (sliding_window > 0) {
+        n_discard = std::max(n_discard, n_past - sliding_window + 1);
+    }
+    if (n_discard <= 0 || n_keep + n_discard > n_past || n_past - n_discard + n_new > max_seq_len) {
+        return false;
+    }
+    if (!update_rope_cache(n_discard + 1)) {
+        return false;
+    }
+
+    // only the pages the kept positions move into are written
+    const int n_moved = n_past - n_keep - n_discard;
+    if (n_moved > 0 && !unshare_pages(cache, n_keep / KVPool::block_size, (n_keep + n_moved - 1) / KVPool::block_size + 1)) {
+        return false;
+    }
+
+    const ggml_type kv_type = kv_pool.row_type();
+    const int head_dim = hidden_size / n_head;
+    const int kv_dim = head_dim * n_kv_head;
+    const size_t row_size = ggml_row_size(kv_type, kv_dim);
+    const RoPEModule& rope_module = plan->rope;
+
+    // positions move down in order, a row is read before anything lands on it
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int l = 0; l < n_layers; l++) {
+        std::vector<float> k_row(kv_dim);
+        for (int i = 0; i < n_moved; i++) {
+            const int src = n_keep + n_discard + i;
+            const int dst = n_keep + i;
+            dequantize_row(kv_type, cache.key(l, src), k_row.data(), kv_dim);
+            rope_module.rotate_back(k_row.data(), n_kv_head, head_dim, n_discard);
+            quantize_row(kv_type, k_row.data(), cache.key(l, dst), kv_dim);
+            memcpy(cache.value(l, dst), cache.value(l, src), row_size);
+        }
+    }
+
+    cache.truncate(n_keep + n_moved);
+    cache.n_dropped += n_discard;
+    history.erase(history.begin() + n_keep, history.begin() + n_keep + n_discard);
+    return true;
+}
+
+// Points cache at the pages of the longest stored prefix of tokens and
+// returns its length, the last token is always left to run so its logits
+// are available
+int LLMEngine::restore_prefix(const std::vector<int>& tokens, KVCache& cache)
+{
+    const int n = (int)tokens.size() - 1;
+    if (prefix_cache.budget() == 0 || n <= 0 || cache.n_past != 0) {
+        return 0;
+    }
+    cache.clear();
+    return prefix_cache.lookup(tokens.data(), n, cache);
+}
+
+// Stores the K/V of the first cache.n_past tokens for later requests, a
+// shifted cache or one missing its first pages holds nothing to reuse
+void LLMEngine::save_prefix(const std::vector<int>& tokens, const KVCache& cache)
+{
+    const int n = std::min((int)tokens.size(), cache.n_past);
+    if (prefix_cache.budget() > 0 && n > 0 && cache.n_dropped == 0 && cache.blocks[0] >= 0) {
+        prefix_cache.insert(tokens.data(), n, cache);
+    }
+}
+
+// Compiles the grammar or JSON schema of a request, grammar stays empty for
+// unconstrained requests
+bool LLMEngine::compile_grammar(const GenerationConfig& config, Grammar& grammar) const
+{
+    std::string error;
+    if (!config.grammar.empty()) {
+        if (!grammar.parse(config.grammar, &error)) {
+            fprintf(stderr, "invalid grammar: %s\n", error.c_str());
+            return false;
+        }
+    } else if (!config.json_schema.empty()) {
+        if (!grammar.parse_json_schema(config.json_schema, &error)) {
+            fprintf(stderr, "invalid json schema: %s\n", error.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+const TokenTrie& LLMEngine::token_trie()
+{
+    std::lock_guard<std::mutex> lock(trie_mutex);
+    if (trie.empty()) {
+        trie.build(tokenizer, vocab_size);
+    }
+    return trie;
+}
+
+std::vector<int> LLMEngine::generate(const std::string& prompt, const GenerationConfig& config, const TokenCallback& on_token)
 {
     std::vector<int> tokens = tokenizer.encode(prompt);
-    if (tokenizer.bos_token() >= 0) {
+    if (tokenizer.add_bos_token() && tokenizer.bos_token() >= 0) {
         tokens.insert(tokens.begin(), tokenizer.bos_token());
     }
 
     std::vector<int> generated;
     std::vector<int> history = tokens;
+    StreamDecoder decoder(tokenizer);
 
-    for (int i = 0; i < config.max_tokens; ++i) {
-        Mat logits = forward(history);
+    // a grammar masks every token it does not allow before sampling
+    Grammar grammar;
+    GrammarState grammar_state;
+    if (!compile_grammar(config, grammar)) {
+        return generated;
+    }
+    const TokenTrie* grammar_trie = 0;
+    if (!grammar.empty()) {
+        grammar_trie = &token_trie();
+        grammar_state.init(&grammar, tokenizer.add_space_prefix_token());
+    }
 
-        float* last_logits = logits.row(logits.h - 1);
-        int next_token = sample_token(last_logits, config, history);
+    // prefill the prompt once, minus any prefix an earlier request already
+    // ran, then feed back one token per step
+    kv_cache.clear();
+    const int reused = restore_prefix(tokens, kv_cache);
+    std::vector<int> pending(tokens.begin() + reused, tokens.end());
 
-        generated.push_back(next_token);
-        history.push_back(next_token);
+    // with a draft model or prompt lookup every step after the prompt may
+    // yield several tokens, the lookup index starts out over the prompt
+    KVCache draft_cache;
+    NgramIndex lookup(lookup_ngram);
+    Sampler sampler;
+    sampler.init(vocab_size, config.seed);
+    if (lookup_ngram > 0) {
+        lookup.update(tokens);
+    }
 
-        // Check stop conditions
-        if (std::find(config.stop_tokens.begin(), config.stop_tokens.end(), next_token) != config.stop_tokens.end()) {
-            break;
+    std::vector<int> chunk;
+    bool stop = false;
+    while (!stop && (int)generated.size() < config.max_tokens) {
+        // a long prompt runs prefill_chunk tokens per step so the activations
+        // of a step stay bounded, only its last chunk is sampled
+        const bool chunked = prefill_chunk > 0 && (int)pending.size() > prefill_chunk;
+        const int n_step = chunked ? prefill_chunk : (int)pending.size();
+        if (kv_cache.n_past + n_step > max_seq_len) {
+            if (!shift_context(kv_cache, history, n_step)) {
+                break;
+            }
+            // the draft catches up with the shifted history from scratch
+            draft_cache.clear();
+            lookup.clear();
         }
-        if (tokenizer.eos_token() >= 0 && next_token == tokenizer.eos_token()) {
-            break;
+
+        if (chunked) {
+            chunk.assign(pending.begin(), pending.begin() + prefill_chunk);
+            if (forward(chunk, kv_cache).empty()) {
+                break;
+            }
+            pending.erase(pending.begin(), pending.begin() + prefill_chunk);
+            continue;
+        }
+
+        // proposals are not checked against a grammar, constrained requests
+        // decode one token at a time
+        std::vector<int> next_tokens;
+        if (can_speculate() && !generated.empty() && !grammar_state.active()) {
+            next_tokens = speculate(history, kv_cache, draft_cache, lookup, sampler, config, config.max_tokens - (int)generated.size());
+            if (next_tokens.empty()) {
+                break;
+            }
+        } else {
+            Mat logits = forward(pending, kv_cache);
+            if (logits.empty()) {
+                break;
+            }
+            if (generated.empty()) {
+                save_prefix(tokens, kv_cache);
+            }
+            const std::vector<int>* allowed = 0;
+            if (grammar_state.active()) {
+                allowed = &grammar_state.allowed_tokens(*grammar_trie, tokenizer.eos_token());
+                if (allowed->empty()) {
+                    break;
+                }
+            }
+            next_tokens.assign(1, sampler.sample(logits, config, history, allowed));
+        }
+
+        for (size_t j = 0; j < next_tokens.size() && !stop; j++) {
+            const int next_token = next_tokens[j];
+
+            generated.push_back(next_token);
+            history.push_back(next_token);
+            pending.assign(1, next_token);
+            if (grammar_state.active()) {
+                grammar_state.accept(grammar_trie->piece(next_token));
+            }
+
+            if (on_token && !on_token(next_token, decoder.push(next_token))) {
+                stop = true;
+            }
+
+            // Check stop conditions
+            if (std::find(config.stop_tokens.begin(), config.stop_tokens.end(), next_token) != config.stop_tokens.end()) {
+                stop = true;
+            }
+            if (tokenizer.eos_token() >= 0 && next_token == tokenizer.eos_token()) {
+                stop = true;
+            }
+        }
+    }
+
+    if (on_token) {
+        std::string rest = decoder.flush();
+        if (!rest.empty()) {
+            on_token(-1, rest);
         }
     }
 
+    // the reply is usually part of the next prompt of the conversation
+    save_prefix(history, kv_cache);
+
     return generated;
 }
 
@@ -227,394 +1529,389 @@ std::string LLMEngine::generate_text(const std::string& prompt, const Generation
     return tokenizer.decode(tokens);
 }
 
-Mat LLMEngine::forward(const std::vector<int>& tokens)
+float LLMEngine::perplexity(const std::string& text, int n_ctx)
+{
+    std::vector<int> tokens = tokenizer.encode(text);
+    if (n_ctx <= 0 || n_ctx > max_seq_len) {
+        n_ctx = max_seq_len;
+    }
+    const bool add_bos = tokenizer.add_bos_token() && tokenizer.bos_token() >= 0;
+    // every window starts with bos when the model expects one
+    const int stride = add_bos ? n_ctx - 1 : n_ctx;
+    if (stride < 2) {
+        return -1.f;
+    }
+
+    double nll = 0;
+    int count = 0;
+    for (size_t begin = 0; begin + 1 < tokens.size(); begin += stride) {
+        std::vector<int> window;
+        if (add_bos) {
+            window.push_back(tokenizer.bos_token());
+        }
+        const size_t end = std::min(tokens.size(), begin + stride);
+        window.insert(window.end(), tokens.begin() + begin, tokens.begin() + end);
+
+        KVCache cache;
+        Mat logits = forward(window, cache, true);
+        if (logits.empty()) {
+            return -1.f;
+        }
+
+        // row i predicts token i + 1, the first token of a window without bos
+        // has nothing to be predicted from
+        for (int i = 0; i + 1 < (int)window.size(); i++) {
+            const float* row = logits.row(i);
+            float max_logit = row[0];
+            for (int j = 1; j < vocab_size; j++) max_logit = std::max(max_logit, row[j]);
+            double sum = 0;
+            for (int j = 0; j < vocab_size; j++) sum += exp(row[j] - max_logit);
+            nll += log(sum) + max_logit - row[window[i + 1]];
+            count++;
+        }
+    }
+
+    return count > 0 ? (float)exp(nll / count) : -1.f;
+}
+
+// Runs tokens at positions [cache.n_past, cache.n_past + tokens.size())
+// appending their keys and values to cache, returns the logits of every
+// token when logits_all is set and of the last one otherwise
+Mat LLMEngine::forward(const std::vector<int>& tokens, KVCache& cache, bool logits_all)
+{
+    std::vector<BatchSpan>& spans = plan->single_span;
+    spans[0].cache = &cache;
+    spans[0].row = 0;
+    spans[0].n_tokens = (int)tokens.size();
+    return forward_batch(tokens, spans, logits_all);
+}
+
+// Runs the tokens of several sequences as one step, every projection sees
+// all rows at once and only attention looks at each span's own cache
+// without logits_all the result has one row per span, its last token
+Mat LLMEngine::forward_batch(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all)
 {
+    if (tokens.empty() || spans.empty()) {
+        return Mat();
+    }
+
+    int n_ctx = 0;
+    for (size_t i = 0; i < spans.size(); i++) {
+        const BatchSpan& span = spans[i];
+        const int n = span.cache->n_past + span.n_tokens;
+        if (span.n_tokens <= 0 || span.row + span.n_tokens > (int)tokens.size() || !reserve_kv_cache(*span.cache, n)) {
+            return Mat();
+        }
+        n_ctx = std::max(n_ctx, n);
+    }
+    if (!update_rope_cache(n_ctx)) {
+        return Mat();
+    }
+    set_phase(tokens.size() == spans.size());
+
     if (architecture == "phi3") {
-        return forward_phi3(tokens);
+        return forward_phi3(tokens, spans, logits_all);
     } else if (architecture == "llama") {
-        return forward_llama(tokens);
+        return forward_llama(tokens, spans, logits_all);
     } else if (architecture == "gpt2") {
-        return forward_gpt2(tokens);
+        return forward_gpt2(tokens, spans, logits_all);
     } else if (architecture == "mistral") {
-        return forward_mistral(tokens);
+        return forward_mistral(tokens, spans, logits_all);
     } else if (architecture == "qwen2") {
-        return forward_qwen(tokens);
+        return forward_qwen(tokens, spans, logits_all);
     } else {
         // Fallback
-        return forward_phi3(tokens);
+        return forward_phi3(tokens, spans, logits_all);
     }
 }
 
-Mat LLMEngine::forward_phi3(const std::vector<int>& tokens)
+Mat LLMEngine::forward_phi3(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all)
 {
-    Option opt;
-    opt.use_vulkan_compute = true;
+    ExecutionPlan& p = *plan;
+    const int n = (int)tokens.size();
+    const int n_logits = logits_all ? n : (int)spans.size();
+    if (!p.reserve(n, n_logits, opt.num_threads)) {
+        return Mat();
+    }
 
-    // Determine embedding prefix
-    std::string embed_prefix = architecture == "phi3" ? "phi3.embed_tokens" :
-                              architecture == "llama" ? "model.embed_tokens" :
-                              architecture == "gpt2" ? "transformer.wte" :
-                              architecture == "mistral" ? "model.embed_tokens" :
-                              architecture == "qwen2" ? "model.embed_tokens" :
-                              "phi3.embed_tokens";
+    const gguf_tensor* embed = p.embed;
+    size_t embed_row_size = ggml_row_size(embed->type, hidden_size);
 
-    Mat x(hidden_size, tokens.size());
-    for (size_t i = 0; i < tokens.size(); i++) {
-        memcpy(x.row(i), weights[embed_prefix].row(tokens[i]), hidden_size * sizeof(float));
+    // a cold mapping faults its weights in page by page on the first steps,
+    // from here on each layer asks for the next one's while it computes
+    if (p.prefetched == 0) {
+        p.prefetch(loader, 0);
+    }
+
+    Mat x = ExecutionPlan::head(p.x, n);
+    for (int i = 0; i < n; i++) {
+        dequantize_row(embed->type, embed->data + tokens[i] * embed_row_size, x.row(i), hidden_size);
+    }
+
+    // the sequence of every row, shared by all layers
+    p.segments.resize(spans.size());
+    p.row_segment.resize(n);
+    for (size_t i = 0; i < spans.size(); i++) {
+        FlashAttention::Segment& seg = p.segments[i];
+        seg.cache = spans[i].cache;
+        seg.row = spans[i].row;
+        seg.n_rows = spans[i].n_tokens;
+        seg.start_pos = spans[i].cache->n_past;
+        for (int r = 0; r < seg.n_rows; r++) {
+            p.row_segment[seg.row + r] = (int)i;
+        }
     }
 
     for (int l = 0; l < n_layers; l++) {
-        x = forward_layer(l, x, 0);
+        if (p.prefetched <= l + 1) {
+            p.prefetch(loader, l + 1);
+        }
+        forward_layer(l, x, spans);
+    }
+    for (size_t i = 0; i < spans.size(); i++) {
+        spans[i].cache->n_past += spans[i].n_tokens;
+    }
+
+    // only the last position of each sequence is needed to pick its next token
+    if (!logits_all && x.h > (int)spans.size()) {
+        Mat last = ExecutionPlan::head(p.proj, (int)spans.size());
+        for (size_t i = 0; i < spans.size(); i++) {
+            memcpy(last.row(i), x.row(spans[i].row + spans[i].n_tokens - 1), hidden_size * sizeof(float));
+        }
+        x = last;
     }
 
     // Final layer norm
-    LayerNorm final_norm;
-    final_norm.affine = true;
-    final_norm.eps = 1e-5f;
-    std::string final_norm_prefix = architecture == "phi3" ? "phi3.norm" :
-                                   architecture == "llama" ? "model.norm" :
-                                   architecture == "gpt2" ? "transformer.ln_f" :
-                                   architecture == "mistral" ? "model.norm" :
-                                   architecture == "qwen2" ? "model.norm" :
-                                   "phi3.norm";
-    final_norm.weight_data = weights[final_norm_prefix + ".weight"];
-    auto final_bias_it = weights.find(final_norm_prefix + ".bias");
-    if (final_bias_it != weights.end()) {
-        final_norm.bias_data = final_bias_it->second;
-    }
-    Mat norm_x;
-    final_norm.forward(x, norm_x, opt);
+    Mat norm_x = ExecutionPlan::head(p.norm, x.h);
+    p.final_norm.forward(x, norm_x, opt);
 
     // Language model head
-    InnerProduct lm_head;
-    lm_head.weight_data = weights["lm_head.weight"];
-    final_bias_it = weights.find("lm_head.bias");
-    if (final_bias_it != weights.end()) {
-        lm_head.bias_data = final_bias_it->second;
-    }
-    Mat logits(vocab_size, tokens.size());
-    lm_head.forward(norm_x, logits, opt);
+    Mat logits = ExecutionPlan::head(p.logits, x.h);
+    p.lm_head.forward(norm_x, logits, p.workspace, opt);
 
     return logits;
 }
 
-Mat LLMEngine::forward_layer(int layer_idx, const Mat& x, int start_pos)
+// Runs one layer over the rows of x in place
+void LLMEngine::forward_layer(int layer_idx, Mat& x, const std::vector<BatchSpan>& spans)
 {
-    Option opt;
-    opt.use_vulkan_compute = true;
-
-    // Determine weight prefix based on architecture
-    std::string prefix;
-    std::string attn_prefix;
-    if (architecture == "phi3") {
-        prefix = "phi3.layers." + std::to_string(layer_idx);
-        attn_prefix = prefix + ".self_attn";
-    } else if (architecture == "llama") {
-        prefix = "model.layers." + std::to_string(layer_idx);
-        attn_prefix = prefix + ".self_attn";
-    } else if (architecture == "gpt2") {
-        prefix = "transformer.h." + std::to_string(layer_idx);
-        attn_prefix = prefix + ".attn";
-    } else if (architecture == "mistral") {
-        prefix = "model.layers." + std::to_string(layer_idx);
-        attn_prefix = prefix + ".self_attn";
-    } else if (architecture == "qwen2") {
-        prefix = "model.layers." + std::to_string(layer_idx);
-        attn_prefix = prefix + ".self_attn";
-    } else {
-        prefix = "phi3.layers." + std::to_string(layer_idx);
-        attn_prefix = prefix + ".self_attn";
-    }
+    ExecutionPlan& p = *plan;
+    const ExecutionPlan::Layer& layer = p.layers[layer_idx];
+    const int n = x.h;
 
     // Input layer norm
-    LayerNorm norm;
-    norm.affine = true;
-    norm.eps = 1e-5f;
-    norm.weight_data = weights[prefix + ".input_layernorm.weight"];
-    auto bias_it = weights.find(prefix + ".input_layernorm.bias");
-    if (bias_it != weights.end()) {
-        norm.bias_data = bias_it->second;
-    }
-    Mat norm_out;
-    norm.forward(x, norm_out, opt);
+    Mat norm_out = ExecutionPlan::head(p.norm, n);
+    layer.attn_norm.forward(x, norm_out, opt);
 
     // Attention mechanism
     // Project Q, K, V
-    InnerProduct ip_q;
-    ip_q.weight_data = weights[attn_prefix + ".q_proj.weight"];
-    bias_it = weights.find(attn_prefix + ".q_proj.bias");
-    if (bias_it != weights.end()) {
-        ip_q.bias_data = bias_it->second;
-    }
-    Mat q;
-    ip_q.forward(norm_out, q, opt);
-
-    InnerProduct ip_k;
-    ip_k.weight_data = weights[attn_prefix + ".k_proj.weight"];
-    bias_it = weights.find(attn_prefix + ".k_proj.bias");
-    if (bias_it != weights.end()) {
-        ip_k.bias_data = bias_it->second;
-    }
-    Mat k;
-    ip_k.forward(norm_out, k, opt);
-
-    InnerProduct ip_v;
-    ip_v.weight_data = weights[attn_prefix + ".v_proj.weight"];
-    bias_it = weights.find(attn_prefix + ".v_proj.bias");
-    if (bias_it != weights.end()) {
-        ip_v.bias_data = bias_it->second;
-    }
-    Mat v;
-    ip_v.forward(norm_out, v, opt);
+    Mat q = ExecutionPlan::head(p.q, n);
+    layer.q.forward(norm_out, q, p.workspace, opt);
+    Mat k = ExecutionPlan::head(p.k, n);
+    layer.k.forward(norm_out, k, p.workspace, opt);
+    Mat v = ExecutionPlan::head(p.v, n);
+    layer.v.forward(norm_out, v, p.workspace, opt);
 
     // Multi-head attention with GQA support
-    // For GQA: multiple query heads share the same key/value head
     int head_dim = hidden_size / n_head;
-    int seq_len = x.h;
-    Mat attn_out(hidden_size, seq_len);
-    int num_heads_per_kv = n_head / n_kv_head;
-    
-    RoPEModule rope;
-    
-    for (int h = 0; h < n_head; h++) {
-        int kv_head_idx = h / num_heads_per_kv;  // Which KV head to use for this query head
-        int offset = h * head_dim;
-        int kv_offset = kv_head_idx * head_dim;  // KV heads use same dimension per head
-        
-        // Extract query head
-        Mat q_h(head_dim, seq_len);
-        for (int s = 0; s < seq_len; s++) {
-            memcpy(q_h.row(s), q.row(s) + offset, head_dim * sizeof(float));
-        }
-        
-        // Extract key/value head (shared across multiple query heads in GQA)
-        Mat k_h(head_dim, seq_len);
-        Mat v_h(head_dim, seq_len);
-        for (int s = 0; s < seq_len; s++) {
-            memcpy(k_h.row(s), k.row(s) + kv_offset, head_dim * sizeof(float));
-            memcpy(v_h.row(s), v.row(s) + kv_offset, head_dim * sizeof(float));
-        }
-
-        // Apply RoPE
-        Mat q_rot, k_rot;
-        rope.forward(q_h, q_rot, start_pos, opt);
-        rope.forward(k_h, k_rot, start_pos, opt);
-
-        // Compute attention scores: Q @ K^T / sqrt(head_dim)
-        Mat scores(seq_len, seq_len);
-        for (int i = 0; i < seq_len; i++) {
-            for (int j = 0; j < seq_len; j++) {
-                float dot = 0;
-                for (int d = 0; d < head_dim; d++) {
-                    dot += q_rot.row(i)[d] * k_rot.row(j)[d];
-                }
-                scores.row(i)[j] = dot / sqrtf((float)head_dim);
-            }
-        }
+    int kv_dim = head_dim * n_kv_head;
 
-        // Apply causal mask (for autoregressive generation)
-        for (int i = 0; i < seq_len; i++) {
-            for (int j = i + 1; j < seq_len; j++) {
-                scores.row(i)[j] = -1e9f;
-            }
-        }
+    for (size_t i = 0; i < spans.size(); i++) {
+        const BatchSpan& span = spans[i];
+        const int start_pos = span.cache->n_past;
 
-        // Softmax
-        for (int i = 0; i < seq_len; i++) {
-            float max_val = *std::max_element(scores.row(i), scores.row(i) + seq_len);
-            float sum = 0;
-            for (int j = 0; j < seq_len; j++) {
-                scores.row(i)[j] = expf(scores.row(i)[j] - max_val);
-                sum += scores.row(i)[j];
-            }
-            for (int j = 0; j < seq_len; j++) {
-                scores.row(i)[j] /= sum;
-            }
-        }
+        Mat q_span = q.row_range(span.row, span.n_tokens);
+        p.rope.forward_inplace(q_span, head_dim, start_pos, opt);
 
-        // Apply attention to values: scores @ V
-        Mat out_h(head_dim, seq_len);
-        for (int i = 0; i < seq_len; i++) {
-            for (int d = 0; d < head_dim; d++) {
-                float val = 0;
-                for (int j = 0; j < seq_len; j++) {
-                    val += scores.row(i)[j] * v_h.row(j)[d];
-                }
-                out_h.row(i)[d] = val;
-            }
+        // Append the new keys, rotated on the way in, and values to the cache
+        // in its storage type
+        const KVCache& cache = *span.cache;
+        const ggml_type kv_type = cache.pool->row_type();
+        for (int s = 0; s < span.n_tokens; s++) {
+            float* k_row = k.row(span.row + s);
+            p.rope.apply(k_row, k_row, n_kv_head, head_dim, start_pos + s);
+            quantize_row(kv_type, k_row, cache.key(layer_idx, start_pos + s), kv_dim);
+            quantize_row(kv_type, v.row(span.row + s), cache.value(layer_idx, start_pos + s), kv_dim);
         }
 
-        // Concatenate heads
-        for (int s = 0; s < seq_len; s++) {
-            memcpy(attn_out.row(s) + offset, out_h.row(s), head_dim * sizeof(float));
-        }
+        p.segments[i].layer = layer_idx;
     }
 
+    Mat attn_out = ExecutionPlan::head(p.attn, n);
+    p.attention.forward(q, p.segments, p.row_segment.data(), p.attn_scratch, attn_out, opt);
+
     // Output projection
-    InnerProduct ip_o;
-    ip_o.weight_data = weights[attn_prefix + ".o_proj.weight"];
-    bias_it = weights.find(attn_prefix + ".o_proj.bias");
-    if (bias_it != weights.end()) {
-        ip_o.bias_data = bias_it->second;
-    }
-    Mat attn_proj;
-    ip_o.forward(attn_out, attn_proj, opt);
+    Mat attn_proj = ExecutionPlan::head(p.proj, n);
+    layer.o.forward(attn_out, attn_proj, p.workspace, opt);
 
     // Residual connection
-    Mat res(x.w, x.h);
     for (size_t i = 0; i < x.total(); i++) {
-        res[i] = x[i] + attn_proj[i];
+        x[i] += attn_proj[i];
     }
 
     // MLP
-    LayerNorm post_norm;
-    post_norm.affine = true;
-    post_norm.eps = 1e-5f;
-    post_norm.weight_data = weights[prefix + ".post_attention_layernorm.weight"];
-    bias_it = weights.find(prefix + ".post_attention_layernorm.bias");
-    if (bias_it != weights.end()) {
-        post_norm.bias_data = bias_it->second;
-    }
-    Mat post_norm_out;
-    post_norm.forward(res, post_norm_out, opt);
+    layer.ffn_norm.forward(x, norm_out, opt);
 
     // MLP with SiLU activation
-    InnerProduct gate;
-    gate.weight_data = weights[prefix + ".mlp.gate_proj.weight"];
-    bias_it = weights.find(prefix + ".mlp.gate_proj.bias");
-    if (bias_it != weights.end()) {
-        gate.bias_data = bias_it->second;
-    }
-    Mat gate_out;
-    gate.forward(post_norm_out, gate_out, opt);
-
-    InnerProduct up;
-    up.weight_data = weights[prefix + ".mlp.up_proj.weight"];
-    bias_it = weights.find(prefix + ".mlp.up_proj.bias");
-    if (bias_it != weights.end()) {
-        up.bias_data = bias_it->second;
-    }
-    Mat up_out;
-    up.forward(post_norm_out, up_out, opt);
-
-    // SiLU activation: x * sigmoid(x)
-    Mat mlp_hidden(gate_out.w, gate_out.h);
+    Mat gate_out = ExecutionPlan::head(p.gate, n);
+    layer.gate.forward(norm_out, gate_out, p.workspace, opt);
+    Mat up_out = ExecutionPlan::head(p.up, n);
+    layer.up.forward(norm_out, up_out, p.workspace, opt);
+
+    // SiLU activation: x * sigmoid(x), into gate_out
     for (size_t i = 0; i < gate_out.total(); i++) {
         float gate_val = gate_out[i];
         float sigmoid_val = 1.0f / (1.0f + expf(-gate_val));
-        mlp_hidden[i] = gate_val * sigmoid_val * up_out[i];
+        gate_out[i] = gate_val * sigmoid_val * up_out[i];
     }
 
-    InnerProduct down;
-    down.weight_data = weights[prefix + ".mlp.down_proj.weight"];
-    bias_it = weights.find(prefix + ".mlp.down_proj.bias");
-    if (bias_it != weights.end()) {
-        down.bias_data = bias_it->second;
-    }
-    Mat mlp_out;
-    down.forward(mlp_hidden, mlp_out, opt);
+    Mat mlp_out = ExecutionPlan::head(p.proj, n);
+    layer.down.forward(gate_out, mlp_out, p.workspace, opt);
 
-    Mat final_out(res.w, res.h);
-    for (size_t i = 0; i < res.total(); i++) {
-        final_out[i] = res[i] + mlp_out[i];
+    for (size_t i = 0; i < x.total(); i++) {
+        x[i] += mlp_out[i];
     }
-
-    return final_out;
 }
 
-int LLMEngine::sample_token(const float* logits, const GenerationConfig& config, const std::vector<int>& history)
+// One speculative decoding step, tokens are proposed by prompt lookup or
+// else by the draft model one at a time, and the model checks all of them in
+// a single forward pass
+// history[cache.n_past] must be the only token cache has not run yet, the
+// result is the accepted proposals followed by one token of the model's own,
+// at most max_new, and both caches are rolled back to match it
+// a proposal is kept with probability min(1, p / q) and a rejection draws from
+// max(0, p - q), so sampled output follows the model's own distribution p
+// a looked up proposal counts as certain, q = 1
+std::vector<int> LLMEngine::speculate(const std::vector<int>& history, KVCache& cache, KVCache& draft_cache, NgramIndex& lookup, Sampler& sampler, const GenerationConfig& config, int max_new)
 {
-    // Apply repetition penalty if configured
-    std::vector<float> adjusted_logits(vocab_size);
-    for (int i = 0; i < vocab_size; i++) {
-        adjusted_logits[i] = logits[i];
+    std::vector<int> result;
+    const int n_past = cache.n_past;
+    if (max_new <= 0 || n_past >= (int)history.size()) {
+        return result;
     }
-    
-    if (config.repetition_penalty != 1.0f && !history.empty()) {
-        for (int token_id : history) {
-            if (token_id >= 0 && token_id < vocab_size) {
-                adjusted_logits[token_id] /= config.repetition_penalty;
-            }
-        }
+
+    const bool greedy = !config.do_sample || config.temperature <= 0;
+
+    // the draft runs positions up to n_past + k - 1, the model up to n_past + k
+    int k = std::min(draft_tokens, max_new - 1);
+    k = std::min(k, max_seq_len - n_past - 1);
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<int> context(history.begin(), history.begin() + n_past + 1);
+    std::vector<int> drafted;
+    // only a sampled draft keeps its distributions, q of a looked up or greedy
+    // proposal is 1
+    bool draft_sampled = false;
+    int looked_up = 0;
+    if (lookup_ngram > 0 && k > 0) {
+        lookup.update(context);
+        looked_up = lookup.propose(context, k, drafted);
+        context.insert(context.end(), drafted.begin(), drafted.end());
+    }
+    if (draft) {
+        k = std::min(k, draft->max_seq_len - n_past);
     }
-    
-    if (!config.do_sample || config.temperature <= 0) {
-        // Greedy sampling
-        int max_id = 0;
-        float max_val = adjusted_logits[0];
-        for (int i = 1; i < vocab_size; i++) {
-            if (adjusted_logits[i] > max_val) {
-                max_val = adjusted_logits[i];
-                max_id = i;
+    if (draft && looked_up == 0 && k > 0) {
+        // catch the draft up with every token it has not seen
+        draft_cache.truncate(n_past + 1);
+        draft_probs.resize((size_t)k * vocab_size);
+        draft_sampled = !greedy;
+        std::vector<int> input(context.begin() + draft_cache.n_past, context.end());
+        for (int i = 0; i < k; i++) {
+            Mat logits = draft->forward(input, draft_cache);
+            if (logits.empty()) {
+                break;
             }
+            float* q = &draft_probs[(size_t)i * vocab_size];
+            sampler.probs(logits, config, context, q);
+            const int token = sampler.draw(q, vocab_size);
+            drafted.push_back(token);
+            context.push_back(token);
+            input.assign(1, token);
         }
-        return max_id;
     }
 
-    // Apply temperature
-    std::vector<float> probs(vocab_size);
-    float max_logit = *std::max_element(adjusted_logits.begin(), adjusted_logits.end());
-    float sum = 0;
-    for (int i = 0; i < vocab_size; i++) {
-        probs[i] = expf((adjusted_logits[i] - max_logit) / config.temperature);
-        sum += probs[i];
-    }
-    for (int i = 0; i < vocab_size; i++) {
-        probs[i] /= sum;
-    }
+    auto drafted_at = std::chrono::high_resolution_clock::now();
 
-    // Top-k filtering
-    if (config.top_k > 0 && config.top_k < vocab_size) {
-        std::vector<std::pair<float, int>> prob_idx;
-        for (int i = 0; i < vocab_size; i++) {
-            prob_idx.emplace_back(probs[i], i);
-        }
-        std::sort(prob_idx.rbegin(), prob_idx.rend());
-        for (int i = config.top_k; i < vocab_size; i++) {
-            probs[prob_idx[i].second] = 0;
-        }
-        // Renormalize
-        sum = 0;
-        for (float p : probs) sum += p;
-        for (float& p : probs) p /= sum;
+    std::vector<int> input(1, history[n_past]);
+    input.insert(input.end(), drafted.begin(), drafted.end());
+    Mat logits = forward(input, cache, true);
+    if (logits.empty()) {
+        cache.truncate(n_past);
+        draft_cache.truncate(n_past);
+        return result;
     }
 
-    // Top-p filtering
-    if (config.top_p < 1.0f) {
-        std::vector<std::pair<float, int>> prob_idx;
-        for (int i = 0; i < vocab_size; i++) {
-            prob_idx.emplace_back(probs[i], i);
-        }
-        std::sort(prob_idx.rbegin(), prob_idx.rend());
-        float cumsum = 0;
-        int cutoff = vocab_size;
-        for (int i = 0; i < vocab_size; i++) {
-            cumsum += prob_idx[i].first;
-            if (cumsum >= config.top_p) {
-                cutoff = i + 1;
-                break;
+    context.resize(n_past + 1);
+    int accepted = 0;
+    target_probs.resize(vocab_size);
+    float* p = target_probs.data();
+    for (int i = 0; i <= (int)drafted.size(); i++) {
+        sampler.probs(logits.row(i), config, context, p);
+        if (i < (int)drafted.size()) {
+            const int token = drafted[i];
+            const float* q = draft_sampled ? &draft_probs[(size_t)i * vocab_size] : 0;
+            const float q_token = q ? q[token] : 1.f;
+            const bool keep = greedy ? p[token] > 0.f : sampler.uniform() * q_token <= p[token];
+            if (keep) {
+                result.push_back(token);
+                context.push_back(token);
+                accepted++;
+                continue;
+            }
+            if (!greedy) {
+                float sum = 0.f;
+                for (int j = 0; j < vocab_size; j++) {
+                    const float qj = q ? q[j] : (j == token ? 1.f : 0.f);
+                    p[j] = std::max(0.f, p[j] - qj);
+                    sum += p[j];
+                }
+                if (sum > 0.f) {
+                    for (int j = 0; j < vocab_size; j++) p[j] /= sum;
+                } else {
+                    sampler.probs(logits.row(i), config, context, p);
+                }
             }
         }
-        for (int i = cutoff; i < vocab_size; i++) {
-            probs[prob_idx[i].second] = 0;
-        }
-        // Renormalize
-        sum = 0;
-        for (float p : probs) sum += p;
-        for (float& p : probs) p /= sum;
+        result.push_back(sampler.draw(p, vocab_size));
+        break;
     }
 
-    // Sample
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    return dist(gen);
+    // the K/V of rejected proposals is dropped, the model's own last token has
+    // not been run by either model yet
+    cache.truncate(n_past + 1 + accepted);
+    draft_cache.truncate(n_past + 1 + accepted);
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::lock_guard<std::mutex> lock(spec_mutex);
+    spec_stats.steps++;
+    spec_stats.drafted += drafted.size();
+    spec_stats.looked_up += looked_up;
+    spec_stats.accepted += accepted;
+    spec_stats.generated += result.size();
+    spec_stats.draft_seconds += std::chrono::duration<double>(drafted_at - start).count();
+    spec_stats.verify_seconds += std::chrono::duration<double>(end - drafted_at).count();
+    return result;
+}
+
+SpeculativeStats LLMEngine::speculative_stats() const
+{
+    std::lock_guard<std::mutex> lock(spec_mutex);
+    return spec_stats;
+}
+
+void LLMEngine::reset_speculative_stats()
+{
+    std::lock_guard<std::mutex> lock(spec_mutex);
+    spec_stats = SpeculativeStats();
 }
 
 // Placeholder implementations for other architectures
-Mat LLMEngine::forward_llama(const std::vector<int>& tokens) { return forward_phi3(tokens); }
-Mat LLMEngine::forward_gpt2(const std::vector<int>& tokens) { return forward_phi3(tokens); }
-Mat LLMEngine::forward_mistral(const std::vector<int>& tokens) { return forward_phi3(tokens); }
-Mat LLMEngine::forward_qwen(const std::vector<int>& tokens) { return forward_phi3(tokens); }
+Mat LLMEngine::forward_llama(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all) { return forward_phi3(tokens, spans, logits_all); }
+Mat LLMEngine::forward_gpt2(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all) { return forward_phi3(tokens, spans, logits_all); }
+Mat LLMEngine::forward_mistral(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all) { return forward_phi3(tokens, spans, logits_all); }
+Mat LLMEngine::forward_qwen(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all) { return forward_phi3(tokens, spans, logits_all); }
 
 } // namespace ncnn
\ No newline at end of file
@@ -1,39 +1,155 @@
 #ifndef LLM_ENGINE_H
 #define LLM_ENGINE_H
 
+#include "cpu.h"
 #include "gguf.h"
 #include "tokenizer.h"
+#include "llm_grammar.h"
+#include "llm_kv_cache.h"
+#include "llm_ngram_index.h"
+#include "llm_prefix_cache.h"
+#include "llm_sampler.h"
 #include "mat.h"
+#include "option.h"
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <functional>
 
 namespace ncnn {
 
+class Layer;
+
 struct GenerationConfig {
     int max_tokens = 100;
     float temperature = 1.0f;
     float top_p = 1.0f;
     int top_k = 0;
     bool do_sample = true;
+    float min_p = 0.0f;            // drop tokens below min_p times the most likely one
+    float typical_p = 1.0f;        // locally typical sampling mass, 1 disables
     float repetition_penalty = 1.0f;
+    float presence_penalty = 0.0f; // subtracted once from every token in the history
+    float frequency_penalty = 0.0f; // subtracted per occurrence in the history
+    int64_t seed = -1;             // sampling seed of the sequence, -1 picks one at random
     std::vector<int> stop_tokens;
+    std::string grammar;           // GBNF the output has to match, see Grammar
+    std::string json_schema;       // JSON schema the output has to match, when no grammar is set
+};
+
+struct EngineConfig {
+    bool use_mmap = true;       // map the model file instead of reading it into memory
+    bool mmap_populate = false; // prefault the whole mapping at load time
+    bool index_cache = false;   // reuse the metadata index saved in <model>.idx
+    int num_threads = 0;        // worker threads, 0 keeps ncnn's default
+    int prefill_threads = 0;    // threads of steps that prefill a prompt, 0 uses num_threads
+    int decode_threads = 0;     // threads of steps of one token per sequence, 0 uses num_threads,
+                                // -1 times each count at load and keeps the fastest per host in <model>.threads
+    bool pin_threads = false;   // pin prefill to every physical core and decode to the physical big cores
+    size_t prefix_cache_size = 0; // bytes of prompt K/V reused across requests, 0 disables
+    ggml_type kv_cache_type = GGML_TYPE_F32; // f32, f16, bf16, q8_0 or q4_0
+    bool q8_activations = true; // multiply q4_0, q4_K and q8_0 weights with activations quantized to int8,
+                                // for the decode sized inputs where that measured faster
+    bool repack_weights = false; // interleave q4_K rows into tiles for those kernels, kept in <model>.repack
+    std::string draft_model;    // small GGUF with the same vocabulary proposing tokens to verify
+    int lookup_ngram = 0;       // propose what followed the last n tokens earlier in the context, 0 disables
+    int draft_tokens = 4;       // tokens proposed per speculative step
+    int prefill_chunk = 512;    // prompt tokens per forward step, the rest waits for the next, 0 runs a prompt at once
+    bool context_shift = true;  // at the context length drop older positions and go on instead of stopping
+    int sink_tokens = 4;        // first positions a context shift always keeps
+};
+
+// Speculative decoding counters since the last reset
+struct SpeculativeStats {
+    uint64_t steps = 0;     // verifying forward passes of the model
+    uint64_t drafted = 0;   // tokens proposed by the draft or the lookup
+    uint64_t looked_up = 0; // proposals taken from the context
+    uint64_t accepted = 0;  // proposed tokens the model agreed with
+    uint64_t generated = 0; // tokens produced by those passes
+    double draft_seconds = 0;
+    double verify_seconds = 0;
+
+    float acceptance_rate() const { return drafted ? (float)accepted / drafted : 0.f; }
+    // tokens per model pass, the speedup over plain decoding if drafting were free
+    float tokens_per_step() const { return steps ? (float)generated / steps : 0.f; }
 };
 
+// Rotary embedding parameters, read from the <arch>.rope.* metadata
+struct RoPEConfig {
+    enum { SCALING_NONE = 0, SCALING_LINEAR, SCALING_NTK, SCALING_YARN };
+
+    int dim = 0;                // rotated dims per head, the rest pass through
+    float freq_base = 10000.f;
+    bool neox = false;          // rotate (i, i + dim/2) pairs instead of (2i, 2i+1)
+    int scaling_type = SCALING_NONE;
+    float scaling_factor = 1.f; // context extension factor
+    int original_context = 0;   // training context, used by yarn
+    float attn_factor = 1.f;    // extra magnitude scale on cos/sin
+    float beta_fast = 32.f;     // yarn ramp bounds, in rotations
+    float beta_slow = 1.f;
+};
+
+// Receives each generated token and the text it completed, the text can be
+// empty while a multi-byte character is still incomplete
+// bytes still held back at the end arrive in a last call with token -1
+// return false to stop generating
+typedef std::function<bool(int token, const std::string& text)> TokenCallback;
+
 class LLMEngine {
 public:
     LLMEngine();
     ~LLMEngine();
 
-    bool load_model(const std::string& model_path);
-    std::vector<int> generate(const std::string& prompt, const GenerationConfig& config = GenerationConfig());
+    bool load_model(const std::string& model_path, const EngineConfig& config = EngineConfig());
+    std::vector<int> generate(const std::string& prompt, const GenerationConfig& config = GenerationConfig(), const TokenCallback& on_token = TokenCallback());
     std::string generate_text(const std::string& prompt, const GenerationConfig& config = GenerationConfig());
 
+    // perplexity of the text, scored in independent windows of n_ctx tokens
+    // (the model context when 0), -1 when nothing could be scored
+    float perplexity(const std::string& text, int n_ctx = 0);
+
+    // speculative decoding is used whenever a draft model was loaded or
+    // prompt lookup is enabled, a lookup match is preferred over the draft
+    bool has_draft() const { return draft.get() != 0; }
+    bool can_speculate() const { return draft.get() != 0 || lookup_ngram > 0; }
+    void set_draft_tokens(int n) { draft_tokens = std::max(1, n); }
+    void set_lookup_ngram(int n) { lookup_ngram = std::max(0, n); }
+    SpeculativeStats speculative_stats() const;
+    void reset_speculative_stats();
+
     const Tokenizer& get_tokenizer() const { return tokenizer; }
+    int context_length() const { return max_seq_len; }
+    // keys a query attends to, itself included, 0 when it sees the whole context
+    int attention_window() const { return sliding_window; }
+    int prefill_thread_count() const { return prefill_threads; }
+    int decode_thread_count() const { return decode_threads; }
+    // bytes of KV cache one position takes in the configured storage type
+    size_t kv_bytes_per_token() const { return kv_pool.page_bytes() / KVPool::block_size; }
+    // heap allocations made for activations and layer workspaces since load,
+    // a step no larger than an earlier one leaves it unchanged
+    size_t allocation_count() const;
 
 private:
+    friend class Scheduler;
+
+    // rows [row, row + n_tokens) of a batched step continue cache from its n_past
+    struct BatchSpan {
+        KVCache* cache;
+        int row;
+        int n_tokens;
+    };
+
+    // weights resolved per layer and the activation buffers of a step, the
+    // logits a forward pass returns point into them and stay valid until the
+    // next pass of this engine
+    struct ExecutionPlan;
+
     GGUFLoader loader;
+    // tiles of repacked weight rows, outlives the plan pointing into it
+    GGUFRepackCache repack_cache;
     Tokenizer tokenizer;
     std::unordered_map<std::string, Mat> weights;
     std::string architecture;
@@ -45,23 +161,81 @@ private:
     int hidden_size;
     int vocab_size;
     int max_seq_len;
+    int sliding_window;
+
+    // pages behind every KV cache of this engine, declared first so it
+    // outlives the caches below
+    KVPool kv_pool;
+    // KV cache of the sequence being generated
+    KVCache kv_cache;
+    // K/V of earlier prompts, so a request only prefills what it adds to them
+    PrefixCache prefix_cache;
+
+    // proposes tokens for speculative decoding, with its own pool and caches
+    std::unique_ptr<LLMEngine> draft;
+    int lookup_ngram;
+    int draft_tokens;
+    // proposal distributions of a speculative step, a row of vocab_size per
+    // drafted token
+    std::vector<float> draft_probs;
+    // distribution of the target model at the position being verified
+    std::vector<float> target_probs;
+    int prefill_chunk;
+    bool context_shift;
+    int sink_tokens;
+    SpeculativeStats spec_stats;
+    mutable std::mutex spec_mutex;
+
+    // token texts for constrained decoding, built by the first request with a grammar
+    TokenTrie trie;
+    std::mutex trie_mutex;
+
+    // cos/sin per (position, rotated pair), grown with the context
+    RoPEConfig rope;
+    Mat rope_cos;
+    Mat rope_sin;
 
-    // KV cache
-    std::vector<Mat> key_cache;
-    std::vector<Mat> value_cache;
+    Option opt;
+    // threads and cpus of the two kinds of step, applied by set_phase()
+    int prefill_threads;
+    int decode_threads;
+    bool pin_threads;
+    CpuSet prefill_cpus;
+    CpuSet decode_cpus;
+    int phase; // 0 prefill, 1 decode, -1 before the first step
+    Layer* gemm; // shared by every projection with enough rows
+    bool q8_activations;
+    bool repack_weights;
+    std::unique_ptr<ExecutionPlan> plan;
 
     bool load_weights();
+    bool build_plan(const std::string& model_path);
+    const gguf_tensor* quant_weight(const std::string& name) const;
+    Mat weight(const std::string& name);
     bool detect_architecture();
-    Mat forward(const std::vector<int>& tokens);
-    Mat forward_layer(int layer_idx, const Mat& x, int start_pos);
-    int sample_token(const float* logits, const GenerationConfig& config, const std::vector<int>& history);
+    bool reserve_kv_cache(KVCache& cache, int n_ctx);
+    bool unshare_pages(KVCache& cache, int first, int last);
+    bool shift_context(KVCache& cache, std::vector<int>& history, int n_new);
+    int restore_prefix(const std::vector<int>& tokens, KVCache& cache);
+    void save_prefix(const std::vector<int>& tokens, const KVCache& cache);
+    bool compile_grammar(const GenerationConfig& config, Grammar& grammar) const;
+    const TokenTrie& token_trie();
+    void load_rope_config();
+    bool update_rope_cache(int n_ctx);
+    void set_threads(int prefill, int decode);
+    void set_phase(int decode);
+    int probe_decode_threads(const std::string& model_path);
+    Mat forward(const std::vector<int>& tokens, KVCache& cache, bool logits_all = false);
+    Mat forward_batch(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all = false);
+    void forward_layer(int layer_idx, Mat& x, const std::vector<BatchSpan>& spans);
+    std::vector<int> speculate(const std::vector<int>& history, KVCache& cache, KVCache& draft_cache, NgramIndex& lookup, Sampler& sampler, const GenerationConfig& config, int max_new);
 
     // Architecture-specific implementations
-    Mat forward_llama(const std::vector<int>& tokens);
-    Mat forward_gpt2(const std::vector<int>& tokens);
-    Mat forward_phi3(const std::vector<int>& tokens);
-    Mat forward_mistral(const std::vector<int>& tokens);
-    Mat forward_qwen(const std::vector<int>& tokens);
+    Mat forward_llama(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all);
+    Mat forward_gpt2(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all);
+    Mat forward_phi3(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all);
+    Mat forward_mistral(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all);
+    Mat forward_qwen(const std::vector<int>& tokens, const std::vector<BatchSpan>& spans, bool logits_all);
 };
 
 } // namespace ncnn
@@ -0,0 +1,1497 @@
+#include "llm_grammar.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace ncnn {
+
+typedef Grammar::Element Element;
+typedef std::pair<uint32_t, uint32_t> CodeRange;
+typedef std::vector<std::pair<uint8_t, uint8_t> > ByteRanges;
+
+// Splits the code points [lo, hi] into byte range sequences, every code point
+// of a sequence encodes to one byte from each of its ranges and back
+static void utf8_ranges(uint32_t lo, uint32_t hi, std::vector<ByteRanges>& out)
+{
+    static const uint32_t last_of_length[3] = {0x7F, 0x7FF, 0xFFFF};
+    for (int i = 0; i < 3; i++) {
+        if (lo <= last_of_length[i] && hi > last_of_length[i]) {
+            utf8_ranges(lo, last_of_length[i], out);
+            utf8_ranges(last_of_length[i] + 1, hi, out);
+            return;
+        }
+    }
+    if (hi <= 0x7F) {
+        out.push_back(ByteRanges(1, std::make_pair((uint8_t)lo, (uint8_t)hi)));
+        return;
+    }
+
+    const int length = hi <= 0x7FF ? 2 : hi <= 0xFFFF ? 3 : 4;
+    for (int i = 1; i < length; i++) {
+        const uint32_t m = (1u << (6 * i)) - 1;
+        if ((lo & ~m) != (hi & ~m)) {
+            if ((lo & m) != 0) {
+                utf8_ranges(lo, lo | m, out);
+                utf8_ranges((lo | m) + 1, hi, out);
+                return;
+            }
+            if ((hi & m) != m) {
+                utf8_ranges(lo, (hi & ~m) - 1, out);
+                utf8_ranges(hi & ~m, hi, out);
+                return;
+            }
+        }
+    }
+
+    ByteRanges ranges(length);
+    for (int i = length - 1; i > 0; i--) {
+        ranges[i] = std::make_pair((uint8_t)(0x80 | (lo & 0x3F)), (uint8_t)(0x80 | (hi & 0x3F)));
+        lo >>= 6;
+        hi >>= 6;
+    }
+    const uint8_t lead = length == 2 ? 0xC0 : length == 3 ? 0xE0 : 0xF0;
+    ranges[0] = std::make_pair((uint8_t)(lead | lo), (uint8_t)(lead | hi));
+    out.push_back(ranges);
+}
+
+static void append_utf8(uint32_t cp, std::string& out)
+{
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// decodes one code point, a malformed byte stands for itself
+static uint32_t decode_utf8(const char*& p, const char* end)
+{
+    const uint8_t c = (uint8_t)*p++;
+    const int length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+    if (length == 1 || end - p < length - 1) {
+        return c;
+    }
+    uint32_t cp = c & (0xFF >> (length + 1));
+    for (int i = 1; i < length; i++) {
+        cp = (cp << 6) | ((uint8_t)*p++ & 0x3F);
+    }
+    return cp;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+// Recursive descent over GBNF text, rules are built as separate element
+// vectors and laid out back to back once everything parsed
+class GrammarParser {
+public:
+    GrammarParser(const std::string& text)
+        : p(text.data()), end(text.data() + text.size()), n_generated(0)
+    {
+    }
+
+    bool parse(Grammar& grammar, std::string& error);
+
+private:
+    int symbol(const std::string& name);
+    int generated_rule(const std::string& base);
+    int byte_set(const Grammar::ByteSet& set);
+    void push_bytes(std::vector<Element>& out, uint8_t lo, uint8_t hi);
+
+    void skip_space(bool newlines);
+    bool parse_name(std::string& name);
+    bool parse_char(uint32_t& cp);
+    bool parse_alternates(const std::string& name, std::vector<Element>& out, bool nested);
+    bool parse_sequence(const std::string& name, std::vector<Element>& out, bool nested);
+    bool parse_class(const std::string& name, std::vector<Element>& out);
+    void push_class(const std::string& name, std::vector<CodeRange>& ranges, bool negated, std::vector<Element>& out);
+    void repeat(const std::string& name, std::vector<Element>& out, size_t last, int min_count, int max_count);
+    bool fail(const char* message);
+
+    const char* p;
+    const char* end;
+    std::map<std::string, int> symbols;
+    std::vector<std::string> names;
+    std::vector<std::vector<Element> > rules;
+    std::vector<bool> defined;
+    std::vector<Grammar::ByteSet> sets;
+    std::map<std::vector<uint64_t>, int> set_ids;
+    int n_generated;
+    std::string error;
+};
+
+int GrammarParser::symbol(const std::string& name)
+{
+    std::map<std::string, int>::iterator it = symbols.find(name);
+    if (it != symbols.end()) {
+        return it->second;
+    }
+    const int id = (int)rules.size();
+    symbols[name] = id;
+    names.push_back(name);
+    rules.push_back(std::vector<Element>());
+    defined.push_back(false);
+    return id;
+}
+
+int GrammarParser::generated_rule(const std::string& base)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%d", n_generated++);
+    const int id = symbol(base + suffix);
+    defined[id] = true;
+    return id;
+}
+
+int GrammarParser::byte_set(const Grammar::ByteSet& set)
+{
+    std::vector<uint64_t> key(set.bits, set.bits + 4);
+    std::map<std::vector<uint64_t>, int>::iterator it = set_ids.find(key);
+    if (it != set_ids.end()) {
+        return it->second;
+    }
+    set_ids[key] = (int)sets.size();
+    sets.push_back(set);
+    return (int)sets.size() - 1;
+}
+
+void GrammarParser::push_bytes(std::vector<Element>& out, uint8_t lo, uint8_t hi)
+{
+    Grammar::ByteSet set;
+    memset(set.bits, 0, sizeof(set.bits));
+    for (int b = lo; b <= hi; b++) {
+        set.bits[b >> 6] |= (uint64_t)1 << (b & 63);
+    }
+    Element e = {Element::BYTES, byte_set(set)};
+    out.push_back(e);
+}
+
+bool GrammarParser::fail(const char* message)
+{
+    if (error.empty()) {
+        error = message;
+        if (p < end) {
+            const char* line_end = std::find(p, end, '\n');
+            error += " at '" + std::string(p, std::min(line_end, p + 32)) + "'";
+        }
+    }
+    return false;
+}
+
+// newlines end a rule unless inside parentheses or after |
+void GrammarParser::skip_space(bool newlines)
+{
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || (newlines && (*p == '\n' || *p == '\r'))) {
+            p++;
+        } else if (*p == '#') {
+            while (p < end && *p != '\n') p++;
+        } else {
+            break;
+        }
+    }
+}
+
+bool GrammarParser::parse_name(std::string& name)
+{
+    const char* start = p;
+    while (p < end && is_name_char(*p)) p++;
+    name.assign(start, p);
+    return !name.empty();
+}
+
+bool GrammarParser::parse_char(uint32_t& cp)
+{
+    if (p >= end) {
+        return fail("unexpected end of input");
+    }
+    if (*p != '\\') {
+        cp = decode_utf8(p, end);
+        return true;
+    }
+    if (++p >= end) {
+        return fail("unexpected end of input");
+    }
+
+    const char c = *p++;
+    int digits = 0;
+    switch (c) {
+    case 'n': cp = '\n'; return true;
+    case 'r': cp = '\r'; return true;
+    case 't': cp = '\t'; return true;
+    case 'x': digits = 2; break;
+    case 'u': digits = 4; break;
+    case 'U': digits = 8; break;
+    default: cp = (uint8_t)c; return true;
+    }
+
+    cp = 0;
+    for (int i = 0; i < digits; i++) {
+        const int v = p < end ? hex_value(*p) : -1;
+        if (v < 0) {
+            return fail("bad escape");
+        }
+        cp = (cp << 4) | v;
+        p++;
+    }
+    return true;
+}
+
+bool GrammarParser::parse_alternates(const std::string& name, std::vector<Element>& out, bool nested)
+{
+    if (!parse_sequence(name, out, nested)) {
+        return false;
+    }
+    while (p < end && *p == '|') {
+        p++;
+        Element alt = {Element::ALT, 0};
+        out.push_back(alt);
+        skip_space(true);
+        if (!parse_sequence(name, out, nested)) {
+            return false;
+        }
+    }
+    Element e = {Element::END, 0};
+    out.push_back(e);
+    return true;
+}
+
+bool GrammarParser::parse_sequence(const std::string& name, std::vector<Element>& out, bool nested)
+{
+    size_t last = out.size(); // where the last item starts, for repetitions
+    bool has_last = false;
+    while (p < end) {
+        const char c = *p;
+        if (c == '"') {
+            last = out.size();
+            has_last = true;
+            p++;
+            while (p < end && *p != '"') {
+                uint32_t cp;
+                if (!parse_char(cp)) {
+                    return false;
+                }
+                std::string bytes;
+                append_utf8(cp, bytes);
+                for (size_t i = 0; i < bytes.size(); i++) {
+                    push_bytes(out, (uint8_t)bytes[i], (uint8_t)bytes[i]);
+                }
+            }
+            if (p >= end) {
+                return fail("unterminated literal");
+            }
+            p++;
+        } else if (c == '[') {
+            last = out.size();
+            has_last = true;
+            if (!parse_class(name, out)) {
+                return false;
+            }
+        } else if (c == '.') {
+            last = out.size();
+            has_last = true;
+            p++;
+            std::vector<CodeRange> ranges;
+            push_class(name, ranges, true, out);
+        } else if (is_name_char(c)) {
+            last = out.size();
+            has_last = true;
+            std::string ref;
+            parse_name(ref);
+            Element e = {Element::RULE_REF, symbol(ref)};
+            out.push_back(e);
+        } else if (c == '(') {
+            last = out.size();
+            has_last = true;
+            p++;
+            skip_space(true);
+            const int sub = generated_rule(name);
+            std::vector<Element> body;
+            if (!parse_alternates(name, body, true)) {
+                return false;
+            }
+            rules[sub] = body;
+            if (p >= end || *p != ')') {
+                return fail("expected )");
+            }
+            p++;
+            Element e = {Element::RULE_REF, sub};
+            out.push_back(e);
+        } else if (c == '*' || c == '+' || c == '?' || c == '{') {
+            if (!has_last) {
+                return fail("repetition without an item");
+            }
+            int min_count = 0;
+            int max_count = -1;
+            p++;
+            if (c == '+') {
+                min_count = 1;
+            } else if (c == '?') {
+                max_count = 1;
+            } else if (c == '{') {
+                skip_space(true);
+                const char* start = p;
+                min_count = 0;
+                while (p < end && *p >= '0' && *p <= '9') min_count = min_count * 10 + (*p++ - '0');
+                if (p == start) {
+                    return fail("expected a count");
+                }
+                skip_space(true);
+                max_count = min_count;
+                if (p < end && *p == ',') {
+                    p++;
+                    skip_space(true);
+                    max_count = -1;
+                    if (p < end && *p >= '0' && *p <= '9') {
+                        max_count = 0;
+                        while (p < end && *p >= '0' && *p <= '9') max_count = max_count * 10 + (*p++ - '0');
+                    }
+                    skip_space(true);
+                }
+                if (p >= end || *p != '}' || (max_count >= 0 && max_count < min_count)) {
+                    return fail("bad repetition count");
+                }
+                p++;
+            }
+            repeat(name, out, last, min_count, max_count);
+            has_last = false;
+        } else {
+            break;
+        }
+        skip_space(nested);
+    }
+    return true;
+}
+
+bool GrammarParser::parse_class(const std::string& name, std::vector<Element>& out)
+{
+    p++;
+    bool negated = false;
+    if (p < end && *p == '^') {
+        negated = true;
+        p++;
+    }
+
+    std::vector<CodeRange> ranges;
+    while (p < end && *p != ']') {
+        uint32_t lo = 0;
+        if (!parse_char(lo)) {
+            return false;
+        }
+        uint32_t hi = lo;
+        if (end - p >= 2 && p[0] == '-' && p[1] != ']') {
+            p++;
+            if (!parse_char(hi)) {
+                return false;
+            }
+        }
+        if (hi < lo || hi > 0x10FFFF) {
+            return fail("bad character range");
+        }
+        ranges.push_back(CodeRange(lo, hi));
+    }
+    if (p >= end) {
+        return fail("unterminated character class");
+    }
+    p++;
+
+    push_class(name, ranges, negated, out);
+    return true;
+}
+
+// One BYTES element when the class stays within ASCII, otherwise a rule with
+// the ASCII part and every UTF-8 byte sequence as alternatives
+void GrammarParser::push_class(const std::string& name, std::vector<CodeRange>& ranges, bool negated, std::vector<Element>& out)
+{
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<CodeRange> merged;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (!merged.empty() && ranges[i].first <= merged.back().second + 1) {
+            merged.back().second = std::max(merged.back().second, ranges[i].second);
+        } else {
+            merged.push_back(ranges[i]);
+        }
+    }
+
+    if (negated) {
+        std::vector<CodeRange> complement;
+        uint32_t next = 0;
+        for (size_t i = 0; i < merged.size(); i++) {
+            if (merged[i].first > next) {
+                complement.push_back(CodeRange(next, merged[i].first - 1));
+            }
+            next = merged[i].second + 1;
+        }
+        if (next <= 0x10FFFF) {
+            complement.push_back(CodeRange(next, 0x10FFFF));
+        }
+        merged.swap(complement);
+    }
+
+    // surrogates are not characters
+    std::vector<CodeRange> valid;
+    for (size_t i = 0; i < merged.size(); i++) {
+        const CodeRange r = merged[i];
+        if (r.first < 0xD800 && r.second >= 0xD800) valid.push_back(CodeRange(r.first, 0xD7FF));
+        if (r.first <= 0xDFFF && r.second > 0xDFFF) valid.push_back(CodeRange(0xE000, r.second));
+        if (r.second < 0xD800 || r.first > 0xDFFF) valid.push_back(r);
+    }
+
+    Grammar::ByteSet ascii;
+    memset(ascii.bits, 0, sizeof(ascii.bits));
+    bool has_ascii = false;
+    std::vector<ByteRanges> sequences;
+    for (size_t i = 0; i < valid.size(); i++) {
+        for (uint32_t c = valid[i].first; c <= std::min(valid[i].second, (uint32_t)0x7F); c++) {
+            ascii.bits[c >> 6] |= (uint64_t)1 << (c & 63);
+            has_ascii = true;
+        }
+        if (valid[i].second >= 0x80) {
+            utf8_ranges(std::max(valid[i].first, (uint32_t)0x80), valid[i].second, sequences);
+        }
+    }
+
+    if (sequences.empty() && has_ascii) {
+        Element e = {Element::BYTES, byte_set(ascii)};
+        out.push_back(e);
+        return;
+    }
+
+    std::vector<Element> body;
+    if (has_ascii) {
+        Element e = {Element::BYTES, byte_set(ascii)};
+        body.push_back(e);
+    }
+    for (size_t i = 0; i < sequences.size(); i++) {
+        if (!body.empty()) {
+            Element alt = {Element::ALT, 0};
+            body.push_back(alt);
+        }
+        for (size_t j = 0; j < sequences[i].size(); j++) {
+            push_bytes(body, sequences[i][j].first, sequences[i][j].second);
+        }
+    }
+    if (body.empty()) {
+        // matches nothing, a set without bytes never moves
+        Grammar::ByteSet none;
+        memset(none.bits, 0, sizeof(none.bits));
+        Element e = {Element::BYTES, byte_set(none)};
+        body.push_back(e);
+    }
+    Element e = {Element::END, 0};
+    body.push_back(e);
+
+    const int rule = generated_rule(name);
+    rules[rule] = body;
+    Element ref = {Element::RULE_REF, rule};
+    out.push_back(ref);
+}
+
+// Rewrites the item starting at out[last] into min_count copies followed by
+//   x*      rest ::= x rest |
+//   x{0,n}  rest ::= x rest' |   nested n deep
+void GrammarParser::repeat(const std::string& name, std::vector<Element>& out, size_t last, int min_count, int max_count)
+{
+    std::vector<Element> item(out.begin() + last, out.end());
+    out.resize(last);
+    if (item.size() != 1) {
+        const int rule = generated_rule(name);
+        Element e = {Element::END, 0};
+        item.push_back(e);
+        rules[rule] = item;
+        Element ref = {Element::RULE_REF, rule};
+        item.assign(1, ref);
+    }
+
+    for (int i = 0; i < min_count; i++) {
+        out.insert(out.end(), item.begin(), item.end());
+    }
+
+    const Element alt = {Element::ALT, 0};
+    const Element end_ = {Element::END, 0};
+    if (max_count < 0) {
+        const int rule = generated_rule(name);
+        std::vector<Element> body(item);
+        Element self = {Element::RULE_REF, rule};
+        body.push_back(self);
+        body.push_back(alt);
+        body.push_back(end_);
+        rules[rule] = body;
+        out.push_back(self);
+        return;
+    }
+
+    int inner = -1;
+    for (int i = min_count; i < max_count; i++) {
+        const int rule = generated_rule(name);
+        std::vector<Element> body(item);
+        if (inner >= 0) {
+            Element ref = {Element::RULE_REF, inner};
+            body.push_back(ref);
+        }
+        body.push_back(alt);
+        body.push_back(end_);
+        rules[rule] = body;
+        inner = rule;
+    }
+    if (inner >= 0) {
+        Element ref = {Element::RULE_REF, inner};
+        out.push_back(ref);
+    }
+}
+
+bool GrammarParser::parse(Grammar& grammar, std::string& error_out)
+{
+    skip_space(true);
+    while (p < end) {
+        std::string name;
+        if (!parse_name(name)) {
+            fail("expected a rule name");
+            break;
+        }
+        skip_space(false);
+        if (end - p < 3 || strncmp(p, "::=", 3) != 0) {
+            fail("expected ::=");
+            break;
+        }
+        p += 3;
+        skip_space(true);
+
+        const int rule = symbol(name);
+        if (defined[rule]) {
+            fail(("rule " + name + " defined twice").c_str());
+            break;
+        }
+        defined[rule] = true;
+        std::vector<Element> body;
+        if (!parse_alternates(name, body, false)) {
+            break;
+        }
+        rules[rule] = body;
+
+        if (p < end && *p != '\n' && *p != '\r') {
+            fail("unexpected character");
+            break;
+        }
+        skip_space(true);
+    }
+
+    if (error.empty()) {
+        std::map<std::string, int>::const_iterator it = symbols.find("root");
+        if (it == symbols.end() || !defined[it->second]) {
+            error = "missing root rule";
+        }
+        for (size_t i = 0; i < rules.size() && error.empty(); i++) {
+            if (!defined[i]) {
+                error = "undefined rule " + names[i];
+            }
+        }
+    }
+    if (!error.empty()) {
+        error_out = error;
+        return false;
+    }
+
+    grammar.elements.clear();
+    grammar.rule_start.resize(rules.size());
+    for (size_t i = 0; i < rules.size(); i++) {
+        grammar.rule_start[i] = (int)grammar.elements.size();
+        grammar.elements.insert(grammar.elements.end(), rules[i].begin(), rules[i].end());
+    }
+    grammar.byte_sets = sets;
+    grammar.root = symbols["root"];
+    return true;
+}
+
+Grammar::Grammar()
+    : root(-1)
+{
+}
+
+bool Grammar::parse(const std::string& gbnf, std::string* error)
+{
+    GrammarParser parser(gbnf);
+    std::string message;
+    if (!parser.parse(*this, message)) {
+        elements.clear();
+        rule_start.clear();
+        byte_sets.clear();
+        root = -1;
+        if (error) *error = message;
+        return false;
+    }
+    return true;
+}
+
+bool Grammar::parse_json_schema(const std::string& schema, std::string* error)
+{
+    std::string gbnf;
+    if (!json_schema_to_gbnf(schema, gbnf, error)) {
+        return false;
+    }
+    return parse(gbnf, error);
+}
+
+// JSON documents are parsed into a flat node array, children by index
+struct JsonNode {
+    enum { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+    int type;
+    std::string text; // string value, number or boolean as written
+    std::vector<std::string> keys;
+    std::vector<int> children;
+};
+
+class JsonReader {
+public:
+    JsonReader(const std::string& text)
+        : p(text.data()), end(text.data() + text.size())
+    {
+    }
+
+    bool read(std::vector<JsonNode>& nodes)
+    {
+        if (parse_value(nodes, 0) < 0) {
+            return false;
+        }
+        skip_space();
+        return p == end;
+    }
+
+private:
+    void skip_space()
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    }
+
+    bool parse_hex4(uint32_t& cp)
+    {
+        if (end - p < 4) return false;
+        cp = 0;
+        for (int i = 0; i < 4; i++) {
+            const int v = hex_value(*p++);
+            if (v < 0) return false;
+            cp = (cp << 4) | v;
+        }
+        return true;
+    }
+
+    bool parse_string(std::string& out)
+    {
+        p++;
+        while (p < end && *p != '"') {
+            if (*p != '\\') {
+                out += *p++;
+                continue;
+            }
+            if (++p >= end) return false;
+            const char c = *p++;
+            switch (c) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if (!parse_hex4(cp)) return false;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    p += 2;
+                    uint32_t low;
+                    if (!parse_hex4(low)) return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(cp, out);
+                break;
+            }
+            default: out += c; break;
+            }
+        }
+        if (p >= end) return false;
+        p++;
+        return true;
+    }
+
+    int parse_value(std::vector<JsonNode>& nodes, int depth)
+    {
+        skip_space();
+        if (p >= end || depth > 64) {
+            return -1;
+        }
+
+        const int id = (int)nodes.size();
+        nodes.push_back(JsonNode());
+        const char c = *p;
+        if (c == '{' || c == '[') {
+            const bool object = c == '{';
+            nodes[id].type = object ? JsonNode::OBJECT : JsonNode::ARRAY;
+            p++;
+            skip_space();
+            if (p < end && *p == (object ? '}' : ']')) {
+                p++;
+                return id;
+            }
+            for (;;) {
+                if (object) {
+                    skip_space();
+                    std::string key;
+                    if (p >= end || *p != '"' || !parse_string(key)) return -1;
+                    skip_space();
+                    if (p >= end || *p != ':') return -1;
+                    p++;
+                    nodes[id].keys.push_back(key);
+                }
+                const int child = parse_value(nodes, depth + 1);
+                if (child < 0) return -1;
+                nodes[id].children.push_back(child);
+                skip_space();
+                if (p < end && *p == ',') {
+                    p++;
+                    continue;
+                }
+                if (p < end && *p == (object ? '}' : ']')) {
+                    p++;
+                    return id;
+                }
+                return -1;
+            }
+        }
+        if (c == '"') {
+            nodes[id].type = JsonNode::STRING;
+            std::string text;
+            if (!parse_string(text)) return -1;
+            nodes[id].text = text;
+            return id;
+        }
+
+        const char* start = p;
+        while (p < end && (is_name_char(*p) || *p == '.' || *p == '+')) p++;
+        const std::string word(start, p);
+        if (word == "null") {
+            nodes[id].type = JsonNode::NUL;
+        } else if (word == "true" || word == "false") {
+            nodes[id].type = JsonNode::BOOLEAN;
+        } else if (!word.empty() && (word[0] == '-' || (word[0] >= '0' && word[0] <= '9'))) {
+            nodes[id].type = JsonNode::NUMBER;
+        } else {
+            return -1;
+        }
+        nodes[id].text = word;
+        return id;
+    }
+
+    const char* p;
+    const char* end;
+};
+
+// Builds one GBNF rule per schema node, primitives are added when first used
+class SchemaConverter {
+public:
+    SchemaConverter(const std::vector<JsonNode>& _nodes)
+        : nodes(_nodes)
+    {
+        // schema rules never take the name of a primitive
+        static const char* reserved[] = {"root", "ws", "char", "string", "number", "integer", "boolean", "null", "value", "object", "array"};
+        used.insert(reserved, reserved + sizeof(reserved) / sizeof(reserved[0]));
+    }
+
+    bool convert(std::string& gbnf, std::string& error_out)
+    {
+        const std::string root = visit(0, "root");
+        if (!error.empty()) {
+            error_out = error;
+            return false;
+        }
+        gbnf = "root ::= " + root + "\n";
+        for (size_t i = 0; i < rules.size(); i++) {
+            gbnf += rules[i].first + " ::= " + rules[i].second + "\n";
+        }
+        return true;
+    }
+
+private:
+    int find(int node, const char* key) const
+    {
+        const JsonNode& n = nodes[node];
+        if (n.type != JsonNode::OBJECT) return -1;
+        for (size_t i = 0; i < n.keys.size(); i++) {
+            if (n.keys[i] == key) return n.children[i];
+        }
+        return -1;
+    }
+
+    int find_int(int node, const char* key, int fallback) const
+    {
+        const int v = find(node, key);
+        return v >= 0 && nodes[v].type == JsonNode::NUMBER ? atoi(nodes[v].text.c_str()) : fallback;
+    }
+
+    static std::string rule_name(const std::string& name)
+    {
+        std::string out;
+        for (size_t i = 0; i < name.size(); i++) {
+            const char c = name[i];
+            out += (is_name_char(c) && c != '_') ? c : '-';
+        }
+        return out.empty() ? "x" : out;
+    }
+
+    static std::string literal(const std::string& text)
+    {
+        std::string out = "\"";
+        for (size_t i = 0; i < text.size(); i++) {
+            const uint8_t c = (uint8_t)text[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += (char)c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else if (c == '\r') {
+                out += "\\r";
+            } else if (c == '\t') {
+                out += "\\t";
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\x%02X", c);
+                out += buf;
+            } else {
+                out += (char)c;
+            }
+        }
+        return out + "\"";
+    }
+
+    std::string serialize(int node) const
+    {
+        const JsonNode& n = nodes[node];
+        switch (n.type) {
+        case JsonNode::NUL: return "null";
+        case JsonNode::BOOLEAN:
+        case JsonNode::NUMBER: return n.text;
+        case JsonNode::STRING: return quote(n.text);
+        }
+        const bool object = n.type == JsonNode::OBJECT;
+        std::string out = object ? "{" : "[";
+        for (size_t i = 0; i < n.children.size(); i++) {
+            if (i) out += ",";
+            if (object) out += quote(n.keys[i]) + ":";
+            out += serialize(n.children[i]);
+        }
+        return out + (object ? "}" : "]");
+    }
+
+    static std::string quote(const std::string& s)
+    {
+        std::string out = "\"";
+        for (size_t i = 0; i < s.size(); i++) {
+            const uint8_t c = (uint8_t)s[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += (char)c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else if (c == '\r') {
+                out += "\\r";
+            } else if (c == '\t') {
+                out += "\\t";
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += (char)c;
+            }
+        }
+        return out + "\"";
+    }
+
+    std::string add_rule(const std::string& name, const std::string& body)
+    {
+        std::string unique = rule_name(name);
+        for (int i = 1; used.count(unique); i++) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "%d", i);
+            unique = rule_name(name) + suffix;
+        }
+        used.insert(unique);
+        rules.push_back(std::make_pair(unique, body));
+        return unique;
+    }
+
+    std::string primitive(const std::string& name)
+    {
+        if (primitives.count(name)) {
+            return name;
+        }
+        primitives.insert(name);
+        used.insert(name);
+
+        std::string body;
+        if (name == "ws") {
+            body = "| \" \" | \"\\n\" [ \\t]{0,20}";
+        } else if (name == "char") {
+            body = "[^\"\\\\\\x7F\\x00-\\x1F] | \"\\\\\" ([\"\\\\/bfnrt] | \"u\" [0-9a-fA-F]{4})";
+        } else if (name == "string") {
+            body = "\"\\\"\" " + primitive("char") + "* \"\\\"\" " + primitive("ws");
+        } else if (name == "number") {
+            body = "\"-\"? ([0] | [1-9] [0-9]{0,15}) (\".\" [0-9]+)? ([eE] [-+]? [0-9]{1,3})? " + primitive("ws");
+        } else if (name == "integer") {
+            body = "\"-\"? ([0] | [1-9] [0-9]{0,15}) " + primitive("ws");
+        } else if (name == "boolean") {
+            body = "(\"true\" | \"false\") " + primitive("ws");
+        } else if (name == "null") {
+            body = "\"null\" " + primitive("ws");
+        } else if (name == "value") {
+            body = "object | array | string | number | boolean | null";
+            primitive("object");
+            primitive("array");
+            primitive("string");
+            primitive("number");
+            primitive("boolean");
+            primitive("null");
+        } else if (name == "object") {
+            body = "\"{\" ws (string \":\" ws value (\",\" ws string \":\" ws value)*)? \"}\" ws";
+            primitive("ws");
+            primitive("string");
+            primitive("value");
+        } else if (name == "array") {
+            body = "\"[\" ws (value (\",\" ws value)*)? \"]\" ws";
+            primitive("ws");
+            primitive("value");
+        }
+        rules.push_back(std::make_pair(name, body));
+        return name;
+    }
+
+    std::string visit_ref(const std::string& ref)
+    {
+        std::map<std::string, std::string>::iterator it = refs.find(ref);
+        if (it != refs.end()) {
+            return it->second;
+        }
+
+        int target = -1;
+        std::string name;
+        static const char* prefixes[2] = {"#/definitions/", "#/$defs/"};
+        for (int i = 0; i < 2 && target < 0; i++) {
+            const size_t n = strlen(prefixes[i]);
+            if (ref.compare(0, n, prefixes[i]) == 0) {
+                name = ref.substr(n);
+                const int defs = find(0, prefixes[i][2] == 'd' ? "definitions" : "$defs");
+                target = defs >= 0 ? find(defs, name.c_str()) : -1;
+            }
+        }
+        if (target < 0) {
+            error = "unresolved $ref " + ref;
+            return "value";
+        }
+
+        // named before visiting so recursive schemas refer back to it
+        const std::string rule = add_rule(name, "");
+        refs[ref] = rule;
+        const std::string body = visit(target, name + "-def");
+        for (size_t i = 0; i < rules.size(); i++) {
+            if (rules[i].first == rule) {
+                rules[i].second = body;
+            }
+        }
+        return rule;
+    }
+
+    std::string visit_object(int node, const std::string& name)
+    {
+        const int properties = find(node, "properties");
+        const int additional = find(node, "additionalProperties");
+        if (properties < 0 || nodes[properties].children.empty()) {
+            if (additional >= 0 && nodes[additional].type == JsonNode::BOOLEAN && nodes[additional].text == "false") {
+                return add_rule(name, "\"{\" " + primitive("ws") + " \"}\" ws");
+            }
+            return primitive("object");
+        }
+
+        std::set<std::string> required;
+        const int req = find(node, "required");
+        if (req >= 0 && nodes[req].type == JsonNode::ARRAY) {
+            for (size_t i = 0; i < nodes[req].children.size(); i++) {
+                required.insert(nodes[nodes[req].children[i]].text);
+            }
+        }
+
+        const JsonNode& props = nodes[properties];
+        std::vector<std::string> required_kv;
+        std::vector<std::string> optional_kv;
+        for (size_t i = 0; i < props.keys.size(); i++) {
+            const std::string value = visit(props.children[i], name + "-" + props.keys[i]);
+            const std::string kv = literal(quote(props.keys[i])) + " " + primitive("ws") + " \":\" ws " + value;
+            (required.count(props.keys[i]) ? required_kv : optional_kv).push_back(kv);
+        }
+
+        // properties come in schema order, required ones first, optional ones
+        // may each be left out
+        std::string body;
+        if (!required_kv.empty()) {
+            body = required_kv[0];
+            for (size_t i = 1; i < required_kv.size(); i++) {
+                body += " \",\" ws " + required_kv[i];
+            }
+            for (size_t i = 0; i < optional_kv.size(); i++) {
+                body += " (\",\" ws " + optional_kv[i] + ")?";
+            }
+        } else {
+            std::string alternatives;
+            for (size_t i = 0; i < optional_kv.size(); i++) {
+                if (i) alternatives += " | ";
+                alternatives += optional_kv[i];
+                for (size_t j = i + 1; j < optional_kv.size(); j++) {
+                    alternatives += " (\",\" ws " + optional_kv[j] + ")?";
+                }
+            }
+            body = "(" + alternatives + ")?";
+        }
+        return add_rule(name, "\"{\" ws " + body + " \"}\" ws");
+    }
+
+    std::string visit_array(int node, const std::string& name)
+    {
+        const int items = find(node, "items");
+        const std::string item = items >= 0 ? visit(items, name + "-item") : primitive("value");
+        const int min_items = find_int(node, "minItems", 0);
+        const int max_items = find_int(node, "maxItems", -1);
+        primitive("ws");
+
+        std::string list;
+        if (max_items == 0) {
+            list = "";
+        } else {
+            char count[32];
+            if (max_items < 0) {
+                snprintf(count, sizeof(count), "{%d,}", std::max(min_items - 1, 0));
+            } else {
+                snprintf(count, sizeof(count), "{%d,%d}", std::max(min_items - 1, 0), max_items - 1);
+            }
+            list = item + " (\",\" ws " + item + ")" + count;
+            if (min_items == 0) {
+                list = "(" + list + ")?";
+            }
+        }
+        return add_rule(name, "\"[\" ws " + list + " \"]\" ws");
+    }
+
+    std::string visit_type(int node, const std::string& type, const std::string& name)
+    {
+        if (type == "object") return visit_object(node, name);
+        if (type == "array") return visit_array(node, name);
+        if (type == "number") return primitive("number");
+        if (type == "integer") return primitive("integer");
+        if (type == "boolean") return primitive("boolean");
+        if (type == "null") return primitive("null");
+        if (type == "string") {
+            const int min_length = find_int(node, "minLength", 0);
+            const int max_length = find_int(node, "maxLength", -1);
+            if (min_length == 0 && max_length < 0) {
+                return primitive("string");
+            }
+            char count[32];
+            if (max_length < 0) {
+                snprintf(count, sizeof(count), "{%d,}", min_length);
+            } else {
+                snprintf(count, sizeof(count), "{%d,%d}", min_length, max_length);
+            }
+            return add_rule(name, "\"\\\"\" " + primitive("char") + count + " \"\\\"\" " + primitive("ws"));
+        }
+        error = "unsupported type " + type;
+        return "value";
+    }
+
+    std::string visit(int node, const std::string& name)
+    {
+        if (nodes[node].type != JsonNode::OBJECT) {
+            // true and other non-object schemas accept anything
+            return primitive("value");
+        }
+
+        const int ref = find(node, "$ref");
+        if (ref >= 0) {
+            return visit_ref(nodes[ref].text);
+        }
+
+        const int constant = find(node, "const");
+        if (constant >= 0) {
+            return add_rule(name, literal(serialize(constant)) + " " + primitive("ws"));
+        }
+
+        const int choices = find(node, "enum");
+        if (choices >= 0 && nodes[choices].type == JsonNode::ARRAY) {
+            std::string body;
+            for (size_t i = 0; i < nodes[choices].children.size(); i++) {
+                if (i) body += " | ";
+                body += literal(serialize(nodes[choices].children[i]));
+            }
+            return add_rule(name, "(" + body + ") " + primitive("ws"));
+        }
+
+        int any_of = find(node, "anyOf");
+        if (any_of < 0) any_of = find(node, "oneOf");
+        if (any_of >= 0 && nodes[any_of].type == JsonNode::ARRAY) {
+            std::string body;
+            for (size_t i = 0; i < nodes[any_of].children.size(); i++) {
+                char suffix[16];
+                snprintf(suffix, sizeof(suffix), "-%d", (int)i);
+                if (i) body += " | ";
+                body += visit(nodes[any_of].children[i], name + suffix);
+            }
+            return add_rule(name, body);
+        }
+
+        const int all_of = find(node, "allOf");
+        if (all_of >= 0) {
+            if (nodes[all_of].type == JsonNode::ARRAY && nodes[all_of].children.size() == 1) {
+                return visit(nodes[all_of].children[0], name);
+            }
+            error = "allOf with several schemas is not supported";
+            return "value";
+        }
+
+        const int type = find(node, "type");
+        if (type >= 0 && nodes[type].type == JsonNode::STRING) {
+            return visit_type(node, nodes[type].text, name);
+        }
+        if (type >= 0 && nodes[type].type == JsonNode::ARRAY) {
+            std::string body;
+            for (size_t i = 0; i < nodes[type].children.size(); i++) {
+                const std::string& t = nodes[nodes[type].children[i]].text;
+                if (i) body += " | ";
+                body += visit_type(node, t, name + "-" + t);
+            }
+            return add_rule(name, body);
+        }
+        if (find(node, "properties") >= 0) {
+            return visit_object(node, name);
+        }
+        if (find(node, "items") >= 0) {
+            return visit_array(node, name);
+        }
+        return primitive("value");
+    }
+
+    const std::vector<JsonNode>& nodes;
+    std::vector<std::pair<std::string, std::string> > rules;
+    std::set<std::string> used;
+    std::set<std::string> primitives;
+    std::map<std::string, std::string> refs;
+    std::string error;
+};
+
+bool Grammar::json_schema_to_gbnf(const std::string& schema, std::string& gbnf, std::string* error)
+{
+    std::vector<JsonNode> nodes;
+    const std::string text = schema.empty() ? std::string("{}") : schema;
+    JsonReader reader(text);
+    if (!reader.read(nodes)) {
+        if (error) *error = "schema is not valid JSON";
+        return false;
+    }
+
+    SchemaConverter converter(nodes);
+    std::string message;
+    if (!converter.convert(gbnf, message)) {
+        if (error) *error = message;
+        return false;
+    }
+    return true;
+}
+
+void TokenTrie::build(const Tokenizer& tokenizer, int n_vocab)
+{
+    pieces.resize(n_vocab);
+    tokens.clear();
+    for (int i = 0; i < n_vocab; i++) {
+        pieces[i] = tokenizer.decode(i);
+        if (!pieces[i].empty()) {
+            tokens.push_back(i);
+        }
+    }
+    // sorted by bytes, the tokens below any node are a contiguous run
+    std::sort(tokens.begin(), tokens.end(), [this](int a, int b) { return pieces[a] < pieces[b]; });
+
+    nodes.assign(1, Node());
+    nodes[0].byte = 0;
+    build_node(0, 0, (int)tokens.size(), 0);
+}
+
+// tokens [begin, end) share their first depth bytes, the ones exactly depth
+// long sort first and end at this node
+int TokenTrie::build_node(int node, int begin, int end, int depth)
+{
+    int i = begin;
+    while (i < end && (int)pieces[tokens[i]].size() == depth) i++;
+    nodes[node].token_begin = begin;
+    nodes[node].token_end = i;
+
+    int n_children = 0;
+    for (int j = i; j < end; j++) {
+        if (j == i || pieces[tokens[j]][depth] != pieces[tokens[j - 1]][depth]) n_children++;
+    }
+    const int first = (int)nodes.size();
+    nodes[node].child_begin = first;
+    nodes[node].child_end = first + n_children;
+    nodes.resize(first + n_children);
+
+    int child = first;
+    for (int j = i; j < end;) {
+        const char byte = pieces[tokens[j]][depth];
+        int k = j;
+        while (k < end && pieces[tokens[k]][depth] == byte) k++;
+        nodes[child].byte = (uint8_t)byte;
+        build_node(child, j, k, depth + 1);
+        child++;
+        j = k;
+    }
+    return node;
+}
+
+GrammarState::GrammarState()
+    : grammar(0), allowed_cached(0), current(0), at_start(true), skip_first_space(false)
+{
+}
+
+void GrammarState::init(const Grammar* _grammar, bool _skip_first_space)
+{
+    grammar = _grammar && !_grammar->empty() ? _grammar : 0;
+    at_start = true;
+    skip_first_space = _skip_first_space;
+    frames.clear();
+    frame_ids.clear();
+    expanded.clear();
+    expand_state.clear();
+    sets.clear();
+    set_ids.clear();
+    moves.clear();
+    allowed_cache.clear();
+    allowed_cached = 0;
+
+    // set 0 is the dead set
+    std::vector<int> dead;
+    intern(dead);
+    current = 0;
+    if (!grammar) {
+        return;
+    }
+
+    std::vector<int> tops;
+    const int rule = grammar->rule_start[grammar->root];
+    for (int pos = rule;; pos++) {
+        // every alternative of root on an empty stack
+        expand(is_end(pos) ? -1 : frame(pos, -1), tops, 0);
+        while (!is_end(pos)) pos++;
+        if (grammar->elements[pos].type == Element::END) {
+            break;
+        }
+    }
+    current = intern(tops);
+}
+
+bool GrammarState::is_end(int pos) const
+{
+    const int type = grammar->elements[pos].type;
+    return type == Element::END || type == Element::ALT;
+}
+
+int GrammarState::frame(int pos, int parent)
+{
+    const uint64_t key = (uint64_t)pos << 32 | (uint32_t)(parent + 1);
+    std::unordered_map<uint64_t, int>::iterator it = frame_ids.find(key);
+    if (it != frame_ids.end()) {
+        return it->second;
+    }
+    Frame f = {pos, parent};
+    frames.push_back(f);
+    expanded.push_back(std::vector<int>());
+    expand_state.push_back(0);
+    const int id = (int)frames.size() - 1;
+    frame_ids[key] = id;
+    return id;
+}
+
+// Adds the stacks with a byte set on top that the stack top reaches, rule
+// references are replaced by each of their alternatives
+void GrammarState::expand(int top, std::vector<int>& out, int depth)
+{
+    if (top < 0 || grammar->elements[frames[top].pos].type == Element::BYTES) {
+        out.push_back(top);
+        return;
+    }
+
+    // a left recursive rule would expand forever, it matches nothing instead
+    if (expand_state[top] == 1 || depth > 256) {
+        return;
+    }
+    if (expand_state[top] == 0) {
+        expand_state[top] = 1;
+        const int pos = frames[top].pos;
+        const int parent = frames[top].parent;
+        const int rest = is_end(pos + 1) ? parent : frame(pos + 1, parent);
+
+        std::vector<int> result;
+        const int rule = grammar->rule_start[grammar->elements[pos].value];
+        for (int alt = rule;; alt++) {
+            expand(is_end(alt) ? rest : frame(alt, rest), result, depth + 1);
+            while (!is_end(alt)) alt++;
+            if (grammar->elements[alt].type == Element::END) {
+                break;
+            }
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        expanded[top].swap(result);
+        expand_state[top] = 2;
+    }
+    out.insert(out.end(), expanded[top].begin(), expanded[top].end());
+}
+
+int GrammarState::intern(std::vector<int>& tops)
+{
+    std::sort(tops.begin(), tops.end());
+    tops.erase(std::unique(tops.begin(), tops.end()), tops.end());
+    std::map<std::vector<int>, int>::iterator it = set_ids.find(tops);
+    if (it != set_ids.end()) {
+        return it->second;
+    }
+    const int id = (int)sets.size();
+    set_ids[tops] = id;
+    sets.push_back(tops);
+    return id;
+}
+
+int GrammarState::move(int set, uint8_t byte)
+{
+    const uint64_t key = (uint64_t)set << 8 | byte;
+    std::unordered_map<uint64_t, int>::iterator it = moves.find(key);
+    if (it != moves.end()) {
+        return it->second;
+    }
+
+    std::vector<int> tops;
+    for (size_t i = 0; i < sets[set].size(); i++) {
+        const int top = sets[set][i];
+        if (top < 0) {
+            continue;
+        }
+        const int pos = frames[top].pos;
+        if (!grammar->byte_sets[grammar->elements[pos].value].test(byte)) {
+            continue;
+        }
+        const int parent = frames[top].parent;
+        expand(is_end(pos + 1) ? parent : frame(pos + 1, parent), tops, 0);
+    }
+    const int next = tops.empty() ? 0 : intern(tops);
+    moves[key] = next;
+    return next;
+}
+
+void GrammarState::walk(const TokenTrie& trie, int node, int set, std::vector<int>& allowed)
+{
+    const TokenTrie::Node& n = trie.nodes[node];
+    for (int c = n.child_begin; c < n.child_end; c++) {
+        const TokenTrie::Node& child = trie.nodes[c];
+        const int next = move(set, child.byte);
+        if (next == 0) {
+            continue;
+        }
+        allowed.insert(allowed.end(), trie.tokens.begin() + child.token_begin, trie.tokens.begin() + child.token_end);
+        walk(trie, c, next, allowed);
+    }
+}
+
+const std::vector<int>& GrammarState::allowed_tokens(const TokenTrie& trie, int eos)
+{
+    if (at_start && skip_first_space) {
+        // tokens below the root's space child are matched from the set itself
+        start_allowed.clear();
+        const TokenTrie::Node& root = trie.nodes[0];
+        for (int c = root.child_begin; c < root.child_end && current != 0; c++) {
+            const TokenTrie::Node& child = trie.nodes[c];
+            if (child.byte == ' ') {
+                walk(trie, c, current, start_allowed);
+                continue;
+            }
+            const int next = move(current, child.byte);
+            if (next != 0) {
+                start_allowed.insert(start_allowed.end(), trie.tokens.begin() + child.token_begin, trie.tokens.begin() + child.token_end);
+                walk(trie, c, next, start_allowed);
+            }
+        }
+        if (eos >= 0 && can_end()) {
+            start_allowed.push_back(eos);
+        }
+        return start_allowed;
+    }
+
+    std::unordered_map<int, std::vector<int> >::iterator it = allowed_cache.find(current);
+    if (it != allowed_cache.end()) {
+        return it->second;
+    }
+
+    // the lists of large sets can be as long as the vocabulary
+    if (allowed_cached > ((size_t)1 << 22)) {
+        allowed_cache.clear();
+        allowed_cached = 0;
+    }
+
+    std::vector<int>& allowed = allowed_cache[current];
+    if (current != 0 && !trie.empty()) {
+        walk(trie, 0, current, allowed);
+    }
+    if (eos >= 0 && can_end()) {
+        allowed.push_back(eos);
+    }
+    allowed_cached += allowed.size();
+    return allowed;
+}
+
+bool GrammarState::accept(const std::string& bytes)
+{
+    if (!grammar) {
+        return true;
+    }
+    size_t i = 0;
+    if (at_start && !bytes.empty()) {
+        at_start = false;
+        if (skip_first_space && bytes[0] == ' ') {
+            i = 1;
+        }
+    }
+    for (; i < bytes.size() && current != 0; i++) {
+        current = move(current, (uint8_t)bytes[i]);
+    }
+    return current != 0;
+}
+
+bool GrammarState::can_end() const
+{
+    return !grammar || (!sets[current].empty() && sets[current][0] == -1);
+}
+
+} // namespace ncnn
@@ -0,0 +1,141 @@
+#ifndef LLM_GRAMMAR_H
+#define LLM_GRAMMAR_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ncnn {
+
+class Tokenizer;
+
+// Context-free grammar the generated text has to follow, written in GBNF
+//   root  ::= "{" ws pair ( "," ws pair )* "}"
+//   pair  ::= "\"" [a-z]+ "\"" ws ":" ws [0-9]+
+//   ws    ::= [ \t\n]*
+// a rule is alternatives of sequences of "literals", [character classes],
+// . and rule names, grouped with ( ) and repeated with * + ? {m} {m,} {m,n},
+// # starts a comment and parsing starts at the rule named root
+// character classes are compiled into the UTF-8 byte sequences they match, so
+// matching, and the token trie below, work on bytes only
+class Grammar {
+public:
+    struct Element {
+        enum { END = 0, ALT, RULE_REF, BYTES };
+        int type;
+        int value; // rule of RULE_REF, byte set of BYTES
+    };
+    struct ByteSet {
+        uint64_t bits[4];
+        bool test(uint8_t b) const { return (bits[b >> 6] >> (b & 63)) & 1; }
+    };
+
+    Grammar();
+
+    // false with a message in error when the text does not compile
+    bool parse(const std::string& gbnf, std::string* error = 0);
+    bool parse_json_schema(const std::string& schema, std::string* error = 0);
+
+    // GBNF accepting the JSON documents described by the schema: types,
+    // properties with required, items, enum, const, anyOf, oneOf and $ref into
+    // definitions or $defs, an empty schema accepts any JSON value
+    static bool json_schema_to_gbnf(const std::string& schema, std::string& gbnf, std::string* error = 0);
+
+    bool empty() const { return elements.empty(); }
+
+    // the rules back to back, alternatives split by ALT and every rule ended by END
+    std::vector<Element> elements;
+    std::vector<int> rule_start;
+    std::vector<ByteSet> byte_sets;
+    int root;
+};
+
+// The byte string of every token in a trie, tokens sharing a prefix are
+// matched against a grammar once for that prefix and a prefix the grammar
+// rejects rules out every token below it
+class TokenTrie {
+public:
+    // control tokens have no text and are left out
+    void build(const Tokenizer& tokenizer, int n_vocab);
+    bool empty() const { return nodes.empty(); }
+    const std::string& piece(int token) const { return pieces[token]; }
+
+private:
+    friend class GrammarState;
+
+    struct Node {
+        uint8_t byte;
+        int child_begin; // children are nodes [child_begin, child_end)
+        int child_end;
+        int token_begin; // tokens spelled by the path to this node
+        int token_end;
+    };
+
+    int build_node(int node, int begin, int end, int depth);
+
+    std::vector<Node> nodes; // nodes[0] is the root
+    std::vector<int> tokens;
+    std::vector<std::string> pieces;
+};
+
+// Position of one sequence in a grammar
+// the parse is a set of stacks of grammar positions, stacks are hash consed
+// into frames and stack sets interned, so the move of a set on a byte and the
+// tokens a set allows are computed once and looked up from then on: matching
+// inside a long string literal returns to the same set after every token
+class GrammarState {
+public:
+    GrammarState();
+
+    // skip_first_space matches the first token without a leading space, the
+    // way decoding drops the space a SentencePiece encoder prepended
+    void init(const Grammar* grammar, bool skip_first_space = false);
+    bool active() const { return grammar != 0; }
+
+    // every token that can come next, eos too once the text may end here
+    // empty when the grammar is stuck
+    const std::vector<int>& allowed_tokens(const TokenTrie& trie, int eos);
+
+    // moves past the bytes of a token, false when the grammar rejects them
+    bool accept(const std::string& bytes);
+
+    // the text so far is complete
+    bool can_end() const;
+
+private:
+    struct Frame {
+        int pos;    // element on top of the stack
+        int parent; // rest of the stack, -1 for none
+    };
+
+    bool is_end(int pos) const;
+    int frame(int pos, int parent);
+    void expand(int top, std::vector<int>& out, int depth);
+    int intern(std::vector<int>& tops);
+    int move(int set, uint8_t byte);
+    void walk(const TokenTrie& trie, int node, int set, std::vector<int>& allowed);
+
+    const Grammar* grammar;
+    std::vector<Frame> frames;
+    std::unordered_map<uint64_t, int> frame_ids;
+    // stack tops a RULE_REF frame expands to, filled on first use
+    std::vector<std::vector<int> > expanded;
+    std::vector<char> expand_state; // 0 not yet, 1 in progress, 2 done
+
+    // sorted stack tops, -1 is an empty stack meaning the text is complete
+    std::vector<std::vector<int> > sets;
+    std::map<std::vector<int>, int> set_ids;
+    std::unordered_map<uint64_t, int> moves; // set << 8 | byte -> set
+    std::unordered_map<int, std::vector<int> > allowed_cache;
+    size_t allowed_cached;
+    std::vector<int> start_allowed;
+    int current;
+    bool at_start;
+    bool skip_first_space;
+};
+
+} // namespace ncnn
+
+#endif // LLM_GRAMMAR_H
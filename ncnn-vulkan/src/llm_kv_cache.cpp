@@ -0,0 +1,142 @@
+#include "llm_kv_cache.h"
+#include "allocator.h"
+
+namespace ncnn {
+
+KVPool::KVPool()
+    : n_layers(0), kv_dim(0), type(GGML_TYPE_F32), row_bytes(0)
+{
+}
+
+KVPool::~KVPool()
+{
+    free_all();
+}
+
+void KVPool::init(int _n_layers, int _kv_dim, ggml_type _type)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    free_all();
+    n_layers = _n_layers;
+    kv_dim = _kv_dim;
+    type = _type;
+    row_bytes = ggml_row_size(type, kv_dim);
+}
+
+void KVPool::free_all()
+{
+    for (size_t i = 0; i < pages.size(); i++) {
+        fastFree(pages[i]);
+    }
+    pages.clear();
+    refcounts.clear();
+    free_pages.clear();
+}
+
+int KVPool::alloc()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!free_pages.empty()) {
+        int page = free_pages.back();
+        free_pages.pop_back();
+        refcounts[page] = 1;
+        return page;
+    }
+
+    char* data = (char*)fastMalloc(page_bytes());
+    if (!data) {
+        return -1;
+    }
+    pages.push_back(data);
+    refcounts.push_back(1);
+    return (int)pages.size() - 1;
+}
+
+void KVPool::retain(int page)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    refcounts[page]++;
+}
+
+void KVPool::release(int page)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--refcounts[page] == 0) {
+        free_pages.push_back(page);
+    }
+}
+
+int KVPool::refcount(int page) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return refcounts[page];
+}
+
+int KVPool::used_pages() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)(pages.size() - free_pages.size());
+}
+
+KVCache::KVCache(const KVCache& other)
+    : pool(other.pool), blocks(other.blocks), n_past(other.n_past), n_dropped(other.n_dropped)
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i] >= 0) {
+            pool->retain(blocks[i]);
+        }
+    }
+}
+
+KVCache& KVCache::operator=(const KVCache& other)
+{
+    if (this != &other) {
+        for (size_t i = 0; i < other.blocks.size(); i++) {
+            if (other.blocks[i] >= 0) {
+                other.pool->retain(other.blocks[i]);
+            }
+        }
+        clear();
+        pool = other.pool;
+        blocks = other.blocks;
+        n_past = other.n_past;
+        n_dropped = other.n_dropped;
+    }
+    return *this;
+}
+
+KVCache::~KVCache()
+{
+    clear();
+}
+
+void KVCache::clear()
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i] >= 0) {
+            pool->release(blocks[i]);
+        }
+    }
+    blocks.clear();
+    n_past = 0;
+    n_dropped = 0;
+}
+
+void KVCache::truncate(int n)
+{
+    if (n >= n_past) {
+        return;
+    }
+    n_past = n < 0 ? 0 : n;
+    const size_t n_blocks = (n_past + KVPool::block_size - 1) / KVPool::block_size;
+    for (size_t i = n_blocks; i < blocks.size(); i++) {
+        if (blocks[i] >= 0) {
+            pool->release(blocks[i]);
+        }
+    }
+    if (blocks.size() > n_blocks) {
+        blocks.resize(n_blocks);
+    }
+}
+
+} // namespace ncnn
@@ -0,0 +1,88 @@
+#ifndef LLM_KV_CACHE_H
+#define LLM_KV_CACHE_H
+
+#include "gguf.h"
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+namespace ncnn {
+
+// Fixed-size pages of key/value rows shared by every sequence of an engine
+// a page holds block_size consecutive positions of all layers, laid out as
+// [layer][key, value][row], and is reference counted so sequences and the
+// prefix cache can share pages and copy one only before writing it
+// rows are stored as type (f32, f16, bf16, q8_0 or q4_0), quantized blocks
+// never straddle two heads so attention can read one head of a row
+// freed pages are kept for reuse instead of going back to the system
+class KVPool {
+public:
+    static const int block_size = 32;
+
+    KVPool();
+    ~KVPool();
+
+    // drops every page, pages still referenced by a cache must not be used after this
+    void init(int n_layers, int kv_dim, ggml_type type = GGML_TYPE_F32);
+
+    // a fresh page with one reference, -1 when out of memory
+    int alloc();
+    void retain(int page);
+    void release(int page);
+    int refcount(int page) const;
+
+    char* key(int page, int layer, int row) const { return pages[page] + ((size_t)(layer * 2) * block_size + row) * row_bytes; }
+    char* value(int page, int layer, int row) const { return pages[page] + ((size_t)(layer * 2 + 1) * block_size + row) * row_bytes; }
+    size_t page_bytes() const { return (size_t)n_layers * 2 * block_size * row_bytes; }
+    ggml_type row_type() const { return type; }
+    size_t row_size() const { return row_bytes; }
+
+    int used_pages() const;
+    int total_pages() const { return (int)pages.size(); }
+
+private:
+    KVPool(const KVPool&);
+    KVPool& operator=(const KVPool&);
+
+    void free_all();
+
+    int n_layers;
+    int kv_dim;
+    ggml_type type;
+    size_t row_bytes;
+    std::vector<char*> pages;
+    std::vector<int> refcounts;
+    std::vector<int> free_pages;
+    // sequences may be released from other threads than the one decoding
+    mutable std::mutex mutex;
+};
+
+// Per-layer key/value history of one sequence, read through its block table
+// keys are stored after RoPE so decode steps only project the new token
+// copies share pages, the engine copies a shared page before writing into it
+// a sliding window model releases the pages behind its window, their entries
+// become -1 and are never read again
+struct KVCache {
+    KVPool* pool;
+    std::vector<int> blocks; // page of positions [i * block_size, (i + 1) * block_size)
+    int n_past;              // number of positions filled
+    int n_dropped;           // positions removed by context shifts, the rows no longer match a plain run of the tokens
+
+    KVCache() : pool(0), n_past(0), n_dropped(0) {}
+    KVCache(const KVCache& other);
+    KVCache& operator=(const KVCache& other);
+    ~KVCache();
+
+    // releases every page
+    void clear();
+    // forgets positions from n on, pages left without a position are released
+    void truncate(int n);
+    int capacity() const { return (int)blocks.size() * KVPool::block_size; }
+
+    char* key(int layer, int pos) const { return pool->key(blocks[pos / KVPool::block_size], layer, pos % KVPool::block_size); }
+    char* value(int layer, int pos) const { return pool->value(blocks[pos / KVPool::block_size], layer, pos % KVPool::block_size); }
+};
+
+} // namespace ncnn
+
+#endif // LLM_KV_CACHE_H
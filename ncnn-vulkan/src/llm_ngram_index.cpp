@@ -0,0 +1,70 @@
+#include "llm_ngram_index.h"
+#include <algorithm>
+
+namespace ncnn {
+
+NgramIndex::NgramIndex(int _max_n)
+    : max_n(std::max(1, _max_n)), n_indexed(0)
+{
+    // single tokens repeat too often to say much about what follows
+    min_n = std::min(2, max_n);
+    last.resize(max_n - min_n + 1);
+}
+
+void NgramIndex::clear()
+{
+    for (size_t i = 0; i < last.size(); i++) {
+        last[i].clear();
+    }
+    n_indexed = 0;
+}
+
+// FNV-1a over the token ids
+uint64_t NgramIndex::hash(const int* tokens, int n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (uint32_t)tokens[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void NgramIndex::update(const std::vector<int>& tokens)
+{
+    if ((int)tokens.size() < n_indexed) {
+        clear();
+    }
+
+    // the n-grams ending just before position p are followed by tokens[p]
+    for (int p = std::max(1, n_indexed); p < (int)tokens.size(); p++) {
+        for (int n = min_n; n <= max_n && n <= p; n++) {
+            last[n - min_n][hash(&tokens[p - n], n)] = p;
+        }
+    }
+    n_indexed = (int)tokens.size();
+}
+
+int NgramIndex::propose(const std::vector<int>& tokens, int max_tokens, std::vector<int>& out) const
+{
+    const int size = (int)tokens.size();
+    for (int n = std::min(max_n, size); n >= min_n && max_tokens > 0; n--) {
+        const int* suffix = &tokens[size - n];
+        std::unordered_map<uint64_t, int>::const_iterator it = last[n - min_n].find(hash(suffix, n));
+        if (it == last[n - min_n].end()) {
+            continue;
+        }
+
+        // a hash collision must not turn into proposals
+        const int p = it->second;
+        if (p > size || !std::equal(suffix, suffix + n, &tokens[p - n])) {
+            continue;
+        }
+
+        const int count = std::min(max_tokens, size - p);
+        out.insert(out.end(), tokens.begin() + p, tokens.begin() + p + count);
+        return count;
+    }
+    return 0;
+}
+
+} // namespace ncnn
@@ -0,0 +1,42 @@
+#ifndef LLM_NGRAM_INDEX_H
+#define LLM_NGRAM_INDEX_H
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace ncnn {
+
+// Where each n-gram of a token sequence last occurred, for prompt lookup
+// speculation: the tokens that followed the latest earlier occurrence of the
+// sequence's last n tokens are proposed as its continuation
+// the index grows with the sequence, so it is built over the prompt once and
+// extended by every generated token, only n-grams that already have a
+// following token are indexed so a match never points at the sequence's end
+class NgramIndex {
+public:
+    // n-grams of max_n tokens down to 2 are matched, longest first
+    explicit NgramIndex(int max_n = 3);
+
+    void clear();
+
+    // indexes the tokens appended since the last call, tokens must only grow
+    void update(const std::vector<int>& tokens);
+
+    // appends up to max_tokens tokens predicted to follow tokens to out,
+    // returns how many, update must have seen tokens first
+    int propose(const std::vector<int>& tokens, int max_tokens, std::vector<int>& out) const;
+
+private:
+    static uint64_t hash(const int* tokens, int n);
+
+    int max_n;
+    int min_n;
+    int n_indexed;
+    // per length n - min_n, hash of n tokens -> position of the token after them
+    std::vector<std::unordered_map<uint64_t, int> > last;
+};
+
+} // namespace ncnn
+
+#endif // LLM_NGRAM_INDEX_H
@@ -0,0 +1,216 @@
+#include "llm_prefix_cache.h"
+#include "llm_kv_cache.h"
+
+namespace ncnn {
+
+PrefixCache::PrefixCache()
+    : pool(0), max_bytes(0), used_bytes(0), clock(0)
+{
+}
+
+PrefixCache::~PrefixCache()
+{
+    clear();
+}
+
+void PrefixCache::set_pool(KVPool* _pool)
+{
+    clear();
+    pool = _pool;
+}
+
+void PrefixCache::set_budget(size_t bytes)
+{
+    max_bytes = bytes;
+    if (max_bytes == 0) {
+        clear();
+    } else {
+        evict();
+    }
+}
+
+void PrefixCache::clear()
+{
+    for (std::unordered_map<int, Node*>::iterator it = root.children.begin(); it != root.children.end(); ++it) {
+        free_node(it->second);
+    }
+    root.children.clear();
+    used_bytes = 0;
+}
+
+void PrefixCache::free_node(Node* node)
+{
+    for (std::unordered_map<int, Node*>::iterator it = node->children.begin(); it != node->children.end(); ++it) {
+        free_node(it->second);
+    }
+    for (size_t i = 0; i < node->pages.size(); i++) {
+        pool->release(node->pages[i]);
+    }
+    delete node;
+}
+
+// a page at an edge boundary is counted by both nodes holding it
+size_t PrefixCache::node_bytes(const Node* node) const
+{
+    return node->pages.size() * pool->page_bytes();
+}
+
+int PrefixCache::lookup(const int* tokens, int n_tokens, KVCache& cache)
+{
+    if (!pool || max_bytes == 0 || n_tokens <= 0 || !cache.blocks.empty()) {
+        return 0;
+    }
+    cache.pool = pool;
+
+    const int B = KVPool::block_size;
+    clock++;
+    Node* node = &root;
+    int n = 0;
+    while (n < n_tokens) {
+        std::unordered_map<int, Node*>::iterator it = node->children.find(tokens[n]);
+        if (it == node->children.end()) {
+            break;
+        }
+        Node* child = it->second;
+
+        const int edge = (int)child->tokens.size();
+        int m = 0;
+        while (m < edge && n + m < n_tokens && child->tokens[m] == tokens[n + m]) {
+            m++;
+        }
+
+        // a deeper node's copy of a boundary page holds every row up to its
+        // own end, so it replaces the page taken from the parent
+        for (int b = n / B; b <= (n + m - 1) / B; b++) {
+            const int page = child->pages[b - child->start / B];
+            pool->retain(page);
+            if (b < (int)cache.blocks.size()) {
+                pool->release(cache.blocks[b]);
+                cache.blocks[b] = page;
+            } else {
+                cache.blocks.push_back(page);
+            }
+        }
+        child->last_used = clock;
+        n += m;
+
+        if (m < edge) {
+            break;
+        }
+        node = child;
+    }
+
+    cache.n_past = n;
+    return n;
+}
+
+void PrefixCache::insert(const int* tokens, int n_tokens, const KVCache& cache)
+{
+    if (!pool || max_bytes == 0 || n_tokens <= 0 || cache.pool != pool || cache.n_past < n_tokens) {
+        return;
+    }
+
+    const int B = KVPool::block_size;
+    clock++;
+    Node* node = &root;
+    int n = 0;
+    while (n < n_tokens) {
+        std::unordered_map<int, Node*>::iterator it = node->children.find(tokens[n]);
+        if (it == node->children.end()) {
+            // the rest of the sequence becomes a new leaf sharing its pages
+            Node* leaf = new Node;
+            leaf->tokens.assign(tokens + n, tokens + n_tokens);
+            leaf->start = n;
+            for (int b = n / B; b <= (n_tokens - 1) / B; b++) {
+                pool->retain(cache.blocks[b]);
+                leaf->pages.push_back(cache.blocks[b]);
+            }
+            leaf->parent = node;
+            leaf->last_used = clock;
+            node->children[tokens[n]] = leaf;
+            used_bytes += node_bytes(leaf);
+            break;
+        }
+
+        Node* child = it->second;
+        const int edge = (int)child->tokens.size();
+        int m = 0;
+        while (m < edge && n + m < n_tokens && child->tokens[m] == tokens[n + m]) {
+            m++;
+        }
+        if (m < edge) {
+            split(child, m);
+        }
+        child->last_used = clock;
+        n += m;
+        node = child;
+    }
+
+    evict();
+}
+
+// cuts the edge of node after n tokens, the rest moves to a new child
+void PrefixCache::split(Node* node, int n)
+{
+    const int B = KVPool::block_size;
+    used_bytes -= node_bytes(node);
+
+    Node* tail = new Node;
+    tail->tokens.assign(node->tokens.begin() + n, node->tokens.end());
+    tail->start = node->start + n;
+
+    // the page holding the cut is kept by both halves
+    const int first_tail = tail->start / B - node->start / B;
+    const int keep = (tail->start - 1) / B - node->start / B + 1;
+    tail->pages.assign(node->pages.begin() + first_tail, node->pages.end());
+    for (size_t i = 0; i < tail->pages.size(); i++) {
+        pool->retain(tail->pages[i]);
+    }
+    for (size_t i = keep; i < node->pages.size(); i++) {
+        pool->release(node->pages[i]);
+    }
+    node->pages.resize(keep);
+
+    tail->children.swap(node->children);
+    for (std::unordered_map<int, Node*>::iterator it = tail->children.begin(); it != tail->children.end(); ++it) {
+        it->second->parent = tail;
+    }
+    tail->parent = node;
+    tail->last_used = node->last_used;
+
+    node->tokens.resize(n);
+    node->children[tail->tokens[0]] = tail;
+    used_bytes += node_bytes(node) + node_bytes(tail);
+}
+
+// drops least recently used leaves until the cache fits its budget
+// a lookup touches every node on its path, so a parent is never older than
+// its children and removing leaves first keeps every kept prefix reachable
+void PrefixCache::evict()
+{
+    while (used_bytes > max_bytes) {
+        Node* oldest = 0;
+        std::vector<Node*> stack(1, &root);
+        while (!stack.empty()) {
+            Node* node = stack.back();
+            stack.pop_back();
+            if (node != &root && node->children.empty()) {
+                if (!oldest || node->last_used < oldest->last_used) {
+                    oldest = node;
+                }
+            }
+            for (std::unordered_map<int, Node*>::iterator it = node->children.begin(); it != node->children.end(); ++it) {
+                stack.push_back(it->second);
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+
+        oldest->parent->children.erase(oldest->tokens[0]);
+        used_bytes -= node_bytes(oldest);
+        free_node(oldest);
+    }
+}
+
+} // namespace ncnn
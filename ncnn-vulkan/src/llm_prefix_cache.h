@@ -0,0 +1,66 @@
+#ifndef LLM_PREFIX_CACHE_H
+#define LLM_PREFIX_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace ncnn {
+
+class KVPool;
+struct KVCache;
+
+// Keys and values of previously prefilled token sequences, shared across requests
+// a radix tree keyed on token ids, every edge holds references to the KV pages
+// its positions live in, so a prompt that starts like an earlier one maps the
+// matching pages into its block table instead of running those tokens again
+// the pages are copied on write, so sharing a partly matching page is safe
+// leaves are evicted least recently used first once the budget is exceeded
+class PrefixCache {
+public:
+    PrefixCache();
+    ~PrefixCache();
+
+    // pool the cached pages come from, clears the cache
+    void set_pool(KVPool* pool);
+    // bytes of K/V pages kept, 0 disables the cache and drops what it holds
+    void set_budget(size_t bytes);
+    size_t budget() const { return max_bytes; }
+    size_t size() const { return used_bytes; }
+    void clear();
+
+    // points the empty cache at the pages of the longest cached prefix of
+    // tokens[0, n_tokens) and returns its length
+    int lookup(const int* tokens, int n_tokens, KVCache& cache);
+
+    // remembers positions [0, n_tokens) of cache as the K/V of tokens
+    void insert(const int* tokens, int n_tokens, const KVCache& cache);
+
+private:
+    struct Node {
+        std::vector<int> tokens;   // edge label
+        int start;                 // position of the first edge token
+        std::vector<int> pages;    // pages of blocks start / block_size onwards
+        std::unordered_map<int, Node*> children; // keyed by their first token
+        Node* parent;
+        uint64_t last_used;
+
+        Node() : start(0), parent(0), last_used(0) {}
+    };
+
+    size_t node_bytes(const Node* node) const;
+    void free_node(Node* node);
+    void split(Node* node, int n);
+    void evict();
+
+    KVPool* pool;
+    Node root;
+    size_t max_bytes;
+    size_t used_bytes;
+    uint64_t clock;
+};
+
+} // namespace ncnn
+
+#endif // LLM_PREFIX_CACHE_H
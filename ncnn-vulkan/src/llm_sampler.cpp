@@ -0,0 +1,293 @@
+#include "llm_sampler.h"
+#include "llm_engine.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+namespace ncnn {
+
+Sampler::Sampler()
+    : n_vocab(0), n_candidates(0), sorted(false)
+{
+}
+
+void Sampler::init(int _n_vocab, int64_t seed)
+{
+    n_vocab = _n_vocab;
+    rng.seed(seed < 0 ? std::random_device()() : (uint32_t)seed);
+
+    penalized.resize(n_vocab);
+    counts.assign(n_vocab, 0);
+    seen.clear();
+    candidates.resize(n_vocab);
+    n_candidates = 0;
+}
+
+int Sampler::sample(const float* logits, const GenerationConfig& config, const std::vector<int>& history, const std::vector<int>* allowed)
+{
+    logits = apply_penalties(logits, config, history);
+    if (!config.do_sample || config.temperature <= 0) {
+        return greedy(logits, allowed);
+    }
+
+    const int n = prepare(logits, config, allowed);
+    float r = uniform();
+    for (int i = 0; i < n; i++) {
+        r -= candidates[i].p;
+        if (r <= 0.f) {
+            return candidates[i].id;
+        }
+    }
+    // rounding left a little mass over, it belongs to the last candidate
+    return candidates[n - 1].id;
+}
+
+void Sampler::probs(const float* logits, const GenerationConfig& config, const std::vector<int>& history, std::vector<float>& out, const std::vector<int>* allowed)
+{
+    out.resize(n_vocab);
+    probs(logits, config, history, out.data(), allowed);
+}
+
+void Sampler::probs(const float* logits, const GenerationConfig& config, const std::vector<int>& history, float* out, const std::vector<int>* allowed)
+{
+    std::fill(out, out + n_vocab, 0.f);
+    logits = apply_penalties(logits, config, history);
+    if (!config.do_sample || config.temperature <= 0) {
+        out[greedy(logits, allowed)] = 1.f;
+        return;
+    }
+
+    const int n = prepare(logits, config, allowed);
+    for (int i = 0; i < n; i++) {
+        out[candidates[i].id] = candidates[i].p;
+    }
+}
+
+int Sampler::draw(const float* weights, int n)
+{
+    float sum = 0.f;
+    for (int i = 0; i < n; i++) sum += weights[i];
+    float r = uniform() * sum;
+    int last = 0;
+    for (int i = 0; i < n; i++) {
+        if (weights[i] <= 0.f) {
+            continue;
+        }
+        last = i;
+        r -= weights[i];
+        if (r <= 0.f) {
+            return i;
+        }
+    }
+    return last;
+}
+
+float Sampler::uniform()
+{
+    return std::uniform_real_distribution<float>(0.f, 1.f)(rng);
+}
+
+// Penalizes every token of the history once, by how often it occurs for the
+// frequency penalty, returns logits untouched when no penalty is set
+const float* Sampler::apply_penalties(const float* logits, const GenerationConfig& config, const std::vector<int>& history)
+{
+    const bool repetition = config.repetition_penalty != 1.0f;
+    if (history.empty() || (!repetition && config.presence_penalty == 0.f && config.frequency_penalty == 0.f)) {
+        return logits;
+    }
+
+    for (size_t i = 0; i < history.size(); i++) {
+        const int token = history[i];
+        if (token >= 0 && token < n_vocab && counts[token]++ == 0) {
+            seen.push_back(token);
+        }
+    }
+
+    memcpy(penalized.data(), logits, n_vocab * sizeof(float));
+    for (size_t i = 0; i < seen.size(); i++) {
+        const int token = seen[i];
+        float logit = penalized[token];
+        if (repetition) {
+            logit = logit > 0.f ? logit / config.repetition_penalty : logit * config.repetition_penalty;
+        }
+        logit -= config.presence_penalty + config.frequency_penalty * counts[token];
+        penalized[token] = logit;
+        counts[token] = 0;
+    }
+    seen.clear();
+
+    return penalized.data();
+}
+
+int Sampler::greedy(const float* logits, const std::vector<int>* allowed) const
+{
+    if (allowed && !allowed->empty()) {
+        int max_id = (*allowed)[0];
+        for (size_t i = 1; i < allowed->size(); i++) {
+            if (logits[(*allowed)[i]] > logits[max_id]) {
+                max_id = (*allowed)[i];
+            }
+        }
+        return max_id;
+    }
+
+    int max_id = 0;
+    for (int i = 1; i < n_vocab; i++) {
+        if (logits[i] > logits[max_id]) {
+            max_id = i;
+        }
+    }
+    return max_id;
+}
+
+// Runs the sampling stages, candidates [0, n) hold the final distribution
+int Sampler::prepare(const float* logits, const GenerationConfig& config, const std::vector<int>* allowed)
+{
+    if (allowed && !allowed->empty()) {
+        n_candidates = (int)allowed->size();
+        for (int i = 0; i < n_candidates; i++) {
+            candidates[i].id = (*allowed)[i];
+            candidates[i].logit = logits[(*allowed)[i]];
+        }
+    } else {
+        for (int i = 0; i < n_vocab; i++) {
+            candidates[i].id = i;
+            candidates[i].logit = logits[i];
+        }
+        n_candidates = n_vocab;
+    }
+    sorted = false;
+
+    if (config.top_k > 0 && config.top_k < n_candidates) {
+        top_k(config.top_k);
+    }
+    softmax(config.temperature);
+    if (config.min_p > 0.f) {
+        min_p(config.min_p);
+    }
+    if (config.typical_p < 1.0f) {
+        typical(config.typical_p);
+    }
+    if (config.top_p < 1.0f) {
+        top_p(config.top_p);
+    }
+    return n_candidates;
+}
+
+void Sampler::top_k(int k)
+{
+    Candidate* c = candidates.data();
+    auto logit_greater = [](const Candidate& a, const Candidate& b) { return a.logit > b.logit; };
+    std::nth_element(c, c + k, c + n_candidates, logit_greater);
+    std::sort(c, c + k, logit_greater);
+    n_candidates = k;
+    sorted = true;
+}
+
+void Sampler::softmax(float temperature)
+{
+    float max_logit = candidates[0].logit;
+    if (!sorted) {
+        for (int i = 1; i < n_candidates; i++) {
+            max_logit = std::max(max_logit, candidates[i].logit);
+        }
+    }
+
+    const float inv_temperature = 1.f / temperature;
+    float sum = 0.f;
+    for (int i = 0; i < n_candidates; i++) {
+        candidates[i].p = expf((candidates[i].logit - max_logit) * inv_temperature);
+        sum += candidates[i].p;
+    }
+    const float inv_sum = 1.f / sum;
+    for (int i = 0; i < n_candidates; i++) {
+        candidates[i].p *= inv_sum;
+    }
+}
+
+// drops tokens less likely than p times the most likely one, keeps the order
+void Sampler::min_p(float p)
+{
+    float max_p = 0.f;
+    for (int i = 0; i < n_candidates; i++) {
+        max_p = std::max(max_p, candidates[i].p);
+    }
+
+    const float threshold = p * max_p;
+    int n = 0;
+    for (int i = 0; i < n_candidates; i++) {
+        if (candidates[i].p >= threshold) {
+            candidates[n++] = candidates[i];
+        }
+    }
+    n_candidates = n;
+    normalize();
+}
+
+// Length of the shortest head of c[0, n) in the order of before that holds
+// mass p, the head is sorted in a few growing steps instead of sorting all n
+// the first n_sorted candidates are in order already
+template<typename T, typename Before>
+static int head_with_mass(T* c, int n, int n_sorted, float p, Before before)
+{
+    int head = std::min(n, 64);
+    float cumsum = 0.f;
+    for (int i = 0;; i++) {
+        if (i == n_sorted) {
+            if (n_sorted == n) {
+                return n;
+            }
+            head = std::max(head, std::min(n, n_sorted * 8));
+            if (head < n) {
+                std::nth_element(c + n_sorted, c + head, c + n, before);
+            }
+            std::sort(c + n_sorted, c + head, before);
+            n_sorted = head;
+        }
+        cumsum += c[i].p;
+        if (cumsum >= p) {
+            return i + 1;
+        }
+    }
+}
+
+// keeps the tokens whose surprise is closest to the entropy, up to mass p
+void Sampler::typical(float p)
+{
+    float entropy = 0.f;
+    for (int i = 0; i < n_candidates; i++) {
+        const float pi = candidates[i].p;
+        if (pi > 0.f) {
+            entropy -= pi * logf(pi);
+        }
+    }
+
+    // the logit slot is free after the softmax, it holds the distance
+    for (int i = 0; i < n_candidates; i++) {
+        const float pi = candidates[i].p;
+        candidates[i].logit = pi > 0.f ? fabsf(-logf(pi) - entropy) : INFINITY;
+    }
+    n_candidates = head_with_mass(candidates.data(), n_candidates, 0, p,
+                                  [](const Candidate& a, const Candidate& b) { return a.logit < b.logit; });
+    sorted = false;
+    normalize();
+}
+
+// keeps the most likely tokens up to mass p
+void Sampler::top_p(float p)
+{
+    n_candidates = head_with_mass(candidates.data(), n_candidates, sorted ? n_candidates : 0, p,
+                                  [](const Candidate& a, const Candidate& b) { return a.p > b.p; });
+    sorted = true;
+    normalize();
+}
+
+void Sampler::normalize()
+{
+    float sum = 0.f;
+    for (int i = 0; i < n_candidates; i++) sum += candidates[i].p;
+    const float inv_sum = 1.f / sum;
+    for (int i = 0; i < n_candidates; i++) candidates[i].p *= inv_sum;
+}
+
+} // namespace ncnn
@@ -0,0 +1,72 @@
+#ifndef LLM_SAMPLER_H
+#define LLM_SAMPLER_H
+
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+namespace ncnn {
+
+struct GenerationConfig;
+
+// Picks the next token from the logits through a chain of stages: repetition,
+// presence and frequency penalties, then greedy or top-k, temperature, min-p,
+// typical and top-p before drawing one token
+// one sampler belongs to one sequence, it keeps the random generator of that
+// sequence and buffers sized for the vocabulary so no step allocates
+// a grammar narrows the candidates to the tokens it allows before any stage
+// top-k selects with nth_element, top-p sorts only as much of the candidates
+// as it needs to reach its mass
+class Sampler {
+public:
+    Sampler();
+
+    // sizes the buffers for n_vocab tokens and seeds the generator, a
+    // negative seed draws one at random
+    void init(int n_vocab, int64_t seed = -1);
+
+    // allowed restricts the draw to those tokens, the logits of every other
+    // token are never read
+    int sample(const float* logits, const GenerationConfig& config, const std::vector<int>& history, const std::vector<int>* allowed = 0);
+
+    // the distribution sample draws from over the whole vocabulary, one-hot on
+    // the most likely token when not sampling
+    void probs(const float* logits, const GenerationConfig& config, const std::vector<int>& history, std::vector<float>& out, const std::vector<int>* allowed = 0);
+    // the same into n_vocab floats at out
+    void probs(const float* logits, const GenerationConfig& config, const std::vector<int>& history, float* out, const std::vector<int>* allowed = 0);
+
+    // an index drawn from the n weights, which need not sum to one
+    int draw(const float* weights, int n);
+    float uniform();
+
+private:
+    struct Candidate {
+        int id;
+        float logit;
+        float p;
+    };
+
+    const float* apply_penalties(const float* logits, const GenerationConfig& config, const std::vector<int>& history);
+    int greedy(const float* logits, const std::vector<int>* allowed) const;
+    int prepare(const float* logits, const GenerationConfig& config, const std::vector<int>* allowed);
+    void top_k(int k);
+    void softmax(float temperature);
+    void min_p(float p);
+    void typical(float p);
+    void top_p(float p);
+    void normalize();
+
+    int n_vocab;
+    std::mt19937 rng;
+
+    std::vector<float> penalized;  // logits after the penalties
+    std::vector<int> counts;       // occurrences of each token in the history
+    std::vector<int> seen;         // tokens with a nonzero count
+    std::vector<Candidate> candidates;
+    int n_candidates;
+    bool sorted; // candidates are in descending order
+};
+
+} // namespace ncnn
+
+#endif // LLM_SAMPLER_H
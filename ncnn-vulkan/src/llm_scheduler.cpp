@@ -0,0 +1,377 @@
+#include "llm_scheduler.h"
+#include <algorithm>
+#include <climits>
+
+namespace ncnn {
+
+// One request from admission to its last token
+// everything but done is only touched by the scheduler thread once queued
+struct Scheduler::Sequence {
+    GenerationConfig config;
+    TokenCallback on_token;
+    DoneCallback on_done; // cleared once called
+    std::shared_ptr<std::atomic<bool> > cancel; // set by the caller, may be null
+    KVCache cache;
+    KVCache draft_cache; // draft model positions while decoding speculatively
+    NgramIndex lookup;   // earlier n-grams of history for prompt lookup
+    Sampler sampler;
+    Grammar grammar;     // compiled from the request, empty when unconstrained
+    GrammarState grammar_state;
+    std::vector<int> pending; // fed at the next steps, the prompt first
+    std::vector<int> history;
+    int prompt_tokens;
+    std::vector<int> generated;
+    StreamDecoder decoder;
+    int finish_reason;
+    bool stopped; // set by the step that ended it, with finish_reason
+    bool done;    // set under the mutex once the caller may return
+
+    Sequence(const Tokenizer& tokenizer, int lookup_ngram) : lookup(lookup_ngram), prompt_tokens(0), decoder(tokenizer), finish_reason(FINISH_STOP), stopped(false), done(false) {}
+};
+
+Scheduler::Scheduler(LLMEngine& _engine, int _max_batch)
+    : engine(_engine), max_batch(std::max(1, _max_batch)), quit(false)
+{
+    worker = std::thread(&Scheduler::run, this);
+}
+
+Scheduler::~Scheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeup.notify_all();
+    worker.join();
+}
+
+std::vector<int> Scheduler::generate(const std::string& prompt, const GenerationConfig& config, const TokenCallback& on_token, GenerationInfo* info)
+{
+    GenerationInfo unused;
+    GenerationInfo& result = info ? *info : unused;
+    std::shared_ptr<Sequence> seq = queue(prompt, config, on_token, DoneCallback(), std::shared_ptr<std::atomic<bool> >(), result);
+    if (!seq) {
+        return std::vector<int>();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&seq] { return seq->done; });
+    result.finish_reason = seq->stopped ? seq->finish_reason : FINISH_ERROR;
+    return seq->generated;
+}
+
+void Scheduler::submit(const std::string& prompt, const GenerationConfig& config, const TokenCallback& on_token, const DoneCallback& on_done, const std::shared_ptr<std::atomic<bool> >& cancel)
+{
+    GenerationInfo info;
+    if (!queue(prompt, config, on_token, on_done, cancel, info) && on_done) {
+        on_done(std::vector<int>(), info);
+    }
+}
+
+// Tokenizes the prompt and adds it to the waiting requests, null with the
+// reason in info when it cannot be generated from
+std::shared_ptr<Scheduler::Sequence> Scheduler::queue(const std::string& prompt, const GenerationConfig& config, const TokenCallback& on_token, const DoneCallback& on_done, const std::shared_ptr<std::atomic<bool> >& cancel, GenerationInfo& info)
+{
+    const Tokenizer& tokenizer = engine.tokenizer;
+    std::vector<int> tokens = tokenizer.encode(prompt);
+    if (tokenizer.add_bos_token() && tokenizer.bos_token() >= 0) {
+        tokens.insert(tokens.begin(), tokenizer.bos_token());
+    }
+    info.prompt_tokens = (int)tokens.size();
+    info.finish_reason = FINISH_ERROR;
+    if (tokens.empty()) {
+        return std::shared_ptr<Sequence>();
+    }
+    if (config.max_tokens <= 0) {
+        info.finish_reason = FINISH_LENGTH;
+        return std::shared_ptr<Sequence>();
+    }
+
+    std::shared_ptr<Sequence> seq = std::make_shared<Sequence>(tokenizer, engine.lookup_ngram);
+    seq->config = config;
+    seq->sampler.init(engine.vocab_size, config.seed);
+    // grammars compile on the caller's thread, the trie is built once
+    if (!engine.compile_grammar(config, seq->grammar)) {
+        return std::shared_ptr<Sequence>();
+    }
+    if (!seq->grammar.empty()) {
+        engine.token_trie();
+        seq->grammar_state.init(&seq->grammar, tokenizer.add_space_prefix_token());
+    }
+    seq->on_token = on_token;
+    seq->on_done = on_done;
+    seq->cancel = cancel;
+    seq->pending = tokens;
+    seq->history = tokens;
+    seq->prompt_tokens = (int)tokens.size();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (quit) {
+        return std::shared_ptr<Sequence>();
+    }
+    waiting.push_back(seq);
+    wakeup.notify_one();
+    return seq;
+}
+
+// Hands a submitted request its tokens, on the scheduler thread and outside
+// the lock so on_done may queue more work
+void Scheduler::complete(Sequence& seq)
+{
+    DoneCallback on_done;
+    on_done.swap(seq.on_done);
+    if (!on_done) {
+        return;
+    }
+    GenerationInfo info;
+    info.prompt_tokens = seq.prompt_tokens;
+    info.finish_reason = seq.stopped ? seq.finish_reason : FINISH_ERROR;
+    on_done(seq.generated, info);
+}
+
+int Scheduler::active_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)active.size();
+}
+
+int Scheduler::waiting_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)waiting.size();
+}
+
+void Scheduler::run()
+{
+    std::vector<std::shared_ptr<Sequence> > batch;
+    for (;;) {
+        bool quitting = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            // hand finished sequences back to their callers
+            size_t n_active = active.size();
+            for (size_t i = 0; i < active.size();) {
+                if (active[i]->stopped) {
+                    active[i]->done = true;
+                    active[i] = active.back();
+                    active.pop_back();
+                } else {
+                    i++;
+                }
+            }
+            if (active.size() != n_active) {
+                finished.notify_all();
+            }
+
+            wakeup.wait(lock, [this] { return quit || !waiting.empty() || !active.empty(); });
+            if (quit) {
+                batch.insert(batch.end(), active.begin(), active.end());
+                batch.insert(batch.end(), waiting.begin(), waiting.end());
+                for (size_t i = 0; i < batch.size(); i++) batch[i]->done = true;
+                active.clear();
+                waiting.clear();
+                finished.notify_all();
+                quitting = true;
+            } else {
+                // admit new requests between steps, up to the batch limit
+                while (!waiting.empty() && (int)active.size() < max_batch) {
+                    active.push_back(waiting.front());
+                    waiting.pop_front();
+                }
+                batch = active;
+            }
+        }
+
+        if (quitting) {
+            for (size_t i = 0; i < batch.size(); i++) complete(*batch[i]);
+            return;
+        }
+
+        step(batch);
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (batch[i]->stopped) complete(*batch[i]);
+        }
+        batch.clear();
+    }
+}
+
+// Feeds every sequence of the batch its pending tokens in one forward pass,
+// a newly admitted prompt is prefilled alongside the others' decode tokens
+// prompts share a budget of prefill_chunk tokens per step, a longer one goes
+// on in the next steps from where its cache ends, so the decode tokens of the
+// others never wait for a whole prompt and a step holds at most the chunk
+// plus one row per decoding sequence
+// a sequence reaching the context length drops older positions and goes on
+void Scheduler::step(std::vector<std::shared_ptr<Sequence> >& batch)
+{
+    // a cancelled request ends here, so a long prompt nobody waits for does
+    // not take the next chunks of step time from the others
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (batch[i]->cancel && batch[i]->cancel->load()) {
+            finish(*batch[i], FINISH_STOP);
+        }
+    }
+
+    // nothing to batch with, speculation can supply the extra rows instead
+    // unless a grammar has to check every token
+    if (batch.size() == 1 && !batch[0]->stopped && engine.can_speculate() && batch[0]->cache.n_past > 0 && batch[0]->pending.size() == 1 && !batch[0]->grammar_state.active()) {
+        speculative_step(*batch[0]);
+        return;
+    }
+
+    std::vector<int> tokens;
+    std::vector<LLMEngine::BatchSpan> spans;
+    std::vector<Sequence*> running;
+    int budget = engine.prefill_chunk > 0 ? engine.prefill_chunk : INT_MAX;
+    for (size_t i = 0; i < batch.size(); i++) {
+        Sequence& seq = *batch[i];
+        if (seq.stopped) {
+            continue;
+        }
+        if (seq.cache.n_past == 0) {
+            // a new prompt only prefills what the prefix cache does not hold
+            int reused = engine.restore_prefix(seq.pending, seq.cache);
+            seq.pending.erase(seq.pending.begin(), seq.pending.begin() + reused);
+        }
+
+        int n_tokens = (int)seq.pending.size();
+        if (n_tokens > 1) {
+            if (budget == 0) {
+                continue;
+            }
+            n_tokens = std::min(n_tokens, budget);
+            budget -= n_tokens;
+        }
+        if (seq.cache.n_past + n_tokens > engine.max_seq_len && !shift_context(seq, n_tokens)) {
+            finish(seq, FINISH_LENGTH);
+            continue;
+        }
+
+        LLMEngine::BatchSpan span;
+        span.cache = &seq.cache;
+        span.row = (int)tokens.size();
+        span.n_tokens = n_tokens;
+        spans.push_back(span);
+        tokens.insert(tokens.end(), seq.pending.begin(), seq.pending.begin() + n_tokens);
+        running.push_back(&seq);
+    }
+    if (running.empty()) {
+        return;
+    }
+
+    Mat logits = engine.forward_batch(tokens, spans);
+    if (logits.empty()) {
+        for (size_t i = 0; i < running.size(); i++) {
+            finish(*running[i], FINISH_ERROR);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < running.size(); i++) {
+        Sequence& seq = *running[i];
+        seq.pending.erase(seq.pending.begin(), seq.pending.begin() + spans[i].n_tokens);
+        if (!seq.pending.empty()) {
+            // the rest of the prompt runs in the next steps
+            continue;
+        }
+        if (seq.cache.n_past == seq.prompt_tokens) {
+            engine.save_prefix(seq.history, seq.cache);
+        }
+        const std::vector<int>* allowed = 0;
+        if (seq.grammar_state.active()) {
+            allowed = &seq.grammar_state.allowed_tokens(engine.trie, engine.tokenizer.eos_token());
+            if (allowed->empty()) {
+                finish(seq, FINISH_STOP);
+                continue;
+            }
+        }
+        int next_token = seq.sampler.sample(logits.row(i), seq.config, seq.history, allowed);
+        int reason = emit(seq, next_token);
+        if (reason >= 0) {
+            finish(seq, reason);
+        }
+    }
+}
+
+// Decodes the only running sequence speculatively, one verifying pass can
+// yield several tokens
+void Scheduler::speculative_step(Sequence& seq)
+{
+    if (seq.cache.n_past + 1 > engine.max_seq_len && !shift_context(seq, 1)) {
+        finish(seq, FINISH_LENGTH);
+        return;
+    }
+
+    std::vector<int> next_tokens = engine.speculate(seq.history, seq.cache, seq.draft_cache, seq.lookup, seq.sampler, seq.config, seq.config.max_tokens - (int)seq.generated.size());
+    if (next_tokens.empty()) {
+        finish(seq, FINISH_ERROR);
+        return;
+    }
+    for (size_t i = 0; i < next_tokens.size(); i++) {
+        int reason = emit(seq, next_tokens[i]);
+        if (reason >= 0) {
+            finish(seq, reason);
+            return;
+        }
+    }
+}
+
+// Drops older positions of a sequence at the context length so n_new more
+// fit, false when they cannot
+bool Scheduler::shift_context(Sequence& seq, int n_new)
+{
+    if (!engine.shift_context(seq.cache, seq.history, n_new)) {
+        return false;
+    }
+    // the draft catches up with the shifted history from scratch
+    seq.draft_cache.clear();
+    seq.lookup.clear();
+    return true;
+}
+
+// Appends a generated token to the sequence, returns the FinishReason when it
+// should stop, -1 to go on
+int Scheduler::emit(Sequence& seq, int token)
+{
+    seq.generated.push_back(token);
+    seq.history.push_back(token);
+    seq.pending.assign(1, token);
+    if (seq.grammar_state.active()) {
+        seq.grammar_state.accept(engine.trie.piece(token));
+    }
+
+    bool stop = seq.on_token && !seq.on_token(token, seq.decoder.push(token));
+    if (std::find(seq.config.stop_tokens.begin(), seq.config.stop_tokens.end(), token) != seq.config.stop_tokens.end()) {
+        stop = true;
+    }
+    const int eos = engine.tokenizer.eos_token();
+    if (eos >= 0 && token == eos) {
+        stop = true;
+    }
+    if (stop) {
+        return FINISH_STOP;
+    }
+    if ((int)seq.generated.size() >= seq.config.max_tokens) {
+        return FINISH_LENGTH;
+    }
+    return -1;
+}
+
+void Scheduler::finish(Sequence& seq, int reason)
+{
+    if (seq.on_token) {
+        std::string rest = seq.decoder.flush();
+        if (!rest.empty()) {
+            seq.on_token(-1, rest);
+        }
+    }
+    engine.save_prefix(seq.history, seq.cache);
+    seq.pending.clear();
+    seq.cache = KVCache();
+    seq.draft_cache = KVCache();
+    seq.finish_reason = reason;
+    seq.stopped = true;
+}
+
+} // namespace ncnn
@@ -0,0 +1,86 @@
+#ifndef LLM_SCHEDULER_H
+#define LLM_SCHEDULER_H
+
+#include "llm_engine.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ncnn {
+
+// Why a generation ended
+enum FinishReason {
+    FINISH_STOP = 0, // end of sequence, a stop token, the grammar or the callback
+    FINISH_LENGTH,   // max_tokens, or a full context that could not shift
+    FINISH_ERROR     // the request was refused or a forward pass failed
+};
+
+// What a generation consumed besides the tokens it returns
+struct GenerationInfo {
+    int prompt_tokens = 0;
+    int finish_reason = FINISH_STOP;
+};
+
+// Receives the tokens of a submitted request once its generation ended, on
+// the scheduler thread, or on the caller's when it could not be queued
+typedef std::function<void(const std::vector<int>& tokens, const GenerationInfo& info)> DoneCallback;
+
+// Serves concurrent generate requests on one engine with continuous batching
+// a worker thread admits waiting requests between decode steps and runs the
+// next token of every active sequence through the model as one batch, so each
+// weight matrix is streamed once per step instead of once per sequence
+// every sequence keeps its own KV cache, sampling history and stop conditions
+// a sequence decoding alone uses speculative steps when the engine has a
+// draft model or prompt lookup
+// while a scheduler is running the engine must not be used directly
+class Scheduler {
+public:
+    explicit Scheduler(LLMEngine& engine, int max_batch = 8);
+    ~Scheduler();
+
+    // queues the prompt and blocks until its generation ends, safe to call
+    // from many threads at once, on_token runs on the scheduler thread
+    // info, when given, receives the prompt length and why it ended
+    std::vector<int> generate(const std::string& prompt, const GenerationConfig& config = GenerationConfig(), const TokenCallback& on_token = TokenCallback(), GenerationInfo* info = 0);
+
+    // queues the prompt and returns without waiting, on_done receives what
+    // generate would have returned, for callers that cannot block a thread
+    // setting cancel ends the request before its next prefill chunk or token,
+    // even while its prompt is still being prefilled
+    void submit(const std::string& prompt, const GenerationConfig& config, const TokenCallback& on_token, const DoneCallback& on_done, const std::shared_ptr<std::atomic<bool> >& cancel = std::shared_ptr<std::atomic<bool> >());
+
+    int active_count() const;
+    int waiting_count() const;
+
+private:
+    struct Sequence;
+
+    std::shared_ptr<Sequence> queue(const std::string& prompt, const GenerationConfig& config, const TokenCallback& on_token, const DoneCallback& on_done, const std::shared_ptr<std::atomic<bool> >& cancel, GenerationInfo& info);
+    void complete(Sequence& seq);
+    void run();
+    void step(std::vector<std::shared_ptr<Sequence> >& batch);
+    void speculative_step(Sequence& seq);
+    bool shift_context(Sequence& seq, int n_new);
+    int emit(Sequence& seq, int token);
+    void finish(Sequence& seq, int reason);
+
+    LLMEngine& engine;
+    int max_batch;
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;   // work arrived or quit was set
+    std::condition_variable finished; // some sequence completed
+    std::deque<std::shared_ptr<Sequence> > waiting;
+    std::vector<std::shared_ptr<Sequence> > active;
+    bool quit;
+    std::thread worker;
+};
+
+} // namespace ncnn
+
+#endif // LLM_SCHEDULER_H
@@ -1,106 +1,648 @@
 #include "tokenizer.h"
+#include "gguf.h"
 #include <algorithm>
+#include <queue>
 #include <sstream>
-#include <regex>
-#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 namespace ncnn {
 
+// ------------------------------------------------------------------
+// utf-8 and unicode classes for the pre-tokenizer
+
+enum {
+    CAT_LETTER = 0,
+    CAT_NUMBER,
+    CAT_SPACE,
+    CAT_OTHER // punctuation, symbols, marks and controls
+};
+
+struct unicode_range {
+    uint32_t first;
+    uint32_t last;
+    int cat;
+};
+
+// code points not covered here are treated as letters, which holds for
+// the alphabetic and CJK blocks that make up nearly all model vocabularies
+static const unicode_range unicode_ranges[] = {
+    {0x0000, 0x0008, CAT_OTHER}, {0x0009, 0x000D, CAT_SPACE}, {0x000E, 0x001F, CAT_OTHER},
+    {0x0020, 0x0020, CAT_SPACE}, {0x0021, 0x002F, CAT_OTHER}, {0x0030, 0x0039, CAT_NUMBER},
+    {0x003A, 0x0040, CAT_OTHER}, {0x005B, 0x0060, CAT_OTHER}, {0x007B, 0x0084, CAT_OTHER},
+    {0x0085, 0x0085, CAT_SPACE}, {0x0086, 0x009F, CAT_OTHER}, {0x00A0, 0x00A0, CAT_SPACE},
+    {0x00A1, 0x00A9, CAT_OTHER}, {0x00AB, 0x00B1, CAT_OTHER}, {0x00B2, 0x00B3, CAT_NUMBER},
+    {0x00B4, 0x00B4, CAT_OTHER}, {0x00B6, 0x00B8, CAT_OTHER}, {0x00B9, 0x00B9, CAT_NUMBER},
+    {0x00BB, 0x00BB, CAT_OTHER}, {0x00BC, 0x00BE, CAT_NUMBER}, {0x00BF, 0x00BF, CAT_OTHER},
+    {0x00D7, 0x00D7, CAT_OTHER}, {0x00F7, 0x00F7, CAT_OTHER}, {0x02C2, 0x02C5, CAT_OTHER},
+    {0x02D2, 0x02DF, CAT_OTHER}, {0x02E5, 0x02EB, CAT_OTHER}, {0x02ED, 0x02ED, CAT_OTHER},
+    {0x02EF, 0x036F, CAT_OTHER}, {0x037E, 0x037E, CAT_OTHER}, {0x0384, 0x0385, CAT_OTHER},
+    {0x0387, 0x0387, CAT_OTHER}, {0x03F6, 0x03F6, CAT_OTHER}, {0x0482, 0x0489, CAT_OTHER},
+    {0x055A, 0x055F, CAT_OTHER}, {0x0589, 0x058F, CAT_OTHER}, {0x0591, 0x05C7, CAT_OTHER},
+    {0x05F3, 0x05F4, CAT_OTHER}, {0x0600, 0x061F, CAT_OTHER}, {0x064B, 0x065F, CAT_OTHER},
+    {0x0660, 0x0669, CAT_NUMBER}, {0x066A, 0x066D, CAT_OTHER}, {0x0670, 0x0670, CAT_OTHER},
+    {0x06D4, 0x06D4, CAT_OTHER}, {0x06D6, 0x06ED, CAT_OTHER}, {0x06F0, 0x06F9, CAT_NUMBER},
+    {0x07C0, 0x07C9, CAT_NUMBER}, {0x0900, 0x0903, CAT_OTHER}, {0x093A, 0x094F, CAT_OTHER},
+    {0x0951, 0x0957, CAT_OTHER}, {0x0962, 0x0965, CAT_OTHER}, {0x0966, 0x096F, CAT_NUMBER},
+    {0x0970, 0x0970, CAT_OTHER}, {0x09E6, 0x09EF, CAT_NUMBER}, {0x0A66, 0x0A6F, CAT_NUMBER},
+    {0x0AE6, 0x0AEF, CAT_NUMBER}, {0x0B66, 0x0B6F, CAT_NUMBER}, {0x0BE6, 0x0BF2, CAT_NUMBER},
+    {0x0C66, 0x0C6F, CAT_NUMBER}, {0x0CE6, 0x0CEF, CAT_NUMBER}, {0x0D66, 0x0D78, CAT_NUMBER},
+    {0x0E31, 0x0E31, CAT_OTHER}, {0x0E34, 0x0E3A, CAT_OTHER}, {0x0E3F, 0x0E3F, CAT_OTHER},
+    {0x0E47, 0x0E4F, CAT_OTHER}, {0x0E50, 0x0E59, CAT_NUMBER}, {0x0E5A, 0x0E5B, CAT_OTHER},
+    {0x0ED0, 0x0ED9, CAT_NUMBER}, {0x0F20, 0x0F33, CAT_NUMBER}, {0x1040, 0x1049, CAT_NUMBER},
+    {0x1680, 0x1680, CAT_SPACE}, {0x17E0, 0x17E9, CAT_NUMBER}, {0x1810, 0x1819, CAT_NUMBER},
+    {0x1AB0, 0x1AFF, CAT_OTHER}, {0x1DC0, 0x1DFF, CAT_OTHER}, {0x1FBD, 0x1FBD, CAT_OTHER},
+    {0x1FBF, 0x1FC1, CAT_OTHER}, {0x1FCD, 0x1FCF, CAT_OTHER}, {0x1FDD, 0x1FDF, CAT_OTHER},
+    {0x1FED, 0x1FEF, CAT_OTHER}, {0x1FFD, 0x1FFE, CAT_OTHER}, {0x2000, 0x200A, CAT_SPACE},
+    {0x200B, 0x2027, CAT_OTHER}, {0x2028, 0x2029, CAT_SPACE}, {0x202A, 0x202E, CAT_OTHER},
+    {0x202F, 0x202F, CAT_SPACE}, {0x2030, 0x205E, CAT_OTHER}, {0x205F, 0x205F, CAT_SPACE},
+    {0x2060, 0x206F, CAT_OTHER}, {0x2070, 0x2070, CAT_NUMBER}, {0x2074, 0x2079, CAT_NUMBER},
+    {0x207A, 0x207E, CAT_OTHER}, {0x2080, 0x2089, CAT_NUMBER}, {0x208A, 0x208E, CAT_OTHER},
+    {0x20A0, 0x20FF, CAT_OTHER}, {0x2100, 0x2101, CAT_OTHER}, {0x2103, 0x2106, CAT_OTHER},
+    {0x2108, 0x2109, CAT_OTHER}, {0x2114, 0x2114, CAT_OTHER}, {0x2116, 0x2118, CAT_OTHER},
+    {0x211E, 0x2123, CAT_OTHER}, {0x2125, 0x2125, CAT_OTHER}, {0x2127, 0x2127, CAT_OTHER},
+    {0x2129, 0x2129, CAT_OTHER}, {0x212E, 0x212E, CAT_OTHER}, {0x213A, 0x213B, CAT_OTHER},
+    {0x2140, 0x2144, CAT_OTHER}, {0x214A, 0x214D, CAT_OTHER}, {0x214F, 0x214F, CAT_OTHER},
+    {0x2150, 0x2182, CAT_NUMBER}, {0x2185, 0x2189, CAT_NUMBER}, {0x218A, 0x245F, CAT_OTHER},
+    {0x2460, 0x249B, CAT_NUMBER}, {0x249C, 0x24E9, CAT_OTHER}, {0x24EA, 0x24FF, CAT_NUMBER},
+    {0x2500, 0x2775, CAT_OTHER}, {0x2776, 0x2793, CAT_NUMBER}, {0x2794, 0x2BFF, CAT_OTHER},
+    {0x2CE5, 0x2CEA, CAT_OTHER}, {0x2CF9, 0x2CFF, CAT_OTHER}, {0x2DE0, 0x2E7F, CAT_OTHER},
+    {0x2E80, 0x2FFF, CAT_OTHER}, {0x3000, 0x3000, CAT_SPACE}, {0x3001, 0x3004, CAT_OTHER},
+    {0x3007, 0x3007, CAT_NUMBER}, {0x3008, 0x3020, CAT_OTHER}, {0x3021, 0x3029, CAT_NUMBER},
+    {0x302A, 0x3030, CAT_OTHER}, {0x3036, 0x3037, CAT_OTHER}, {0x3038, 0x303A, CAT_NUMBER},
+    {0x303D, 0x303F, CAT_OTHER}, {0x3099, 0x309C, CAT_OTHER}, {0x30A0, 0x30A0, CAT_OTHER},
+    {0x30FB, 0x30FB, CAT_OTHER}, {0x3190, 0x3191, CAT_OTHER}, {0x3192, 0x3195, CAT_NUMBER},
+    {0x3196, 0x319F, CAT_OTHER}, {0x31C0, 0x31E3, CAT_OTHER}, {0x3200, 0x321E, CAT_OTHER},
+    {0x3220, 0x3229, CAT_NUMBER}, {0x322A, 0x3247, CAT_OTHER}, {0x3248, 0x324F, CAT_NUMBER},
+    {0x3250, 0x3250, CAT_OTHER}, {0x3251, 0x325F, CAT_NUMBER}, {0x3260, 0x327F, CAT_OTHER},
+    {0x3280, 0x3289, CAT_NUMBER}, {0x328A, 0x32B0, CAT_OTHER}, {0x32B1, 0x32BF, CAT_NUMBER},
+    {0x32C0, 0x33FF, CAT_OTHER}, {0x4DC0, 0x4DFF, CAT_OTHER}, {0xA490, 0xA4C6, CAT_OTHER},
+    {0xA620, 0xA629, CAT_NUMBER}, {0xA8D0, 0xA8D9, CAT_NUMBER}, {0xA900, 0xA909, CAT_NUMBER},
+    {0xD800, 0xF8FF, CAT_OTHER}, {0xFB29, 0xFB29, CAT_OTHER}, {0xFD3E, 0xFD3F, CAT_OTHER},
+    {0xFDFC, 0xFDFD, CAT_OTHER}, {0xFE00, 0xFE6F, CAT_OTHER}, {0xFEFF, 0xFEFF, CAT_OTHER},
+    {0xFF01, 0xFF0F, CAT_OTHER}, {0xFF10, 0xFF19, CAT_NUMBER}, {0xFF1A, 0xFF20, CAT_OTHER},
+    {0xFF3B, 0xFF40, CAT_OTHER}, {0xFF5B, 0xFF65, CAT_OTHER}, {0xFFE0, 0xFFFF, CAT_OTHER},
+    {0x10100, 0x1013F, CAT_NUMBER}, {0x1D000, 0x1D24F, CAT_OTHER}, {0x1D7CE, 0x1D7FF, CAT_NUMBER},
+    {0x1F000, 0x1FBEF, CAT_OTHER}, {0x1FBF0, 0x1FBF9, CAT_NUMBER}, {0xE0000, 0xE01EF, CAT_OTHER},
+    {0xF0000, 0x10FFFF, CAT_OTHER},
+};
+
+static int unicode_category(uint32_t cp)
+{
+    if (cp < 0x80) {
+        if ((cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z')) return CAT_LETTER;
+    }
+
+    int lo = 0;
+    int hi = (int)(sizeof(unicode_ranges) / sizeof(unicode_ranges[0])) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < unicode_ranges[mid].first) {
+            hi = mid - 1;
+        } else if (cp > unicode_ranges[mid].last) {
+            lo = mid + 1;
+        } else {
+            return unicode_ranges[mid].cat;
+        }
+    }
+    return CAT_LETTER;
+}
+
+static int utf8_len(unsigned char c)
+{
+    if (c < 0x80) return 1;
+    if ((c & 0xE0) == 0xC0) return 2;
+    if ((c & 0xF0) == 0xE0) return 3;
+    if ((c & 0xF8) == 0xF0) return 4;
+    return 1; // stray continuation byte, keep it as its own unit
+}
+
+// decodes the code point at text, invalid sequences decode byte by byte
+static uint32_t utf8_decode(const char* text, size_t avail, int* len)
+{
+    const unsigned char* s = (const unsigned char*)text;
+    int n = utf8_len(s[0]);
+    if ((size_t)n > avail) n = 1;
+    for (int i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            n = 1;
+            break;
+        }
+    }
+    *len = n;
+    switch (n) {
+    case 2: return ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+    case 3: return ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+    case 4: return ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+    default: return s[0];
+    }
+}
+
+static std::string utf8_encode(uint32_t cp)
+{
+    std::string out;
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+// fnv-1a
+static uint64_t text_hash(const char* text, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// ------------------------------------------------------------------
+
 Tokenizer::Tokenizer()
-    : bos_token_id(-1), eos_token_id(-1), unk_token_id(-1), pad_token_id(-1)
+    : pre_type(PRE_GPT2), bos_token_id(-1), eos_token_id(-1), unk_token_id(-1), pad_token_id(-1),
+      add_bos(false), add_space_prefix(true)
 {
     initialize_byte_encoder();
+    for (int i = 0; i < 256; ++i) {
+        byte_tokens[i] = -1;
+    }
 }
 
 Tokenizer::~Tokenizer()
 {
 }
 
+// id of the token spelled exactly as text, -1 when not in the vocabulary
+int Tokenizer::find_token(const char* text, size_t size) const
+{
+    if (vocab_buckets.empty()) return -1;
+
+    const size_t mask = vocab_buckets.size() - 1;
+    for (size_t b = text_hash(text, size) & mask;; b = (b + 1) & mask) {
+        int id = vocab_buckets[b];
+        if (id < 0) return -1;
+        if (token_size(id) == size && memcmp(token_data(id), text, size) == 0) return id;
+    }
+}
+
+// gpt2 bytes_to_unicode: printable bytes map to themselves, the rest to 256+
 void Tokenizer::initialize_byte_encoder()
 {
-    for (int i = 0; i < 256; ++i) {
-        char c = static_cast<char>(i);
-        std::string byte_str(1, c);
-        byte_encoder.insert(byte_str);
+    int n = 0;
+    for (int b = 0; b < 256; ++b) {
+        bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+        uint32_t cp = printable ? b : 256 + n++;
+        byte_to_unicode[b] = utf8_encode(cp);
+        unicode_to_byte[cp] = (uint8_t)b;
     }
 }
 
-bool Tokenizer::load_from_gguf(const std::unordered_map<std::string, std::string>& kv_strings,
-                              const std::unordered_map<std::string, std::vector<std::string>>& kv_string_arrays)
+bool Tokenizer::load_from_gguf(const GGUFLoader& loader)
 {
     // Check tokenizer model type
-    auto model_it = kv_strings.find("tokenizer.ggml.model");
-    if (model_it != kv_strings.end()) {
-        model_type = model_it->second;
-    } else {
+    if (!loader.get_kv_string("tokenizer.ggml.model", model_type)) {
         // Fallback to basic token ID input
         return true;
     }
 
-    // Load vocab
-    auto vocab_it = kv_string_arrays.find("tokenizer.ggml.tokens");
-    if (vocab_it != kv_string_arrays.end()) {
-        id_to_token = vocab_it->second;
-        for (size_t i = 0; i < id_to_token.size(); ++i) {
-            vocab[id_to_token[i]] = static_cast<int>(i);
+    // Load vocab straight from the file's string table
+    const gguf_kv* tokens_kv = loader.find_kv("tokenizer.ggml.tokens");
+    if (!tokens_kv || tokens_kv->array_type != GGUF_TYPE_STRING) {
+        fprintf(stderr, "tokenizer.ggml.tokens missing\n");
+        return false;
+    }
+    const int n_vocab = (int)tokens_kv->array_size;
+    token_offsets.resize(n_vocab + 1);
+    token_offsets[0] = 0;
+    for (int i = 0; i < n_vocab; ++i) {
+        token_offsets[i + 1] = token_offsets[i] + (uint32_t)loader.get_arr_str(*tokens_kv, i).size;
+    }
+    token_text.resize(token_offsets[n_vocab]);
+    for (int i = 0; i < n_vocab; ++i) {
+        gguf_str token = loader.get_arr_str(*tokens_kv, i);
+        memcpy(&token_text[token_offsets[i]], token.data, (size_t)token.size);
+    }
+
+    size_t n_buckets = 16;
+    while (n_buckets < (size_t)n_vocab * 2) n_buckets *= 2;
+    vocab_buckets.assign(n_buckets, -1);
+    for (int i = 0; i < n_vocab; ++i) {
+        size_t b = text_hash(token_data(i), token_size(i)) & (n_buckets - 1);
+        while (vocab_buckets[b] >= 0) {
+            // duplicated text keeps the first id
+            int other = vocab_buckets[b];
+            if (token_size(other) == token_size(i) && memcmp(token_data(other), token_data(i), token_size(i)) == 0) break;
+            b = (b + 1) & (n_buckets - 1);
         }
+        if (vocab_buckets[b] < 0) vocab_buckets[b] = i;
     }
 
-    // Load merges for BPE
-    auto merges_it = kv_string_arrays.find("tokenizer.ggml.merges");
-    if (merges_it != kv_string_arrays.end()) {
-        for (const auto& merge : merges_it->second) {
-            size_t space_pos = merge.find(' ');
-            if (space_pos != std::string::npos) {
-                std::string first = merge.substr(0, space_pos);
-                std::string second = merge.substr(space_pos + 1);
-                bpe_merges.emplace_back(first, second);
-            }
+    scores.assign(n_vocab, 0.f);
+    const gguf_kv* scores_kv = loader.find_kv("tokenizer.ggml.scores");
+    if (scores_kv && scores_kv->array_type == GGUF_TYPE_FLOAT32) {
+        for (int i = 0; i < n_vocab && i < (int)scores_kv->array_size; ++i) {
+            scores[i] = loader.get_arr_float(*scores_kv, i);
         }
     }
 
-    // Load special tokens
-    auto bos_it = kv_strings.find("tokenizer.ggml.bos_token_id");
-    if (bos_it != kv_strings.end()) {
-        bos_token_id = std::stoi(bos_it->second);
+    token_types.assign(n_vocab, TOKEN_NORMAL);
+    const gguf_kv* types_kv = loader.find_kv("tokenizer.ggml.token_type");
+    if (types_kv && types_kv->type == GGUF_TYPE_ARRAY && types_kv->array_type != GGUF_TYPE_STRING) {
+        for (int i = 0; i < n_vocab && i < (int)types_kv->array_size; ++i) {
+            token_types[i] = (int)loader.get_arr_int(*types_kv, i);
+        }
+    }
+
+    // Load special tokens, ids are integers in current files and strings in old ones
+    struct { const char* key; int* id; } specials[] = {
+        {"tokenizer.ggml.bos_token_id", &bos_token_id},
+        {"tokenizer.ggml.eos_token_id", &eos_token_id},
+        {"tokenizer.ggml.unknown_token_id", &unk_token_id},
+        {"tokenizer.ggml.padding_token_id", &pad_token_id},
+    };
+    for (size_t i = 0; i < sizeof(specials) / sizeof(specials[0]); ++i) {
+        int64_t id;
+        std::string id_str;
+        if (loader.get_kv_int(specials[i].key, id)) {
+            *specials[i].id = (int)id;
+        } else if (loader.get_kv_string(specials[i].key, id_str)) {
+            *specials[i].id = atoi(id_str.c_str());
+        }
     }
 
-    auto eos_it = kv_strings.find("tokenizer.ggml.eos_token_id");
-    if (eos_it != kv_strings.end()) {
-        eos_token_id = std::stoi(eos_it->second);
+    int64_t flag;
+    add_bos = model_type == "llama";
+    if (loader.get_kv_int("tokenizer.ggml.add_bos_token", flag)) {
+        add_bos = flag != 0;
+    }
+    add_space_prefix = model_type == "llama";
+    if (loader.get_kv_int("tokenizer.ggml.add_space_prefix", flag)) {
+        add_space_prefix = flag != 0;
+    }
+
+    pre_type = PRE_GPT2;
+    std::string pre;
+    if (loader.get_kv_string("tokenizer.ggml.pre", pre)) {
+        if (pre == "llama3" || pre == "llama-bpe" || pre == "llama-v3" || pre == "qwen2" || pre == "smaug-bpe" || pre == "dbrx") {
+            pre_type = PRE_LLAMA3;
+        }
+    }
+
+    special_tokens.clear();
+    for (int i = 0; i < n_vocab; ++i) {
+        if ((token_types[i] == TOKEN_CONTROL || token_types[i] == TOKEN_USER_DEFINED) && token_size(i) > 0) {
+            special_tokens.push_back(i);
+        }
     }
+    std::sort(special_tokens.begin(), special_tokens.end(), [this](int a, int b) {
+        return token_size(a) > token_size(b);
+    });
 
-    auto unk_it = kv_strings.find("tokenizer.ggml.unknown_token_id");
-    if (unk_it != kv_strings.end()) {
-        unk_token_id = std::stoi(unk_it->second);
+    // Load merges for BPE, rank is the line number
+    merges.clear();
+    const gguf_kv* merges_kv = loader.find_kv("tokenizer.ggml.merges");
+    if (merges_kv && merges_kv->array_type == GGUF_TYPE_STRING) {
+        merges.reserve((size_t)merges_kv->array_size);
+        std::string merged;
+        for (uint64_t i = 0; i < merges_kv->array_size; ++i) {
+            gguf_str line = loader.get_arr_str(*merges_kv, i);
+            const char* space = line.size > 1 ? (const char*)memchr(line.data + 1, ' ', (size_t)line.size - 1) : 0;
+            if (!space) continue;
+            size_t left_size = space - line.data;
+            size_t right_size = (size_t)line.size - left_size - 1;
+            merged.assign(line.data, left_size);
+            merged.append(space + 1, right_size);
+            int l = find_token(line.data, left_size);
+            int r = find_token(space + 1, right_size);
+            int m = find_token(merged.data(), merged.size());
+            if (l < 0 || r < 0 || m < 0) continue;
+            uint64_t key = ((uint64_t)(uint32_t)l << 32) | (uint32_t)r;
+            merges.insert(std::make_pair(key, std::make_pair((int)i, m)));
+        }
     }
 
-    auto pad_it = kv_strings.find("tokenizer.ggml.padding_token_id");
-    if (pad_it != kv_strings.end()) {
-        pad_token_id = std::stoi(pad_it->second);
+    // token of every raw byte
+    for (int b = 0; b < 256; ++b) {
+        byte_tokens[b] = -1;
+        if (model_type == "gpt2") {
+            byte_tokens[b] = find_token(byte_to_unicode[b].data(), byte_to_unicode[b].size());
+        } else {
+            char name[8];
+            snprintf(name, sizeof(name), "<0x%02X>", b);
+            byte_tokens[b] = find_token(name, strlen(name));
+        }
     }
 
     return true;
 }
 
-std::vector<int> Tokenizer::encode(const std::string& text) const
+// splits text the way the model's pre-tokenizer regex does, see PRE_*
+void Tokenizer::pretokenize(const std::string& text, std::vector<std::string>& words) const
 {
-    if (model_type == "gpt2" || !bpe_merges.empty()) {
-        // Use BPE encoding
-        auto bpe_tokens = bpe_encode(text);
-        std::vector<int> tokens;
-        for (const auto& token : bpe_tokens) {
-            auto it = vocab.find(token);
-            if (it != vocab.end()) {
-                tokens.push_back(it->second);
-            } else if (unk_token_id >= 0) {
-                tokens.push_back(unk_token_id);
+    // code points with their byte offsets and classes
+    std::vector<uint32_t> cps;
+    std::vector<size_t> offsets;
+    std::vector<int> cats;
+    cps.reserve(text.size());
+    offsets.reserve(text.size() + 1);
+    cats.reserve(text.size());
+    for (size_t pos = 0; pos < text.size();) {
+        int len;
+        uint32_t cp = utf8_decode(text.data() + pos, text.size() - pos, &len);
+        cps.push_back(cp);
+        offsets.push_back(pos);
+        cats.push_back(unicode_category(cp));
+        pos += len;
+    }
+    offsets.push_back(text.size());
+
+    const int n = (int)cps.size();
+    const bool llama3 = pre_type == PRE_LLAMA3;
+    #define CAT(k) ((k) < n ? cats[k] : -1)
+    #define IS_NEWLINE(k) ((k) < n && (cps[k] == '\r' || cps[k] == '\n'))
+
+    int i = 0;
+    while (i < n) {
+        int end = i;
+
+        // 's 't 're 've 'm 'll 'd
+        if (cps[i] == '\'' && i + 1 < n) {
+            uint32_t c1 = cps[i + 1];
+            uint32_t c2 = i + 2 < n ? cps[i + 2] : 0;
+            if (llama3) {
+                if (c1 < 0x80) c1 = tolower(c1);
+                if (c2 < 0x80) c2 = tolower(c2);
+            }
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                end = i + 2;
+            } else if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                end = i + 3;
             }
         }
-        return tokens;
-    } else {
+
+        if (end == i && llama3) {
+            // [^\r\n\p{L}\p{N}]?\p{L}+
+            int k = i;
+            if (cats[k] != CAT_LETTER && cats[k] != CAT_NUMBER && !IS_NEWLINE(k) && CAT(k + 1) == CAT_LETTER) k++;
+            if (cats[k] == CAT_LETTER) {
+                while (CAT(k) == CAT_LETTER) k++;
+                end = k;
+            }
+            // \p{N}{1,3}
+            if (end == i && cats[i] == CAT_NUMBER) {
+                k = i;
+                while (CAT(k) == CAT_NUMBER && k - i < 3) k++;
+                end = k;
+            }
+        } else if (end == i) {
+            // ' ?\p{L}+' and ' ?\p{N}+'
+            int k = i;
+            if (cps[k] == ' ' && (CAT(k + 1) == CAT_LETTER || CAT(k + 1) == CAT_NUMBER)) k++;
+            if (cats[k] == CAT_LETTER || cats[k] == CAT_NUMBER) {
+                int cat = cats[k];
+                while (CAT(k) == cat) k++;
+                end = k;
+            }
+        }
+
+        // ' ?[^\s\p{L}\p{N}]+', followed by [\r\n]* for llama3
+        if (end == i) {
+            int k = i;
+            if (cps[k] == ' ' && CAT(k + 1) == CAT_OTHER) k++;
+            if (cats[k] == CAT_OTHER) {
+                while (CAT(k) == CAT_OTHER) k++;
+                if (llama3) {
+                    while (IS_NEWLINE(k)) k++;
+                }
+                end = k;
+            }
+        }
+
+        // whitespace
+        if (end == i) {
+            int k = i;
+            while (CAT(k) == CAT_SPACE) k++;
+            int last_newline = -1;
+            if (llama3) {
+                for (int j = i; j < k; j++) {
+                    if (IS_NEWLINE(j)) last_newline = j;
+                }
+            }
+            if (last_newline >= 0) {
+                // \s*[\r\n]+
+                end = last_newline + 1;
+            } else if (k < n && k - i > 1) {
+                // \s+(?!\S) leaves the last space to the next word
+                end = k - 1;
+            } else {
+                end = k;
+            }
+        }
+
+        words.push_back(text.substr(offsets[i], offsets[end] - offsets[i]));
+        i = end;
+    }
+
+    #undef CAT
+    #undef IS_NEWLINE
+}
+
+struct bpe_symbol {
+    int id;
+    int prev;
+    int next;
+};
+
+struct bpe_bigram {
+    int rank;
+    int left;
+    int right;
+    int merged;
+    bool operator<(const bpe_bigram& o) const {
+        // lowest rank first, leftmost first among equal ranks
+        return rank > o.rank || (rank == o.rank && left > o.left);
+    }
+};
+
+// merges the bytes of one pre-tokenized word by rank using a heap of
+// candidate pairs, stale pairs are skipped when popped
+void Tokenizer::bpe_encode(const std::string& word, std::vector<int>& tokens) const
+{
+    std::vector<bpe_symbol> symbols(word.size());
+    for (size_t i = 0; i < word.size(); ++i) {
+        symbols[i].id = byte_tokens[(unsigned char)word[i]];
+        symbols[i].prev = (int)i - 1;
+        symbols[i].next = i + 1 < word.size() ? (int)i + 1 : -1;
+    }
+
+    // a llama3 style vocabulary holds many whole words, take them as is
+    if (pre_type == PRE_LLAMA3 && word.size() > 1) {
+        std::string mapped;
+        for (size_t i = 0; i < word.size(); ++i) mapped += byte_to_unicode[(unsigned char)word[i]];
+        int id = find_token(mapped.data(), mapped.size());
+        if (id >= 0) {
+            tokens.push_back(id);
+            return;
+        }
+    }
+
+    std::priority_queue<bpe_bigram> queue;
+    auto try_add = [&](int left) {
+        if (left < 0) return;
+        int right = symbols[left].next;
+        if (right < 0 || symbols[left].id < 0 || symbols[right].id < 0) return;
+        uint64_t key = ((uint64_t)(uint32_t)symbols[left].id << 32) | (uint32_t)symbols[right].id;
+        auto it = merges.find(key);
+        if (it == merges.end()) return;
+        bpe_bigram bigram;
+        bigram.rank = it->second.first;
+        bigram.left = left;
+        bigram.right = right;
+        bigram.merged = it->second.second;
+        queue.push(bigram);
+    };
+
+    for (int i = 0; i + 1 < (int)symbols.size(); ++i) {
+        try_add(i);
+    }
+
+    while (!queue.empty()) {
+        bpe_bigram bigram = queue.top();
+        queue.pop();
+
+        bpe_symbol& left = symbols[bigram.left];
+        if (left.next != bigram.right || left.id < 0) continue;
+        bpe_symbol& right = symbols[bigram.right];
+        uint64_t key = ((uint64_t)(uint32_t)left.id << 32) | (uint32_t)right.id;
+        auto it = merges.find(key);
+        if (it == merges.end() || it->second.first != bigram.rank) continue;
+
+        left.id = bigram.merged;
+        left.next = right.next;
+        if (right.next >= 0) symbols[right.next].prev = bigram.left;
+        right.id = -1;
+        right.next = -1;
+
+        try_add(left.prev);
+        try_add(bigram.left);
+    }
+
+    for (int i = 0; i >= 0 && i < (int)symbols.size(); i = symbols[i].next) {
+        if (symbols[i].id >= 0) {
+            tokens.push_back(symbols[i].id);
+        } else if (unk_token_id >= 0) {
+            tokens.push_back(unk_token_id);
+        }
+    }
+}
+
+struct spm_symbol {
+    size_t offset;
+    size_t len;
+    int prev;
+    int next;
+};
+
+struct spm_bigram {
+    float score;
+    int left;
+    int right;
+    size_t len;
+    bool operator<(const spm_bigram& o) const {
+        // highest score first, leftmost first among equal scores
+        return score < o.score || (score == o.score && left > o.left);
+    }
+};
+
+// sentencepiece bpe: repeatedly merge the adjacent pair whose concatenation
+// is the best scoring vocabulary piece, unknown pieces fall back to bytes
+void Tokenizer::spm_encode(const std::string& text, std::vector<int>& tokens) const
+{
+    std::vector<spm_symbol> symbols;
+    symbols.reserve(text.size());
+    for (size_t pos = 0; pos < text.size();) {
+        spm_symbol sym;
+        sym.offset = pos;
+        sym.len = std::min((size_t)utf8_len((unsigned char)text[pos]), text.size() - pos);
+        sym.prev = (int)symbols.size() - 1;
+        sym.next = pos + sym.len < text.size() ? (int)symbols.size() + 1 : -1;
+        symbols.push_back(sym);
+        pos += sym.len;
+    }
+
+    std::priority_queue<spm_bigram> queue;
+    auto try_add = [&](int left) {
+        if (left < 0) return;
+        int right = symbols[left].next;
+        if (right < 0) return;
+        size_t len = symbols[left].len + symbols[right].len;
+        int id = find_token(text.data() + symbols[left].offset, len);
+        if (id < 0) return;
+        spm_bigram bigram;
+        bigram.score = scores[id];
+        bigram.left = left;
+        bigram.right = right;
+        bigram.len = len;
+        queue.push(bigram);
+    };
+
+    for (int i = 0; i + 1 < (int)symbols.size(); ++i) {
+        try_add(i);
+    }
+
+    while (!queue.empty()) {
+        spm_bigram bigram = queue.top();
+        queue.pop();
+
+        spm_symbol& left = symbols[bigram.left];
+        spm_symbol& right = symbols[bigram.right];
+        if (left.len == 0 || right.len == 0 || left.next != bigram.right || left.len + right.len != bigram.len) continue;
+
+        left.len += right.len;
+        left.next = right.next;
+        if (right.next >= 0) symbols[right.next].prev = bigram.left;
+        right.len = 0;
+
+        try_add(left.prev);
+        try_add(bigram.left);
+    }
+
+    for (int i = symbols.empty() ? -1 : 0; i >= 0; i = symbols[i].next) {
+        const spm_symbol& sym = symbols[i];
+        int id = find_token(text.data() + sym.offset, sym.len);
+        if (id >= 0) {
+            tokens.push_back(id);
+            continue;
+        }
+        for (size_t j = 0; j < sym.len; ++j) {
+            int id = byte_tokens[(unsigned char)text[sym.offset + j]];
+            if (id < 0) id = unk_token_id;
+            if (id >= 0) tokens.push_back(id);
+        }
+    }
+}
+
+std::vector<int> Tokenizer::encode(const std::string& text) const
+{
+    std::vector<int> tokens;
+
+    if (model_type != "gpt2" && model_type != "llama") {
         // Fallback: assume space-separated token IDs
-        std::vector<int> tokens;
         std::stringstream ss(text);
         int id;
         while (ss >> id) {
@@ -108,20 +650,117 @@ std::vector<int> Tokenizer::encode(const std::string& text) const
         }
         return tokens;
     }
+
+    // split out special tokens first, they never take part in merges
+    std::vector<size_t> next_match(special_tokens.size(), 0);
+    for (size_t i = 0; i < special_tokens.size(); ++i) {
+        next_match[i] = text.find(token_data(special_tokens[i]), 0, token_size(special_tokens[i]));
+    }
+
+    bool is_prev_special = true;
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        // earliest special token at or after pos, the longest one on ties
+        size_t match_pos = std::string::npos;
+        int match = -1;
+        for (size_t i = 0; i < special_tokens.size(); ++i) {
+            if (next_match[i] != std::string::npos && next_match[i] < pos) {
+                next_match[i] = text.find(token_data(special_tokens[i]), pos, token_size(special_tokens[i]));
+            }
+            if (next_match[i] < match_pos) {
+                match_pos = next_match[i];
+                match = special_tokens[i];
+            }
+        }
+
+        size_t end = match >= 0 ? match_pos : text.size();
+        if (end > pos) {
+            std::string fragment = text.substr(pos, end - pos);
+            if (model_type == "gpt2") {
+                words.clear();
+                pretokenize(fragment, words);
+                for (size_t i = 0; i < words.size(); ++i) {
+                    bpe_encode(words[i], tokens);
+                }
+            } else {
+                std::string escaped;
+                if (add_space_prefix && is_prev_special) escaped = "\xe2\x96\x81";
+                for (size_t i = 0; i < fragment.size(); ++i) {
+                    if (fragment[i] == ' ') escaped += "\xe2\x96\x81";
+                    else escaped += fragment[i];
+                }
+                spm_encode(escaped, tokens);
+            }
+            is_prev_special = false;
+        }
+
+        if (match < 0) break;
+        tokens.push_back(match);
+        is_prev_special = true;
+        pos = match_pos + token_size(match);
+    }
+
+    return tokens;
 }
 
-std::string Tokenizer::decode(const std::vector<int>& tokens) const
+// the raw text of one token, control tokens decode to nothing
+std::string Tokenizer::token_to_piece(int token) const
 {
-    if (model_type == "gpt2" || !bpe_merges.empty()) {
-        // Use BPE decoding
-        std::vector<std::string> token_strings;
-        for (int token : tokens) {
-            if (token >= 0 && token < static_cast<int>(id_to_token.size())) {
-                token_strings.push_back(id_to_token[token]);
+    std::string piece;
+    if (token < 0 || token >= vocab_size()) {
+        return piece;
+    }
+
+    const char* text = token_data(token);
+    const size_t size = token_size(token);
+    int type = token_types[token];
+    if (type == TOKEN_CONTROL) {
+        return piece;
+    }
+    if (type == TOKEN_USER_DEFINED) {
+        piece.assign(text, size);
+        return piece;
+    }
+
+    piece.reserve(size);
+    if (model_type == "gpt2") {
+        for (size_t pos = 0; pos < size;) {
+            int len;
+            uint32_t cp = utf8_decode(text + pos, size - pos, &len);
+            auto it = unicode_to_byte.find(cp);
+            if (it != unicode_to_byte.end()) {
+                piece += (char)it->second;
+            } else {
+                piece.append(text + pos, len);
             }
+            pos += len;
         }
-        return bpe_decode(token_strings);
     } else {
+        if (size == 6 && memcmp(text, "<0x", 3) == 0 && text[5] == '>') {
+            char hex[3] = {text[3], text[4], 0};
+            char* end;
+            long byte = strtol(hex, &end, 16);
+            if (end == hex + 2) {
+                piece += (char)byte;
+                return piece;
+            }
+        }
+        for (size_t pos = 0; pos < size; ++pos) {
+            if (pos + 3 <= size && memcmp(text + pos, "\xe2\x96\x81", 3) == 0) {
+                piece += ' ';
+                pos += 2;
+            } else {
+                piece += text[pos];
+            }
+        }
+    }
+    return piece;
+}
+
+std::string Tokenizer::decode(const std::vector<int>& tokens) const
+{
+    if (model_type != "gpt2" && model_type != "llama") {
         // Fallback: just convert to string
         std::stringstream ss;
         for (size_t i = 0; i < tokens.size(); ++i) {
@@ -130,38 +769,71 @@ std::string Tokenizer::decode(const std::vector<int>& tokens) const
         }
         return ss.str();
     }
+
+    std::string result;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        result += token_to_piece(tokens[i]);
+    }
+    // drop the space the encoder prepended to the text
+    if (add_space_prefix && !result.empty() && result[0] == ' ') {
+        result.erase(0, 1);
+    }
+    return result;
 }
 
 std::string Tokenizer::decode(int token) const
 {
-    return decode(std::vector<int>{token});
+    if (model_type != "gpt2" && model_type != "llama") {
+        return decode(std::vector<int>(1, token));
+    }
+    return token_to_piece(token);
 }
 
-std::vector<std::string> Tokenizer::bpe_encode(const std::string& text) const
+StreamDecoder::StreamDecoder(const Tokenizer& _tokenizer)
+    : tokenizer(_tokenizer), at_start(true)
 {
-    // Simplified BPE encoding - this is a basic implementation
-    // In practice, you'd want a more robust BPE tokenizer
-    std::vector<std::string> words;
-    std::stringstream ss(text);
-    std::string word;
-    while (ss >> word) {
-        // Convert to bytes
-        std::vector<std::string> chars;
-        for (char c : word) {
-            chars.push_back(std::string(1, c));
+}
+
+std::string StreamDecoder::push(int token)
+{
+    if (tokenizer.model_type != "gpt2" && tokenizer.model_type != "llama") {
+        // Fallback: space-separated token IDs
+        std::string text = at_start ? "" : " ";
+        at_start = false;
+        return text + tokenizer.decode(token);
+    }
+
+    std::string piece = tokenizer.token_to_piece(token);
+    if (at_start && !piece.empty()) {
+        // same as decode(), drop the space the encoder prepended
+        if (tokenizer.add_space_prefix && piece[0] == ' ') {
+            piece.erase(0, 1);
+        }
+        at_start = false;
+    }
+    pending += piece;
+
+    // hold back a trailing lead byte whose continuation bytes are still to come
+    size_t complete = pending.size();
+    for (size_t i = pending.size(); i > 0 && pending.size() - i < 3; --i) {
+        unsigned char c = (unsigned char)pending[i - 1];
+        if ((c & 0xC0) == 0x80) continue;
+        if (c >= 0xC0 && (size_t)utf8_len(c) > pending.size() - (i - 1)) {
+            complete = i - 1;
         }
-        words.insert(words.end(), chars.begin(), chars.end());
+        break;
     }
-    return words;
+
+    std::string text = pending.substr(0, complete);
+    pending.erase(0, complete);
+    return text;
 }
 
-std::string Tokenizer::bpe_decode(const std::vector<std::string>& tokens) const
+std::string StreamDecoder::flush()
 {
-    std::string result;
-    for (const auto& token : tokens) {
-        result += token;
-    }
-    return result;
+    std::string text;
+    text.swap(pending);
+    return text;
 }
 
-} // namespace ncnn
\ No newline at end of file
+} // namespace ncnn
@@ -1,20 +1,23 @@
 #ifndef TOKENIZER_H
 #define TOKENIZER_H
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
 
 namespace ncnn {
 
+class GGUFLoader;
+
 class Tokenizer {
 public:
     Tokenizer();
     ~Tokenizer();
 
-    bool load_from_gguf(const std::unordered_map<std::string, std::string>& kv_strings,
-                        const std::unordered_map<std::string, std::vector<std::string>>& kv_string_arrays);
+    // reads tokenizer.ggml.* from the model metadata
+    // tokenizer.ggml.model selects byte-level BPE ("gpt2") or SentencePiece ("llama")
+    bool load_from_gguf(const GGUFLoader& loader);
 
     std::vector<int> encode(const std::string& text) const;
     std::string decode(const std::vector<int>& tokens) const;
@@ -24,26 +27,81 @@ public:
     int eos_token() const { return eos_token_id; }
     int unk_token() const { return unk_token_id; }
     int pad_token() const { return pad_token_id; }
+    bool add_bos_token() const { return add_bos; }
+    // decoded text drops the space the encoder put before the first word
+    bool add_space_prefix_token() const { return add_space_prefix; }
 
 private:
+    enum {
+        TOKEN_NORMAL = 1,
+        TOKEN_UNKNOWN = 2,
+        TOKEN_CONTROL = 3,
+        TOKEN_USER_DEFINED = 4,
+        TOKEN_UNUSED = 5,
+        TOKEN_BYTE = 6
+    };
+
+    enum {
+        PRE_GPT2 = 0, // 's|'t|... | ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+        PRE_LLAMA3    // case-insensitive contractions, \p{N}{1,3}, newline runs
+    };
+
     std::string model_type;
-    std::unordered_map<std::string, int> vocab;
-    std::vector<std::string> id_to_token;
-    std::unordered_map<std::string, int> merges; // for BPE
+    int pre_type;
+    // token text back to back, token i is [token_offsets[i], token_offsets[i + 1])
+    std::string token_text;
+    std::vector<uint32_t> token_offsets;
+    std::vector<int> vocab_buckets; // open addressing on the text hash, -1 is empty
+    std::vector<float> scores;
+    std::vector<int> token_types;
     int bos_token_id;
     int eos_token_id;
     int unk_token_id;
     int pad_token_id;
+    bool add_bos;
+    bool add_space_prefix;
 
-    // BPE helpers
-    std::vector<std::pair<std::string, std::string>> bpe_merges;
-    std::unordered_set<std::string> byte_encoder;
+    // (left id << 32 | right id) -> (rank, merged id)
+    std::unordered_map<uint64_t, std::pair<int, int> > merges;
+    // control and user defined tokens matched verbatim before splitting, longest first
+    std::vector<int> special_tokens;
+    // byte -> its gpt2 unicode stand-in, and the token of each byte
+    std::string byte_to_unicode[256];
+    std::unordered_map<uint32_t, uint8_t> unicode_to_byte;
+    int byte_tokens[256];
+
+    int vocab_size() const { return token_offsets.empty() ? 0 : (int)token_offsets.size() - 1; }
+    const char* token_data(int id) const { return token_text.data() + token_offsets[id]; }
+    size_t token_size(int id) const { return token_offsets[id + 1] - token_offsets[id]; }
+    int find_token(const char* text, size_t size) const;
+
+    friend class StreamDecoder;
 
     void initialize_byte_encoder();
-    std::vector<std::string> bpe_encode(const std::string& text) const;
-    std::string bpe_decode(const std::vector<std::string>& tokens) const;
+    void pretokenize(const std::string& text, std::vector<std::string>& words) const;
+    void bpe_encode(const std::string& word, std::vector<int>& tokens) const;
+    void spm_encode(const std::string& text, std::vector<int>& tokens) const;
+    std::string token_to_piece(int token) const;
+};
+
+// Decodes a token stream one token at a time
+// bytes of a character split across tokens are held back until it is complete,
+// so concatenating every push() and the final flush() equals decode() of all tokens
+class StreamDecoder {
+public:
+    explicit StreamDecoder(const Tokenizer& tokenizer);
+
+    // text completed by this token, may be empty
+    std::string push(int token);
+    // whatever is still held back, an incomplete tail is returned as is
+    std::string flush();
+
+private:
+    const Tokenizer& tokenizer;
+    std::string pending;
+    bool at_start;
 };
 
 } // namespace ncnn
 
-#endif // TOKENIZER_H
\ No newline at end of file
+#endif // TOKENIZER_H
@@ -5,14 +5,29 @@ class LLMEngine {
     this._engine = new binding.LLMEngine();
   }
 
-  async loadModel(modelPath) {
-    return this._engine.loadModel(modelPath);
+  // Resolves once the model is loaded. Models are cached by path for the
+  // life of the process, so loading the same path again is free.
+  loadModel(modelPath, options = {}) {
+    return this._engine.loadModel(modelPath, options);
   }
 
-  async generateText(prompt, options = {}) {
+  // Resolves with { text, promptTokens, completionTokens, finishReason } once
+  // the generation ends, finishReason being "stop" or "length". Rejects when
+  // the request is refused or a forward pass fails.
+  generateText(prompt, options = {}) {
     return this._engine.generateText(prompt, options);
   }
 
+  // Calls onText with each piece of text as soon as it is decoded, pieces
+  // always end on a UTF-8 character boundary. Returns { done, stop }: done
+  // resolves with { text, promptTokens, completionTokens, finishReason }
+  // after the last piece has been delivered, finishReason being "stop",
+  // "length" or "error". stop() ends this stream after the current token and
+  // leaves the other streams of the model running.
+  generateStream(prompt, options, onText) {
+    return this._engine.generateStream(prompt, options || {}, onText);
+  }
+
   getTokenizer() {
     return this._engine.getTokenizer();
   }
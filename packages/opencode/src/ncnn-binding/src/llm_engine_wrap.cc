@@ -1,15 +1,308 @@
 #include "llm_engine_wrap.h"
 #include <iostream>
+#include <unordered_map>
 
 Napi::FunctionReference LLMEngineWrap::constructor;
 
+// Models stay loaded for the life of the process, keyed by path
+static std::mutex engine_cache_mutex;
+static std::unordered_map<std::string, std::shared_ptr<EngineEntry>> engine_cache;
+
+static std::shared_ptr<EngineEntry> GetEngineEntry(const std::string& modelPath) {
+  std::lock_guard<std::mutex> lock(engine_cache_mutex);
+  std::shared_ptr<EngineEntry>& entry = engine_cache[modelPath];
+  if (!entry) {
+    entry = std::make_shared<EngineEntry>();
+  }
+  return entry;
+}
+
+// Loads the model on a worker thread, concurrent loads of one path wait for the first
+class LoadModelWorker : public Napi::AsyncWorker {
+ public:
+  LoadModelWorker(Napi::Env env, LLMEngineWrap* wrap, Napi::Object self,
+                  const std::string& modelPath, const ncnn::EngineConfig& config)
+      : Napi::AsyncWorker(env, "ncnn.loadModel"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        wrap_(wrap),
+        self_(Napi::Persistent(self)),
+        modelPath_(modelPath),
+        config_(config) {}
+
+  Napi::Promise GetPromise() { return deferred_.Promise(); }
+
+  void Execute() override {
+    entry_ = GetEngineEntry(modelPath_);
+    std::lock_guard<std::mutex> lock(entry_->mutex);
+    if (!entry_->loaded) {
+      entry_->loaded = entry_->engine.load_model(modelPath_, config_);
+      if (entry_->loaded) {
+        entry_->scheduler.reset(new ncnn::Scheduler(entry_->engine));
+      }
+    }
+    if (!entry_->loaded) {
+      SetError("Failed to load model: " + modelPath_);
+    }
+  }
+
+  void OnOK() override {
+    wrap_->SetEntry(entry_);
+    deferred_.Resolve(Napi::Boolean::New(Env(), true));
+  }
+
+  void OnError(const Napi::Error& e) override {
+    deferred_.Reject(e.Value());
+  }
+
+ private:
+  Napi::Promise::Deferred deferred_;
+  LLMEngineWrap* wrap_;
+  Napi::ObjectReference self_; // keeps the wrapper alive until OnOK
+  std::string modelPath_;
+  ncnn::EngineConfig config_;
+  std::shared_ptr<EngineEntry> entry_;
+};
+
+// The finishReason strings of the AI SDK for a scheduler FinishReason
+static const char* FinishReasonName(int reason) {
+  switch (reason) {
+  case ncnn::FINISH_STOP:
+    return "stop";
+  case ncnn::FINISH_LENGTH:
+    return "length";
+  default:
+    return "error";
+  }
+}
+
+// What generateText and generateStream resolve with
+static Napi::Object GenerationResult(Napi::Env env, const std::string& text, int completion_tokens, const ncnn::GenerationInfo& info) {
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("text", Napi::String::New(env, text));
+  result.Set("promptTokens", Napi::Number::New(env, info.prompt_tokens));
+  result.Set("completionTokens", Napi::Number::New(env, completion_tokens));
+  result.Set("finishReason", Napi::String::New(env, FinishReasonName(info.finish_reason)));
+  return result;
+}
+
+// Queues one generation and returns, concurrent requests share decode steps
+// Execute only tokenizes the prompt, the scheduler thread settles the promise
+// through a thread-safe function once the generation ends, so a long
+// generation never holds one of the few libuv pool threads
+class GenerateWorker : public Napi::AsyncWorker {
+ public:
+  GenerateWorker(Napi::Env env, const std::shared_ptr<EngineEntry>& entry,
+                 const std::string& prompt, const ncnn::GenerationConfig& config)
+      : Napi::AsyncWorker(env, "ncnn.generateText"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        entry_(entry),
+        prompt_(prompt),
+        config_(config) {
+    done_ = Napi::ThreadSafeFunction::New(env, Napi::Function(), "ncnn.generateText", 0, 1);
+  }
+
+  Napi::Promise GetPromise() { return deferred_.Promise(); }
+
+  void Execute() override {
+    const ncnn::Tokenizer* tokenizer = &entry_->engine.get_tokenizer();
+    Napi::ThreadSafeFunction done = done_;
+    Napi::Promise::Deferred deferred = deferred_;
+    entry_->scheduler->submit(prompt_, config_, ncnn::TokenCallback(),
+                              [tokenizer, done, deferred](const std::vector<int>& tokens, const ncnn::GenerationInfo& info) {
+      std::string text = tokenizer->decode(tokens);
+      int completion_tokens = (int)tokens.size();
+      done.BlockingCall([deferred, text, completion_tokens, info](Napi::Env env, Napi::Function) {
+        if (env == nullptr) return;
+        // a refused request or a failed forward pass has no text to trust
+        if (info.finish_reason == ncnn::FINISH_ERROR) {
+          deferred.Reject(Napi::Error::New(env, "Generation failed").Value());
+          return;
+        }
+        deferred.Resolve(GenerationResult(env, text, completion_tokens, info));
+      });
+      done.Release();
+    });
+  }
+
+  // the promise is settled from the scheduler through done_
+  void OnOK() override {}
+
+ private:
+  Napi::Promise::Deferred deferred_;
+  std::shared_ptr<EngineEntry> entry_;
+  std::string prompt_;
+  ncnn::GenerationConfig config_;
+  Napi::ThreadSafeFunction done_;
+};
+
+// Streams text deltas to a JS callback as tokens are produced, queued the
+// same way as GenerateWorker
+// completion travels through the same thread-safe function as the deltas so
+// the promise never settles before the last delta has been delivered
+class GenerateStreamWorker : public Napi::AsyncWorker {
+ public:
+  GenerateStreamWorker(Napi::Env env, const std::shared_ptr<EngineEntry>& entry,
+                       const std::string& prompt, const ncnn::GenerationConfig& config,
+                       Napi::Function onToken, const std::shared_ptr<std::atomic<bool>>& stop)
+      : Napi::AsyncWorker(env, "ncnn.generateStream"),
+        deferred_(Napi::Promise::Deferred::New(env)),
+        entry_(entry),
+        prompt_(prompt),
+        config_(config),
+        stop_(stop) {
+    onToken_ = Napi::ThreadSafeFunction::New(env, onToken, "ncnn.onToken", 0, 1);
+  }
+
+  Napi::Promise GetPromise() { return deferred_.Promise(); }
+
+  void Execute() override {
+    // text so far, only touched by the scheduler thread
+    struct Progress {
+      std::string text;
+      int completion_tokens = 0;
+    };
+    std::shared_ptr<Progress> progress = std::make_shared<Progress>();
+    Napi::ThreadSafeFunction onToken = onToken_;
+    Napi::Promise::Deferred deferred = deferred_;
+    std::shared_ptr<std::atomic<bool>> stop = stop_;
+
+    // both callbacks run on the scheduler thread, so they must not block on JS
+    auto on_token = [progress, onToken, stop](int token, const std::string& delta) {
+      if (token >= 0) progress->completion_tokens++;
+      if (!delta.empty()) {
+        progress->text += delta;
+        std::string* chunk = new std::string(delta);
+        napi_status status = onToken.NonBlockingCall(chunk, [](Napi::Env env, Napi::Function js, std::string* chunk) {
+          if (env != nullptr) {
+            js.Call({Napi::String::New(env, *chunk)});
+          }
+          delete chunk;
+        });
+        if (status != napi_ok) {
+          delete chunk;
+        }
+      }
+      return !stop->load();
+    };
+
+    auto on_done = [progress, onToken, deferred](const std::vector<int>&, const ncnn::GenerationInfo& info) {
+      std::string text = progress->text;
+      int completion_tokens = progress->completion_tokens;
+      onToken.BlockingCall([deferred, text, completion_tokens, info](Napi::Env env, Napi::Function) {
+        if (env == nullptr) return;
+        deferred.Resolve(GenerationResult(env, text, completion_tokens, info));
+      });
+      onToken.Release();
+    };
+
+    // the flag also reaches the scheduler, which checks it before every
+    // prefill chunk so a stream cancelled during a long prompt ends there
+    entry_->scheduler->submit(prompt_, config_, on_token, on_done, stop_);
+  }
+
+  // the promise is settled from the scheduler through onToken_
+  void OnOK() override {}
+
+ private:
+  Napi::Promise::Deferred deferred_;
+  std::shared_ptr<EngineEntry> entry_;
+  std::string prompt_;
+  ncnn::GenerationConfig config_;
+  Napi::ThreadSafeFunction onToken_;
+  std::shared_ptr<std::atomic<bool>> stop_;
+};
+
+// Optional generation options object at info[index]
+static ncnn::GenerationConfig ParseGenerationConfig(const Napi::CallbackInfo& info, size_t index) {
+  ncnn::GenerationConfig config;
+  if (info.Length() > index && info[index].IsObject()) {
+    Napi::Object configObj = info[index].As<Napi::Object>();
+
+    if (configObj.Has("maxTokens")) {
+      config.max_tokens = configObj.Get("maxTokens").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("temperature")) {
+      config.temperature = configObj.Get("temperature").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("topP")) {
+      config.top_p = configObj.Get("topP").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("topK")) {
+      config.top_k = configObj.Get("topK").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("minP")) {
+      config.min_p = configObj.Get("minP").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("typicalP")) {
+      config.typical_p = configObj.Get("typicalP").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("repetitionPenalty")) {
+      config.repetition_penalty = configObj.Get("repetitionPenalty").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("presencePenalty")) {
+      config.presence_penalty = configObj.Get("presencePenalty").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("frequencyPenalty")) {
+      config.frequency_penalty = configObj.Get("frequencyPenalty").As<Napi::Number>().FloatValue();
+    }
+    if (configObj.Has("seed")) {
+      config.seed = configObj.Get("seed").As<Napi::Number>().Int64Value();
+    }
+    if (configObj.Has("grammar")) {
+      config.grammar = configObj.Get("grammar").As<Napi::String>().Utf8Value();
+    }
+    if (configObj.Has("jsonSchema")) {
+      // a schema object is accepted as well as its JSON text
+      Napi::Value schema = configObj.Get("jsonSchema");
+      if (schema.IsObject()) {
+        Napi::Object json = info.Env().Global().Get("JSON").As<Napi::Object>();
+        schema = json.Get("stringify").As<Napi::Function>().Call(json, {schema});
+      }
+      config.json_schema = schema.As<Napi::String>().Utf8Value();
+    }
+  }
+  return config;
+}
+
+// Why the grammar or schema of a request does not compile, empty when it does
+static std::string GrammarError(const ncnn::GenerationConfig& config) {
+  std::string error;
+  ncnn::Grammar grammar;
+  if (!config.grammar.empty()) {
+    grammar.parse(config.grammar, &error);
+  } else if (!config.json_schema.empty()) {
+    grammar.parse_json_schema(config.json_schema, &error);
+  }
+  return error;
+}
+
+static Napi::Value RejectedPromise(Napi::Env env, const char* message) {
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+  deferred.Reject(Napi::Error::New(env, message).Value());
+  return deferred.Promise();
+}
+
+// The { done, stop } handle generateStream returns, stop sets only this
+// stream's flag
+static Napi::Value StreamHandle(Napi::Env env, Napi::Value done, const std::shared_ptr<std::atomic<bool>>& stop) {
+  Napi::Object handle = Napi::Object::New(env);
+  handle.Set("done", done);
+  handle.Set("stop", Napi::Function::New(env, [stop](const Napi::CallbackInfo& info) {
+    stop->store(true);
+    return info.Env().Undefined();
+  }, "stop"));
+  return handle;
+}
+
 Napi::Object LLMEngineWrap::Init(Napi::Env env, Napi::Object exports) {
   Napi::HandleScope scope(env);
 
   Napi::Function func = DefineClass(env, "LLMEngine", {
     InstanceMethod("loadModel", &LLMEngineWrap::LoadModel),
     InstanceMethod("generateText", &LLMEngineWrap::GenerateText),
-    InstanceMethod("getTokenizer", &LLMEngineWrap::GetTokenizer)
+    InstanceMethod("generateStream", &LLMEngineWrap::GenerateStream),
+    InstanceMethod("getTokenizer", &LLMEngineWrap::GetTokenizer),
+    InstanceMethod("getSpeculativeStats", &LLMEngineWrap::GetSpeculativeStats)
   });
 
   constructor = Napi::Persistent(func);
@@ -21,14 +314,10 @@ Napi::Object LLMEngineWrap::Init(Napi::Env env, Napi::Object exports) {
 
 LLMEngineWrap::LLMEngineWrap(const Napi::CallbackInfo& info)
     : Napi::ObjectWrap<LLMEngineWrap>(info) {
-  engine_ = new ncnn::LLMEngine();
 }
 
 LLMEngineWrap::~LLMEngineWrap() {
-  if (engine_) {
-    delete engine_;
-    engine_ = nullptr;
-  }
+  // the engine itself stays in the cache for the next wrapper
 }
 
 Napi::Value LLMEngineWrap::LoadModel(const Napi::CallbackInfo& info) {
@@ -40,9 +329,77 @@ Napi::Value LLMEngineWrap::LoadModel(const Napi::CallbackInfo& info) {
   }
 
   std::string modelPath = info[0].As<Napi::String>().Utf8Value();
-  bool result = engine_->load_model(modelPath);
 
-  return Napi::Boolean::New(env, result);
+  // Parse optional engine options, they only apply to the first load of a path
+  ncnn::EngineConfig config;
+  if (info.Length() > 1 && info[1].IsObject()) {
+    Napi::Object configObj = info[1].As<Napi::Object>();
+
+    if (configObj.Has("useMmap")) {
+      config.use_mmap = configObj.Get("useMmap").ToBoolean().Value();
+    }
+    if (configObj.Has("numThreads")) {
+      config.num_threads = configObj.Get("numThreads").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("prefillThreads")) {
+      config.prefill_threads = configObj.Get("prefillThreads").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("decodeThreads")) {
+      config.decode_threads = configObj.Get("decodeThreads").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("pinThreads")) {
+      config.pin_threads = configObj.Get("pinThreads").ToBoolean().Value();
+    }
+    if (configObj.Has("indexCache")) {
+      config.index_cache = configObj.Get("indexCache").ToBoolean().Value();
+    }
+    if (configObj.Has("repackWeights")) {
+      config.repack_weights = configObj.Get("repackWeights").ToBoolean().Value();
+    }
+    if (configObj.Has("prefixCacheMB")) {
+      config.prefix_cache_size = (size_t)configObj.Get("prefixCacheMB").As<Napi::Number>().Int64Value() << 20;
+    }
+    if (configObj.Has("kvCacheType")) {
+      std::string type = configObj.Get("kvCacheType").ToString().Utf8Value();
+      if (type == "f32") {
+        config.kv_cache_type = ncnn::GGML_TYPE_F32;
+      } else if (type == "f16") {
+        config.kv_cache_type = ncnn::GGML_TYPE_F16;
+      } else if (type == "bf16") {
+        config.kv_cache_type = ncnn::GGML_TYPE_BF16;
+      } else if (type == "q8_0") {
+        config.kv_cache_type = ncnn::GGML_TYPE_Q8_0;
+      } else if (type == "q4_0") {
+        config.kv_cache_type = ncnn::GGML_TYPE_Q4_0;
+      } else {
+        Napi::TypeError::New(env, "kvCacheType must be f32, f16, bf16, q8_0 or q4_0").ThrowAsJavaScriptException();
+        return env.Null();
+      }
+    }
+    if (configObj.Has("prefillChunk")) {
+      config.prefill_chunk = configObj.Get("prefillChunk").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("contextShift")) {
+      config.context_shift = configObj.Get("contextShift").ToBoolean().Value();
+    }
+    if (configObj.Has("sinkTokens")) {
+      config.sink_tokens = configObj.Get("sinkTokens").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("draftModel")) {
+      config.draft_model = configObj.Get("draftModel").ToString().Utf8Value();
+    }
+    if (configObj.Has("lookupNgram")) {
+      config.lookup_ngram = configObj.Get("lookupNgram").As<Napi::Number>().Int32Value();
+    }
+    if (configObj.Has("draftTokens")) {
+      config.draft_tokens = configObj.Get("draftTokens").As<Napi::Number>().Int32Value();
+    }
+  }
+
+  LoadModelWorker* worker = new LoadModelWorker(env, this, info.This().As<Napi::Object>(), modelPath, config);
+  Napi::Promise promise = worker->GetPromise();
+  worker->Queue();
+  return promise;
 }
 
 Napi::Value LLMEngineWrap::GenerateText(const Napi::CallbackInfo& info) {
@@ -53,41 +410,88 @@ Napi::Value LLMEngineWrap::GenerateText(const Napi::CallbackInfo& info) {
     return env.Null();
   }
 
+  if (!entry_) {
+    return RejectedPromise(env, "Model not loaded");
+  }
+
   std::string prompt = info[0].As<Napi::String>().Utf8Value();
 
-  // Parse optional config object
-  ncnn::GenerationConfig config;
-  if (info.Length() > 1 && info[1].IsObject()) {
-    Napi::Object configObj = info[1].As<Napi::Object>();
+  ncnn::GenerationConfig config = ParseGenerationConfig(info, 1);
+  std::string grammar_error = GrammarError(config);
+  if (!grammar_error.empty()) {
+    return RejectedPromise(env, grammar_error.c_str());
+  }
 
-    if (configObj.Has("maxTokens")) {
-      config.max_tokens = configObj.Get("maxTokens").As<Napi::Number>().Int32Value();
-    }
-    if (configObj.Has("temperature")) {
-      config.temperature = configObj.Get("temperature").As<Napi::Number>().FloatValue();
-    }
-    if (configObj.Has("topP")) {
-      config.top_p = configObj.Get("topP").As<Napi::Number>().FloatValue();
-    }
-    if (configObj.Has("topK")) {
-      config.top_k = configObj.Get("topK").As<Napi::Number>().Int32Value();
-    }
+  GenerateWorker* worker = new GenerateWorker(env, entry_, prompt, config);
+  Napi::Promise promise = worker->GetPromise();
+  worker->Queue();
+  return promise;
+}
+
+Napi::Value LLMEngineWrap::GenerateStream(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 3 || !info[0].IsString() || !info[2].IsFunction()) {
+    Napi::TypeError::New(env, "String, options and callback expected").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  // every stream gets its own flag, the wrapper is shared by all the
+  // requests for one model so stopping one must not end the others
+  std::shared_ptr<std::atomic<bool>> stop = std::make_shared<std::atomic<bool>>(false);
+
+  if (!entry_) {
+    return StreamHandle(env, RejectedPromise(env, "Model not loaded"), stop);
+  }
+
+  std::string prompt = info[0].As<Napi::String>().Utf8Value();
+  ncnn::GenerationConfig config = ParseGenerationConfig(info, 1);
+  std::string grammar_error = GrammarError(config);
+  if (!grammar_error.empty()) {
+    return StreamHandle(env, RejectedPromise(env, grammar_error.c_str()), stop);
   }
 
-  std::string result = engine_->generate_text(prompt, config);
-  return Napi::String::New(env, result);
+  GenerateStreamWorker* worker = new GenerateStreamWorker(env, entry_, prompt, config, info[2].As<Napi::Function>(), stop);
+  Napi::Promise promise = worker->GetPromise();
+  worker->Queue();
+  return StreamHandle(env, promise, stop);
 }
 
 Napi::Value LLMEngineWrap::GetTokenizer(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
 
+  if (!entry_) {
+    return env.Null();
+  }
+
   // Return a simple object with tokenizer methods
   Napi::Object tokenizer = Napi::Object::New(env);
 
   // We can't directly expose the C++ Tokenizer object, so we'll create wrapper methods
   // For now, return a placeholder object
-  tokenizer.Set("bosToken", Napi::Number::New(env, engine_->get_tokenizer().bos_token()));
-  tokenizer.Set("eosToken", Napi::Number::New(env, engine_->get_tokenizer().eos_token()));
+  tokenizer.Set("bosToken", Napi::Number::New(env, entry_->engine.get_tokenizer().bos_token()));
+  tokenizer.Set("eosToken", Napi::Number::New(env, entry_->engine.get_tokenizer().eos_token()));
 
   return tokenizer;
-}
\ No newline at end of file
+}
+
+Napi::Value LLMEngineWrap::GetSpeculativeStats(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!entry_ || !entry_->engine.can_speculate()) {
+    return env.Null();
+  }
+
+  ncnn::SpeculativeStats stats = entry_->engine.speculative_stats();
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("steps", Napi::Number::New(env, (double)stats.steps));
+  result.Set("drafted", Napi::Number::New(env, (double)stats.drafted));
+  result.Set("accepted", Napi::Number::New(env, (double)stats.accepted));
+  result.Set("lookedUp", Napi::Number::New(env, (double)stats.looked_up));
+  result.Set("generated", Napi::Number::New(env, (double)stats.generated));
+  result.Set("acceptanceRate", Napi::Number::New(env, stats.acceptance_rate()));
+  result.Set("tokensPerStep", Napi::Number::New(env, stats.tokens_per_step()));
+  result.Set("draftSeconds", Napi::Number::New(env, stats.draft_seconds));
+  result.Set("verifySeconds", Napi::Number::New(env, stats.verify_seconds));
+  return result;
+}
@@ -2,7 +2,21 @@
 #define LLM_ENGINE_WRAP_H
 
 #include <napi.h>
-#include "../ncnn/llm_engine.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "llm_engine.h"
+#include "llm_scheduler.h"
+
+// A loaded model shared by every wrapper that asked for the same path
+// the mutex guards loading, generations from every wrapper go through the
+// scheduler which batches them into shared decode steps
+struct EngineEntry {
+  ncnn::LLMEngine engine;
+  std::unique_ptr<ncnn::Scheduler> scheduler;
+  std::mutex mutex;
+  bool loaded = false;
+};
 
 class LLMEngineWrap : public Napi::ObjectWrap<LLMEngineWrap> {
  public:
@@ -10,16 +24,22 @@ class LLMEngineWrap : public Napi::ObjectWrap<LLMEngineWrap> {
   LLMEngineWrap(const Napi::CallbackInfo& info);
   ~LLMEngineWrap();
 
+  void SetEntry(const std::shared_ptr<EngineEntry>& entry) { entry_ = entry; }
+
  private:
   static Napi::FunctionReference constructor;
 
-  // Wrapped methods
+  // Wrapped methods, loadModel and generateText return Promises, generateStream
+  // returns a handle holding its Promise and a stop function for that stream
   Napi::Value LoadModel(const Napi::CallbackInfo& info);
   Napi::Value GenerateText(const Napi::CallbackInfo& info);
+  Napi::Value GenerateStream(const Napi::CallbackInfo& info);
   Napi::Value GetTokenizer(const Napi::CallbackInfo& info);
+  // Speculative decoding counters, null when the engine does not speculate
+  Napi::Value GetSpeculativeStats(const Napi::CallbackInfo& info);
 
-  // Internal LLMEngine instance
-  ncnn::LLMEngine* engine_;
+  // Engine loaded from the process-wide cache, null until loadModel resolves
+  std::shared_ptr<EngineEntry> entry_;
 };
 
-#endif // LLM_ENGINE_WRAP_H
\ No newline at end of file
+#endif // LLM_ENGINE_WRAP_H
@@ -15,10 +15,84 @@ try {
     console.warn("Failed to load ncnn-binding:", e)
 }
 
+// Engine options of the config, the binding reads every key it is given so
+// unset ones are left out and keep the engine defaults
+function engineOptions(config: NcnnConfig) {
+    const options = {
+        prefixCacheMB: config.prefixCacheMB,
+        kvCacheType: config.kvCacheType,
+        lookupNgram: config.lookupNgram,
+        draftTokens: config.draftTokens,
+    }
+    return Object.fromEntries(Object.entries(options).filter(([, value]) => value !== undefined))
+}
+
+// One loaded engine per model path for the whole process, the options of
+// the first config to load a path apply to it
+const engines = new Map<string, Promise<any>>()
+
+function loadEngine(config: NcnnConfig): Promise<any> {
+    const modelPath = config.modelPath
+    const cached = engines.get(modelPath)
+    if (cached) return cached
+    if (!binding) return Promise.reject(new Error("ncnn-binding is not available"))
+    const instance = new binding.LLMEngine()
+    const engine = instance.loadModel(modelPath, engineOptions(config)).then(() => instance)
+    engines.set(modelPath, engine)
+    // let a failed load be retried by the next request
+    engine.catch(() => engines.delete(modelPath))
+    return engine
+}
+
+// What generateText and generateStream resolve with
+interface GenerationResult {
+    text: string
+    promptTokens: number
+    completionTokens: number
+    finishReason: LanguageModelV2FinishReason
+}
+
+const generationOptions = {
+    maxTokens: 1024,
+    temperature: 0.7
+}
+
+// JSON responses are constrained to their schema while decoding, so they always parse
+function callOptions(options: any) {
+    if (options.responseFormat?.type === "json") {
+        return { ...generationOptions, jsonSchema: options.responseFormat.schema ?? {} }
+    }
+    return generationOptions
+}
+
+function buildPrompt(options: any): string {
+    if (options.inputFormat === "prompt") {
+        return options.input.map((c: any) => c.text).join("")
+    }
+    return options.prompt
+        .map((m: any) => {
+            const text = m.content.filter((c: any) => c.type === "text").map((c: any) => c.text).join("")
+            return `${m.role}: ${text}`
+        })
+        .join("\n") + "\nassistant:"
+}
+
 export interface NcnnConfig {
     modelPath: string
     gpuLayers?: number
     contextLength?: number
+    // KV cache kept for recent prompts so a conversation turn only prefills
+    // what it adds, none when unset
+    prefixCacheMB?: number
+    // storage of the KV cache, f16 fits twice the context of f32 in the same
+    // memory at some accuracy, the engine default when unset
+    kvCacheType?: "f32" | "f16" | "bf16" | "q8_0" | "q4_0"
+    // prompt lookup: propose the tokens that followed the last lookupNgram
+    // tokens earlier in the context, edits copy most of their text from the
+    // prompt so 3 suits them, 0 or unset turns it off
+    lookupNgram?: number
+    // tokens proposed per speculative step, the engine default when unset
+    draftTokens?: number
 }
 
 export class NcnnLanguageModel implements LanguageModelV2 {
@@ -29,72 +103,72 @@ export class NcnnLanguageModel implements LanguageModelV2 {
     readonly supportedUrls = {}
 
     private config: NcnnConfig
-    private engine: any = null
 
     constructor(modelId: string, config: NcnnConfig) {
         this.modelId = modelId
         this.config = config
     }
 
-    private getEngine() {
-        if (this.engine) return this.engine
-        if (!binding) throw new Error("ncnn-binding is not available")
-        this.engine = new binding.LLMEngine()
-        return this.engine
-    }
-
     async doGenerate(options: any) {
-        const engine = this.getEngine()
-
-        let prompt = ""
-        if (options.inputFormat === "prompt") {
-            prompt = options.input.map((c: any) => c.text).join("")
-        } else {
-            prompt = options.prompt
-                .map((m: any) => {
-                    const text = m.content.filter((c: any) => c.type === "text").map((c: any) => c.text).join("")
-                    return `${m.role}: ${text}`
-                })
-                .join("\n") + "\nassistant:"
-        }
+        const prompt = buildPrompt(options)
+        const engine = await this.getEngine()
 
-        try {
-            await engine.loadModel(this.config.modelPath)
-        } catch (e) {
-            throw new Error(`Failed to load model at ${this.config.modelPath}: ${e}`)
-        }
-
-        const text: string = await engine.generateText(prompt, {
-            maxTokens: 1024,
-            temperature: 0.7
-        })
+        const result: GenerationResult = await engine.generateText(prompt, callOptions(options))
 
         return {
-            content: [{ type: "text" as const, text }],
+            content: [{ type: "text" as const, text: result.text }],
             usage: {
-                inputTokens: 0,
-                outputTokens: 0,
-                totalTokens: 0
+                inputTokens: result.promptTokens,
+                outputTokens: result.completionTokens,
+                totalTokens: result.promptTokens + result.completionTokens
             },
-            finishReason: "stop" as LanguageModelV2FinishReason,
+            finishReason: result.finishReason,
             warnings: [] as LanguageModelV2CallWarning[]
         }
     }
 
     async doStream(options: any) {
-        const result = await this.doGenerate(options)
+        const prompt = buildPrompt(options)
+        const engine = await this.getEngine()
 
+        // the engine is shared by every request for this model, so cancelling
+        // stops only this stream through its own handle
+        const state: { handle?: { done: Promise<GenerationResult>; stop: () => void }; cancelled: boolean } = {
+            cancelled: false,
+        }
         const stream = new ReadableStream<LanguageModelV2StreamPart>({
             start(controller) {
-                if (result.content && result.content[0]?.type === "text") {
-                    controller.enqueue({ type: "text-delta", delta: result.content[0].text, id: "0" })
-                }
-                controller.enqueue({
-                    type: "finish",
-                    finishReason: result.finishReason,
-                    usage: result.usage,
+                controller.enqueue({ type: "stream-start", warnings: [] })
+                controller.enqueue({ type: "text-start", id: "0" })
+                const handle = engine.generateStream(prompt, callOptions(options), (delta: string) => {
+                    if (state.cancelled) return
+                    controller.enqueue({ type: "text-delta", id: "0", delta })
                 })
-                controller.close()
+                state.handle = handle
+                handle.done
+                    .then((result: GenerationResult) => {
+                        if (state.cancelled) return
+                        controller.enqueue({ type: "text-end", id: "0" })
+                        controller.enqueue({
+                            type: "finish",
+                            finishReason: result.finishReason,
+                            usage: {
+                                inputTokens: result.promptTokens,
+                                outputTokens: result.completionTokens,
+                                totalTokens: result.promptTokens + result.completionTokens
+                            },
+                        })
+                        controller.close()
+                    })
+                    .catch((e: unknown) => {
+                        if (state.cancelled) return
+                        controller.enqueue({ type: "error", error: e })
+                        controller.close()
+                    })
+            },
+            cancel() {
+                state.cancelled = true
+                state.handle?.stop()
             },
         })
 
@@ -103,6 +177,14 @@ export class NcnnLanguageModel implements LanguageModelV2 {
             rawCall: { rawPrompt: null, rawSettings: {} },
         }
     }
+
+    private async getEngine() {
+        try {
+            return await loadEngine(this.config)
+        } catch (e) {
+            throw new Error(`Failed to load model at ${this.config.modelPath}: ${e}`)
+        }
+    }
 }
 
 export interface NcnnProvider {